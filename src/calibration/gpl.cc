@@ -1,7 +1,7 @@
 #include "gpl.h"
 
 #include <set>
-#include <sys/time.h>
+#include <time.h>
 
 namespace px
 {
@@ -38,21 +38,21 @@ float r2d(float rad)
 
 uint64_t timeInMicroseconds(void)
 {
-	 struct timeval tv;
+	 struct timespec ts;
 
-	 gettimeofday(&tv, 0);
+	 clock_gettime(CLOCK_MONOTONIC, &ts);
 
-	 return tv.tv_sec * 1000000.0 + tv.tv_usec;
+	 return static_cast<uint64_t>(ts.tv_sec) * 1000000 + ts.tv_nsec / 1000;
 }
 
 double timeInSeconds(void)
 {
-	 struct timeval tv;
+	 struct timespec ts;
 
-	 gettimeofday(&tv, 0);
+	 clock_gettime(CLOCK_MONOTONIC, &ts);
 
-	 return static_cast<double>(tv.tv_sec) +
-			 static_cast<double>(tv.tv_usec) / 1000000.0;
+	 return static_cast<double>(ts.tv_sec) +
+			 static_cast<double>(ts.tv_nsec) / 1000000000.0;
 }
 
 float colormapAutumn[128][3] =
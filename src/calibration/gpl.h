@@ -52,6 +52,7 @@ const T random(const T& a, const T& b)
 	return static_cast<double>(rand()) / RAND_MAX * (b - a) + a;
 }
 
+// monotonic time with an arbitrary start, for measuring intervals
 uint64_t timeInMicroseconds(void);
 
 double timeInSeconds(void);
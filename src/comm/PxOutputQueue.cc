@@ -0,0 +1,357 @@
+#include "PxOutputQueue.h"
+
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
+#include <string.h>
+#include <termios.h>
+#include <unistd.h>
+
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
+
+PxOutputQueue::PxOutputQueue()
+ : fd(-1)
+ , drain(false)
+ , deadlineUsecs(0)
+ , destinationLength(0)
+ , kMaxFrames(64)
+ , pendingCount(0)
+ , pendingSince(0)
+ , sendingCount(0)
+ , thread(0)
+ , running(false)
+{
+	g_mutex_init(&mutex);
+	g_mutex_init(&writeMutex);
+	g_cond_init(&cond);
+
+	pending.resize(kMaxFrames);
+	sending.resize(kMaxFrames);
+	iov.resize(kMaxFrames);
+#ifdef __linux__
+	msgs.resize(kMaxFrames);
+#endif
+}
+
+PxOutputQueue::~PxOutputQueue()
+{
+	if (thread != 0)
+	{
+		g_mutex_lock(&mutex);
+		running = false;
+		g_cond_signal(&cond);
+		g_mutex_unlock(&mutex);
+
+		g_thread_join(thread);
+	}
+
+	if (fd != -1)
+	{
+		flush();
+	}
+
+	g_cond_clear(&cond);
+	g_mutex_clear(&writeMutex);
+	g_mutex_clear(&mutex);
+}
+
+bool
+PxOutputQueue::init(int fd, int deadlineUsecs, bool drain)
+{
+	this->fd = fd;
+	this->deadlineUsecs = deadlineUsecs;
+	this->drain = drain;
+
+	if (deadlineUsecs <= 0 || thread != 0)
+	{
+		return true;
+	}
+
+	running = true;
+
+	GError* err = NULL;
+	if ((thread = g_thread_try_new("FLUSH", &PxOutputQueue::flushThread, this, &err)) == NULL)
+	{
+		fprintf(stderr, "ERROR: Failed to create output thread: %s, writing frames immediately\n", err->message);
+		g_error_free(err);
+		running = false;
+		this->deadlineUsecs = 0;
+		return false;
+	}
+
+	return true;
+}
+
+void
+PxOutputQueue::setDestination(const struct sockaddr* addr, socklen_t addrLength)
+{
+	g_mutex_lock(&writeMutex);
+	memcpy(&destination, addr, addrLength);
+	destinationLength = addrLength;
+	g_mutex_unlock(&writeMutex);
+}
+
+bool
+PxOutputQueue::push(const uint8_t* data, size_t length, bool urgent)
+{
+	return push(data, length, NULL, 0, urgent);
+}
+
+bool
+PxOutputQueue::push(const uint8_t* data, size_t length,
+					const uint8_t* data2, size_t length2, bool urgent)
+{
+	return push(NULL, 0, data, length, data2, length2, urgent);
+}
+
+bool
+PxOutputQueue::push(const struct sockaddr* addr, socklen_t addrLength,
+					const uint8_t* data, size_t length,
+					const uint8_t* data2, size_t length2, bool urgent)
+{
+	bool result = true;
+
+	g_mutex_lock(&mutex);
+	while (pendingCount == kMaxFrames)
+	{
+		g_mutex_unlock(&mutex);
+		result = flush() && result;
+		g_mutex_lock(&mutex);
+	}
+
+	// frame buffers keep their capacity, so this only allocates while warming up
+	Frame& frame = pending[pendingCount];
+	frame.data.resize(length + length2);
+	memcpy(&(frame.data[0]), data, length);
+	if (length2 > 0)
+	{
+		memcpy(&(frame.data[length]), data2, length2);
+	}
+	frame.addrLength = addrLength;
+	if (addrLength > 0)
+	{
+		memcpy(&frame.addr, addr, addrLength);
+	}
+
+	if (pendingCount++ == 0)
+	{
+		pendingSince = g_get_monotonic_time();
+		g_cond_signal(&cond);
+	}
+	g_mutex_unlock(&mutex);
+
+	if (urgent || thread == 0)
+	{
+		result = flush() && result;
+	}
+
+	return result;
+}
+
+bool
+PxOutputQueue::flush(void)
+{
+	g_mutex_lock(&writeMutex);
+
+	g_mutex_lock(&mutex);
+	pending.swap(sending);
+	sendingCount = pendingCount;
+	pendingCount = 0;
+	g_mutex_unlock(&mutex);
+
+	bool result = true;
+	if (sendingCount > 0)
+	{
+		result = writeFrames();
+		sendingCount = 0;
+	}
+
+	g_mutex_unlock(&writeMutex);
+
+	return result;
+}
+
+gpointer
+PxOutputQueue::flushThread(gpointer queue)
+{
+	PxOutputQueue* q = reinterpret_cast<PxOutputQueue*>(queue);
+
+	g_mutex_lock(&q->mutex);
+	while (q->running)
+	{
+		if (q->pendingCount == 0)
+		{
+			g_cond_wait(&q->cond, &q->mutex);
+			continue;
+		}
+
+		gint64 due = q->pendingSince + q->deadlineUsecs;
+		if (g_get_monotonic_time() < due)
+		{
+			g_cond_wait_until(&q->cond, &q->mutex, due);
+			continue;
+		}
+
+		g_mutex_unlock(&q->mutex);
+		q->flush();
+		g_mutex_lock(&q->mutex);
+	}
+	g_mutex_unlock(&q->mutex);
+
+	return NULL;
+}
+
+bool
+PxOutputQueue::writeFrames(void)
+{
+	if (destinationLength > 0 || sending[0].addrLength > 0)
+	{
+		return writeDatagrams();
+	}
+	else
+	{
+		return writeStream();
+	}
+}
+
+bool
+PxOutputQueue::writeStream(void)
+{
+	for (size_t i = 0; i < sendingCount; ++i)
+	{
+		iov[i].iov_base = &(sending[i].data[0]);
+		iov[i].iov_len = sending[i].data.size();
+	}
+
+	size_t first = 0;
+	while (first < sendingCount)
+	{
+		int count = sendingCount - first;
+		if (count > IOV_MAX)
+		{
+			count = IOV_MAX;
+		}
+
+		ssize_t written = writev(fd, &iov[first], count);
+		if (written < 0)
+		{
+			if (errno == EINTR)
+			{
+				continue;
+			}
+			perror("Could not write queued frames");
+			return false;
+		}
+
+		// skip what has been written, including a partially written frame
+		while (first < sendingCount && written >= (ssize_t)iov[first].iov_len)
+		{
+			written -= iov[first].iov_len;
+			++first;
+		}
+		if (written > 0)
+		{
+			iov[first].iov_base = static_cast<uint8_t*>(iov[first].iov_base) + written;
+			iov[first].iov_len -= written;
+		}
+	}
+
+	if (drain)
+	{
+		/* wait until all data has been written */
+		tcdrain(fd);
+	}
+
+	return true;
+}
+
+bool
+PxOutputQueue::writeDatagrams(void)
+{
+	bool result = true;
+
+#ifdef __linux__
+	for (size_t i = 0; i < sendingCount; ++i)
+	{
+		Frame& frame = sending[i];
+		iov[i].iov_base = &(frame.data[0]);
+		iov[i].iov_len = frame.data.size();
+
+		memset(&msgs[i], 0, sizeof(struct mmsghdr));
+		if (frame.addrLength > 0)
+		{
+			msgs[i].msg_hdr.msg_name = &frame.addr;
+			msgs[i].msg_hdr.msg_namelen = frame.addrLength;
+		}
+		else
+		{
+			msgs[i].msg_hdr.msg_name = &destination;
+			msgs[i].msg_hdr.msg_namelen = destinationLength;
+		}
+		msgs[i].msg_hdr.msg_iov = &iov[i];
+		msgs[i].msg_hdr.msg_iovlen = 1;
+	}
+#endif
+
+	size_t first = 0;
+	while (first < sendingCount)
+	{
+#ifdef __linux__
+		int sent = sendmmsg(fd, &msgs[first], sendingCount - first, 0);
+		if (sent > 0)
+		{
+			first += sent;
+			continue;
+		}
+		if (sent < 0 && errno == EINTR)
+		{
+			continue;
+		}
+#else
+		Frame& frame = sending[first];
+		ssize_t sent;
+		if (frame.addrLength > 0)
+		{
+			sent = sendto(fd, &(frame.data[0]), frame.data.size(), 0,
+						  (struct sockaddr*)&frame.addr, frame.addrLength);
+		}
+		else
+		{
+			sent = sendto(fd, &(frame.data[0]), frame.data.size(), 0,
+						  (struct sockaddr*)&destination, destinationLength);
+		}
+		if (sent == (ssize_t)frame.data.size())
+		{
+			++first;
+			continue;
+		}
+#endif
+
+		// the datagram at first could not be sent, drop it
+		perror("Could not send over UDP socket");
+		result = false;
+
+		// Try to increase buffer size for the next large datagram
+		int size = sending[first].data.size();
+		int bufferSize = 0;
+		socklen_t optionLength = sizeof(bufferSize);
+		if (getsockopt(fd, SOL_SOCKET, SO_SNDBUF, &bufferSize, &optionLength) == 0 &&
+			size > bufferSize)
+		{
+			if (setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &size, sizeof(size)) < 0)
+			{
+				printf("Could not change buffer size! Giving up.\n");
+			}
+			else
+			{
+				printf("Increased UDP protocol buffer size to allow next large packet to pass.\n");
+			}
+		}
+
+		++first;
+	}
+
+	return result;
+}
@@ -0,0 +1,92 @@
+#ifndef PXOUTPUTQUEUE_H
+#define PXOUTPUTQUEUE_H
+
+#include <glib.h>
+#include <inttypes.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <vector>
+
+/**
+ * Output stage of a link. Outgoing frames are queued for a short deadline
+ * and then written together: to a stream (e.g. a serial port) with one
+ * writev(), to a datagram socket as one datagram per frame with sendmmsg().
+ */
+class PxOutputQueue
+{
+public:
+	PxOutputQueue();
+	~PxOutputQueue();
+
+	/**
+	 * @param fd File descriptor of the link.
+	 * @param deadlineUsecs Time a queued frame is held back at most. With 0,
+	 * 						every frame is written immediately.
+	 * @param drain Wait with tcdrain() until every flush has been transmitted.
+	 */
+	bool init(int fd, int deadlineUsecs, bool drain = false);
+
+	// send every frame as a datagram to this address
+	void setDestination(const struct sockaddr* addr, socklen_t addrLength);
+
+	/**
+	 * Queue a frame. Urgent frames (heartbeats, commands) flush the queue
+	 * right away, so they neither wait for the deadline nor overtake frames
+	 * queued earlier.
+	 */
+	bool push(const uint8_t* data, size_t length, bool urgent = false);
+
+	// queue a frame made of two parts, e.g. a message and its extended payload
+	bool push(const uint8_t* data, size_t length,
+			  const uint8_t* data2, size_t length2, bool urgent = false);
+
+	// queue a datagram for an address other than the destination
+	bool push(const struct sockaddr* addr, socklen_t addrLength,
+			  const uint8_t* data, size_t length,
+			  const uint8_t* data2, size_t length2, bool urgent = false);
+
+	bool flush(void);
+
+private:
+	struct Frame
+	{
+		std::vector<uint8_t> data;
+		struct sockaddr_storage addr;
+		socklen_t addrLength;	// 0 for the destination
+	};
+
+	static gpointer flushThread(gpointer queue);
+
+	bool writeFrames(void);
+	bool writeStream(void);
+	bool writeDatagrams(void);
+
+	int fd;
+	bool drain;
+	gint64 deadlineUsecs;
+
+	struct sockaddr_storage destination;
+	socklen_t destinationLength;
+
+	const size_t kMaxFrames;
+
+	// frames are queued in one set while the other one is written
+	std::vector<Frame> pending;
+	size_t pendingCount;
+	gint64 pendingSince;
+	std::vector<Frame> sending;
+	size_t sendingCount;
+
+	std::vector<struct iovec> iov;
+#ifdef __linux__
+	std::vector<struct mmsghdr> msgs;
+#endif
+
+	GMutex mutex;		// guards the pending frames
+	GMutex writeMutex;	// serializes flushes to keep the frame order
+	GCond cond;
+	GThread* thread;
+	bool running;
+};
+
+#endif
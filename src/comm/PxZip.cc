@@ -1,20 +1,167 @@
 #include "PxZip.h"
 
+#include <algorithm>
 #include <cassert>
+#include <cstring>
 #include <opencv2/imgproc/imgproc.hpp>
 #include <turbojpeg.h>
 #include <zlib.h>
 
-PxZip* PxZip::mInstance = 0;
+namespace
+{
+
+/*
+ * Depth images are coded as in RVL (A. Wilson, "Fast Lossless Depth Image
+ * Compression", 2017): runs of invalid (zero) pixels alternate with runs of
+ * valid pixels, and valid pixels are stored as the zigzag-coded difference
+ * to the previous valid pixel. All counts and differences are written as
+ * variable-length nibbles, 3 bits of value plus a continuation bit, packed
+ * into 32-bit words.
+ *
+ * The header starts with the codec tag "RVL" and a version byte, followed
+ * by the image height and width. A zlib stream never starts with 'R', so a
+ * receiver can tell the codec from zlib-compressed raw pixels, which is how
+ * older senders transmit depth images.
+ */
+const unsigned char kDepthTag[4] = { 'R', 'V', 'L', 1 };
+const size_t kDepthHeaderSize = 3 * sizeof(uint32_t);
+
+// zigzag coding maps small negative and positive differences to small codes
+inline uint32_t zigzagEncode(uint32_t delta)
+{
+	return (delta << 1) ^ (0u - (delta >> 31));
+}
+
+inline uint32_t zigzagDecode(uint32_t code)
+{
+	return (code >> 1) ^ (0u - (code & 1));
+}
+
+class NibbleWriter
+{
+public:
+	explicit NibbleWriter(uint32_t* out)
+	 : p(out), word(0), nibbles(0)
+	{
+
+	}
+
+	void put(uint32_t value)
+	{
+		do
+		{
+			uint32_t nibble = value & 0x7;
+			value >>= 3;
+			if (value != 0)
+			{
+				nibble |= 0x8;
+			}
+
+			word = (word << 4) | nibble;
+			if (++nibbles == 8)
+			{
+				*p++ = word;
+				word = 0;
+				nibbles = 0;
+			}
+		}
+		while (value != 0);
+	}
+
+	uint32_t* finish(void)
+	{
+		if (nibbles > 0)
+		{
+			*p++ = word << (4 * (8 - nibbles));
+		}
+		return p;
+	}
+
+private:
+	uint32_t* p;
+	uint32_t word;
+	int nibbles;
+};
+
+class NibbleReader
+{
+public:
+	NibbleReader(const unsigned char* in, const unsigned char* end)
+	 : overrun(false), p(in), end(end), word(0), nibbles(0)
+	{
+
+	}
+
+	uint32_t get(void)
+	{
+		uint32_t value = 0;
+		int shift = 0;
+		uint32_t nibble;
+		do
+		{
+			if (nibbles == 0)
+			{
+				if (end - p < 4)
+				{
+					overrun = true;
+					return 0;
+				}
+				// the input is not necessarily aligned
+				memcpy(&word, p, sizeof(word));
+				p += 4;
+				nibbles = 8;
+			}
+
+			nibble = word >> 28;
+			word <<= 4;
+			--nibbles;
+
+			value |= (nibble & 0x7) << shift;
+			shift += 3;
+		}
+		while ((nibble & 0x8) && shift < 32);
+
+		return value;
+	}
+
+	bool overrun;
+
+private:
+	const unsigned char* p;
+	const unsigned char* end;
+	uint32_t word;
+	int nibbles;
+};
+
+}
+
+pthread_key_t PxZip::mInstanceKey;
+pthread_once_t PxZip::mInstanceKeyOnce = PTHREAD_ONCE_INIT;
 
 PxZip*
 PxZip::instance(void)
 {
-	if (mInstance == 0)
+	pthread_once(&mInstanceKeyOnce, &PxZip::createKey);
+
+	PxZip* zip = reinterpret_cast<PxZip*>(pthread_getspecific(mInstanceKey));
+	if (zip == 0)
 	{
-		mInstance = new PxZip();
+		zip = new PxZip();
+		pthread_setspecific(mInstanceKey, zip);
 	}
-	return mInstance;
+	return zip;
+}
+
+void
+PxZip::createKey(void)
+{
+	pthread_key_create(&mInstanceKey, &PxZip::destroyInstance);
+}
+
+void
+PxZip::destroyInstance(void* zip)
+{
+	delete reinterpret_cast<PxZip*>(zip);
 }
 
 PxZip::PxZip()
@@ -23,37 +170,56 @@ PxZip::PxZip()
 	jpegBufferSize = TJBUFSIZE(1280, 960);
 	jpegBuffer = new unsigned char[jpegBufferSize];
 
+	depthBufferSize = 0;
+	depthBuffer = 0;
+
 	handleCompress = tjInitCompress();
 	handleDecompress = tjInitDecompress();
 
+	// the streams are reset instead of set up again for every call
+	deflateStream = new z_stream;
+	deflateStream->zalloc = Z_NULL;
+	deflateStream->zfree = Z_NULL;
+	deflateStream->opaque = Z_NULL;
+	deflateInit(deflateStream, Z_BEST_SPEED);
+
+	inflateStream = new z_stream;
+	inflateStream->zalloc = Z_NULL;
+	inflateStream->zfree = Z_NULL;
+	inflateStream->opaque = Z_NULL;
+	inflateStream->next_in = Z_NULL;
+	inflateStream->avail_in = 0;
+	inflateInit(inflateStream);
+
 	chunkBuffer = new unsigned char[kChunkSize];
 }
 
 PxZip::~PxZip()
 {
 	delete [] jpegBuffer;
+	delete [] depthBuffer;
 	delete [] chunkBuffer;
 
 	tjDestroy(handleCompress);
 	tjDestroy(handleDecompress);
+
+	deflateEnd(deflateStream);
+	delete deflateStream;
+	inflateEnd(inflateStream);
+	delete inflateStream;
 }
 
 void
 PxZip::compressData(unsigned char* inData, size_t inDataSize,
 					std::vector<unsigned char>& outData)
 {
-	std::vector<unsigned char> buffer;
+	// keeps the capacity of outData
+	outData.clear();
 
-	z_stream strm;
-	strm.zalloc = Z_NULL;
-	strm.zfree = Z_NULL;
-	strm.opaque = Z_NULL;
+	z_stream& strm = *deflateStream;
+	deflateReset(&strm);
 	strm.next_in = inData;
 	strm.avail_in = inDataSize;
-	strm.next_out = chunkBuffer;
-	strm.avail_out = kChunkSize;
-	
-	deflateInit(&strm, Z_BEST_SPEED);
 
 	int flush, ret;
 
@@ -69,36 +235,27 @@ PxZip::compressData(unsigned char* inData, size_t inDataSize,
 			ret = deflate(&strm, flush);
 			assert(ret != Z_STREAM_ERROR);
 
-			buffer.insert(buffer.end(), chunkBuffer,
-						  chunkBuffer + kChunkSize - strm.avail_out);
+			outData.insert(outData.end(), chunkBuffer,
+						   chunkBuffer + kChunkSize - strm.avail_out);
 		}
 		while (strm.avail_out == 0);
 	}
 	while (flush != Z_FINISH);
 
 	assert(ret == Z_STREAM_END);
-
-	deflateEnd(&strm);
-
-	outData.swap(buffer);
 }			
 
 void
 PxZip::decompressData(unsigned char* inData, size_t inDataSize,
 					  std::vector<unsigned char>& outData)
 {
-	std::vector<unsigned char> buffer;
+	// keeps the capacity of outData
+	outData.clear();
 
-	z_stream strm;
-	strm.zalloc = Z_NULL;
-	strm.zfree = Z_NULL;
-	strm.opaque = Z_NULL;
+	z_stream& strm = *inflateStream;
+	inflateReset(&strm);
 	strm.next_in = inData;
 	strm.avail_in = inDataSize;
-	strm.next_out = chunkBuffer;
-	strm.avail_out = kChunkSize;
-	
-	inflateInit(&strm);
 
 	int ret;
 
@@ -117,16 +274,12 @@ PxZip::decompressData(unsigned char* inData, size_t inDataSize,
 			ret = inflate(&strm, Z_NO_FLUSH);
 			assert(ret != Z_STREAM_ERROR);
 
-			buffer.insert(buffer.end(), chunkBuffer,
-						  chunkBuffer + kChunkSize - strm.avail_out);
+			outData.insert(outData.end(), chunkBuffer,
+						   chunkBuffer + kChunkSize - strm.avail_out);
 		}
 		while (strm.avail_out == 0);
 	}
 	while (ret != Z_STREAM_END);
-
-	inflateEnd(&strm);
-
-	outData.swap(buffer);
 }
 
 void
@@ -160,7 +313,7 @@ PxZip::compressImage(const cv::Mat& inData, std::vector<unsigned char>& outData)
 			   inData.data, inData.cols, inData.step[0], inData.rows,
 			   inData.elemSize(), jpegBuffer, &jpegSize, jpegsubsamp, 50, flags);
 
-	outData = std::vector<unsigned char>(jpegBuffer, jpegBuffer + jpegSize);
+	outData.assign(jpegBuffer, jpegBuffer + jpegSize);
 }
 
 void
@@ -183,9 +336,120 @@ PxZip::decompressImage(unsigned char* inData, size_t inDataSize,
 		type = CV_8UC3;
 		flags = TJ_BGR;
 	}
-	outData = cv::Mat(height, width, type);
+	// reuses the image memory if the size and type did not change
+	outData.create(height, width, type);
 
 	tjDecompress(handleDecompress, inData, inDataSize,
 				 outData.data, outData.cols, outData.step[0], outData.rows,
 				 outData.elemSize(), flags);
 }
+
+void
+PxZip::compressDepth(const cv::Mat& inData, std::vector<unsigned char>& outData)
+{
+	assert(inData.type() == CV_16UC1);
+
+	cv::Mat img = inData.isContinuous() ? inData : inData.clone();
+	const uint16_t* pixel = reinterpret_cast<const uint16_t*>(img.data);
+	const uint16_t* end = pixel + img.rows * img.cols;
+
+	// header and at most 8 nibbles (one word) per pixel
+	size_t maxsize = img.rows * img.cols + 4;
+	if (maxsize > depthBufferSize)
+	{
+		delete [] depthBuffer;
+		depthBufferSize = maxsize;
+		depthBuffer = new uint32_t[depthBufferSize];
+	}
+
+	memcpy(depthBuffer, kDepthTag, sizeof(kDepthTag));
+	depthBuffer[1] = img.rows;
+	depthBuffer[2] = img.cols;
+
+	NibbleWriter writer(depthBuffer + 3);
+	uint32_t previous = 0;
+	while (pixel != end)
+	{
+		const uint16_t* start = pixel;
+		while (pixel != end && *pixel == 0)
+		{
+			++pixel;
+		}
+		writer.put(pixel - start);
+
+		start = pixel;
+		while (pixel != end && *pixel != 0)
+		{
+			++pixel;
+		}
+		writer.put(pixel - start);
+
+		for (const uint16_t* p = start; p != pixel; ++p)
+		{
+			writer.put(zigzagEncode(*p - previous));
+			previous = *p;
+		}
+	}
+	uint32_t* last = writer.finish();
+
+	unsigned char* data = reinterpret_cast<unsigned char*>(depthBuffer);
+	outData.assign(data, reinterpret_cast<unsigned char*>(last));
+}
+
+bool
+PxZip::isDepthCodec(const unsigned char* inData, size_t inDataSize)
+{
+	return inDataSize >= kDepthHeaderSize &&
+		   memcmp(inData, kDepthTag, sizeof(kDepthTag)) == 0;
+}
+
+bool
+PxZip::decompressDepth(unsigned char* inData, size_t inDataSize,
+					   int rows, int cols, cv::Mat& outData)
+{
+	if (!isDepthCodec(inData, inDataSize))
+	{
+		outData.release();
+		return false;
+	}
+
+	// the size comes from the sender, only allocate the expected image
+	uint32_t header[3];
+	memcpy(header, inData, kDepthHeaderSize);
+	if (rows <= 0 || cols <= 0 ||
+		header[1] != static_cast<uint32_t>(rows) ||
+		header[2] != static_cast<uint32_t>(cols))
+	{
+		outData.release();
+		return false;
+	}
+	outData.create(rows, cols, CV_16UC1);
+
+	uint16_t* pixel = reinterpret_cast<uint16_t*>(outData.data);
+	uint16_t* end = pixel + outData.rows * outData.cols;
+
+	NibbleReader reader(inData + kDepthHeaderSize, inData + inDataSize);
+	uint32_t previous = 0;
+	while (pixel != end)
+	{
+		size_t zeros = std::min<size_t>(reader.get(), end - pixel);
+		memset(pixel, 0, zeros * sizeof(uint16_t));
+		pixel += zeros;
+
+		size_t nonzeros = std::min<size_t>(reader.get(), end - pixel);
+		for (uint16_t* stop = pixel + nonzeros; pixel != stop; ++pixel)
+		{
+			previous += zigzagDecode(reader.get());
+			*pixel = static_cast<uint16_t>(previous);
+		}
+
+		if (reader.overrun)
+		{
+			// truncated input, leave the rest of the image invalid
+			memset(pixel, 0, (end - pixel) * sizeof(uint16_t));
+			break;
+		}
+	}
+
+	return true;
+}
@@ -1,11 +1,24 @@
 #ifndef PXZIP_H
 #define PXZIP_H
 
+#include <inttypes.h>
 #include <opencv2/core/core.hpp>
+#include <pthread.h>
 #include <vector>
 
 typedef void* tjhandle;
+struct z_stream_s;
 
+/**
+ * Codec state (TurboJPEG handles, zlib streams and scratch buffers) is
+ * kept per instance and reused from call to call. An instance must only
+ * be used by one thread at a time; instance() returns the calling
+ * thread's own instance, which is deleted when the thread exits.
+ *
+ * Output vectors and images are overwritten in place, so callers passing
+ * the same buffer for every frame do not allocate once it has grown to
+ * the frame size.
+ */
 class PxZip
 {
 public:
@@ -28,8 +41,24 @@ public:
 	void decompressImage(unsigned char* inData, size_t inDataSize,
 						 cv::Mat& outData);
 
+	// lossless run-length/delta codec for 16-bit depth images (CV_16UC1)
+	void compressDepth(const cv::Mat& inData,
+					   std::vector<unsigned char>& outData);
+
+	// rows and cols are the expected image size; returns false and releases
+	// outData if inData is not a depth image of that size
+	bool decompressDepth(unsigned char* inData, size_t inDataSize,
+						 int rows, int cols, cv::Mat& outData);
+
+	// true if inData was written by compressDepth()
+	static bool isDepthCodec(const unsigned char* inData, size_t inDataSize);
+
 private:
-	static PxZip* mInstance;
+	static void createKey(void);
+	static void destroyInstance(void* zip);
+
+	static pthread_key_t mInstanceKey;
+	static pthread_once_t mInstanceKeyOnce;
 
 	unsigned long jpegBufferSize;
 	unsigned char* jpegBuffer;
@@ -37,6 +66,12 @@ private:
 	tjhandle handleCompress;
 	tjhandle handleDecompress;
 
+	size_t depthBufferSize;
+	uint32_t* depthBuffer;
+
+	struct z_stream_s* deflateStream;
+	struct z_stream_s* inflateStream;
+
 	const size_t kChunkSize;
 	unsigned char* chunkBuffer;
 };
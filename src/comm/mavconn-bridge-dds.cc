@@ -31,6 +31,8 @@ This file is part of the PIXHAWK project
 *
 */
 
+#include <algorithm>
+#include <deque>
 #include <mavconn.h>
 #include <opencv2/highgui/highgui.hpp>
 #include <opencv2/imgproc/imgproc.hpp>
@@ -55,6 +57,31 @@ std::vector<PxSHMImageClient> imageClientVec;
 
 dds_image_message_t dds_image_msg;
 dds_rgbd_image_message_t dds_rgbd_image_msg;
+Glib::Mutex rgbdMutex;
+
+enum CompressCodec
+{
+	CODEC_JPEG,							// 8-bit images
+	CODEC_DEPTH,						// 16-bit depth images
+	CODEC_ZLIB							// anything else
+};
+
+// image planes waiting to be compressed by the worker threads
+struct CompressJob
+{
+	cv::Mat img;
+	CompressCodec codec;
+	std::vector<uchar>* buffer;
+	int* pending;						// planes of the frame still being compressed
+};
+
+int compressThreadCount = 2;
+const size_t kMaxQueuedPlanes = 8;
+std::deque<CompressJob> compressQueue;
+Glib::Mutex compressMutex;
+Glib::Cond compressQueuedCond;
+Glib::Cond compressSpaceCond;
+Glib::Cond compressDoneCond;
 
 void signalHandler(int signal)
 {
@@ -66,11 +93,127 @@ void signalHandler(int signal)
 	}
 }
 
+// seconds on the monotonic clock, only used for rate limiting
+double
+getCurrentTime(void)
+{
+	return static_cast<double>(getMonotonicTimeUsecs()) / 1000000.0;
+}
+
+void
+compressWorker(void)
+{
+	PxZip* zip = PxZip::instance();
+
+	Glib::Mutex::Lock lock(compressMutex);
+	while (!quit)
+	{
+		if (compressQueue.empty())
+		{
+			compressQueuedCond.wait(compressMutex);
+			continue;
+		}
+
+		CompressJob job = compressQueue.front();
+		compressQueue.pop_front();
+		compressSpaceCond.signal();
+
+		lock.release();
+		switch (job.codec)
+		{
+		case CODEC_JPEG:
+			zip->compressImage(job.img, *job.buffer);
+			break;
+		case CODEC_DEPTH:
+			zip->compressDepth(job.img, *job.buffer);
+			break;
+		default:
+			zip->compressData(job.img.data, job.img.step[0] * job.img.rows, *job.buffer);
+			break;
+		}
+		lock.acquire();
+
+		if (--(*job.pending) == 0)
+		{
+			compressDoneCond.broadcast();
+		}
+	}
+}
+
+/**
+ * Hand an image plane to the compression workers. Blocks while the queue
+ * is full, so a slow link cannot pile up frames in memory.
+ */
+void
+queueCompression(const cv::Mat& img, CompressCodec codec, std::vector<uchar>& buffer, int& pending)
+{
+	Glib::Mutex::Lock lock(compressMutex);
+	while (compressQueue.size() >= kMaxQueuedPlanes)
+	{
+		compressSpaceCond.wait(compressMutex);
+	}
+
+	CompressJob job;
+	job.img = img;
+	job.codec = codec;
+	job.buffer = &buffer;
+	job.pending = &pending;
+	compressQueue.push_back(job);
+	++pending;
+
+	compressQueuedCond.signal();
+}
+
+// the depth codec only handles 16-bit single channel images; the receiving
+// side tells the codecs apart by the header of the compressed plane
+CompressCodec
+getDepthCodec(const cv::Mat& img)
+{
+	return (img.type() == CV_16UC1) ? CODEC_DEPTH : CODEC_ZLIB;
+}
+
+// decode the depth plane of a DDS message; older senders compress every
+// depth image with zlib, so planes without the depth codec header are raw
+// pixels. buffer holds the pixels of imgDepth in that case.
+bool
+decompressDepthPlane(uint8_t* data, size_t dataSize, int rows, int cols,
+					 int type, size_t step, std::vector<uint8_t>& buffer,
+					 cv::Mat& imgDepth)
+{
+	if (PxZip::isDepthCodec(data, dataSize))
+	{
+		return type == CV_16UC1 &&
+			   PxZip::instance()->decompressDepth(data, dataSize, rows, cols,
+												  imgDepth);
+	}
+
+	PxZip::instance()->decompressData(data, dataSize, buffer);
+	if (buffer.empty() || buffer.size() < step * rows)
+	{
+		return false;
+	}
+	imgDepth = cv::Mat(rows, cols, type, &(buffer[0]), step);
+	return true;
+}
+
+// wait until all planes queued with this counter are compressed
+void
+waitForCompression(int& pending)
+{
+	Glib::Mutex::Lock lock(compressMutex);
+	while (pending > 0)
+	{
+		compressDoneCond.wait(compressMutex);
+	}
+}
+
 void
 imageLCMHandler(const lcm_recv_buf_t* rbuf, const char* channel,
 				const mavconn_mavlink_msg_container_t* container, void* user)
 {
 	const mavlink_message_t* msg = getMAVLinkMsgPtr(container);
+	double currentTime = getCurrentTime();
+
 	for (size_t i = 0; i < imageClientVec.size(); ++i)
 	{
 		PxSHMImageClient& client = imageClientVec.at(i);
@@ -80,10 +223,19 @@ imageLCMHandler(const lcm_recv_buf_t* rbuf, const char* channel,
 			continue;
 		}
 
+		// decide before reading and compressing whether the image is
+		// forwarded at all; the client only returns the latest frame
+		if (currentTime - lastImageTimestamp[i] < imageMinimumSeparation)
+		{
+			continue;
+		}
+
 		bool publishImage = false;
 		PxSHM::CameraType cameraType;
 
-		std::vector<uchar> buffer;
+		// only used by the LCM thread; keep the buffers to avoid reallocating
+		static std::vector<uchar> buffer1, buffer2;
+		int pending = 0;
 
 		// read mono image data
 		cv::Mat img;
@@ -94,12 +246,11 @@ imageLCMHandler(const lcm_recv_buf_t* rbuf, const char* channel,
 			dds_image_msg.step1 = img.step[0];
 			dds_image_msg.type1 = img.type();
 
-			PxZip::instance()->compressImage(img, buffer);
-			dds_image_msg.imageData1.from_array(reinterpret_cast<DDS_Char*>(&buffer[0]), buffer.size());
+			queueCompression(img, CODEC_JPEG, buffer1, pending);
 
 			dds_image_msg.step2 = 0;
 			dds_image_msg.type2 = 0;
-			dds_image_msg.imageData2.length(0);
+			buffer2.clear();
 
 			if (img.channels() == 1)
 			{
@@ -121,16 +272,12 @@ imageLCMHandler(const lcm_recv_buf_t* rbuf, const char* channel,
 			dds_image_msg.step1 = imgLeft.step[0];
 			dds_image_msg.type1 = imgLeft.type();
 
-			PxZip::instance()->compressImage(imgLeft, buffer);
-			DDS_Char* pBuffer = reinterpret_cast<DDS_Char*>(&buffer[0]);
-			dds_image_msg.imageData1.from_array(pBuffer, buffer.size());
-
 			dds_image_msg.step2 = imgRight.step[0];
 			dds_image_msg.type2 = imgRight.type();
 
-			PxZip::instance()->compressImage(imgRight, buffer);
-			pBuffer = reinterpret_cast<DDS_Char*>(&buffer[0]);
-			dds_image_msg.imageData2.from_array(pBuffer, buffer.size());
+			// compress left and right image concurrently
+			queueCompression(imgLeft, CODEC_JPEG, buffer1, pending);
+			queueCompression(imgRight, CODEC_JPEG, buffer2, pending);
 
 			if (imgLeft.channels() == 1)
 			{
@@ -153,35 +300,32 @@ imageLCMHandler(const lcm_recv_buf_t* rbuf, const char* channel,
 			dds_image_msg.step1 = imgBayer.step[0];
 			dds_image_msg.type1 = imgBayer.type();
 
-			PxZip::instance()->compressData(imgBayer.data,
-											imgBayer.step[0] * imgBayer.rows,
-											buffer);
-			DDS_Char* pBuffer = reinterpret_cast<DDS_Char*>(&buffer[0]);
-			dds_image_msg.imageData1.from_array(pBuffer, buffer.size());
-
 			dds_image_msg.step2 = imgDepth.step[0];
 			dds_image_msg.type2 = imgDepth.type();
 
-			PxZip::instance()->compressData(imgDepth.data,
-											imgDepth.step[0] * imgDepth.rows,
-											buffer);
-			pBuffer = reinterpret_cast<DDS_Char*>(&buffer[0]);
-			dds_image_msg.imageData2.from_array(pBuffer, buffer.size());
+			queueCompression(imgBayer, CODEC_ZLIB, buffer1, pending);
+			queueCompression(imgDepth, getDepthCodec(imgDepth), buffer2, pending);
 
 			cameraType = PxSHM::CAMERA_KINECT;
 
 			publishImage = true;
 		}
 
+		waitForCompression(pending);
+
 		if (publishImage)
 		{
-			struct timeval tv;
-			gettimeofday(&tv, 0);
-			double currentTime = tv.tv_sec + static_cast<double>(tv.tv_usec) / 1000000.0;
+			DDS_Char* pBuffer = reinterpret_cast<DDS_Char*>(&buffer1[0]);
+			dds_image_msg.imageData1.from_array(pBuffer, buffer1.size());
 
-			if (currentTime - lastImageTimestamp[i] < imageMinimumSeparation)
+			if (buffer2.empty())
+			{
+				dds_image_msg.imageData2.length(0);
+			}
+			else
 			{
-				continue;
+				pBuffer = reinterpret_cast<DDS_Char*>(&buffer2[0]);
+				dds_image_msg.imageData2.from_array(pBuffer, buffer2.size());
 			}
 
 			dds_image_msg.camera_config = client.getCameraConfig();
@@ -246,97 +390,103 @@ mavlinkLCMHandler(const lcm_recv_buf_t* rbuf, const char* channel,
 }
 
 void
-rgbdLCMHandler(void)
+rgbdLCMHandler(PxSHM::Camera camera)
 {
-	std::vector<PxSHMImageClient> clientVec;
-	clientVec.resize(2);
+	PxSHMImageClient client;
+	client.init(true, camera);
 
-	double lastRgbdTimestamp[clientVec.size()];
+	double lastRgbdTimestamp = 0.0;
 
-	clientVec.at(0).init(true, PxSHM::CAMERA_FORWARD_RGBD);
-	clientVec.at(1).init(true, PxSHM::CAMERA_DOWNWARD_RGBD);
-
-	std::vector<uchar> buffer;
+	std::vector<uchar> buffer1, buffer2;
 
 	while (!quit)
 	{
-		for (size_t i = 0; i < clientVec.size(); ++i)
+		// sleep until the camera process has written a new frame; the
+		// timeout only serves to check the quit flag
+		if (!client.waitForFrame(100))
 		{
-			PxSHMImageClient& client = clientVec.at(i);
-
-			cv::Mat imgColor, imgDepth;
-			uint64_t timestamp;
-			float roll, pitch, yaw;
-			float lon, lat, alt;
-			float ground_x, ground_y, ground_z;
-			cv::Mat cameraMatrix;
-			cv::Rect roi;
-
-			if (client.readRGBDImage(imgColor, imgDepth, timestamp,
-									 roll, pitch, yaw,
-									 lon, lat, alt,
-									 ground_x, ground_y, ground_z,
-									 cameraMatrix, roi))
-			{
-				struct timeval tv;
-				gettimeofday(&tv, 0);
-				double currentTime = tv.tv_sec + static_cast<double>(tv.tv_usec) / 1000000.0;
+			continue;
+		}
 
-				if (currentTime - lastRgbdTimestamp[i] < imageMinimumSeparation)
-				{
-					continue;
-				}
+		// leave frames unread until the next one is due; the client only
+		// returns the latest frame, so nothing is compressed for nothing
+		double currentTime = getCurrentTime();
+		if (currentTime - lastRgbdTimestamp < imageMinimumSeparation)
+		{
+			double wait = std::min(lastRgbdTimestamp + imageMinimumSeparation - currentTime, 0.1);
+			usleep(static_cast<useconds_t>(wait * 1000000.0));
+			continue;
+		}
 
-				// prepare DDS message struct
-				dds_rgbd_image_msg.camera_config = client.getCameraConfig();
-				dds_rgbd_image_msg.camera_type = PxSHM::CAMERA_RGBD;
-				dds_rgbd_image_msg.timestamp = timestamp;
-				dds_rgbd_image_msg.roll = roll;
-				dds_rgbd_image_msg.pitch = pitch;
-				dds_rgbd_image_msg.yaw = yaw;
-				dds_rgbd_image_msg.lon = lon;
-				dds_rgbd_image_msg.lat = lat;
-				dds_rgbd_image_msg.alt = alt;
-				dds_rgbd_image_msg.ground_x = ground_x;
-				dds_rgbd_image_msg.ground_y = ground_y;
-				dds_rgbd_image_msg.ground_z = ground_z;
-
-				for (int r = 0; r < 3; ++r)
+		cv::Mat imgColor, imgDepth;
+		uint64_t timestamp;
+		float roll, pitch, yaw;
+		float lon, lat, alt;
+		float ground_x, ground_y, ground_z;
+		cv::Mat cameraMatrix;
+		cv::Rect roi;
+
+		if (client.readRGBDImage(imgColor, imgDepth, timestamp,
+								 roll, pitch, yaw,
+								 lon, lat, alt,
+								 ground_x, ground_y, ground_z,
+								 cameraMatrix, roi))
+		{
+			// compress color and depth concurrently
+			int pending = 0;
+			queueCompression(imgColor, CODEC_JPEG, buffer1, pending);
+			queueCompression(imgDepth, getDepthCodec(imgDepth), buffer2, pending);
+			waitForCompression(pending);
+
+			// the DDS message struct is shared by all RGBD threads
+			Glib::Mutex::Lock lock(rgbdMutex);
+
+			// prepare DDS message struct
+			dds_rgbd_image_msg.camera_config = client.getCameraConfig();
+			dds_rgbd_image_msg.camera_type = PxSHM::CAMERA_RGBD;
+			dds_rgbd_image_msg.timestamp = timestamp;
+			dds_rgbd_image_msg.roll = roll;
+			dds_rgbd_image_msg.pitch = pitch;
+			dds_rgbd_image_msg.yaw = yaw;
+			dds_rgbd_image_msg.lon = lon;
+			dds_rgbd_image_msg.lat = lat;
+			dds_rgbd_image_msg.alt = alt;
+			dds_rgbd_image_msg.ground_x = ground_x;
+			dds_rgbd_image_msg.ground_y = ground_y;
+			dds_rgbd_image_msg.ground_z = ground_z;
+
+			for (int r = 0; r < 3; ++r)
+			{
+				for (int c = 0; c < 3; ++c)
 				{
-					for (int c = 0; c < 3; ++c)
-					{
-						dds_rgbd_image_msg.camera_matrix[r * 3 + c] = cameraMatrix.at<float>(r,c);
-					}
+					dds_rgbd_image_msg.camera_matrix[r * 3 + c] = cameraMatrix.at<float>(r,c);
 				}
+			}
 
-				dds_rgbd_image_msg.cols = imgColor.cols;
-				dds_rgbd_image_msg.rows = imgColor.rows;
-				dds_rgbd_image_msg.step1 = imgColor.step[0];
-				dds_rgbd_image_msg.type1 = imgColor.type();
+			dds_rgbd_image_msg.cols = imgColor.cols;
+			dds_rgbd_image_msg.rows = imgColor.rows;
+			dds_rgbd_image_msg.step1 = imgColor.step[0];
+			dds_rgbd_image_msg.type1 = imgColor.type();
 
-				PxZip::instance()->compressImage(imgColor, buffer);
-				DDS_Char* pBuffer = reinterpret_cast<DDS_Char*>(&buffer[0]);
-				dds_rgbd_image_msg.imageData1.from_array(pBuffer, buffer.size());
+			DDS_Char* pBuffer = reinterpret_cast<DDS_Char*>(&buffer1[0]);
+			dds_rgbd_image_msg.imageData1.from_array(pBuffer, buffer1.size());
 
-				dds_rgbd_image_msg.step2 = imgDepth.step[0];
-				dds_rgbd_image_msg.type2 = imgDepth.type();
+			dds_rgbd_image_msg.step2 = imgDepth.step[0];
+			dds_rgbd_image_msg.type2 = imgDepth.type();
 
-				PxZip::instance()->compressData(imgDepth.data, imgDepth.step[0] * imgDepth.rows, buffer);
-				pBuffer = reinterpret_cast<DDS_Char*>(&buffer[0]);
-				dds_rgbd_image_msg.imageData2.from_array(pBuffer, buffer.size());
+			pBuffer = reinterpret_cast<DDS_Char*>(&buffer2[0]);
+			dds_rgbd_image_msg.imageData2.from_array(pBuffer, buffer2.size());
 
-				// publish image to DDS
-				px::RGBDImageTopic::instance()->publish(&dds_rgbd_image_msg);
+			// publish image to DDS
+			px::RGBDImageTopic::instance()->publish(&dds_rgbd_image_msg);
 
-				lastRgbdTimestamp[i] = currentTime;
+			lastRgbdTimestamp = currentTime;
 
-				if (verbose)
-				{
-					fprintf(stderr, "# INFO: Forwarded RGBD image from LCM to DDS.\n");
-				}
+			if (verbose)
+			{
+				fprintf(stderr, "# INFO: Forwarded RGBD image from LCM to DDS.\n");
 			}
 		}
-		usleep(1000);
 	}
 }
 
@@ -426,13 +576,17 @@ imageDDSHandler(void* msg)
 		cv::Mat imgBayer(dds_msg->rows, dds_msg->cols, dds_msg->type1,
 						 &(buffer1[0]), dds_msg->step1);
 
+		cv::Mat imgDepth;
 		std::vector<uint8_t> buffer2;
 		pBuffer = reinterpret_cast<uint8_t*>(dds_msg->imageData2.get_contiguous_buffer());
-		PxZip::instance()->decompressData(pBuffer,
-										  dds_msg->imageData2.length(),
-										  buffer2);
-		cv::Mat imgDepth(dds_msg->rows, dds_msg->cols, dds_msg->type2,
-						 &(buffer2[0]), dds_msg->step2);
+		if (!decompressDepthPlane(pBuffer, dds_msg->imageData2.length(),
+								  dds_msg->rows, dds_msg->cols,
+								  dds_msg->type2, dds_msg->step2,
+								  buffer2, imgDepth))
+		{
+			fprintf(stderr, "# WARNING: Dropped Kinect image with an invalid depth plane.\n");
+			return;
+		}
 
 		server.writeKinectImage(imgBayer, imgDepth, dds_msg->timestamp,
 								dds_msg->roll, dds_msg->pitch, dds_msg->yaw,
@@ -479,13 +633,17 @@ rgbdDDSHandler(void* msg)
 									   dds_msg->imageData1.length(),
 									   imgColor);
 		
+	cv::Mat imgDepth;
 	std::vector<uint8_t> buffer;
 	pBuffer = reinterpret_cast<uint8_t*>(dds_msg->imageData2.get_contiguous_buffer());
-	PxZip::instance()->decompressData(pBuffer,
-									  dds_msg->imageData2.length(),
-									  buffer);
-	cv::Mat imgDepth(dds_msg->rows, dds_msg->cols, dds_msg->type2,
-					 &(buffer[0]), dds_msg->step2);
+	if (!decompressDepthPlane(pBuffer, dds_msg->imageData2.length(),
+							  dds_msg->rows, dds_msg->cols,
+							  dds_msg->type2, dds_msg->step2,
+							  buffer, imgDepth))
+	{
+		fprintf(stderr, "# WARNING: Dropped RGBD image with an invalid depth plane.\n");
+		return;
+	}
 
 	cv::Mat cameraMatrix(3, 3, CV_32F);
 	for (int i = 0; i < 3; ++i)
@@ -559,6 +717,10 @@ main(int argc, char** argv)
 	optImageMinimumSeparation.set_long_name("image_minimum_separation");
 	optImageMinimumSeparation.set_description("Minimum time separation in seconds between image samples");
 
+	Glib::OptionEntry optCompressThreads;
+	optCompressThreads.set_long_name("compress_threads");
+	optCompressThreads.set_description("Number of threads compressing images (default: 2)");
+
 	Glib::OptionEntry optVerbose;
 	optVerbose.set_short_name('v');
 	optVerbose.set_long_name("verbose");
@@ -577,6 +739,7 @@ main(int argc, char** argv)
 	bool streamRGBA = false;
 	optGroup.add_entry_filename(optBridgeMode, bridgeMode);
 	optGroup.add_entry(optImageMinimumSeparation, imageMinimumSeparation);
+	optGroup.add_entry(optCompressThreads, compressThreadCount);
 	optGroup.add_entry(optRGBA, streamRGBA);
 	optGroup.add_entry(optVerbose, verbose);
 
@@ -654,6 +817,21 @@ main(int argc, char** argv)
 		dds_image_message_t_initialize(&dds_image_msg);
 		dds_rgbd_image_message_t_initialize(&dds_rgbd_image_msg);
 
+		if (!Glib::thread_supported())
+		{
+			Glib::thread_init();
+		}
+
+		// set up the threads compressing outgoing images
+		if (compressThreadCount < 1)
+		{
+			compressThreadCount = 1;
+		}
+		for (int i = 0; i < compressThreadCount; ++i)
+		{
+			Glib::Thread::create(sigc::ptr_fun(&compressWorker), false);
+		}
+
 		// subscribe to LCM messages
 		imageLCMSub = mavconn_mavlink_msg_container_t_subscribe(lcm, "IMAGES", &imageLCMHandler, 0);
 
@@ -661,15 +839,12 @@ main(int argc, char** argv)
 		px::ImageTopic::instance()->advertise();
 		px::RGBDImageTopic::instance()->advertise();
 
-		// set up thread to check for incoming RGBD data from shared memory
-		if (!Glib::thread_supported())
-		{
-			Glib::thread_init();
-		}
+		// set up one thread per RGBD camera waiting for frames in shared memory
 
 		if (streamRGBA)
 		{
-			Glib::Thread* rgbdLCMThread = Glib::Thread::create(sigc::ptr_fun(&rgbdLCMHandler), true);
+			Glib::Thread::create(sigc::bind(sigc::ptr_fun(&rgbdLCMHandler), PxSHM::CAMERA_FORWARD_RGBD), true);
+			Glib::Thread::create(sigc::bind(sigc::ptr_fun(&rgbdLCMHandler), PxSHM::CAMERA_DOWNWARD_RGBD), true);
 		}
 	}
 
@@ -52,8 +52,10 @@ This file is part of the MAVCONN project
 #include <fcntl.h>   /* File control definitions */
 #include <errno.h>   /* Error number definitions */
 #include <termios.h> /* POSIX terminal control definitions */
+#include <poll.h>    /* Waiting for serial data */
 #ifdef __linux
 #include <sys/ioctl.h>
+#include <linux/serial.h>
 #endif
 
 // Latency Benchmarking
@@ -61,6 +63,7 @@ This file is part of the MAVCONN project
 #include <time.h>
 #include "mavconn.h"
 #include <glib.h>
+#include "PxOutputQueue.h"
 
 namespace config = boost::program_options;
 using std::string;
@@ -81,6 +84,10 @@ bool emitHeartbeat;       ///< Generate a heartbeat with this process
 bool debug;               ///< Enable debug functions and output
 bool test;                ///< Enable test mode
 bool pc2serial;			  ///< Enable PC to serial push mode (send more stuff from pc over serial)
+bool lowLatency;          ///< Ask the UART driver to hand over received bytes immediately
+int coalesceUsecs;        ///< Time outgoing messages are held back to be written together
+
+PxOutputQueue serialQueue; ///< Output stage of the serial port
 
 lcm_t* lcm;               ///< Reference to LCM bus
 
@@ -93,6 +100,21 @@ lcm_t* lcm;               ///< Reference to LCM bus
 #define B921600 921600
 #endif
 
+/* bytes fetched from the port with one read(), more than the driver buffers
+   between two wake-ups even at 921600 baud */
+#define SERIAL_READ_BUFFER_SIZE 4096
+
+/**
+* @brief Messages which bypass the output queue deadline
+*/
+static bool is_urgent(const mavlink_message_t* msg)
+{
+	return msg->msgid == MAVLINK_MSG_ID_HEARTBEAT
+		|| msg->msgid == MAVLINK_MSG_ID_SET_MODE
+		|| msg->msgid == MAVLINK_MSG_ID_COMMAND_LONG
+		|| msg->msgid == MAVLINK_MSG_ID_COMMAND_ACK;
+}
+
 /**
 * @brief Handle a MAVLINK message received from LCM
 *
@@ -154,11 +176,8 @@ static void mavlink_handler (const lcm_recv_buf_t *rbuf, const char * channel,
 				// Send message over serial port
 				uint8_t buffer[MAVLINK_MAX_PACKET_LEN];
 				int messageLength = mavlink_msg_to_send_buffer(buffer, msg);
-				if (debug) printf("Writing %d bytes\n", messageLength);
-				int written = write(fd, (char*)buffer, messageLength);
-				/* wait until all data has been written */
-				tcdrain(fd);
-				if (messageLength != written) fprintf(stderr, "ERROR: Wrote %d bytes but should have written %d\n", written, messageLength);
+				if (debug) printf("Queueing %d bytes\n", messageLength);
+				if (!serialQueue.push(buffer, messageLength, is_urgent(msg))) fprintf(stderr, "ERROR: Could not write %d bytes\n", messageLength);
 			}
 		}
 
@@ -201,11 +220,8 @@ static void mavlink_handler (const lcm_recv_buf_t *rbuf, const char * channel,
 				// Send message over serial port
 				uint8_t buffer[MAVLINK_MAX_PACKET_LEN];
 				int messageLength = mavlink_msg_to_send_buffer(buffer, msg);
-				if (debug) printf("Writing %d bytes\n", messageLength);
-				int written = write(fd, (char*)buffer, messageLength);
-				/* wait until all data has been written */
-				tcdrain(fd);
-				if (messageLength != written) fprintf(stderr, "ERROR: Wrote %d bytes but should have written %d\n", written, messageLength);
+				if (debug) printf("Queueing %d bytes\n", messageLength);
+				if (!serialQueue.push(buffer, messageLength, is_urgent(msg))) fprintf(stderr, "ERROR: Could not write %d bytes\n", messageLength);
 		}
 
 		if (msg->msgid == MAVLINK_MSG_ID_PING)
@@ -312,11 +328,12 @@ bool setup_port(int fd, int baud, int data_bits, int stop_bits, bool parity, boo
 	config.c_cflag |= CS8;
 	config.c_cflag |= CLOCAL;
 	//
-	// One input byte is enough to return from read()
-	// Inter-character timer off
+	// One input byte is enough to return from read(), which then returns
+	// all bytes received so far. Inter-character timer off, the serial
+	// thread waits with poll() instead.
 	//
 	config.c_cc[VMIN]  = 1;
-	config.c_cc[VTIME] = 10; // was 0
+	config.c_cc[VTIME] = 0;
 
 	// Get the current options for the port
 	//tcgetattr(fd, &options);
@@ -437,16 +454,91 @@ bool setup_port(int fd, int baud, int data_bits, int stop_bits, bool parity, boo
 	return true;
 }
 
+/**
+* @brief Disable the receive latency timer of the UART driver
+*
+* Many USB-serial adapters otherwise hold back received bytes for several
+* milliseconds to fill larger USB packets.
+*/
+bool setup_low_latency(int fd)
+{
+#ifdef __linux
+	struct serial_struct serial;
+	if (ioctl(fd, TIOCGSERIAL, &serial) < 0)
+	{
+		fprintf(stderr, "\nERROR: could not read driver settings of port %s\n", port.c_str());
+		return false;
+	}
+	serial.flags |= ASYNC_LOW_LATENCY;
+	if (ioctl(fd, TIOCSSERIAL, &serial) < 0)
+	{
+		fprintf(stderr, "\nERROR: could not enable low latency mode of port %s\n", port.c_str());
+		return false;
+	}
+	return true;
+#else
+	fprintf(stderr, "\nERROR: low latency mode is not supported on this platform\n");
+	return false;
+#endif
+}
+
 void close_port(int fd)
 {
 	close(fd);
 }
 
+/**
+* @brief Forward a MAVLink message received from the serial port to LCM
+*/
+static void forward_message(mavlink_message_t* message)
+{
+	if (verbose || debug) std::cout << std::dec << "Received and forwarded serial port message with id " << static_cast<unsigned int>(message->msgid) << " from system " << static_cast<int>(message->sysid) << std::endl;
+
+	// Do not send images over serial port
+
+	// DEBUG output
+	if (debug)
+	{
+		fprintf(stderr,"Forwarding SERIAL -> LCM: ");
+		unsigned int i;
+		uint8_t buffer[MAVLINK_MAX_PACKET_LEN];
+		unsigned int messageLength = mavlink_msg_to_send_buffer(buffer, message);
+		if (messageLength > MAVLINK_MAX_PACKET_LEN)
+		{
+			fprintf(stderr, "\nFATAL ERROR: MESSAGE LENGTH IS LARGER THAN BUFFER SIZE\n");
+		}
+		else
+		{
+			for (i=0; i<messageLength; i++)
+			{
+				unsigned char v=buffer[i];
+				fprintf(stderr,"%02x ", v);
+			}
+			fprintf(stderr,"\n");
+		}
+	}
+
+	// Send out packets to LCM
+	// Send over LCM
+
+	if (pc2serial)
+	{
+		sendMAVLinkMessage(lcm, message, MAVCONN_LINK_TYPE_UART_VICON);
+	}
+	else
+	{
+		sendMAVLinkMessage(lcm, message, MAVCONN_LINK_TYPE_UART);
+	}
+}
+
 /**
 * @brief Serial function
 *
 * This function blocks waiting for serial data in it's own thread
-* and forwards the data once received.
+* and forwards the data once received. All bytes the driver has buffered
+* are fetched with a single read() and parsed in one pass, so a high-rate
+* stream costs one system call per chunk instead of one per byte.
+* mavconn-serial-bench measures both reader loops over a pseudo terminal.
 */
 void* serial_wait(void* serial_ptr)
 				{
@@ -455,77 +547,60 @@ void* serial_wait(void* serial_ptr)
 	mavlink_status_t lastStatus;
 	lastStatus.packet_rx_drop_count = 0;
 
+	struct pollfd pfd;
+	pfd.fd = fd;
+	pfd.events = POLLIN;
+
+	uint8_t buf[SERIAL_READ_BUFFER_SIZE];
+	mavlink_message_t message;
+	mavlink_status_t status;
+
 	// Blocking wait for new data
 	while (1)
 	{
 		//if (debug) printf("Checking for new data on serial port\n");
-		// Block until data is available, read only one byte to be able to continue immediately
-		//char buf[MAVLINK_MAX_PACKET_LEN];
-		uint8_t cp;
-		mavlink_message_t message;
-		mavlink_status_t status;
-		uint8_t msgReceived = false;
-
-		if (read(fd, &cp, 1) > 0)
+		int ready = poll(&pfd, 1, 1000);
+		if (ready == 0 || (ready == -1 && errno == EINTR))
 		{
-			// Check if a message could be decoded, return the message in case yes
-			msgReceived = mavlink_parse_char(MAVLINK_COMM_1, cp, &message, &status);
-			if (lastStatus.packet_rx_drop_count != status.packet_rx_drop_count)
-			{
-				if (verbose || debug) printf("ERROR: DROPPED %d PACKETS\n", status.packet_rx_drop_count);
-				if (debug)
-				{
-					unsigned char v=cp;
-					fprintf(stderr,"%02x ", v);
-				}
-			}
-			lastStatus = status;
+			continue;
 		}
-		else
+
+		ssize_t len = -1;
+		if (ready > 0 && (pfd.revents & POLLIN))
 		{
-			if (!silent) fprintf(stderr, "ERROR: Could not read from port %s\n", port.c_str());
+			len = read(fd, buf, sizeof(buf));
 		}
 
-		// If a message could be decoded, handle it
-		if(msgReceived)
+		if (len <= 0)
 		{
-			if (verbose || debug) std::cout << std::dec << "Received and forwarded serial port message with id " << static_cast<unsigned int>(message.msgid) << " from system " << static_cast<int>(message.sysid) << std::endl;
-
-			// Do not send images over serial port
-
-			// DEBUG output
-			if (debug)
+			if (len == -1 && (errno == EAGAIN || errno == EINTR))
 			{
-				fprintf(stderr,"Forwarding SERIAL -> LCM: ");
-				unsigned int i;
-				uint8_t buffer[MAVLINK_MAX_PACKET_LEN];
-				unsigned int messageLength = mavlink_msg_to_send_buffer(buffer, &message);
-				if (messageLength > MAVLINK_MAX_PACKET_LEN)
-				{
-					fprintf(stderr, "\nFATAL ERROR: MESSAGE LENGTH IS LARGER THAN BUFFER SIZE\n");
-				}
-				else
-				{
-					for (i=0; i<messageLength; i++)
-					{
-						unsigned char v=buffer[i];
-						fprintf(stderr,"%02x ", v);
-					}
-					fprintf(stderr,"\n");
-				}
+				continue;
 			}
+			if (!silent) fprintf(stderr, "ERROR: Could not read from port %s\n", port.c_str());
+			// do not spin on a port which has been unplugged
+			usleep(100000);
+			continue;
+		}
 
-			// Send out packets to LCM
-			// Send over LCM
-
-			if (pc2serial)
+		for (ssize_t i = 0; i < len; ++i)
+		{
+			// Check if a message could be decoded, handle it in case yes
+			if (mavlink_parse_char(MAVLINK_COMM_1, buf[i], &message, &status))
 			{
-				sendMAVLinkMessage(lcm, &message, MAVCONN_LINK_TYPE_UART_VICON);
+				forward_message(&message);
 			}
-			else
+
+			if (lastStatus.packet_rx_drop_count != status.packet_rx_drop_count)
 			{
-				sendMAVLinkMessage(lcm, &message, MAVCONN_LINK_TYPE_UART);
+				if (verbose || debug) printf("ERROR: DROPPED %d PACKETS\n", status.packet_rx_drop_count);
+				if (debug)
+				{
+					unsigned char v=buf[i];
+					fprintf(stderr,"%02x ", v);
+				}
 			}
+			lastStatus = status;
 		}
 	}
 	return NULL;
@@ -550,6 +625,8 @@ int main(int argc, char* argv[])
 		("verbose,v", config::bool_switch(&verbose)->default_value(false), "verbose output")
 		("debug,d", config::bool_switch(&debug)->default_value(false), "Emit debug information")
 		("pc2serial", config::bool_switch(&pc2serial)->default_value(false), "Send more status information from PC over serial (for second XBee mode)")
+		("lowlatency", config::bool_switch(&lowLatency)->default_value(false), "Disable the latency timer of the serial driver (e.g. FTDI USB adapters)")
+		("coalesce", config::value<int>(&coalesceUsecs)->default_value(1000), "Microseconds outgoing messages are held back to be written together, 0 to write every message at once (heartbeats and commands are never held back)")
 		;
 	config::variables_map vm;
 	config::store(config::parse_command_line(argc, argv, desc), vm);
@@ -589,6 +666,11 @@ int main(int argc, char* argv[])
 	{
 		if (!silent) printf("success.\n");
 	}
+	if (lowLatency && !setup_low_latency(fd))
+	{
+		if (!silent) printf("Continuing without low latency mode.\n");
+	}
+	serialQueue.init(fd, coalesceUsecs, true);
 	int* fd_ptr = &fd;
 
 	// SETUP LCM
@@ -655,19 +737,17 @@ int main(int argc, char* argv[])
 	mavlink_message_t msg;
 	while(1)
 	{
-			gettimeofday(&tv, NULL);
-			uint64_t currTime =  ((uint64_t)tv.tv_sec) * 1000000 + tv.tv_usec;
+			uint64_t currTime = getMonotonicTimeUsecs();
 
 			if (currTime - lastTime > 2000000)
 			{
 				// SEND OUT TIME MESSAGE
 				// send message as close to time aquisition as possible
-				mavlink_msg_system_time_pack(systemid, compid, &msg, currTime, 0);
+				mavlink_msg_system_time_pack(systemid, compid, &msg, getSystemTimeUsecs(), 0);
 				// Send message over serial port
 				int messageLength = mavlink_msg_to_send_buffer(buffer, &msg);
-				int written = write(fd, (char*)buffer, messageLength);
 				lastTime = currTime;
-				if (written != messageLength)
+				if (!serialQueue.push(buffer, messageLength, true))
 				{
 					fprintf(stderr, "\nERROR: Unable to send system time over serial port.\n");
 				}
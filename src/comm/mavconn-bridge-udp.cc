@@ -25,6 +25,11 @@
  * @file
  *   @brief UDPLink
  *
+ *   Connects any number of ground stations and tools (peers) to the LCM bus.
+ *   Peers are either given on the command line or learned from incoming
+ *   traffic. Messages with a target system/component are only sent to the
+ *   peers behind which the target has been seen.
+ *
  *   @author Lorenz Meier <mavteam@student.ethz.ch>
  *   @author Bryan Godbolt <godbolt@ualberta.ca>
  *
@@ -45,6 +50,14 @@
 #include <fcntl.h>
 #include <errno.h>
 #include <netdb.h>
+#include <set>
+#include <string>
+#include <vector>
+#ifdef __linux__
+#include <sys/epoll.h>
+#else
+#include <poll.h>
+#endif
 #if (defined __QNX__) | (defined __QNXNTO__)
 /* QNX specific headers */
 #include <unix.h>
@@ -55,6 +68,7 @@
 #endif
 #include <glib.h>
 #include "mavconn.h"
+#include "PxOutputQueue.h"
 
 // Settings
 int systemid = getSystemID();
@@ -63,6 +77,8 @@ uint8_t mode;
 
 static GString* host = g_string_new("localhost");	///< host name for UDP server
 static GString* port = g_string_new("14550");		///< port for UDP server to open connection
+int listenPort = 0;		///< local port peers can send to, 0 for any
+int peerTimeout = 10;	///< seconds after which a silent learned peer is dropped
 
 bool transmitExtended = true; ///< send extended MAVLINK messages
 bool silent; ///< silent run mode
@@ -70,20 +86,215 @@ bool verbose; ///< verbose run mode
 bool emitHeartbeat; ///< tells the program to emit heart beats regularly
 bool dataOnly; ///< send only data, without video stream
 bool debug; ///< debug mode
+int coalesceUsecs = 1000; ///< time outgoing messages are held back to be sent together
 
 int sock = socket(PF_INET, SOCK_DGRAM, IPPROTO_UDP);
-struct sockaddr_in gcAddr;
 struct sockaddr_in locAddr;
-struct sockaddr_in fromAddr;
 int messageBurstSize = 20; ///< Number of image messages to send in a row - controls how much bandwidth the image consumes
 
-ssize_t recsize;
-socklen_t fromlen;
-
 struct timeval tv;
 
+/**
+ * @brief A ground station or tool connected over UDP
+ */
+struct Peer
+{
+	struct sockaddr_in addr;
+	bool configured;				///< given on the command line, never dropped
+	gint64 lastSeen;				///< time of the last datagram from this peer
+	std::set<uint16_t> components;	///< (sysid << 8) | compid of all senders behind this peer
+};
+
+const size_t kMaxPeers = 16;
+const int kReceiveBatchSize = 16;
+
+/// only used by the main loop, which also dispatches the LCM handlers
+std::vector<Peer> peers;
+
 lcm_t* lcm;
 
+PxOutputQueue udpQueue; ///< output stage of the UDP link
+
+/**
+ * @brief Messages which bypass the output queue deadline
+ */
+static bool is_urgent(const mavlink_message_t* msg)
+{
+	return msg->msgid == MAVLINK_MSG_ID_HEARTBEAT
+		|| msg->msgid == MAVLINK_MSG_ID_SET_MODE
+		|| msg->msgid == MAVLINK_MSG_ID_COMMAND_LONG
+		|| msg->msgid == MAVLINK_MSG_ID_COMMAND_ACK;
+}
+
+/**
+ * @brief Extract the target of a message
+ *
+ * @return False if the message is not addressed to a system
+ */
+static bool get_target(const mavlink_message_t* msg, uint8_t& system, uint8_t& component)
+{
+#define TARGET_CASE(ID, name) \
+	case ID: \
+		system = mavlink_msg_##name##_get_target_system(msg); \
+		component = mavlink_msg_##name##_get_target_component(msg); \
+		return true;
+
+	switch (msg->msgid)
+	{
+	TARGET_CASE(MAVLINK_MSG_ID_PING, ping)
+	TARGET_CASE(MAVLINK_MSG_ID_PARAM_REQUEST_READ, param_request_read)
+	TARGET_CASE(MAVLINK_MSG_ID_PARAM_REQUEST_LIST, param_request_list)
+	TARGET_CASE(MAVLINK_MSG_ID_PARAM_SET, param_set)
+	TARGET_CASE(MAVLINK_MSG_ID_MISSION_ITEM, mission_item)
+	TARGET_CASE(MAVLINK_MSG_ID_MISSION_REQUEST, mission_request)
+	TARGET_CASE(MAVLINK_MSG_ID_MISSION_SET_CURRENT, mission_set_current)
+	TARGET_CASE(MAVLINK_MSG_ID_MISSION_REQUEST_LIST, mission_request_list)
+	TARGET_CASE(MAVLINK_MSG_ID_MISSION_COUNT, mission_count)
+	TARGET_CASE(MAVLINK_MSG_ID_MISSION_CLEAR_ALL, mission_clear_all)
+	TARGET_CASE(MAVLINK_MSG_ID_MISSION_ACK, mission_ack)
+	TARGET_CASE(MAVLINK_MSG_ID_REQUEST_DATA_STREAM, request_data_stream)
+	TARGET_CASE(MAVLINK_MSG_ID_COMMAND_LONG, command_long)
+	case MAVLINK_MSG_ID_SET_MODE:
+		system = mavlink_msg_set_mode_get_target_system(msg);
+		component = 0;
+		return true;
+	default:
+		return false;
+	}
+
+#undef TARGET_CASE
+}
+
+/**
+ * @brief Check if a system (and component, if non-zero) sends through a peer
+ */
+static bool peer_has(const Peer& peer, uint8_t system, uint8_t component)
+{
+	if (component != 0)
+	{
+		return peer.components.count((system << 8) | component) > 0;
+	}
+
+	std::set<uint16_t>::const_iterator it = peer.components.lower_bound(system << 8);
+	return it != peer.components.end() && (*it >> 8) == system;
+}
+
+/**
+ * @brief Find the peer with this address or add it as a learned peer
+ *
+ * @return NULL if the peer table is full
+ */
+static Peer* learn_peer(const struct sockaddr_in& addr)
+{
+	for (size_t i = 0; i < peers.size(); ++i)
+	{
+		if (peers[i].addr.sin_addr.s_addr == addr.sin_addr.s_addr &&
+			peers[i].addr.sin_port == addr.sin_port)
+		{
+			return &peers[i];
+		}
+	}
+
+	if (peers.size() >= kMaxPeers)
+	{
+		if (verbose) fprintf(stderr, "Peer table full, not answering %s:%u\n",
+							 inet_ntoa(addr.sin_addr), ntohs(addr.sin_port));
+		return NULL;
+	}
+
+	if (!silent) printf("New peer %s:%u\n", inet_ntoa(addr.sin_addr), ntohs(addr.sin_port));
+
+	Peer peer;
+	peer.addr = addr;
+	peer.configured = false;
+	peer.lastSeen = g_get_monotonic_time();
+	peers.push_back(peer);
+
+	return &peers.back();
+}
+
+/**
+ * @brief Drop learned peers which have been silent for too long
+ */
+static void expire_peers(void)
+{
+	gint64 deadline = g_get_monotonic_time() - (gint64)peerTimeout * 1000000;
+
+	for (size_t i = 0; i < peers.size();)
+	{
+		if (!peers[i].configured && peers[i].lastSeen < deadline)
+		{
+			if (!silent) printf("Peer %s:%u timed out\n", inet_ntoa(peers[i].addr.sin_addr),
+								ntohs(peers[i].addr.sin_port));
+			peers.erase(peers.begin() + i);
+		}
+		else
+		{
+			++i;
+		}
+	}
+}
+
+/**
+ * @brief Queue a message for all peers which should receive it
+ *
+ * A targeted message only goes to the peers behind which its target has
+ * been seen; untargeted messages and messages to unknown targets go to all
+ * peers. No message is sent back to the peer its sender is behind.
+ */
+static bool send_to_peers(const mavlink_message_t* msg,
+						  const uint8_t* data, size_t length,
+						  const uint8_t* data2, size_t length2)
+{
+	static std::vector<size_t> receivers;
+	receivers.clear();
+
+	uint8_t targetSystem = 0;
+	uint8_t targetComponent = 0;
+	if (get_target(msg, targetSystem, targetComponent) && targetSystem != 0)
+	{
+		for (size_t i = 0; i < peers.size(); ++i)
+		{
+			if (peer_has(peers[i], targetSystem, targetComponent))
+			{
+				receivers.push_back(i);
+			}
+		}
+		// component not seen yet, fall back to the system
+		for (size_t i = 0; receivers.empty() && targetComponent != 0 && i < peers.size(); ++i)
+		{
+			if (peer_has(peers[i], targetSystem, 0))
+			{
+				receivers.push_back(i);
+			}
+		}
+	}
+	if (receivers.empty())
+	{
+		for (size_t i = 0; i < peers.size(); ++i)
+		{
+			if (!peer_has(peers[i], msg->sysid, msg->compid))
+			{
+				receivers.push_back(i);
+			}
+		}
+	}
+
+	bool result = true;
+	for (size_t i = 0; i < receivers.size(); ++i)
+	{
+		const Peer& peer = peers[receivers[i]];
+		if (debug) fprintf(stderr, "QUEUED MESSAGE %u FOR %s:%u\n", msg->msgid,
+						   inet_ntoa(peer.addr.sin_addr), ntohs(peer.addr.sin_port));
+
+		// an urgent message flushes the queue once it is queued for every peer
+		bool urgent = is_urgent(msg) && i + 1 == receivers.size();
+		result = udpQueue.push((const struct sockaddr*) &peer.addr, sizeof(struct sockaddr_in),
+							   data, length, data2, length2, urgent) && result;
+	}
+
+	return result;
+}
 
 /**
  * @brief Handle a MAVLINK message over LCM
@@ -99,12 +310,9 @@ static void mavlink_handler(const lcm_recv_buf_t *rbuf, const char * channel,
 	const mavlink_message_t* msg = getMAVLinkMsgPtr(container);
 
 	// Send message over UDP
-	int link = *(static_cast<int*>(user));
-	int bytes_sent = 0;
-
 	static uint8_t buf[MAVLINK_MAX_PACKET_LEN];
 	uint32_t messageLength = mavlink_msg_to_send_buffer(buf, msg);
-	int bytesToSend = 0;
+	bool sent;
 	
 	if (msg->msgid != MAVLINK_MSG_ID_EXTENDED_MESSAGE)
 	{
@@ -119,23 +327,13 @@ static void mavlink_handler(const lcm_recv_buf_t *rbuf, const char * channel,
 			fprintf(stderr, "\n");
 		}
 
-		// Send over UDP
-		bytes_sent = sendto(link, buf, messageLength, 0, (struct sockaddr*) &gcAddr,
-				sizeof(struct sockaddr_in));
-		bytesToSend = messageLength;
-		//	extern int errno;
+		// Queue for UDP
+		sent = send_to_peers(msg, buf, messageLength, NULL, 0);
 	}
 	else if (transmitExtended)
 	{
-		static uint8_t extended_buf[MAVLINK_MAX_EXTENDED_PACKET_LEN];
-
 		uint32_t extendedMessageLength = messageLength + container->extended_payload_len;
 
-		// copy core message data
-		memcpy(extended_buf, buf, messageLength);
-		// copy extended message data
-		memcpy(extended_buf + messageLength, container->extended_payload, container->extended_payload_len);
-
 		if (verbose)
 		{
 			printf("(SYS: %d/COMP: %d/LCM->UDP) Received message with ID %u from LCM with %d payload bytes and %u total length\n",
@@ -147,94 +345,155 @@ static void mavlink_handler(const lcm_recv_buf_t *rbuf, const char * channel,
 			fprintf(stderr, "\n");
 		}
 
-		// Send over UDP
-		bytes_sent = sendto(link, extended_buf, extendedMessageLength, 0, (struct sockaddr*) &gcAddr,
-				sizeof(struct sockaddr_in));
-		bytesToSend = extendedMessageLength;
+		// Queue core and extended message data as one datagram
+		sent = send_to_peers(msg, buf, messageLength,
+							 reinterpret_cast<const uint8_t*>(container->extended_payload),
+							 container->extended_payload_len);
 	}
 	else
 	{
 		return;
 	}
 
-	if (bytes_sent != bytesToSend)
+	if (!sent)
 	{
-		// Error handling
-		perror("Could not send over UDP socket");
-		fprintf(stderr, "Target address and host: %s:%s\n", host->str, port->str);
+		fprintf(stderr, "Could not send message with ID %u to all peers\n", msg->msgid);
+	}
+}
 
-		// Try to increase buffer size
-		if (bytesToSend > MAVLINK_MAX_PACKET_LEN)
-		{
+/**
+ * @brief Forward the messages of one datagram to LCM
+ */
+static void handle_datagram(const struct sockaddr_in& addr, const uint8_t* buf, int recsize)
+{
+	Peer* peer = learn_peer(addr);
+	if (peer != NULL)
+	{
+		peer->lastSeen = g_get_monotonic_time();
+	}
 
-			int tmp = bytesToSend;
-			int ret = setsockopt(link, SOL_SOCKET, SO_SNDBUF, &tmp, sizeof(tmp));
+	// Something received - print out all bytes and parse packet
+	mavlink_message_t msg;
+	mavlink_status_t status;
 
-			if(ret < 0) {
-			    printf("Could not change buffer size! Giving up.\n");
-			    return;
+	for (int i = 0; i < recsize; ++i)
+	{
+		unsigned char tmpchar = buf[i];
+		if (debug) printf("%02x ", tmpchar);
+		if (mavlink_parse_char(MAVLINK_COMM_0, buf[i], &msg, &status))
+		{
+			if (verbose)
+			{
+				// Packet received
+				printf("\n(SYS: %d/COMP: %d/UDP) Received message with ID %u from UDP with %i payload bytes and %i total length\n",
+						msg.sysid, msg.compid, msg.msgid, msg.len, recsize);
 			}
-			else
+			if (peer != NULL)
 			{
-				printf("Increased UDP protocol buffer size to allow next large packet to pass.\n");
+				peer->components.insert((msg.sysid << 8) | msg.compid);
 			}
+			sendMAVLinkMessage(lcm, &msg);
 		}
 	}
-	else
-	{
-		if (debug) fprintf(stderr, "SENT %d BYTES OVER UDP TO %s:%s", bytes_sent, host->str, port->str);
-	}
 }
 
-void* lcm_wait(void* lcm_ptr)
-		{
-	lcm_t* lcm = (lcm_t*) lcm_ptr;
-	// Blocking wait for new data
-	while (1)
+/**
+ * @brief Read all pending datagrams from the UDP link
+ */
+static void udp_receive(void)
+{
+	// READ PENDING BYTES ON UDP LINK
+	static uint8_t buf[kReceiveBatchSize][MAVLINK_MAX_PACKET_LEN];
+	struct sockaddr_in fromAddr[kReceiveBatchSize];
+
+#ifdef __linux__
+	// fetch a whole burst with one system call
+	struct mmsghdr msgs[kReceiveBatchSize];
+	struct iovec iov[kReceiveBatchSize];
+	memset(msgs, 0, sizeof(msgs));
+	for (int i = 0; i < kReceiveBatchSize; ++i)
 	{
-		lcm_handle(lcm);
+		iov[i].iov_base = buf[i];
+		iov[i].iov_len = MAVLINK_MAX_PACKET_LEN;
+		msgs[i].msg_hdr.msg_iov = &iov[i];
+		msgs[i].msg_hdr.msg_iovlen = 1;
+		msgs[i].msg_hdr.msg_name = &fromAddr[i];
+		msgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
 	}
-	return NULL;
-		}
 
-void* udp_wait(void* lcm_ptr)
-		{
-	lcm_t* lcm = (lcm_t*) lcm_ptr;
-	// Blocking wait for new data
-	// READ PENDING BYTES ON UDP LINK
-	uint8_t buf[MAVLINK_MAX_PACKET_LEN];
-	while (1)
+	int count = recvmmsg(sock, msgs, kReceiveBatchSize, MSG_DONTWAIT, NULL);
+	if (count < 0)
 	{
-		int recsize = recvfrom(sock, (void *) buf, MAVLINK_MAX_PACKET_LEN, 0,
-				(struct sockaddr *) &gcAddr, &fromlen);
-		if (recsize < 1)
+		if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
 		{
-			// An error occured
+			perror("Could not receive from UDP socket");
 		}
+		return;
+	}
 
-		// Something received - print out all bytes and parse packet
-		mavlink_message_t msg;
-		mavlink_status_t status;
+	for (int i = 0; i < count; ++i)
+	{
+		handle_datagram(fromAddr[i], buf[i], msgs[i].msg_len);
+	}
+#else
+	socklen_t fromlen = sizeof(struct sockaddr_in);
+	int recsize = recvfrom(sock, (void *) buf[0], MAVLINK_MAX_PACKET_LEN, MSG_DONTWAIT,
+						   (struct sockaddr *) &fromAddr[0], &fromlen);
+	if (recsize > 0)
+	{
+		handle_datagram(fromAddr[0], buf[0], recsize);
+	}
+#endif
+}
 
-		for (int i = 0; i < recsize; ++i)
-		{
-			unsigned char tmpchar = buf[i];
-			if (debug) printf("%02x ", tmpchar);
-			if (mavlink_parse_char(MAVLINK_COMM_0, buf[i], &msg, &status))
-			{
-				if (verbose)
-				{
-					// Packet received
-					printf("\n(SYS: %d/COMP: %d/UDP) Received message with ID %u from UDP with %i payload bytes and %i total length\n",
-							msg.sysid, msg.compid, msg.msgid, msg.len, recsize);
-				}
-				sendMAVLinkMessage(lcm, &msg);
-			}
-		}
+/**
+ * @brief Add a peer given as host or host:port on the command line
+ */
+static bool add_configured_peer(const char* hostAndPort)
+{
+	std::string hostname(hostAndPort);
+	std::string service(port->str);
 
+	size_t colon = hostname.rfind(':');
+	if (colon != std::string::npos)
+	{
+		service = hostname.substr(colon + 1);
+		hostname = hostname.substr(0, colon);
 	}
-	return NULL;
-		}
+
+	struct addrinfo hints;
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_INET;
+	hints.ai_socktype = SOCK_DGRAM;
+
+	struct addrinfo* result = NULL;
+	int error = getaddrinfo(hostname.c_str(), service.c_str(), &hints, &result);
+	if (error != 0)
+	{
+		fprintf(stderr, "Unknown remote host address: %s:%s (%s), please check spelling.\n",
+				hostname.c_str(), service.c_str(), gai_strerror(error));
+		return false;
+	}
+
+	if (peers.size() >= kMaxPeers)
+	{
+		fprintf(stderr, "Too many peers, not adding %s\n", hostAndPort);
+		freeaddrinfo(result);
+		return false;
+	}
+
+	Peer peer;
+	memcpy(&peer.addr, result->ai_addr, sizeof(struct sockaddr_in));
+	peer.configured = true;
+	peer.lastSeen = g_get_monotonic_time();
+	peers.push_back(peer);
+	freeaddrinfo(result);
+
+	printf("Using IP address: %s:%u for host %s\n", inet_ntoa(peer.addr.sin_addr),
+		   ntohs(peer.addr.sin_port), hostname.c_str());
+
+	return true;
+}
 
 int main(int argc, char* argv[])
 {
@@ -243,12 +502,15 @@ int main(int argc, char* argv[])
 	{
 			{ "sysid", 'a', 0, G_OPTION_ARG_INT, &systemid, "ID of this system", NULL },
 			{ "compid", 'c', 0, G_OPTION_ARG_INT, &componentid, "ID of this component", NULL },
-			{ "host", 'r', 0, G_OPTION_ARG_STRING, host, "Remote host", host->str },
-			{ "port", 'p', 0, G_OPTION_ARG_STRING, port, "Remote port", port->str },
+			{ "host", 'r', 0, G_OPTION_ARG_STRING, host, "Remote hosts, comma-separated host[:port] list", host->str },
+			{ "port", 'p', 0, G_OPTION_ARG_STRING, port, "Remote port of hosts given without port", port->str },
+			{ "listen", 'l', 0, G_OPTION_ARG_INT, &listenPort, "Local port peers can send to, 0 for any", "0" },
+			{ "peer-timeout", 'o', 0, G_OPTION_ARG_INT, &peerTimeout, "Seconds after which a silent learned peer is dropped", "10" },
 			{ "extended", 'e', 0, G_OPTION_ARG_NONE, &transmitExtended, "Transmit extended MAVLINK messages", "true" },
 			{ "silent", 's', 0, G_OPTION_ARG_NONE, &silent, "Be silent", NULL },
 			{ "verbose", 'v', 0, G_OPTION_ARG_NONE, &verbose, "Be verbose", NULL },
 			{ "debug", 'd', 0, G_OPTION_ARG_NONE, &debug, "Debug mode, changes behaviour", NULL },
+			{ "coalesce", 't', 0, G_OPTION_ARG_INT, &coalesceUsecs, "Microseconds outgoing messages are held back to be sent together, 0 to send every message at once", "1000" },
 			{ NULL }
 	};
 
@@ -267,21 +529,14 @@ int main(int argc, char* argv[])
 	// Handling program options done
 
 	// Print the basic configuration
-	printf("Connecting to host %s:%s\n", host->str, port->str);
-
-	//		sock = socket(PF_INET, SOCK_DGRAM, IPPROTO_UDP);
-	//		struct sockaddr_in gcAddr;
-	//		struct sockaddr_in locAddr;
-	//		struct sockaddr_in fromAddr;
-	//		ssize_t recsize;
-	//		socklen_t fromlen;
+	printf("Connecting to hosts %s (default port %s)\n", host->str, port->str);
 
 	memset(&locAddr, 0, sizeof(locAddr));
 	locAddr.sin_family = AF_INET;
 	locAddr.sin_addr.s_addr = INADDR_ANY;
-	locAddr.sin_port = htons(0);//htons(14551);
+	locAddr.sin_port = htons(listenPort);
 
-	/* Bind the socket to port 14551 - necessary to receive packets from qgroundcontrol */
+	/* Bind the socket - necessary to receive packets from the peers */
 	if ((int)-1 == bind(sock, (struct sockaddr *) &locAddr, sizeof(struct sockaddr)))
 	{
 		perror("error bind failed");
@@ -289,45 +544,17 @@ int main(int argc, char* argv[])
 		exit(EXIT_FAILURE);
 	}
 
-	/* Attempt to make it non blocking */
-	// if (fcntl(sock, F_SETFL, O_NONBLOCK | FASYNC) < 0)
-	//    {
-	//	fprintf(stderr, "error setting nonblocking: %s\n", strerror(errno));
-	//	close(sock);
-	//	exit(EXIT_FAILURE);
-	//    }
-
-	// Get internet address for hostname
-	struct hostent *hp = gethostbyname(host->str);
-
-	if (hp == NULL)
+	gchar** hosts = g_strsplit(host->str, ",", 0);
+	for (int i = 0; hosts[i] != NULL; ++i)
 	{
-		fprintf(stderr,"Unknown remote host address: %s, please check spelling.\n", host->str);
-		exit(EXIT_FAILURE);
-	}
-	else
-	{
-		printf("Using IP address: %s for host %s\n", inet_ntoa( *( struct in_addr*)( hp -> h_addr)), hp->h_name);
-
-		// If more than one address exists
-		if (hp->h_addr_list[1] != NULL)
+		if (hosts[i][0] != '\0' && !add_configured_peer(hosts[i]))
 		{
-			printf("Additional (unused) addresses of this host (%s) are:\n", hp->h_name);
-			int i=1;
-			while (hp->h_addr_list[i] != NULL)
-			{
-				printf( "\t%s \n", inet_ntoa( *( struct in_addr*)( hp -> h_addr_list[i])));
-				i++;
-			}
+			exit(EXIT_FAILURE);
 		}
 	}
+	g_strfreev(hosts);
 
-
-	// Set host and port
-	memset(&gcAddr, 0, sizeof(gcAddr));
-	gcAddr.sin_family = hp->h_addrtype;
-	gcAddr.sin_addr.s_addr = ((struct in_addr *)(hp->h_addr))->s_addr;//inet_addr("127.0.0.1");//inet_addr(host.c_str());
-	gcAddr.sin_port = htons(atoi(port->str));
+	udpQueue.init(sock, coalesceUsecs);
 
 	lcm = lcm_create ("udpm://");
 	if (!lcm)
@@ -338,36 +565,68 @@ int main(int argc, char* argv[])
 	mavconn_mavlink_msg_container_t_subscription_t * comm_sub =
 			mavconn_mavlink_msg_container_t_subscribe (lcm, MAVLINK_MAIN, &mavlink_handler, &sock);
 
-	// Initialize LCM receiver thread
-	GThread* lcm_thread;
-	GThread* udp_thread;
-	GError* err;
-
-
-	if( (lcm_thread = g_thread_try_new("LCM", (GThreadFunc)lcm_wait, (void *)lcm, &err)) == NULL)
-	{
-		printf("Thread creation failed: %s!!\n", err->message );
-		g_error_free ( err ) ;
-	}
-
-	if( (udp_thread = g_thread_try_new("UDP", (GThreadFunc)udp_wait, (void *)lcm, &err)) == NULL)
-	{
-		printf("Thread creation failed: %s!!\n", err->message );
-		g_error_free ( err ) ;
-	}
-
 	printf("\nPX MAVLINK BRIDGE UDP STARTED ON MAV %d (COMPONENT ID:%d) - RUNNING..\n\n", systemid, componentid);
 
+	// Serve the UDP socket and LCM from one loop, so the peer table needs no locking
+	int lcmFd = lcm_get_fileno(lcm);
+#ifdef __linux__
+	int epfd = epoll_create(2);
+	struct epoll_event ev;
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.fd = sock;
+	epoll_ctl(epfd, EPOLL_CTL_ADD, sock, &ev);
+	ev.data.fd = lcmFd;
+	epoll_ctl(epfd, EPOLL_CTL_ADD, lcmFd, &ev);
+#else
+	struct pollfd pfds[2];
+	pfds[0].fd = sock;
+	pfds[0].events = POLLIN;
+	pfds[1].fd = lcmFd;
+	pfds[1].events = POLLIN;
+#endif
+
+	gint64 lastExpiry = g_get_monotonic_time();
 	while (1)
 	{
-		sleep(1); // Sleep one second
+#ifdef __linux__
+		struct epoll_event events[2];
+		int n = epoll_wait(epfd, events, 2, 1000);
+		for (int i = 0; i < n; ++i)
+		{
+			if (events[i].data.fd == sock)
+			{
+				udp_receive();
+			}
+			else
+			{
+				lcm_handle(lcm);
+			}
+		}
+#else
+		if (poll(pfds, 2, 1000) > 0)
+		{
+			if (pfds[0].revents & POLLIN)
+			{
+				udp_receive();
+			}
+			if (pfds[1].revents & POLLIN)
+			{
+				lcm_handle(lcm);
+			}
+		}
+#endif
+
+		if (g_get_monotonic_time() - lastExpiry > 1000000)
+		{
+			expire_peers();
+			lastExpiry = g_get_monotonic_time();
+		}
 	}
 	mavconn_mavlink_msg_container_t_unsubscribe(lcm, comm_sub);
 	lcm_destroy (lcm);
 	close(sock);
 
-	g_thread_join(lcm_thread);
-	g_thread_join(udp_thread);
 	exit(0);
 }
 
@@ -0,0 +1,271 @@
+/*=====================================================================
+
+MAVCONN Micro Air Vehicle Flying Robotics Toolkit
+
+(c) 2009, 2010, 2011 MAVCONN PROJECT  <http://MAVCONN.ethz.ch>
+
+This file is part of the MAVCONN project
+
+    MAVCONN is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    MAVCONN is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with MAVCONN. If not, see <http://www.gnu.org/licenses/>.
+
+======================================================================*/
+
+/**
+* @file
+*   @brief Round-trip check and benchmark of the PxZip depth codec
+*
+*   Synthetic depth images are encoded with PxZip::compressDepth() and
+*   decoded again; every image must come back unchanged. Besides frames
+*   resembling a Kinect depth image (planes and a sphere in millimeters,
+*   range dependent noise and shadow holes) this covers worst cases for the
+*   codec: random pixels, alternating valid/invalid pixels and the largest
+*   possible differences. Truncated input and input of the wrong size must
+*   be handled without writing past the image.
+*
+*   The size and speed of the depth codec are compared with zlib on the raw
+*   pixels, which is how depth images were sent before.
+*
+*/
+
+#include <cmath>
+#include <cstdlib>
+#include <iostream>
+#include <vector>
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include <boost/program_options.hpp>
+
+#include "PxZip.h"
+
+namespace config = boost::program_options;
+
+static double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/**
+* @brief Fill img with a depth image like the Kinect delivers, in millimeters
+*
+* @param shift Horizontal offset of the sphere, to vary the frames
+*/
+static void kinect_frame(cv::Mat& img, int width, int height, int shift)
+{
+	img.create(height, width, CV_16UC1);
+	uint16_t* p = reinterpret_cast<uint16_t*>(img.data);
+
+	for (int y = 0; y < height; ++y)
+	{
+		for (int x = 0; x < width; ++x)
+		{
+			double z = 1500.0 + y * 3.0 + x * 0.5;
+			double dx = x - width / 2 - shift;
+			double dy = y - height / 2;
+			if (dx * dx + dy * dy < 100.0 * 100.0)
+			{
+				z = 900.0 + 0.01 * (dx * dx + dy * dy);
+			}
+
+			// left border and sphere shadow are invalid, like random dropouts
+			if (x < 16 || (dx > 100 && dx < 115 && fabs(dy) < 100) || rand() % 50 == 0)
+			{
+				z = 0;
+			}
+			else
+			{
+				z += (rand() % 7 - 3) * z * z / 4e6;
+			}
+			*p++ = static_cast<uint16_t>(z);
+		}
+	}
+}
+
+/**
+* @brief Fill img with one of the worst cases of the codec
+*/
+static void worst_case_frame(cv::Mat& img, int rows, int cols, int kind)
+{
+	img.create(rows, cols, CV_16UC1);
+	uint16_t* p = reinterpret_cast<uint16_t*>(img.data);
+
+	for (int i = 0; i < rows * cols; ++i)
+	{
+		switch (kind)
+		{
+		case 0:		// random pixels
+			p[i] = rand() & 0xFFFF;
+			break;
+		case 1:		// alternating invalid and maximum pixels
+			p[i] = (i & 1) ? 0xFFFF : 0;
+			break;
+		case 2:		// largest possible differences between valid pixels
+			p[i] = (i & 1) ? 0xFFFF : 1;
+			break;
+		default:	// short runs of small values
+			p[i] = (rand() % 3) ? 0 : rand() % 4;
+			break;
+		}
+	}
+}
+
+static bool same(const cv::Mat& a, const cv::Mat& b)
+{
+	return a.rows == b.rows && a.cols == b.cols && a.type() == b.type() &&
+		   memcmp(a.data, b.data, a.rows * a.cols * sizeof(uint16_t)) == 0;
+}
+
+/**
+* @brief Round trips of edge cases and malformed input
+*
+* @return number of failed checks
+*/
+static int check(PxZip& zip)
+{
+	std::vector<unsigned char> data;
+	cv::Mat img, decoded;
+	int failed = 0;
+
+	for (int i = 0; i < 20; ++i)
+	{
+		worst_case_frame(img, 37 + i, 53, i % 4);
+		zip.compressDepth(img, data);
+		if (!zip.decompressDepth(&data[0], data.size(), img.rows, img.cols, decoded) ||
+			!same(img, decoded))
+		{
+			fprintf(stderr, "# ERROR: Round trip of worst case %d failed.\n", i % 4);
+			failed++;
+		}
+	}
+
+	worst_case_frame(img, 1, 1, 1);
+	zip.compressDepth(img, data);
+	if (!zip.decompressDepth(&data[0], data.size(), 1, 1, decoded) || !same(img, decoded))
+	{
+		fprintf(stderr, "# ERROR: Round trip of a single pixel failed.\n");
+		failed++;
+	}
+
+	kinect_frame(img, 640, 480, 0);
+	zip.compressDepth(img, data);
+
+	// a truncated image decodes to the right size, the missing part invalid
+	if (!zip.decompressDepth(&data[0], data.size() / 2, img.rows, img.cols, decoded) ||
+		decoded.rows != img.rows || decoded.cols != img.cols)
+	{
+		fprintf(stderr, "# ERROR: Truncated input was not decoded.\n");
+		failed++;
+	}
+
+	// the size in the header must match the size the caller expects
+	if (zip.decompressDepth(&data[0], data.size(), img.rows * 2, img.cols, decoded) ||
+		zip.decompressDepth(&data[0], 8, img.rows, img.cols, decoded))
+	{
+		fprintf(stderr, "# ERROR: Malformed input was accepted.\n");
+		failed++;
+	}
+
+	// zlib streams of raw pixels from older senders are not taken for the codec
+	zip.compressData(img.data, img.rows * img.cols * sizeof(uint16_t), data);
+	if (PxZip::isDepthCodec(&data[0], data.size()))
+	{
+		fprintf(stderr, "# ERROR: zlib data was taken for the depth codec.\n");
+		failed++;
+	}
+
+	return failed;
+}
+
+int main(int argc, char* argv[])
+{
+	int frameCount = 30;
+	int width = 640;
+	int height = 480;
+
+	config::options_description desc("Allowed options");
+	desc.add_options()
+		("help", "produce help message")
+		("frames,n", config::value<int>(&frameCount)->default_value(frameCount), "number of frames to encode")
+		("width", config::value<int>(&width)->default_value(width), "frame width")
+		("height", config::value<int>(&height)->default_value(height), "frame height")
+		;
+	config::variables_map vm;
+	config::store(config::parse_command_line(argc, argv, desc), vm);
+	config::notify(vm);
+
+	if (vm.count("help") || frameCount < 1 || width < 1 || height < 1)
+	{
+		std::cout << desc << std::endl;
+		return 1;
+	}
+
+	srand(42);
+	PxZip zip;
+
+	int failed = check(zip);
+
+	std::vector<cv::Mat> frames(frameCount);
+	for (int i = 0; i < frameCount; ++i)
+	{
+		kinect_frame(frames[i], width, height, i);
+	}
+
+	std::vector<unsigned char> data;
+	std::vector<unsigned char> raw;
+	cv::Mat decoded;
+	size_t depthSize = 0, zlibSize = 0;
+	double depthEncode = 0, depthDecode = 0, zlibEncode = 0, zlibDecode = 0;
+	size_t rawSize = width * height * sizeof(uint16_t);
+
+	for (int i = 0; i < frameCount; ++i)
+	{
+		double start = now();
+		zip.compressDepth(frames[i], data);
+		depthEncode += now() - start;
+		depthSize += data.size();
+
+		start = now();
+		bool ok = zip.decompressDepth(&data[0], data.size(), height, width, decoded);
+		depthDecode += now() - start;
+		if (!ok || !same(frames[i], decoded))
+		{
+			fprintf(stderr, "# ERROR: Round trip of frame %d failed.\n", i);
+			failed++;
+		}
+
+		start = now();
+		zip.compressData(frames[i].data, rawSize, data);
+		zlibEncode += now() - start;
+		zlibSize += data.size();
+
+		start = now();
+		zip.decompressData(&data[0], data.size(), raw);
+		zlibDecode += now() - start;
+	}
+
+	printf("%dx%d frames, %.0f KB raw\n", width, height, rawSize / 1024.0);
+	printf("depth %8.1f KB/frame %8.2f ms encode %8.2f ms decode\n",
+		   depthSize / 1024.0 / frameCount,
+		   depthEncode * 1000.0 / frameCount, depthDecode * 1000.0 / frameCount);
+	printf("zlib  %8.1f KB/frame %8.2f ms encode %8.2f ms decode\n",
+		   zlibSize / 1024.0 / frameCount,
+		   zlibEncode * 1000.0 / frameCount, zlibDecode * 1000.0 / frameCount);
+	printf("%d failed checks\n", failed);
+
+	return failed ? 1 : 0;
+}
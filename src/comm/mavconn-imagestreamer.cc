@@ -36,6 +36,9 @@ This file is part of the MAVCONN project
 #include <inttypes.h>
 #include <cstdlib>
 #include <cstdio>
+#include <cstring>
+#include <algorithm>
+#include <deque>
 #include <iostream>
 #include <fstream>
 #include <glib.h>
@@ -45,6 +48,7 @@ This file is part of the MAVCONN project
 // OpenCV includes
 #include <opencv2/core/core.hpp>
 #include <opencv2/highgui/highgui.hpp>
+#include <opencv2/imgproc/imgproc.hpp>
 
 // Latency Benchmarking
 // #include <sys/time.h>
@@ -62,18 +66,386 @@ int sysid;
 int compid;
 uint64_t camno;
 bool silent, verbose, debug;
+int window;				///< packets in flight in windowed mode, 0 sends the image in one burst
+int bandwidth;			///< bytes per second the streamer may use on the link, 0 for no limit
+int ackTimeout;			///< milliseconds without acknowledgment before packets are sent again
+int maxRetries;
+bool progressive;
+int targetInterval;		///< milliseconds per image the encoder settings are chosen for, 0 to disable
+int minQuality;
 
 using namespace std;
 
 #define PACKET_PAYLOAD		253
+/* the handshake announces the number of packets in one byte */
+#define MAX_IMAGE_PACKETS	255
+
+/*
+ * Acknowledgment of a windowed transfer: an ENCAPSULATED_DATA message from
+ * the ground station with this sequence number. Its data holds the image
+ * size (uint32, identifies the transfer), the number of packets received
+ * in order (uint16) and a bitmap of all packets received, little endian.
+ */
+#define ACK_SEQNR			0xFFFF
+#define ACK_BITMAP_OFFSET	6
+
 bool captureImage = false;
 
+enum PacketState
+{
+	PACKET_UNSENT,
+	PACKET_SENT,
+	PACKET_QUEUED,		///< reported missing, waiting to be sent again
+	PACKET_RECEIVED
+};
+
+/**
+ * @brief Image being sent in windowed mode, shared with the MAVLink thread
+ * receiving the acknowledgments
+ */
+struct ImageTransfer
+{
+	bool active;
+	uint32_t size;
+	std::vector<uint8_t> state;		///< PacketState of every packet
+	std::deque<uint16_t> retransmit;
+	uint16_t base;					///< first packet not received
+	uint16_t next;					///< first packet not sent yet
+	int acks;
+	gint64 firstSent;				///< time the first packet was sent
+	gint64 firstAck;				///< time the first acknowledgment arrived
+};
+
+ImageTransfer transfer;
+GMutex transferMutex;
+GCond transferCond;
+
+/**
+ * Image size reductions, from full frame to smallest. Within a level the
+ * JPEG quality varies between minQuality and the requested quality.
+ */
+struct StreamLevel
+{
+	int scale;			///< downscale factor
+	bool crop;			///< send only the center half of the frame
+};
+
+static const StreamLevel kStreamLevels[] = {
+	{1, false},
+	{2, false},
+	{4, false},
+	{4, true}
+};
+static const int kStreamLevelCount = sizeof(kStreamLevels) / sizeof(kStreamLevels[0]);
+
+/**
+ * @brief Encoder settings adapted to the measured link throughput
+ */
+struct StreamControl
+{
+	int level;
+	int quality;
+	double throughput;	///< bytes per second, smoothed over the last images
+	double rtt;			///< seconds until the first acknowledgment of an image
+};
+
+StreamControl control = {0, 0, 0.0, 0.0};
+
 lcm_t* lcmImage;
 lcm_t* lcmMavlink;
 mavlink_message_t tmp;
 mavlink_data_transmission_handshake_t req, ack;
 
 bool quit = false;
+/**
+ * @brief Wait until the bandwidth budget allows sending the message
+ */
+static void pace_link(const mavlink_message_t* msg)
+{
+	static gint64 nextSend = 0;
+
+	if (bandwidth <= 0)
+	{
+		return;
+	}
+
+	gint64 now = g_get_monotonic_time();
+	if (nextSend > now)
+	{
+		g_usleep(nextSend - now);
+	}
+	else
+	{
+		nextSend = now;
+	}
+	nextSend += static_cast<gint64>(msg->len + MAVLINK_NUM_NON_PAYLOAD_BYTES) * 1000000 / bandwidth;
+}
+
+/**
+ * @brief Send one ENCAPSULATED_DATA packet of the image
+ */
+static void send_image_packet(const vector<uint8_t>& jpg, uint16_t index)
+{
+	uint8_t data[PACKET_PAYLOAD];
+	size_t offset = static_cast<size_t>(index) * PACKET_PAYLOAD;
+	size_t length = std::min(static_cast<size_t>(PACKET_PAYLOAD), jpg.size() - offset);
+
+	memcpy(data, &jpg[offset], length);
+	// fill packet data with padding bits
+	memset(data + length, 0, PACKET_PAYLOAD - length);
+
+	mavlink_message_t msg;
+	mavlink_msg_encapsulated_data_pack(sysid, compid, &msg, index, data);
+	pace_link(&msg);
+	sendMAVLinkMessage(lcmMavlink, &msg);
+	if (verbose) printf("sent packet %02d successfully\n", index + 1);
+}
+
+/**
+ * @brief Send the image with at most window packets in flight
+ *
+ * Packets are sent in order. Packets the ground station reports missing are
+ * sent again before new ones; if no acknowledgment arrives for ackTimeout,
+ * all packets in flight are sent again.
+ *
+ * @param rtt Set to the time from the first packet to the first acknowledgment
+ * @return false if the transfer was given up after maxRetries timeouts
+ */
+static bool send_image_windowed(const vector<uint8_t>& jpg, uint16_t packets, double& rtt)
+{
+	g_mutex_lock(&transferMutex);
+	transfer.active = true;
+	transfer.size = jpg.size();
+	transfer.state.assign(packets, PACKET_UNSENT);
+	transfer.retransmit.clear();
+	transfer.base = 0;
+	transfer.next = 0;
+	transfer.acks = 0;
+	transfer.firstSent = 0;
+	transfer.firstAck = 0;
+
+	bool result = true;
+	int timeouts = 0;
+	while (true)
+	{
+		while (transfer.base < packets && transfer.state[transfer.base] == PACKET_RECEIVED)
+		{
+			++transfer.base;
+		}
+		if (transfer.base == packets)
+		{
+			break;
+		}
+
+		int packet = -1;
+		while (!transfer.retransmit.empty() && packet == -1)
+		{
+			if (transfer.state[transfer.retransmit.front()] == PACKET_QUEUED)
+			{
+				packet = transfer.retransmit.front();
+			}
+			transfer.retransmit.pop_front();
+		}
+		if (packet == -1 && transfer.next < packets &&
+			transfer.next < transfer.base + window)
+		{
+			packet = transfer.next++;
+		}
+
+		if (packet == -1)
+		{
+			// window is full, wait for the ground station
+			int acks = transfer.acks;
+			gint64 deadline = g_get_monotonic_time() + static_cast<gint64>(ackTimeout) * 1000;
+			while (transfer.acks == acks && g_get_monotonic_time() < deadline)
+			{
+				g_cond_wait_until(&transferCond, &transferMutex, deadline);
+			}
+
+			if (transfer.acks != acks)
+			{
+				timeouts = 0;
+				continue;
+			}
+
+			if (++timeouts > maxRetries)
+			{
+				result = false;
+				break;
+			}
+
+			if (verbose) printf("no acknowledgment, sending packets %d to %d again\n", transfer.base, transfer.next - 1);
+			for (int i = transfer.base; i < transfer.next; ++i)
+			{
+				if (transfer.state[i] == PACKET_SENT)
+				{
+					transfer.state[i] = PACKET_QUEUED;
+					transfer.retransmit.push_back(i);
+				}
+			}
+			continue;
+		}
+
+		transfer.state[packet] = PACKET_SENT;
+		if (transfer.firstSent == 0)
+		{
+			transfer.firstSent = g_get_monotonic_time();
+		}
+		g_mutex_unlock(&transferMutex);
+
+		send_image_packet(jpg, packet);
+
+		g_mutex_lock(&transferMutex);
+	}
+
+	rtt = (transfer.firstAck > transfer.firstSent) ? (transfer.firstAck - transfer.firstSent) / 1000000.0 : 0.0;
+	transfer.active = false;
+	g_mutex_unlock(&transferMutex);
+
+	return result;
+}
+
+/**
+ * @brief Scale and crop the frame according to the current stream level
+ */
+static void prepare_image(const cv::Mat& img, cv::Mat& out)
+{
+	const StreamLevel& level = kStreamLevels[control.level];
+
+	cv::Mat roi = img;
+	if (level.crop)
+	{
+		roi = img(cv::Rect(img.cols / 4, img.rows / 4, img.cols / 2, img.rows / 2));
+	}
+
+	if (level.scale > 1)
+	{
+		cv::resize(roi, out, cv::Size(roi.cols / level.scale, roi.rows / level.scale), 0, 0, cv::INTER_AREA);
+	}
+	else
+	{
+		out = roi;
+	}
+}
+
+/**
+ * @brief Encode the frame as JPEG, lowering quality and then size until
+ * the image fits into MAX_IMAGE_PACKETS packets
+ *
+ * @return False if not even the smallest image fits
+ */
+static bool encode_image(cv::Mat& frame, int& quality, vector<uint8_t>& jpg)
+{
+	while (true)
+	{
+		vector<int> p; ///< params for cv::imencode. Sets the JPEG quality.
+		p.push_back(CV_IMWRITE_JPEG_QUALITY);
+		p.push_back(quality);
+#if CV_MAJOR_VERSION >= 3
+		if (progressive)
+		{
+			// the ground station can show a coarse image from the first packets
+			p.push_back(cv::IMWRITE_JPEG_PROGRESSIVE);
+			p.push_back(1);
+		}
+#endif
+		cv::imencode(".jpg", frame, jpg, p);
+
+		if (jpg.size() <= MAX_IMAGE_PACKETS * PACKET_PAYLOAD)
+		{
+			return true;
+		}
+
+		if (quality > minQuality)
+		{
+			quality = std::max(quality - 10, minQuality);
+		}
+		else if (frame.cols >= 32 && frame.rows >= 32)
+		{
+			cv::Mat smaller;
+			cv::resize(frame, smaller, cv::Size(frame.cols / 2, frame.rows / 2), 0, 0, cv::INTER_AREA);
+			frame = smaller;
+		}
+		else
+		{
+			return false;
+		}
+		if (verbose) printf("image of %d bytes needs more than %d packets, encoding %dx%d at quality %d\n",
+							(int)jpg.size(), MAX_IMAGE_PACKETS, frame.cols, frame.rows, quality);
+	}
+}
+
+/**
+ * @brief Choose the settings for the next image from the last transfer
+ *
+ * The image should fit into what the link carries in targetInterval once
+ * the round trip is subtracted. Far off the target, the size level changes
+ * (each level has about a quarter of the pixels of the one before); close
+ * to it, the quality is adjusted in steps between minQuality and the
+ * requested quality.
+ */
+static void adapt_stream(size_t bytes, double seconds, double rtt, int requestedQuality)
+{
+	if (seconds <= rtt)
+	{
+		return;
+	}
+
+	double throughput = bytes / (seconds - rtt);
+	if (control.throughput == 0.0)
+	{
+		control.throughput = throughput;
+		control.rtt = rtt;
+	}
+	else
+	{
+		control.throughput = 0.7 * control.throughput + 0.3 * throughput;
+		control.rtt = 0.7 * control.rtt + 0.3 * rtt;
+	}
+
+	double budget = control.throughput * std::max(targetInterval / 1000.0 - control.rtt, 0.0);
+	double ratio = budget / bytes;
+
+	while (ratio < 0.3 && control.level < kStreamLevelCount - 1)
+	{
+		++control.level;
+		ratio *= 4.0;
+	}
+	while (ratio > 6.0 && control.level > 0)
+	{
+		--control.level;
+		ratio /= 4.0;
+	}
+
+	if (ratio < 0.9)
+	{
+		if (control.quality > minQuality)
+		{
+			control.quality = std::max(control.quality - 10, minQuality);
+		}
+		else if (control.level < kStreamLevelCount - 1)
+		{
+			++control.level;
+			control.quality = requestedQuality;
+		}
+	}
+	else if (ratio > 1.5)
+	{
+		if (control.quality < requestedQuality)
+		{
+			control.quality = std::min(control.quality + 10, requestedQuality);
+		}
+		else if (control.level > 0 && ratio > 4.0)
+		{
+			--control.level;
+			control.quality = minQuality;
+		}
+	}
+
+	if (verbose) printf("link %.0f bytes/s, rtt %.0f ms: level %d, quality %d\n",
+						control.throughput, control.rtt * 1000.0, control.level, control.quality);
+}
+
 /**
  * @brief Handle incoming MAVLink packets containing images
  */
@@ -115,12 +487,26 @@ static void image_handler (const lcm_recv_buf_t *rbuf, const char * channel, con
 			req.jpg_quality = 60;
 		}
 
+		// Pick size and quality for the measured link throughput
+		int quality = req.jpg_quality;
+		cv::Mat frame = img;
+		if (targetInterval > 0)
+		{
+			if (control.quality == 0 || control.quality > req.jpg_quality)
+			{
+				control.quality = req.jpg_quality;
+			}
+			quality = control.quality;
+			prepare_image(img, frame);
+		}
+
 		// Encode image as JPEG
 		vector<uint8_t> jpg; ///< container for JPEG image data
-		vector<int> p (2); ///< params for cv::imencode. Sets the JPEG quality.
-		p[0] = CV_IMWRITE_JPEG_QUALITY;
-		p[1] = req.jpg_quality;
-		cv::imencode(".jpg", img, jpg, p);
+		if (!encode_image(frame, quality, jpg))
+		{
+			if (!silent) fprintf(stderr, "# WARNING: Image does not fit into %d packets, not sending it\n", MAX_IMAGE_PACKETS);
+			continue;
+		}
 
 		// Prepare and send acknowledgment packet
 		ack.type = static_cast<uint8_t>( DATA_TYPE_JPEG_IMAGE );
@@ -128,41 +514,96 @@ static void image_handler (const lcm_recv_buf_t *rbuf, const char * channel, con
 		ack.packets = static_cast<uint8_t>( ack.size/PACKET_PAYLOAD );
 		if (ack.size % PACKET_PAYLOAD) { ++ack.packets; } // one more packet with the rest of data
 		ack.payload = static_cast<uint8_t>( PACKET_PAYLOAD );
-		ack.jpg_quality = req.jpg_quality;
-		ack.width = 640;
-		ack.height = 480;
+		ack.jpg_quality = quality;
+		ack.width = frame.cols;
+		ack.height = frame.rows;
 
+		gint64 start = g_get_monotonic_time();
 		mavlink_msg_data_transmission_handshake_encode(sysid, compid, &tmp, &ack);
+		pace_link(&tmp);
 		sendMAVLinkMessage(lcmMavlink, &tmp);
 
 		// Send image data (split up into smaller chunks first, then sent over MAVLink)
-		uint8_t data[PACKET_PAYLOAD];
-		uint16_t byteIndex = 0;
 		if (verbose) printf("there are %02d packets waiting to be sent (%05d bytes). start sending...\n", ack.packets, ack.size);
 
-		for (uint8_t i = 0; i < ack.packets; ++i)
+		if (window > 0)
 		{
-			// Copy PACKET_PAYLOAD bytes of image data to send buffer
-			for (uint8_t j = 0; j < PACKET_PAYLOAD; ++j)
+			double rtt;
+			if (send_image_windowed(jpg, ack.packets, rtt))
 			{
-				if (byteIndex < ack.size)
-				{
-					data[j] = (uint8_t)jpg[byteIndex];
-				}
-				// fill packet data with padding bits
-				else
-				{
-					data[j] = 0;
-				}
-				++byteIndex;
+				adapt_stream(jpg.size(), (g_get_monotonic_time() - start) / 1000000.0, rtt, req.jpg_quality);
+			}
+			else if (!silent)
+			{
+				fprintf(stderr, "# WARNING: Image transfer aborted, no acknowledgment from ground station\n");
 			}
-			// Send ENCAPSULATED_IMAGE packet
-			mavlink_msg_encapsulated_data_pack(sysid, compid, &tmp, i, data);
-			sendMAVLinkMessage(lcmMavlink, &tmp);
-			if (verbose) printf("sent packet %02d successfully\n", i+1);
 		}
+		else
+		{
+			for (uint16_t i = 0; i < ack.packets; ++i)
+			{
+				send_image_packet(jpg, i);
+			}
+
+			// without acknowledgments the paced rate is all there is to go by
+			if (bandwidth > 0)
+			{
+				adapt_stream(jpg.size(), (g_get_monotonic_time() - start) / 1000000.0, 0.0, req.jpg_quality);
+			}
+		}
+	}
 	}
+}
+
+/**
+ * @brief Apply an acknowledgment from the ground station to the current transfer
+ *
+ * Packets missing below the highest packet received are treated as lost
+ * and queued to be sent again.
+ */
+static void handle_transfer_ack(const mavlink_message_t* msg)
+{
+	uint8_t data[PACKET_PAYLOAD];
+	mavlink_msg_encapsulated_data_get_data(msg, data);
+
+	uint32_t size;
+	uint16_t inOrder;
+	memcpy(&size, data, sizeof(size));
+	memcpy(&inOrder, data + sizeof(size), sizeof(inOrder));
+
+	g_mutex_lock(&transferMutex);
+	if (transfer.active && size == transfer.size)
+	{
+		const size_t bitmapSize = (PACKET_PAYLOAD - ACK_BITMAP_OFFSET) * 8;
+
+		int highest = -1;
+		for (size_t i = 0; i < transfer.state.size(); ++i)
+		{
+			if (i < inOrder ||
+				(i < bitmapSize && (data[ACK_BITMAP_OFFSET + i / 8] & (1 << (i % 8)))))
+			{
+				transfer.state[i] = PACKET_RECEIVED;
+				highest = i;
+			}
+		}
+
+		for (int i = transfer.base; i < highest; ++i)
+		{
+			if (transfer.state[i] == PACKET_SENT)
+			{
+				transfer.state[i] = PACKET_QUEUED;
+				transfer.retransmit.push_back(i);
+			}
+		}
+
+		if (transfer.firstAck == 0)
+		{
+			transfer.firstAck = g_get_monotonic_time();
+		}
+		++transfer.acks;
+		g_cond_signal(&transferCond);
 	}
+	g_mutex_unlock(&transferMutex);
 }
 
 /**
@@ -175,6 +616,12 @@ static void mavlink_handler (const lcm_recv_buf_t *rbuf, const char * channel, c
 	if(msg->sysid == 42)
 		captureImage = true;
 
+	if (msg->msgid == MAVLINK_MSG_ID_ENCAPSULATED_DATA && msg->sysid != sysid &&
+		mavlink_msg_encapsulated_data_get_seqnr(msg) == ACK_SEQNR)
+	{
+		handle_transfer_ack(msg);
+	}
+
 	if (msg->msgid == MAVLINK_MSG_ID_DATA_TRANSMISSION_HANDSHAKE)
 	{
 		mavlink_msg_data_transmission_handshake_decode(msg, &req);
@@ -234,6 +681,13 @@ int main(int argc, char* argv[])
 		("silent,s", config::bool_switch(&silent)->default_value(false), "suppress outputs")
 		("verbose,v", config::bool_switch(&verbose)->default_value(false), "verbose output")
 		("debug,d", config::bool_switch(&debug)->default_value(false), "Emit debug information")
+		("window,w", config::value<int>(&window)->default_value(0), "Packets in flight per image, needs acknowledgments from the ground station (0: send whole image at once)")
+		("bandwidth,b", config::value<int>(&bandwidth)->default_value(0), "Bytes per second used for images, e.g. 4000 on a 57600 baud radio (0: no limit)")
+		("ack-timeout", config::value<int>(&ackTimeout)->default_value(500), "Milliseconds to wait for an acknowledgment before sending packets again")
+		("retries", config::value<int>(&maxRetries)->default_value(5), "Timeouts before an image transfer is given up")
+		("progressive", config::bool_switch(&progressive)->default_value(false), "Encode progressive JPEGs")
+		("target-interval", config::value<int>(&targetInterval)->default_value(0), "Milliseconds per image: adapt resolution and quality to the link to reach it (0: always full frame at requested quality)")
+		("min-quality", config::value<int>(&minQuality)->default_value(20), "Lowest JPEG quality before the resolution is reduced")
 		;
 	config::variables_map vm;
 	config::store(config::parse_command_line(argc, argv, desc), vm);
@@ -244,6 +698,23 @@ int main(int argc, char* argv[])
 		return 1;
 	}
 
+#if CV_MAJOR_VERSION < 3
+	if (progressive)
+	{
+		fprintf(stderr, "# WARNING: Progressive JPEG needs OpenCV 3 or newer, sending baseline JPEGs\n");
+	}
+#endif
+
+	if (targetInterval > 0 && window <= 0 && bandwidth <= 0)
+	{
+		fprintf(stderr, "# WARNING: Adapting to the link needs --window or --bandwidth, sending full frames\n");
+		targetInterval = 0;
+	}
+
+	g_mutex_init(&transferMutex);
+	g_cond_init(&transferCond);
+	transfer.active = false;
+
 	// ----- Setting up communication and data for images
 	// Creating LCM network provider
 	lcmImage = lcm_create ("udpm://");
@@ -25,6 +25,19 @@ This file is part of the MAVCONN project
 * @file
 *   @brief Ping utility to measure system communication latency
 *
+*   Pings are sent open-loop at a fixed rate, independent of the responses,
+*   and every roundtrip is measured from the time the ping was scheduled to
+*   be sent. A sender that falls behind therefore shows up as latency
+*   instead of hiding the slow responses (coordinated omission). The
+*   roundtrips are collected in a log-linear histogram and reported as
+*   percentiles.
+*
+*   Pings travel over LCM, the shared memory transport, a serial port or
+*   UDP. A serial port is replaced by a pseudo terminal if none is given,
+*   so that mavconn-bridge-serial can be measured without hardware.
+*   Pinged over LCM, every running mavconn-ping answers; on the other
+*   transports, the answering side is a second mavconn-ping with --echo.
+*
 *   @author Lorenz Meier, <mavteam@student.ethz.ch>
 *
 */
@@ -42,32 +55,283 @@ This file is part of the MAVCONN project
 // Serial includes
 #include <stdio.h>   /* Standard input/output definitions */
 #include <string.h>  /* String function definitions */
-
+#include <errno.h>
+#include <fcntl.h>
+#include <termios.h>
+#include <time.h>
+// UDP includes
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+#include <algorithm>
 #include <vector>
 
 #include "glib.h"
 #include "mavconn.h"
+#include "interface/shared_mem/SHM.h"
 
 using std::string;
 
-struct timeval tv;		  ///< System time
+// shared memory segments of the shm transport ("PNG0", "PNG1")
+#define PING_SHM_KEY_REQUEST	0x30474e50
+#define PING_SHM_KEY_RESPONSE	0x31474e50
+
 // Settings
 int sysid;             ///< The unique system id of this MAV, 0-254. Has to be consistent across the system
 int compid = PX_COMP_ID_PING;
-int nPing;				  ///< Number of ping packets to send
-int pingInterval;         ///< Interval between ping packets
+int nPing = 10;			  ///< Number of ping packets to send
+int pingInterval = 1000000;	///< Interval between ping packets, in microseconds
+double pingRate = 0;	  ///< Ping packets per second, replaces the interval if set
+int payloadSize = 0;	  ///< Bytes sent along with every ping
+int responseTimeout = 1000;	///< Time to wait for outstanding responses, in milliseconds
+gchar* transportName = NULL;	///< lcm, shm, serial or udp
+gchar* device = NULL;	  ///< Serial port, a pseudo terminal is opened if not set
+gchar* udpHost = NULL;	  ///< Host of the UDP bridge
+int udpPort = 14550;	  ///< Port of the UDP bridge
+int udpListenPort = 0;	  ///< Local UDP port, 0 for any
+bool echo;				  ///< Answer pings instead of sending them
+bool printHistogram;	  ///< Print the percentile distribution
 bool silent;              ///< Wether console output should be enabled
 bool verbose;             ///< Enable verbose output
-bool emitHeartbeat;       ///< Generate a heartbeat with this process
 bool debug;               ///< Enable debug functions and output
-bool test;                ///< Enable test mode
 
-std::vector<uint64_t> emitTimes; ///< List containing the timestamps when each ping message was sent
+typedef enum
+{
+	TRANSPORT_LCM,
+	TRANSPORT_SHM,
+	TRANSPORT_SERIAL,
+	TRANSPORT_UDP
+} Transport;
+
+Transport transport = TRANSPORT_LCM;
+lcm_t* lcm = NULL;
+px::SHM shmOut;			  ///< requests when pinging, responses in echo mode
+px::SHM shmIn;
+int fd = -1;			  ///< serial port or UDP socket
+struct sockaddr_in udpPeer;
+bool udpPeerKnown = false;
+std::vector<uint8_t> payload;	///< padding sent with every ping
 
 /**
-* @brief Handle a MAVLINK message received from LCM
+ * @brief Latency histogram in the style of HdrHistogram
+ *
+ * Values below 2^(kSubBits + 1) have a bucket each. Above, every power of
+ * two is split into 2^kSubBits buckets, so recorded values are accurate to
+ * 1% and the histogram covers the full 64 bit range in a few thousand
+ * buckets.
+ */
+class LatencyHistogram
+{
+public:
+	LatencyHistogram()
+	 : counts((65 - kSubBits) << kSubBits, 0)
+	 , total(0)
+	 , sum(0)
+	 , min(UINT64_MAX)
+	 , max(0)
+	{
+
+	}
+
+	void record(uint64_t value)
+	{
+		++counts[index(value)];
+		++total;
+		sum += value;
+		min = std::min(min, value);
+		max = std::max(max, value);
+	}
+
+	uint64_t getCount(void) const { return total; }
+	uint64_t getMin(void) const { return total ? min : 0; }
+	uint64_t getMax(void) const { return max; }
+	double getMean(void) const { return total ? (double)sum / total : 0.0; }
+
+	// smallest recorded value that p percent of the values do not exceed
+	uint64_t getPercentile(double p) const
+	{
+		if (total == 0)
+		{
+			return 0;
+		}
+
+		uint64_t target = std::max((uint64_t)ceil(p / 100.0 * total), (uint64_t)1);
+		uint64_t count = 0;
+		for (size_t i = 0; i < counts.size(); ++i)
+		{
+			count += counts[i];
+			if (count >= target)
+			{
+				return std::min(highestEquivalentValue(i), max);
+			}
+		}
+		return max;
+	}
+
+private:
+	static const int kSubBits = 7;
+
+	static size_t index(uint64_t value)
+	{
+		if (value < (2u << kSubBits))
+		{
+			return value;
+		}
+		int exponent = 63 - __builtin_clzll(value) - kSubBits;
+		return ((size_t)(exponent + 1) << kSubBits) + (value >> exponent) - (1u << kSubBits);
+	}
+
+	static uint64_t highestEquivalentValue(size_t index)
+	{
+		if (index < (2u << kSubBits))
+		{
+			return index;
+		}
+		int exponent = (index >> kSubBits) - 1;
+		uint64_t mantissa = (index & ((1u << kSubBits) - 1)) + (1u << kSubBits);
+		return ((mantissa + 1) << exponent) - 1;
+	}
+
+	std::vector<uint64_t> counts;
+	uint64_t total;
+	uint64_t sum;
+	uint64_t min;
+	uint64_t max;
+};
+
+GMutex statsMutex;				///< guards the statistics below
+LatencyHistogram histogram;		///< roundtrips in nanoseconds
+std::vector<uint64_t> emitTimes; ///< List containing the timestamps when each ping message was scheduled
+std::vector<uint8_t> answered;	///< responses received per ping
+uint64_t responses = 0;
+uint64_t duplicates = 0;
+
+static inline uint64_t
+getMonotonicTimeNsecs(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t)ts.tv_sec) * 1000000000 + ts.tv_nsec;
+}
+
+/**
+* @brief Record the roundtrip of a response to one of our pings
+*/
+static void record_response(uint32_t seq, const mavlink_message_t* msg)
+{
+	uint64_t now = getMonotonicTimeNsecs();
+
+	g_mutex_lock(&statsMutex);
+	if (seq < answered.size())
+	{
+		if (answered[seq]++ == 0)
+		{
+			uint64_t roundTrip = now - emitTimes[seq];
+			histogram.record(roundTrip);
+			++responses;
+			if (verbose) printf("Response: SYS: %d\t COMP: %d\t seq: %u\t roundtrip time: %.1f us\n", msg->sysid, msg->compid, seq, roundTrip / 1000.0);
+		}
+		else
+		{
+			++duplicates;
+		}
+	}
+	g_mutex_unlock(&statsMutex);
+}
+
+/**
+* @brief Write a MAVLink message and the payload to the transport
 *
-* The message is forwarded to the serial port.
+* On shared memory, the payload is appended to the message in the same
+* packet; on LCM, it is sent as the extended payload of the container.
+* Serial ports and UDP carry plain MAVLink frames, without payload.
+*/
+static void send_message(const mavlink_message_t* msg, uint32_t payloadLength)
+{
+	uint8_t buf[MAVLINK_MAX_PACKET_LEN];
+	uint16_t len;
+
+	switch (transport)
+	{
+	case TRANSPORT_LCM:
+		if (payloadLength > 0)
+		{
+			mavconn_mavlink_msg_container_t container;
+			container.link_component_id = 0;
+			container.link_network_source = MAVCONN_LINK_TYPE_LCM;
+			copyMAVLinkMsg(&(container.msg), msg);
+			container.extended_payload_len = payloadLength;
+			container.extended_payload = (int8_t*)&(payload[0]);
+			publishMAVLinkContainer(lcm, MAVLINK_MAIN, &container);
+		}
+		else
+		{
+			sendMAVLinkMessage(lcm, msg);
+		}
+		break;
+	case TRANSPORT_SHM:
+	{
+		std::vector<uint8_t> packet(MAVLINK_MAX_PACKET_LEN + payloadLength, 0);
+		mavlink_msg_to_send_buffer(&(packet[0]), msg);
+		shmOut.writeDataPacket(packet);
+	}
+	break;
+	case TRANSPORT_SERIAL:
+		len = mavlink_msg_to_send_buffer(buf, msg);
+		if (write(fd, buf, len) != len)
+		{
+			fprintf(stderr, "# WARNING: Could not write ping to serial port: %s\n", strerror(errno));
+		}
+		break;
+	case TRANSPORT_UDP:
+		len = mavlink_msg_to_send_buffer(buf, msg);
+		if (udpPeerKnown &&
+			sendto(fd, buf, len, 0, (struct sockaddr*)&udpPeer, sizeof(udpPeer)) != len)
+		{
+			fprintf(stderr, "# WARNING: Could not send ping: %s\n", strerror(errno));
+		}
+		break;
+	}
+}
+
+/**
+* @brief Answer ping requests and record responses to our own pings
+*
+* @param msg Received message
+* @param payloadLength Length of the payload received with it, echoed back
+* @param respond Answer requests; pinging processes only do so on LCM
+*/
+static void handle_message(const mavlink_message_t* msg, uint32_t payloadLength, bool respond)
+{
+	// Do not accept messages originating from this component
+	if ((msg->sysid == sysid && msg->compid == compid) || msg->msgid != MAVLINK_MSG_ID_PING)
+	{
+		return;
+	}
+
+	mavlink_ping_t ping;
+	mavlink_msg_ping_decode(msg, &ping);
+	if (ping.target_system == 0 && ping.target_component == 0)
+	{
+		if (respond)
+		{
+			uint64_t r_timestamp = getSystemTimeUsecs();
+			mavlink_message_t r_msg;
+			mavlink_msg_ping_pack(sysid, compid, &r_msg, ping.seq, msg->sysid, msg->compid, r_timestamp);
+			send_message(&r_msg, std::min(payloadLength, (uint32_t)payload.size()));
+		}
+	}
+	else if (ping.target_system == sysid && ping.target_component == compid)
+	{
+		// This is a response to a ping request
+		record_response(ping.seq, msg);
+	}
+}
+
+/**
+* @brief Handle a MAVLINK message received from LCM
 *
 * @param rbuf LCM receive buffer
 * @param channel LCM channel
@@ -79,62 +343,240 @@ static void mavlink_handler (const lcm_recv_buf_t *rbuf, const char * channel,
 {
 	const mavlink_message_t* msg = getMAVLinkMsgPtr(container);
 
-	lcm_t* lcm = (lcm_t*)user;
+	if ((lcm_t*)user == NULL)
+	{
+		fprintf(stderr, "ERROR: LCM connection broke\n");
+		return;
+	}
 
-	// Do not accept messages originating from this component
-	if (msg->sysid != sysid || msg->compid != compid)
+	// every mavconn-ping listening on the bus answers pings
+	handle_message(msg, container->extended_payload_len, true);
+}
+
+void* lcm_wait(void* lcm_ptr)
+		{
+	lcm_t* lcm = (lcm_t*) lcm_ptr;
+	// Blocking wait for new data
+	while (1)
+	{
+		if (debug) printf("Waiting for LCM data\n");
+		lcm_handle (lcm);
+	}
+	return NULL;
+		}
+
+void* shm_wait(void*)
+{
+	std::vector<uint8_t> data;
+	while (1)
 	{
-		//lcm_t* lcm = dynamic_cast<lcm_t*>(user);
-		if ((lcm_t*)user == NULL)
+		if (!shmIn.waitForDataPacket(100))
 		{
-			fprintf(stderr, "ERROR: LCM connection broke\n");
+			continue;
 		}
-		else
+
+		int length;
+		while ((length = shmIn.readDataPacket(data)) > 0)
 		{
-			// Everything is alright, decode MAVLink message
-			switch (msg->msgid)
+			// the packet starts with the message, the payload follows it
+			mavlink_message_t msg;
+			mavlink_status_t status;
+			for (int i = 0; i < length; ++i)
 			{
-			case MAVLINK_MSG_ID_PING:
-			{
-				mavlink_ping_t ping;
-				mavlink_msg_ping_decode(msg, &ping);
-				uint64_t r_timestamp = getSystemTimeUsecs();
-				if (ping.target_system == 0 && ping.target_component == 0)
-				{
-					mavlink_message_t r_msg;
-					mavlink_msg_ping_pack(sysid, compid, &r_msg, ping.seq, msg->sysid, msg->compid, r_timestamp);
-					sendMAVLinkMessage(lcm, &r_msg);
-				}
-				else
+				if (mavlink_parse_char(MAVLINK_COMM_1, data[i], &msg, &status))
 				{
-					if (ping.target_system == sysid && ping.target_component == compid)
-						{
-						    // This is a response to a ping request
-							uint64_t sendTime = emitTimes.at(ping.seq);
-							uint64_t roundTrip = r_timestamp - sendTime;
-							printf("Response: SYS: %d\t COMP: %d\t roundtrip time: %lu\n", msg->sysid, msg->compid, roundTrip);
-						}
+					handle_message(&msg, length - MAVLINK_MAX_PACKET_LEN, echo);
+					break;
 				}
 			}
-			break;
-			default:
-				break;
-			}
 		}
 	}
+	return NULL;
 }
 
-void* lcm_wait(void* lcm_ptr)
-		{
-	lcm_t* lcm = (lcm_t*) lcm_ptr;
-	// Blocking wait for new data
+void* fd_wait(void*)
+{
+	uint8_t buf[2048];
 	while (1)
 	{
-		if (debug) printf("Waiting for LCM data\n");
-		lcm_handle (lcm);
+		ssize_t length;
+		if (transport == TRANSPORT_UDP)
+		{
+			struct sockaddr_in addr;
+			socklen_t addrLength = sizeof(addr);
+			length = recvfrom(fd, buf, sizeof(buf), 0, (struct sockaddr*)&addr, &addrLength);
+			if (length > 0 && echo)
+			{
+				// answer whoever pinged us last
+				udpPeer = addr;
+				udpPeerKnown = true;
+			}
+		}
+		else
+		{
+			length = read(fd, buf, sizeof(buf));
+		}
+
+		if (length < 0 && errno != EINTR && errno != EAGAIN)
+		{
+			fprintf(stderr, "# ERROR: Could not read from %s: %s\n", transportName, strerror(errno));
+			usleep(100000);
+			continue;
+		}
+
+		mavlink_message_t msg;
+		mavlink_status_t status;
+		for (ssize_t i = 0; i < length; ++i)
+		{
+			if (mavlink_parse_char(MAVLINK_COMM_2, buf[i], &msg, &status))
+			{
+				handle_message(&msg, 0, echo);
+			}
+		}
 	}
 	return NULL;
+}
+
+/**
+* @brief Open a serial port, or a pseudo terminal standing in for one
+*/
+static bool open_serial(void)
+{
+	if (device != NULL)
+	{
+		fd = open(device, O_RDWR | O_NOCTTY);
+		if (fd == -1)
+		{
+			fprintf(stderr, "# ERROR: Could not open serial port %s: %s\n", device, strerror(errno));
+			return false;
+		}
+	}
+	else
+	{
+		fd = posix_openpt(O_RDWR | O_NOCTTY);
+		if (fd == -1 || grantpt(fd) != 0 || unlockpt(fd) != 0)
+		{
+			fprintf(stderr, "# ERROR: Could not open a pseudo terminal: %s\n", strerror(errno));
+			return false;
+		}
+		device = g_strdup(ptsname(fd));
+
+		// the terminal has to be raw before the bridge opens it, and it is
+		// kept open so that it does not hang up in between
+		int slave = open(device, O_RDWR | O_NOCTTY);
+		if (slave != -1)
+		{
+			struct termios config;
+			if (tcgetattr(slave, &config) == 0)
+			{
+				cfmakeraw(&config);
+				tcsetattr(slave, TCSANOW, &config);
+			}
+		}
+		printf("Serial port stand-in: %s\n", device);
+		fflush(stdout);
+	}
+
+	struct termios config;
+	if (tcgetattr(fd, &config) == 0)
+	{
+		cfmakeraw(&config);
+		tcsetattr(fd, TCSANOW, &config);
+	}
+
+	return true;
+}
+
+/**
+* @brief Open a UDP socket towards the UDP bridge (or, in echo mode, for it)
+*/
+static bool open_udp(void)
+{
+	fd = socket(AF_INET, SOCK_DGRAM, 0);
+	if (fd == -1)
+	{
+		fprintf(stderr, "# ERROR: Could not create UDP socket: %s\n", strerror(errno));
+		return false;
+	}
+
+	struct sockaddr_in addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_ANY);
+	addr.sin_port = htons(udpListenPort);
+	if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0)
+	{
+		fprintf(stderr, "# ERROR: Could not bind UDP port %d: %s\n", udpListenPort, strerror(errno));
+		return false;
+	}
+
+	if (!echo)
+	{
+		struct hostent* host = gethostbyname(udpHost ? udpHost : "127.0.0.1");
+		if (host == NULL)
+		{
+			fprintf(stderr, "# ERROR: Unknown host %s\n", udpHost);
+			return false;
+		}
+		memset(&udpPeer, 0, sizeof(udpPeer));
+		udpPeer.sin_family = AF_INET;
+		memcpy(&udpPeer.sin_addr, host->h_addr, sizeof(udpPeer.sin_addr));
+		udpPeer.sin_port = htons(udpPort);
+		udpPeerKnown = true;
+	}
+
+	return true;
+}
+
+/**
+* @brief Print the number of pings answered and the roundtrip percentiles
+*/
+static void print_statistics(double rate)
+{
+	g_mutex_lock(&statsMutex);
+
+	uint64_t sent = emitTimes.size();
+	printf("\n--- %s ping statistics, %d byte payload, %.1f Hz ---\n", transportName, payloadSize, rate);
+	printf("%llu sent, %llu received, %.2f%% lost", (long long unsigned)sent, (long long unsigned)responses,
+		   sent ? 100.0 * (sent - responses) / sent : 0.0);
+	if (duplicates > 0)
+	{
+		printf(", %llu duplicates", (long long unsigned)duplicates);
+	}
+	printf("\n");
+
+	if (histogram.getCount() > 0)
+	{
+		printf("roundtrip [us]: min %.1f  mean %.1f  p50 %.1f  p90 %.1f  p99 %.1f  p99.9 %.1f  max %.1f\n",
+			   histogram.getMin() / 1000.0, histogram.getMean() / 1000.0,
+			   histogram.getPercentile(50) / 1000.0, histogram.getPercentile(90) / 1000.0,
+			   histogram.getPercentile(99) / 1000.0, histogram.getPercentile(99.9) / 1000.0,
+			   histogram.getMax() / 1000.0);
+
+		if (printHistogram)
+		{
+			// percentiles halve the distance to 100% in every step
+			printf("\n%12s %12s %12s\n", "value [us]", "percentile", "count");
+			double remaining = 100.0;
+			while (true)
+			{
+				double p = 100.0 - remaining;
+				uint64_t value = histogram.getPercentile(p);
+				printf("%12.1f %12.6f %12llu\n", value / 1000.0, p / 100.0,
+					   (long long unsigned)ceil(p / 100.0 * histogram.getCount()));
+				if (value == histogram.getMax() || remaining < 100.0 / histogram.getCount())
+				{
+					break;
+				}
+				remaining /= 2.0;
+			}
+			printf("%12.1f %12.6f %12llu\n", histogram.getMax() / 1000.0, 1.0,
+				   (long long unsigned)histogram.getCount());
 		}
+	}
+
+	g_mutex_unlock(&statsMutex);
+}
 
 /**
 * @brief Main function to start serial link process
@@ -148,6 +590,16 @@ int main(int argc, char* argv[])
 			{ "compid", 'c', 0, G_OPTION_ARG_INT, &compid, "ID of this component, 1-255", "ID" },
 			{ "ping-requests", 'n', 0, G_OPTION_ARG_INT, &nPing, "Number of ping requests", "10" },
 			{ "ping-interval", 'i', 0, G_OPTION_ARG_INT, &pingInterval, "Interval between ping attempts, in microseconds", "I" },
+			{ "rate", 'r', 0, G_OPTION_ARG_DOUBLE, &pingRate, "Ping requests per second, instead of an interval", "HZ" },
+			{ "payload", 'p', 0, G_OPTION_ARG_INT, &payloadSize, "Bytes sent with every ping (lcm, shm); has to match on both sides for shm", "0" },
+			{ "transport", 't', 0, G_OPTION_ARG_STRING, &transportName, "lcm, shm, serial or udp", "lcm" },
+			{ "device", 0, 0, G_OPTION_ARG_STRING, &device, "Serial port, a pseudo terminal is opened if not set", "DEV" },
+			{ "udp-host", 0, 0, G_OPTION_ARG_STRING, &udpHost, "Host of the UDP bridge", "127.0.0.1" },
+			{ "udp-port", 0, 0, G_OPTION_ARG_INT, &udpPort, "Port of the UDP bridge", "14550" },
+			{ "udp-listen", 0, 0, G_OPTION_ARG_INT, &udpListenPort, "Local UDP port, 0 for any", "0" },
+			{ "timeout", 0, 0, G_OPTION_ARG_INT, &responseTimeout, "Time to wait for outstanding responses, in milliseconds", "1000" },
+			{ "echo", 'e', 0, G_OPTION_ARG_NONE, &echo, "Answer pings instead of sending them", NULL },
+			{ "histogram", 0, 0, G_OPTION_ARG_NONE, &printHistogram, "Print the distribution of the roundtrip times", NULL },
 			{ "silent", 's', 0, G_OPTION_ARG_NONE, &silent, "Be silent", NULL },
 			{ "verbose", 'v', 0, G_OPTION_ARG_NONE, &verbose, "Be verbose", NULL },
 			{ "debug", 'd', 0, G_OPTION_ARG_NONE, &debug, "Debug mode, changes behaviour", NULL },
@@ -166,12 +618,49 @@ int main(int argc, char* argv[])
 		exit (1);
 	}
 
+	if (transportName == NULL)
+	{
+		transportName = g_strdup("lcm");
+	}
+	if (strcmp(transportName, "lcm") == 0)
+	{
+		transport = TRANSPORT_LCM;
+	}
+	else if (strcmp(transportName, "shm") == 0)
+	{
+		transport = TRANSPORT_SHM;
+	}
+	else if (strcmp(transportName, "serial") == 0)
+	{
+		transport = TRANSPORT_SERIAL;
+	}
+	else if (strcmp(transportName, "udp") == 0)
+	{
+		transport = TRANSPORT_UDP;
+	}
+	else
+	{
+		fprintf(stderr, "# ERROR: Unknown transport %s\n", transportName);
+		exit(EXIT_FAILURE);
+	}
+
+	if (payloadSize < 0 || nPing < 0)
+	{
+		fprintf(stderr, "# ERROR: Payload size and number of pings must not be negative\n");
+		exit(EXIT_FAILURE);
+	}
+	if (payloadSize > 0 && (transport == TRANSPORT_SERIAL || transport == TRANSPORT_UDP))
+	{
+		fprintf(stderr, "# WARNING: The %s transport carries plain MAVLink frames, ignoring the payload\n", transportName);
+		payloadSize = 0;
+	}
+	payload.assign(std::max(payloadSize, 1), 0);
+
 	// Start process
 
 	if (!silent) printf("\nPING CLIENT STARTED\n");
 
 	// SETUP LCM
-	lcm_t* lcm;
 	lcm = lcm_create (NULL);
 	if (!lcm)
 	{
@@ -185,51 +674,128 @@ int main(int argc, char* argv[])
 	// Start thread to handle incoming LCM messages
 	// Thread
 	GThread* lcm_thread;
-	GError* err;
+	GError* err = NULL;
 
+	// Only listen on LCM when it is the transport under test, replies over
+	// LCM (e.g. through a bridge) would otherwise end up in the statistics
+	mavconn_mavlink_msg_container_t_subscription_t * comm_sub = NULL;
+	if (transport == TRANSPORT_LCM)
+	{
+		comm_sub = mavconn_mavlink_msg_container_t_subscribe (lcm, MAVLINK_MAIN, &mavlink_handler, (void*)lcm);
+		if (!silent) printf("Subscribed to %s LCM channel.\n", MAVLINK_MAIN);
 
-	mavconn_mavlink_msg_container_t_subscription_t * comm_sub =
-			mavconn_mavlink_msg_container_t_subscribe (lcm, MAVLINK_MAIN, &mavlink_handler, (void*)lcm);
-	if (!silent) printf("Subscribed to %s LCM channel.\n", MAVLINK_MAIN);
+		if( (lcm_thread = g_thread_try_new("LCm", (GThreadFunc)lcm_wait, (void *)lcm, &err)) == NULL)
+		{
+			printf("Failed to create LCM handling thread: %s!!\n", err->message );
+			g_error_free ( err ) ;
+		}
+	}
 
-	if( (lcm_thread = g_thread_try_new("LCm", (GThreadFunc)lcm_wait, (void *)lcm, &err)) == NULL)
+	// Open the transport, if it is not LCM
+	GThread* transport_thread = NULL;
+	bool opened = true;
+	if (transport == TRANSPORT_SHM)
+	{
+		// requests go to one segment and responses to the other; each
+		// side is the server of the segment it writes
+		int slotSize = MAVLINK_MAX_PACKET_LEN + payloadSize;
+		int outKey = echo ? PING_SHM_KEY_RESPONSE : PING_SHM_KEY_REQUEST;
+		int inKey = echo ? PING_SHM_KEY_REQUEST : PING_SHM_KEY_RESPONSE;
+		shmIn.setReadMode(px::SHM::READ_SEQUENTIAL);
+		opened = shmOut.init(outKey, px::SHM::SERVER_TYPE, 128, 1, slotSize, 64, px::SHM::LAYOUT_SLOTS) &&
+				 shmIn.init(inKey, px::SHM::CLIENT_TYPE, 128, 1, slotSize, 64, px::SHM::LAYOUT_SLOTS);
+		if (opened)
+		{
+			transport_thread = g_thread_try_new("SHM", (GThreadFunc)shm_wait, NULL, &err);
+		}
+	}
+	else if (transport == TRANSPORT_SERIAL || transport == TRANSPORT_UDP)
 	{
-		printf("Failed to create LCM handling thread: %s!!\n", err->message );
+		opened = (transport == TRANSPORT_SERIAL) ? open_serial() : open_udp();
+		if (opened)
+		{
+			transport_thread = g_thread_try_new("FD", (GThreadFunc)fd_wait, NULL, &err);
+		}
+	}
+	if (!opened)
+	{
+		exit(EXIT_FAILURE);
+	}
+	if (transport != TRANSPORT_LCM && transport_thread == NULL)
+	{
+		printf("Failed to create %s handling thread: %s!!\n", transportName, err->message );
 		g_error_free ( err ) ;
+		exit(EXIT_FAILURE);
 	}
 
-	// Start to ping system nPing times
+	if (echo)
+	{
+		if (!silent) printf("Answering ping requests on %s..\n", transportName);
+		while (1)
+		{
+			// Wait for CTRL-C
+			sleep(1);
+		}
+	}
 
-	int seq = 0;
-	uint64_t time = 0;
+	// Start to ping system nPing times, on a fixed schedule
 
-	printf("Sending %d ping requests with interval %d, waiting for responses..\n", nPing, pingInterval);
+	uint64_t interval = (pingRate > 0) ? (uint64_t)(1e9 / pingRate) : (uint64_t)pingInterval * 1000;
+	double rate = (interval > 0) ? 1e9 / interval : 0.0;
 
-	for (int pingCount = 0; pingCount < nPing; pingCount++)
+	emitTimes.assign(nPing, 0);
+	answered.assign(nPing, 0);
+
+	if (!silent) printf("Sending %d ping requests over %s at %.1f Hz, waiting for responses..\n", nPing, transportName, rate);
+
+	struct timespec start;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	uint64_t startTime = ((uint64_t)start.tv_sec) * 1000000000 + start.tv_nsec;
+
+	for (int seq = 0; seq < nPing; seq++)
 	{
+		// roundtrips count from when the ping was due, not from when the
+		// sender got around to sending it
+		uint64_t due = startTime + seq * interval;
+		struct timespec ts;
+		ts.tv_sec = due / 1000000000;
+		ts.tv_nsec = due % 1000000000;
+		while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR) {}
+
+		g_mutex_lock(&statsMutex);
+		emitTimes[seq] = due;
+		g_mutex_unlock(&statsMutex);
+
 		mavlink_message_t msg;
-		time = getSystemTimeUsecs();
-		emitTimes.push_back(time);
 		// Send out request for ping responses
-		mavlink_msg_ping_pack(sysid, compid, &msg, seq, 0, 0, time);
-		seq++;
-		sendMAVLinkMessage(lcm, &msg);
-		usleep(pingInterval);
+		mavlink_msg_ping_pack(sysid, compid, &msg, seq, 0, 0, getSystemTimeUsecs());
+		send_message(&msg, payloadSize);
 		if (debug) printf("Sent MAVLink PING seq: %d\n", seq);
 	}
 
 	// Wait for responses
-	while(1)
+	uint64_t lastSent = getMonotonicTimeNsecs();
+	while (getMonotonicTimeNsecs() - lastSent < (uint64_t)responseTimeout * 1000000)
 	{
-		// Wait for CTRL-C
-		// FIXME Implement timeout, loss counter
+		g_mutex_lock(&statsMutex);
+		bool done = (responses == (uint64_t)nPing);
+		g_mutex_unlock(&statsMutex);
+		if (done)
+		{
+			break;
+		}
+		usleep(1000);
 	}
 
+	if (!silent) print_statistics(rate);
+
 	// Disconnect from LCM
-	mavconn_mavlink_msg_container_t_unsubscribe (lcm, comm_sub);
+	if (comm_sub != NULL)
+	{
+		mavconn_mavlink_msg_container_t_unsubscribe (lcm, comm_sub);
+	}
 	lcm_destroy (lcm);
 
-	g_thread_join(lcm_thread);
+	// the handling threads block in their transport, do not join them
 	exit(EXIT_SUCCESS);
 }
-
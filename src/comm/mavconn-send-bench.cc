@@ -0,0 +1,254 @@
+/*=====================================================================
+
+MAVCONN Micro Air Vehicle Flying Robotics Toolkit
+
+(c) 2009, 2010, 2011 MAVCONN PROJECT  <http://MAVCONN.ethz.ch>
+
+This file is part of the MAVCONN project
+
+    MAVCONN is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    MAVCONN is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with MAVCONN. If not, see <http://www.gnu.org/licenses/>.
+
+======================================================================*/
+
+/**
+* @file
+*   @brief Cost and thread safety benchmark of sendMAVLinkMessage()
+*
+*   First one thread, then several threads at once publish ping messages
+*   with sendMAVLinkMessage(). The cost per message is measured on the
+*   sending side. A subscriber checks that every message arrives intact:
+*   each thread sends with its own system id, and the time field of a
+*   ping encodes its sequence number and sender.
+*
+*   The default LCM url is the in-process memq:// provider, so the cost is
+*   that of packing, encoding and queueing a message, not of the network.
+*
+*/
+
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include <stdio.h>
+#include <string.h>
+#include <inttypes.h>
+#include <poll.h>
+
+#include <boost/program_options.hpp>
+#include <glib.h>
+
+#include "mavconn.h"
+
+namespace config = boost::program_options;
+
+static lcm_t* lcm = NULL;
+static int messageCount = 200000;
+
+static bool quit = false;
+static uint64_t received = 0;
+static uint64_t corrupt = 0;
+static std::vector<uint32_t> nextSeq;	///< next expected sequence number per sender
+
+/**
+* @brief Payload marker of a ping, derived from its sequence number and sender
+*/
+static inline uint64_t marker(uint32_t seq, uint8_t sysid)
+{
+	return ((uint64_t)seq << 8) | sysid;
+}
+
+static void ping_handler(const lcm_recv_buf_t* rbuf, const char* channel, const mavconn_mavlink_msg_container_t* container, void* user)
+{
+	const mavlink_message_t* msg = getMAVLinkMsgPtr(container);
+	if (msg->msgid != MAVLINK_MSG_ID_PING)
+	{
+		return;
+	}
+
+	mavlink_ping_t ping;
+	mavlink_msg_ping_decode(msg, &ping);
+
+	// senders are numbered from 1
+	if (msg->sysid == 0 || msg->sysid > nextSeq.size() ||
+		ping.time_usec != marker(ping.seq, msg->sysid) ||
+		ping.seq < nextSeq[msg->sysid - 1])
+	{
+		corrupt++;
+	}
+	else
+	{
+		nextSeq[msg->sysid - 1] = ping.seq + 1;
+	}
+	__atomic_add_fetch(&received, 1, __ATOMIC_RELEASE);
+}
+
+static void* receive_pings(void* arg)
+{
+	(void)arg;
+	struct pollfd pfd;
+	pfd.fd = lcm_get_fileno(lcm);
+	pfd.events = POLLIN;
+
+	while (!__atomic_load_n(&quit, __ATOMIC_ACQUIRE))
+	{
+		if (poll(&pfd, 1, 100) > 0)
+		{
+			lcm_handle(lcm);
+		}
+	}
+	return NULL;
+}
+
+struct Sender
+{
+	uint8_t sysid;
+	uint64_t elapsed;	///< usecs spent in sendMAVLinkMessage()
+};
+
+static void* send_pings(void* arg)
+{
+	Sender* sender = reinterpret_cast<Sender*>(arg);
+
+	mavlink_message_t msg;
+	uint64_t start = getMonotonicTimeUsecs();
+	for (int i = 0; i < messageCount; ++i)
+	{
+		mavlink_msg_ping_pack(sender->sysid, 0, &msg, i, 0, 0, marker(i, sender->sysid));
+		sendMAVLinkMessage(lcm, &msg);
+	}
+	sender->elapsed = getMonotonicTimeUsecs() - start;
+
+	return NULL;
+}
+
+/**
+* @brief Publish from threadCount threads at once and check what arrives
+*/
+static bool run(int threadCount)
+{
+	__atomic_store_n(&received, 0, __ATOMIC_RELEASE);
+	corrupt = 0;
+	nextSeq.assign(threadCount, 0);
+
+	std::vector<Sender> senders(threadCount);
+	std::vector<GThread*> threads(threadCount);
+	for (int i = 0; i < threadCount; ++i)
+	{
+		senders[i].sysid = i + 1;
+		senders[i].elapsed = 0;
+
+		GError* err = NULL;
+		threads[i] = g_thread_try_new("SENDER", (GThreadFunc)send_pings, &senders[i], &err);
+		if (threads[i] == NULL)
+		{
+			fprintf(stderr, "# ERROR: Could not create a sender thread: %s\n", err->message);
+			g_error_free(err);
+			threadCount = i;
+			break;
+		}
+	}
+
+	uint64_t elapsed = 0;
+	for (int i = 0; i < threadCount; ++i)
+	{
+		g_thread_join(threads[i]);
+		elapsed += senders[i].elapsed;
+	}
+
+	// wait until the subscriber has caught up or nothing arrives for a second
+	uint64_t expected = (uint64_t)threadCount * messageCount;
+	uint64_t last = 0;
+	uint64_t lastChange = getMonotonicTimeUsecs();
+	while (true)
+	{
+		uint64_t now = __atomic_load_n(&received, __ATOMIC_ACQUIRE);
+		if (now >= expected) break;
+		if (now != last)
+		{
+			last = now;
+			lastChange = getMonotonicTimeUsecs();
+		}
+		else if (getMonotonicTimeUsecs() - lastChange > 1000000)
+		{
+			break;
+		}
+		usleep(1000);
+	}
+
+	uint64_t got = __atomic_load_n(&received, __ATOMIC_ACQUIRE);
+	printf("%2d threads %10" PRIu64 " messages %8.1f ns/message %10" PRIu64 " received %6" PRIu64 " corrupt %6" PRIu64 " lost\n",
+			threadCount, expected, expected ? elapsed * 1000.0 / expected : 0.0,
+			got, corrupt, got < expected ? expected - got : 0);
+
+	return got == expected && corrupt == 0;
+}
+
+int main(int argc, char* argv[])
+{
+	int threadCount = 4;
+	std::string url = "memq://";
+
+	config::options_description desc("Allowed options");
+	desc.add_options()
+		("help", "produce help message")
+		("threads,t", config::value<int>(&threadCount)->default_value(threadCount), "threads publishing at once in the second run (1-254)")
+		("messages,n", config::value<int>(&messageCount)->default_value(messageCount), "messages sent by every thread")
+		("url,u", config::value<std::string>(&url)->default_value(url), "LCM url, e.g. udpm:// to include the network")
+		;
+	config::variables_map vm;
+	config::store(config::parse_command_line(argc, argv, desc), vm);
+	config::notify(vm);
+
+	if (vm.count("help") || threadCount < 1 || threadCount > 254 || messageCount < 1)
+	{
+		std::cout << desc << std::endl;
+		return 1;
+	}
+
+	lcm = lcm_create(url.c_str());
+	if (!lcm)
+	{
+		fprintf(stderr, "# ERROR: Cannot initialize LCM with %s.\n", url.c_str());
+		return 1;
+	}
+
+	mavconn_mavlink_msg_container_t_subscription_t* comm_sub =
+			mavconn_mavlink_msg_container_t_subscribe(lcm, MAVLINK_MAIN, &ping_handler, NULL);
+	// the senders outpace the subscriber, do not drop what it has not handled yet
+	mavconn_mavlink_msg_container_t_subscription_set_queue_capacity(comm_sub, 0);
+
+	GError* err = NULL;
+	GThread* receiver = g_thread_try_new("RECEIVER", (GThreadFunc)receive_pings, NULL, &err);
+	if (receiver == NULL)
+	{
+		fprintf(stderr, "# ERROR: Could not create the receiver thread: %s\n", err->message);
+		g_error_free(err);
+		return 1;
+	}
+
+	bool ok = run(1);
+	if (threadCount > 1)
+	{
+		ok = run(threadCount) && ok;
+	}
+
+	__atomic_store_n(&quit, true, __ATOMIC_RELEASE);
+	g_thread_join(receiver);
+
+	mavconn_mavlink_msg_container_t_unsubscribe(lcm, comm_sub);
+	lcm_destroy(lcm);
+
+	return ok ? 0 : 1;
+}
@@ -0,0 +1,284 @@
+/*=====================================================================
+
+MAVCONN Micro Air Vehicle Flying Robotics Toolkit
+
+(c) 2009, 2010, 2011 MAVCONN PROJECT  <http://MAVCONN.ethz.ch>
+
+This file is part of the MAVCONN project
+
+    MAVCONN is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    MAVCONN is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with MAVCONN. If not, see <http://www.gnu.org/licenses/>.
+
+======================================================================*/
+
+/**
+* @file
+*   @brief Serial read throughput benchmark over a pseudo terminal
+*
+*   A writer thread streams MAVLink ping messages into the master side of a
+*   pseudo terminal. The slave side is configured like mavconn-bridge-serial
+*   configures a real port and read back with the reader loop of the bridge:
+*   either one byte per read(), or with poll() and one read() of everything
+*   the driver has buffered. Every byte is fed to the MAVLink parser, so the
+*   throughput includes the parsing cost of the bridge.
+*
+*/
+
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include <stdio.h>
+#include <string.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <termios.h>
+#include <poll.h>
+
+#include <boost/program_options.hpp>
+#include <glib.h>
+
+#include "mavconn.h"
+
+namespace config = boost::program_options;
+
+/* same chunk size as the reader of mavconn-bridge-serial */
+#define SERIAL_READ_BUFFER_SIZE 4096
+
+static int master = -1;
+static uint64_t streamBytes = 0;
+static std::vector<uint8_t> pattern;
+
+/**
+* @brief Open a pseudo terminal and configure its slave side like a serial port
+*
+* @return file descriptor of the slave side, -1 on failure
+*/
+static int open_loopback(void)
+{
+	master = posix_openpt(O_RDWR | O_NOCTTY);
+	if (master == -1 || grantpt(master) != 0 || unlockpt(master) != 0)
+	{
+		fprintf(stderr, "# ERROR: Could not open a pseudo terminal: %s\n", strerror(errno));
+		return -1;
+	}
+
+	struct termios config;
+	if (tcgetattr(master, &config) == 0)
+	{
+		cfmakeraw(&config);
+		tcsetattr(master, TCSANOW, &config);
+	}
+
+	int fd = open(ptsname(master), O_RDWR | O_NOCTTY);
+	if (fd == -1)
+	{
+		fprintf(stderr, "# ERROR: Could not open %s: %s\n", ptsname(master), strerror(errno));
+		return -1;
+	}
+
+	// the settings of setup_port() in mavconn-bridge-serial
+	if (tcgetattr(fd, &config) < 0)
+	{
+		fprintf(stderr, "# ERROR: Could not read the configuration of %s\n", ptsname(master));
+		close(fd);
+		return -1;
+	}
+	config.c_iflag &= ~(IGNBRK | BRKINT | ICRNL |
+			INLCR | PARMRK | INPCK | ISTRIP | IXON);
+	config.c_oflag = 0;
+	config.c_lflag &= ~(ECHO | ECHONL | ICANON | IEXTEN | ISIG);
+	config.c_cflag &= ~(CSIZE | PARENB);
+	config.c_cflag |= CS8;
+	config.c_cflag |= CLOCAL;
+	config.c_cc[VMIN]  = 1;
+	config.c_cc[VTIME] = 0;
+	cfsetispeed(&config, B921600);
+	cfsetospeed(&config, B921600);
+	if (tcsetattr(fd, TCSAFLUSH, &config) < 0)
+	{
+		fprintf(stderr, "# ERROR: Could not configure %s\n", ptsname(master));
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+/**
+* @brief Write the message pattern into the master side until the stream is complete
+*/
+static void* write_stream(void* arg)
+{
+	(void)arg;
+	uint64_t written = 0;
+	while (written < streamBytes)
+	{
+		size_t len = pattern.size();
+		if (streamBytes - written < len)
+		{
+			len = streamBytes - written;
+		}
+
+		size_t offset = 0;
+		while (offset < len)
+		{
+			ssize_t n = write(master, &pattern[offset], len - offset);
+			if (n < 0)
+			{
+				if (errno == EINTR) continue;
+				fprintf(stderr, "# ERROR: Could not write to the pseudo terminal: %s\n", strerror(errno));
+				return NULL;
+			}
+			offset += n;
+		}
+		written += len;
+	}
+	return NULL;
+}
+
+/**
+* @brief Read the stream back and report the throughput
+*
+* @param chunked Wait with poll() and fetch all buffered bytes with one read(),
+*                instead of one read() per byte
+*/
+static bool run(int fd, bool chunked)
+{
+	mavlink_message_t message;
+	mavlink_status_t status;
+	uint8_t buf[SERIAL_READ_BUFFER_SIZE];
+
+	struct pollfd pfd;
+	pfd.fd = fd;
+	pfd.events = POLLIN;
+
+	uint64_t received = 0;
+	uint64_t reads = 0;
+	uint64_t messages = 0;
+
+	GError* err = NULL;
+	GThread* writer = g_thread_try_new("WRITER", (GThreadFunc)write_stream, NULL, &err);
+	if (writer == NULL)
+	{
+		fprintf(stderr, "# ERROR: Could not create the writer thread: %s\n", err->message);
+		g_error_free(err);
+		return false;
+	}
+
+	uint64_t start = getMonotonicTimeUsecs();
+	while (received < streamBytes)
+	{
+		ssize_t len;
+		if (chunked)
+		{
+			int ready = poll(&pfd, 1, 1000);
+			if (ready == 0 || (ready == -1 && errno == EINTR))
+			{
+				continue;
+			}
+			len = read(fd, buf, sizeof(buf));
+		}
+		else
+		{
+			len = read(fd, buf, 1);
+		}
+		reads++;
+
+		if (len <= 0)
+		{
+			if (len == -1 && (errno == EAGAIN || errno == EINTR))
+			{
+				continue;
+			}
+			fprintf(stderr, "# ERROR: Could not read from the pseudo terminal: %s\n", strerror(errno));
+			break;
+		}
+
+		for (ssize_t i = 0; i < len; ++i)
+		{
+			if (mavlink_parse_char(MAVLINK_COMM_1, buf[i], &message, &status))
+			{
+				messages++;
+			}
+		}
+		received += len;
+	}
+	uint64_t elapsed = getMonotonicTimeUsecs() - start;
+	g_thread_join(writer);
+
+	if (elapsed == 0) elapsed = 1;
+	printf("%-8s %10" PRIu64 " bytes %8" PRIu64 " messages %10" PRIu64 " reads %8.1f MB/s %8.1f bytes/read\n",
+			chunked ? "chunked" : "bytewise", received, messages, reads,
+			(double)received / elapsed, reads ? (double)received / reads : 0.0);
+
+	return received == streamBytes;
+}
+
+int main(int argc, char* argv[])
+{
+	int megabytes = 20;
+	std::string mode = "both";
+
+	config::options_description desc("Allowed options");
+	desc.add_options()
+		("help", "produce help message")
+		("megabytes,m", config::value<int>(&megabytes)->default_value(megabytes), "MB streamed through the pseudo terminal per run")
+		("mode", config::value<std::string>(&mode)->default_value(mode), "reader loop to measure: bytewise, chunked or both")
+		;
+	config::variables_map vm;
+	config::store(config::parse_command_line(argc, argv, desc), vm);
+	config::notify(vm);
+
+	if (vm.count("help"))
+	{
+		std::cout << desc << std::endl;
+		return 1;
+	}
+
+	bool bytewise = (mode == "bytewise" || mode == "both");
+	bool chunked = (mode == "chunked" || mode == "both");
+	if ((!bytewise && !chunked) || megabytes <= 0)
+	{
+		std::cout << desc << std::endl;
+		return 1;
+	}
+	streamBytes = (uint64_t)megabytes * 1000000;
+
+	// a stream of ping messages with increasing sequence numbers
+	uint8_t msgBuf[MAVLINK_MAX_PACKET_LEN];
+	for (uint32_t seq = 0; pattern.size() < 64 * 1024; ++seq)
+	{
+		mavlink_message_t msg;
+		mavlink_msg_ping_pack(42, 0, &msg, seq, 0, 0, getSystemTimeUsecs());
+		uint16_t len = mavlink_msg_to_send_buffer(msgBuf, &msg);
+		pattern.insert(pattern.end(), msgBuf, msgBuf + len);
+	}
+
+	int fd = open_loopback();
+	if (fd == -1)
+	{
+		return 1;
+	}
+
+	bool ok = true;
+	if (bytewise) ok = run(fd, false) && ok;
+	if (chunked) ok = run(fd, true) && ok;
+
+	close(fd);
+	close(master);
+	return ok ? 0 : 1;
+}
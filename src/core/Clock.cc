@@ -32,32 +32,102 @@ This file is part of the MAVCONN project
 
 namespace MAVCONN {
 
-Clock::Clock(){}
+Clock::Clock()
+ : offset(0)
+{}
 
 Clock::~Clock(){}
 
-unsigned long Clock::getMilliseconds()
+uint64_t Clock::getMonotonicMicroseconds()
 {
-    struct timeval now;
-	gettimeofday(&now, NULL);
-    return now.tv_sec*1000 + now.tv_usec/1000 + offset/1000;
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return ((uint64_t)now.tv_sec) * 1000000 + now.tv_nsec / 1000;
 }
 
-unsigned long Clock::getMicroseconds()
+uint64_t Clock::getSystemMicroseconds()
 {
-    struct timeval now;
-	gettimeofday(&now, NULL);
-	return now.tv_sec*1000000 + now.tv_usec + offset;
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    return ((uint64_t)now.tv_sec) * 1000000 + now.tv_nsec / 1000;
 }
 
-unsigned long Clock::getOffset()
+uint64_t Clock::getMilliseconds()
+{
+    return getMicroseconds() / 1000;
+}
+
+uint64_t Clock::getMicroseconds()
+{
+    return getSystemMicroseconds() + offset;
+}
+
+int64_t Clock::getOffset()
 {
     return offset;
 }
 
-void Clock::addOffset(unsigned long off)
+void Clock::addOffset(int64_t off)
 {
     offset += off;
 }
 
+ClockOffset::ClockOffset()
+{
+    reset();
+}
+
+void ClockOffset::addSample(uint64_t remoteUsecs, uint64_t localUsecs)
+{
+    if (count > 0 && remoteUsecs < lastRemote)
+    {
+        reset();
+    }
+    lastRemote = remoteUsecs;
+
+    samples[next] = (int64_t)(localUsecs - remoteUsecs);
+    next = (next + 1) % kWindow;
+    if (count < kWindow)
+    {
+        ++count;
+    }
+
+    offset = samples[0];
+    for (int i = 1; i < count; ++i)
+    {
+        if (samples[i] < offset)
+        {
+            offset = samples[i];
+        }
+    }
+}
+
+void ClockOffset::reset()
+{
+    count = 0;
+    next = 0;
+    lastRemote = 0;
+    offset = 0;
+}
+
+bool ClockOffset::isValid() const
+{
+    return count > 0;
+}
+
+int64_t ClockOffset::getOffset() const
+{
+    return offset;
+}
+
+uint64_t ClockOffset::toLocal(uint64_t remoteUsecs) const
+{
+    return remoteUsecs + offset;
+}
+
+uint64_t ClockOffset::toRemote(uint64_t localUsecs) const
+{
+    return localUsecs - offset;
+}
+
 }
@@ -28,11 +28,25 @@ This file is part of the MAVCONN project
 
 ========================================================================*/
 
+/**
+ * @file
+ *   @brief Clocks for interval measurement and for timestamps
+ *
+ *   Intervals, timeouts and rates are measured on the monotonic clock,
+ *   which never steps when NTP or GPS correct the system time. The system
+ *   time is only used to stamp data that is compared across processes and
+ *   systems. Both are read with clock_gettime(), which the vDSO serves
+ *   without entering the kernel.
+ *
+ *   ClockOffset relates a remote clock, e.g. the time since boot that the
+ *   autopilot sends in SYSTEM_TIME, to the local monotonic clock.
+ */
+
 #ifndef _CLOCK_H_
 #define _CLOCK_H_
 
-#include <sys/time.h>
-#include <ctime>
+#include <inttypes.h>
+#include <time.h>
 
 namespace MAVCONN
 {
@@ -41,12 +55,53 @@ namespace MAVCONN
         public:
             Clock();
             ~Clock();
-            unsigned long getMilliseconds();
-            unsigned long getMicroseconds();
-            unsigned long getOffset();
-            void addOffset(unsigned long off);
+
+            /** Monotonic time in microseconds, for intervals only */
+            static uint64_t getMonotonicMicroseconds();
+            /** System time in microseconds since the epoch, for stamping */
+            static uint64_t getSystemMicroseconds();
+
+            /** System time with the offset of this clock */
+            uint64_t getMilliseconds();
+            uint64_t getMicroseconds();
+            int64_t getOffset();
+            void addOffset(int64_t off);
+        private:
+            int64_t offset;
+    };
+
+    /**
+     * @brief Estimates the offset between a remote clock and the local
+     * monotonic clock
+     *
+     * Every sample pairs a remote timestamp with the local time the message
+     * carrying it was received. The transport only ever delays messages, so
+     * the sample with the smallest difference among the recent ones is the
+     * best estimate. The window follows drift between the clocks; a remote
+     * clock that goes backwards (a rebooted autopilot) restarts it.
+     */
+    class ClockOffset
+    {
+        public:
+            ClockOffset();
+
+            void addSample(uint64_t remoteUsecs, uint64_t localUsecs);
+            void reset();
+
+            bool isValid() const;
+            /** Local minus remote time, in microseconds */
+            int64_t getOffset() const;
+
+            uint64_t toLocal(uint64_t remoteUsecs) const;
+            uint64_t toRemote(uint64_t localUsecs) const;
         private:
-            unsigned long offset;
+            static const int kWindow = 16;
+
+            int64_t samples[kWindow];
+            int count;
+            int next;
+            uint64_t lastRemote;
+            int64_t offset;
     };
 }
 
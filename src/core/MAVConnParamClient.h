@@ -14,18 +14,66 @@
 #include <iostream>
 #include <fstream>
 #include <string>
+#include <cstring>
 #include <tr1/unordered_map>
+#include <deque>
 #include <list>
+#include <poll.h>
 
 #include "mavconn.h"
 #include "ParamClientCallbacks.h"
 
 using namespace std::tr1;
 
-typedef std::tr1::unordered_map< std::string, float > PxParameterMap;
+/**
+ * One parameter. Entries live in a std::deque and are never removed, so
+ * their address and index stay valid for the lifetime of the client.
+ */
+struct PxParameter
+{
+	PxParameter(const std::string& name, float value) : name(name), value(value) {}
+
+	float get(void) const
+	{
+		float v;
+		__atomic_load(&value, &v, __ATOMIC_RELAXED);
+		return v;
+	}
+
+	void set(float v)
+	{
+		__atomic_store(&value, &v, __ATOMIC_RELAXED);
+	}
+
+	std::string name;
+	float value;
+};
+
+typedef std::deque< PxParameter > PxParameterList;
+typedef std::tr1::unordered_map< std::string, uint16_t > PxParameterIndex;
 typedef std::tr1::unordered_map< std::string, PCCallback* > PxParameterCallbackMap;
 typedef std::list<PCCallback*> PxCallbackList;
-typedef PxParameterMap::value_type ParamPair;
+
+/**
+ * Typed handle to a parameter. Reading it costs one atomic load instead of
+ * a string lookup, so hot loops should keep a handle instead of calling
+ * getParamValue(). Changes from the ground station are seen immediately.
+ */
+template <typename T = float>
+class PxParamHandle
+{
+public:
+	PxParamHandle() : param(0) {}
+	explicit PxParamHandle(const PxParameter* param) : param(param) {}
+
+	bool isValid(void) const { return param != 0; }
+
+	T get(void) const { return param ? (T)param->get() : T(); }
+	operator T() const { return get(); }
+
+private:
+	const PxParameter* param;
+};
 
 class MAVConnParamClient
 {
@@ -35,7 +83,11 @@ public:
 		componentid(componentid),
 		lcm(lcm),
 		verbose(verbose),
-		configFileName(configFileName)
+		configFileName(configFileName),
+		listNext(0),
+		listRemaining(0),
+		listInterval(10000),
+		listLastSent(0)
 	{
 		if (configFileName.size() != 0)
 		{
@@ -52,7 +104,8 @@ public:
 	}
 
 protected:
-	PxParameterMap params;
+	PxParameterList params;		///< in index order, as seen by the ground station
+	PxParameterIndex paramIndex;	///< name -> index into params
 	int systemid;
 	int componentid;
 	lcm_t* lcm;
@@ -61,6 +114,26 @@ protected:
 	PxCallbackList callbacks;
 	PxParameterCallbackMap paramCallbacks;
 
+	// state of the parameter list transmission
+	size_t listNext;			///< index of the next parameter to send
+	size_t listRemaining;		///< parameters left to send
+	uint64_t listInterval;		///< us between two parameters
+	uint64_t listLastSent;
+
+	PxParameter* findParam(const std::string& paramName)
+	{
+		PxParameterIndex::const_iterator iter = paramIndex.find(paramName);
+		return (iter != paramIndex.end()) ? &params[iter->second] : 0;
+	}
+
+	void sendParam(uint16_t index)
+	{
+		const PxParameter& param = params[index];
+		mavlink_message_t response;
+		mavlink_msg_param_value_pack(systemid, componentid, &response, param.name.c_str(), param.get(), MAVLINK_TYPE_FLOAT, params.size(), index);
+		sendMAVLinkMessage(lcm, &response);
+		if (verbose) std::cout << "Sending param " << param.name << ':' << param.get() << std::endl;
+	}
 
 public:
 
@@ -70,20 +143,10 @@ public:
 		{
 		case MAVLINK_MSG_ID_PARAM_REQUEST_LIST:
 		{
-			// Start sending parameters
+			// Start sending parameters; a request during a transmission
+			// continues it and wraps around, so no parameter is sent twice
 			if (verbose) printf("MAVConnParamClient: Requested parameters, sending them now..\n");
-
-			uint16_t i = 0;
-			PxParameterMap::const_iterator iter = params.begin();
-			while(iter != params.end())
-			{
-				mavlink_message_t response;
-				mavlink_msg_param_value_pack(systemid, componentid, &response, (*iter).first.c_str(), (*iter).second, MAVLINK_TYPE_FLOAT, params.size(), i);
-				sendMAVLinkMessage(lcm, &response);
-				if (verbose) std::cout << "Sending param " << (*iter).first  << ':' << (*iter).second << std::endl;
-				++iter;
-				i++;
-			}
+			listRemaining = params.size();
 		}
 		break;
 		case MAVLINK_MSG_ID_PARAM_REQUEST_READ:
@@ -92,21 +155,23 @@ public:
 			if (verbose) printf("MAVConnParamClient: Send requested parameter now..\n");
 			mavlink_param_request_read_t read;
 			mavlink_msg_param_request_read_decode(msg, &read);
-		//	mavlink_message_t response;
 
-			uint16_t i = 0;
-			PxParameterMap::const_iterator iter = params.begin();
-			while(iter != params.end())
+			if (read.param_index >= 0)
 			{
-				if (i == read.param_index)
+				if ((size_t)read.param_index < params.size())
 				{
-					mavlink_message_t response;
-					mavlink_msg_param_value_pack(systemid, componentid, &response, (*iter).first.c_str(), (*iter).second, MAVLINK_TYPE_FLOAT, params.size(), i);
-					sendMAVLinkMessage(lcm, &response);
-					if (verbose) std::cout << "Sending param " << (*iter).first  << ':' << (*iter).second << std::endl;
+					sendParam(read.param_index);
+				}
+			}
+			else
+			{
+				// a negative index selects the parameter by name
+				std::string paramName(read.param_id, strnlen(read.param_id, sizeof(read.param_id)));
+				PxParameterIndex::const_iterator iter = paramIndex.find(paramName);
+				if (iter != paramIndex.end())
+				{
+					sendParam(iter->second);
 				}
-				i++;
-				++iter;
 			}
 		}
 		break;
@@ -120,28 +185,27 @@ public:
 					== (uint8_t) systemid && (uint8_t) set.target_component
 					== componentid)
 			{
-				const char* key = (char*) set.param_id;
-				std::string paramName(key);
+				std::string paramName(set.param_id, strnlen(set.param_id, sizeof(set.param_id)));
 
-				if (params.count(paramName) > 0)
+				uint16_t index = (uint16_t)-1;
+				PxParameterIndex::const_iterator param = paramIndex.find(paramName);
+				if (param != paramIndex.end())
 				{
-					params.erase(paramName);
-					params.insert(std::make_pair(paramName, set.param_value));
+					index = param->second;
+					params[index].set(set.param_value);
 				}
 
-				uint16_t i = 0;
 				for (PxCallbackList::iterator iter = callbacks.begin(); iter != callbacks.end(); ++iter)
 				{
 					(**iter)(paramName, set.param_value);
-					i++;
 				}
-				i--;
-				if (paramCallbacks.count(paramName) > 0)
-					(*paramCallbacks[paramName])(paramName, set.param_value);
+				PxParameterCallbackMap::const_iterator callback = paramCallbacks.find(paramName);
+				if (callback != paramCallbacks.end())
+					(*callback->second)(paramName, set.param_value);
 
 				// Report back new value
 				mavlink_message_t response;
-				mavlink_msg_param_value_pack(systemid, componentid, &response, set.param_id, set.param_value, MAVLINK_TYPE_FLOAT, params.size(), i);
+				mavlink_msg_param_value_pack(systemid, componentid, &response, set.param_id, set.param_value, MAVLINK_TYPE_FLOAT, params.size(), index);
 				sendMAVLinkMessage(lcm, &response);
 			}
 		}
@@ -171,27 +235,123 @@ public:
 		}
 		break;
 		}
+
+		// every message gives a pending parameter list a chance to continue
+		sendPendingParams();
+	}
+
+	/**
+	 * Continue a requested parameter list, sending at most one parameter
+	 * every listInterval us so that the link is not flooded. Called with
+	 * every message handled and by handleLCM() when the next parameter is
+	 * due. Must be called from the thread which handles the messages.
+	 *
+	 * @return True while parameters are left to send.
+	 */
+	bool sendPendingParams(void)
+	{
+		if (listRemaining == 0)
+		{
+			return false;
+		}
+
+		uint64_t now = getMonotonicTimeUsecs();
+		if (now - listLastSent < listInterval)
+		{
+			return true;
+		}
+		listLastSent = now;
+
+		if (listNext >= params.size())
+		{
+			listNext = 0;
+		}
+		sendParam(listNext);
+		++listNext;
+		--listRemaining;
+
+		return listRemaining > 0;
+	}
+
+	/**
+	 * Wait for and handle the next LCM message like lcm_handle(), but wake
+	 * up when the next parameter of a requested list is due, so that the
+	 * list continues on a quiet bus. Use it instead of lcm_handle() in the
+	 * loop which passes the messages to handleMAVLinkPacket().
+	 */
+	int handleLCM(void)
+	{
+		if (listRemaining > 0)
+		{
+			uint64_t now = getMonotonicTimeUsecs();
+			uint64_t due = listLastSent + listInterval;
+			int timeout = (due > now) ? (int)((due - now + 999) / 1000) : 0;
+
+			struct pollfd pfd;
+			pfd.fd = lcm_get_fileno(lcm);
+			pfd.events = POLLIN;
+			pfd.revents = 0;
+			if (poll(&pfd, 1, timeout) <= 0)
+			{
+				sendPendingParams();
+				return 0;
+			}
+		}
+
+		return lcm_handle(lcm);
+	}
+
+	void setListInterval(uint64_t usecs)
+	{
+		listInterval = usecs;
 	}
 
 	float getParamValue(const std::string& key)
 	{
-		return params.find(key)->second;
+		const PxParameter* param = findParam(key);
+		return param ? param->get() : 0.f;
+	}
+
+	/**
+	 * Handle to a parameter for repeated reads. The parameter has to be
+	 * set (with setParamValue() or from the config file) before; for an
+	 * unknown parameter the handle is invalid and reads as 0.
+	 */
+	template <typename T>
+	PxParamHandle<T> getParamHandle(const std::string& paramName)
+	{
+		const PxParameter* param = findParam(paramName);
+		if (!param)
+		{
+			fprintf(stderr, "MAVConnParamClient: No parameter %s, returning an invalid handle\n", paramName.c_str());
+		}
+		return PxParamHandle<T>(param);
+	}
+
+	PxParamHandle<float> getParamHandle(const std::string& paramName)
+	{
+		return getParamHandle<float>(paramName);
 	}
 
 	bool setParamValue(const std::string& paramName, float value)
 	{
 		bool updated = false;
-		if (params.count(paramName) > 0)
+		PxParameter* param = findParam(paramName);
+		if (param)
 		{
-			params.erase(paramName);
+			param->set(value);
 			updated = true;
 		}
-		params.insert(std::make_pair(paramName, value));
+		else
+		{
+			addParam(paramName, value);
+		}
 
 		for (PxCallbackList::iterator iter = callbacks.begin(); iter != callbacks.end(); ++iter)
 			(**iter)(paramName, value);
-		if (paramCallbacks.count(paramName) > 0)
-			(*paramCallbacks[paramName])(paramName, value);
+		PxParameterCallbackMap::const_iterator callback = paramCallbacks.find(paramName);
+		if (callback != paramCallbacks.end())
+			(*callback->second)(paramName, value);
 
 		return updated;
 	}
@@ -240,10 +400,10 @@ public:
 		//	        std::cout << i->first << " -> " << i->second << " (hash = " << hashfunc( i->first ) << ")" << std::endl;
 		//	    }
 
-		PxParameterMap::const_iterator iter = params.begin();
+		PxParameterList::const_iterator iter = params.begin();
 		while(iter != params.end())
 		{
-			std::cout << (*iter).first  << ':' << (*iter).second << std::endl;
+			std::cout << (*iter).name  << ':' << (*iter).get() << std::endl;
 			++iter;
 		}
 	}
@@ -298,10 +458,10 @@ public:
 		}
 
 		// Write all parameters to file
-		PxParameterMap::const_iterator iter = params.begin();
+		PxParameterList::const_iterator iter = params.begin();
 		while(iter != params.end())
 		{
-			outfile << (*iter).first  << "\t" << (*iter).second << std::endl;
+			outfile << (*iter).name  << "\t" << (*iter).get() << std::endl;
 			++iter;
 		}
 		outfile.close();
@@ -311,6 +471,19 @@ public:
 	{
 		this->lcm = lcm;
 	}
+
+private:
+	PxParameter* addParam(const std::string& paramName, float value)
+	{
+		if (params.size() >= (uint16_t)-1)
+		{
+			fprintf(stderr, "# WARNING: Too many parameters, ignoring %s\n", paramName.c_str());
+			return 0;
+		}
+		paramIndex[paramName] = params.size();
+		params.push_back(PxParameter(paramName, value));
+		return &params.back();
+	}
 };
 
 #endif /* MAVCONNPARAMCLIENT_H_ */
@@ -44,14 +44,12 @@ This file is part of the MAVCONN project
 // MAVLINK message format includes
 #include "mavconn.h"
 #include "core/MAVConnParamClient.h"
+#include "core/Clock.h"
 
 // Latency Benchmarking
 #include <sys/time.h>
 #include <time.h>
 
-// Timer for benchmarking
-struct timeval tv;
-
 using std::string;
 using namespace std;
 
@@ -124,10 +122,13 @@ uint64_t lastTime;
 
 uint64_t lastGCSTime;
 
+MAVCONN::ClockOffset autopilotClock;	///< time since boot of the autopilot, from SYSTEM_TIME
+
 MAVConnParamClient* paramClient;
 
 static void mavlink_handler(const lcm_recv_buf_t *rbuf, const char * channel,const mavconn_mavlink_msg_container_t* container, void * user)
 {
+	uint64_t receiveTime = getMonotonicTimeUsecs();
 	if (debug) printf("Received message on channel \"%s\":\n", channel);
 
 	thread_context_t* context = static_cast<thread_context_t*>(user);
@@ -191,8 +192,7 @@ static void mavlink_handler(const lcm_recv_buf_t *rbuf, const char * channel,con
 		switch(mavlink_msg_heartbeat_get_type(msg))
 		{
 		case MAV_TYPE_GCS:
-			gettimeofday(&tv, NULL);
-			uint64_t currTime =  ((uint64_t)tv.tv_sec) * 1000000 + tv.tv_usec;
+			uint64_t currTime = getMonotonicTimeUsecs();
 			// Groundstation present
 			lastGCSTime = currTime;
 			if (verbose) std::cout << "Heartbeat received from GCS/OCU " << msg->sysid;
@@ -200,6 +200,18 @@ static void mavlink_handler(const lcm_recv_buf_t *rbuf, const char * channel,con
 		}
 	}
 	break;
+	case MAVLINK_MSG_ID_SYSTEM_TIME:
+	{
+		// the other processes on this system send the epoch time only
+		mavlink_system_time_t time;
+		mavlink_msg_system_time_decode(msg, &time);
+		if (msg->sysid == systemid && msg->compid != compid && time.time_boot_ms != 0)
+		{
+			autopilotClock.addSample((uint64_t)time.time_boot_ms * 1000, receiveTime);
+			if (verbose) printf("Autopilot clock offset: %lld us\n", (long long)autopilotClock.getOffset());
+		}
+	}
+	break;
 	case MAVLINK_MSG_ID_PING:
 	{
 		mavlink_ping_t ping;
@@ -237,8 +249,7 @@ static void mavlink_handler(const lcm_recv_buf_t *rbuf, const char * channel,con
 				mavlink_local_position_ned_t pos;
 				mavlink_msg_local_position_ned_decode(msg, &pos);
 
-				gettimeofday(&tv, NULL);
-				uint64_t currTime =  ((uint64_t)tv.tv_sec) * 1000000 + tv.tv_usec;
+				uint64_t currTime = getMonotonicTimeUsecs();
 
 				if (currTime - last_sim > 1000000)
 				{
@@ -269,11 +280,11 @@ static void mavlink_handler(const lcm_recv_buf_t *rbuf, const char * channel,con
 
 void* lcm_wait(void* lcm_ptr)
 				{
-	lcm_t* lcm = (lcm_t*) lcm_ptr;
-	// Blocking wait for new data
+	// Blocking wait for new data; paramClient uses the same LCM instance
+	// and also continues a requested parameter list on a quiet bus
 	while (1)
 	{
-		lcm_handle (lcm);
+		paramClient->handleLCM();
 	}
 	return NULL;
 				}
@@ -353,8 +364,7 @@ int main (int argc, char ** argv)
 
 	while (1)
 	{
-		gettimeofday(&tv, NULL);
-		uint64_t currTime =  ((uint64_t)tv.tv_sec) * 1000000 + tv.tv_usec;
+		uint64_t currTime = getMonotonicTimeUsecs();
 
 		if (currTime - lastTime > 1000000)
 		{
@@ -373,7 +383,7 @@ int main (int argc, char ** argv)
 			// Send heartbeat if enabled
 			if (emitHeartbeat)
 			{
-				mavlink_msg_system_time_pack(systemid, compid, &msg, currTime, 0);
+				mavlink_msg_system_time_pack(systemid, compid, &msg, getSystemTimeUsecs(), 0);
 				sendMAVLinkMessage(lcm, &msg);
 
 				lastTime = currTime;
@@ -445,8 +455,7 @@ int main (int argc, char ** argv)
 		}
 
 		//sleep as long as possible, if getting near to 1 second sleep only short
-		gettimeofday(&tv, NULL);
-		uint64_t currTime2 =  ((uint64_t)tv.tv_sec) * 1000000 + tv.tv_usec;
+		uint64_t currTime2 = getMonotonicTimeUsecs();
 		int64_t sleeptime = 900000 - (currTime2-currTime);
 		if (sleeptime > 0)
 			usleep(sleeptime);
@@ -45,31 +45,28 @@ Timer::~Timer()
 void Timer::reset()
 {
 	zeroClock = clock();
-	gettimeofday(&start, NULL);
+	// the monotonic clock does not step with corrections of the system time
+	clock_gettime(CLOCK_MONOTONIC, &start);
 }
 
 //--------------------------------------------------------------------------------//
 unsigned long Timer::getSeconds()
 {
-	struct timeval now;
-	gettimeofday(&now, NULL);
-	return (now.tv_sec-start.tv_sec);
+	return getMicroseconds()/1000000;
 }
 
 //--------------------------------------------------------------------------------//
 unsigned long Timer::getMilliseconds()
 {
-	struct timeval now;
-	gettimeofday(&now, NULL);
-	return (now.tv_sec-start.tv_sec)*1000+(now.tv_usec-start.tv_usec)/1000;
+	return getMicroseconds()/1000;
 }
 
 //--------------------------------------------------------------------------------//
 unsigned long Timer::getMicroseconds()
 {
-	struct timeval now;
-	gettimeofday(&now, NULL);
-	return (now.tv_sec-start.tv_sec)*1000000+(now.tv_usec-start.tv_usec);
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return ((now.tv_sec-start.tv_sec)*1000000000LL+(now.tv_nsec-start.tv_nsec))/1000;
 }
 
 //-- Common Across All Timers ----------------------------------------------------//
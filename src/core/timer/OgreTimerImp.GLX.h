@@ -31,6 +31,7 @@ Torus Knot Software Ltd.
 #define __GLXTimer_H__
 
 #include <sys/time.h>
+#include <time.h>
 #include <ctime>
 #include <string>
 
@@ -40,7 +41,7 @@ namespace Ogre
 	class Timer
 	{
 	private:
-		struct timeval start;
+		struct timespec start;
 		clock_t zeroClock;
 	public:
 		Timer();
@@ -229,5 +229,26 @@ namespace watchdog
         sendMAVLinkMessage(watchdog->getLcm(), &msg);
 //std::cout << "--> sent mavlink_watchdog_process_status_t" << std::endl;
     }
+
+    /**
+        @brief Sends the resource usage of a process as two debug vectors, named cpu.<process code> and mem.<process code>.
+
+        cpu: x = CPU usage in percent of one core, y = voluntary, z = involuntary context switches per second
+        mem: x = resident memory in megabytes, y = read, z = written kilobytes per second
+    */
+    void sendWatchdogCommandProcessResources(Watchdog* watchdog, const Process& process)
+    {
+        uint64_t time = getSystemTimeUsecs();
+        char name[10];
+        mavlink_message_t msg;
+
+        snprintf(name, sizeof(name), "cpu.%u", process.getCode());
+        mavlink_msg_debug_vect_pack(sysid, compid, &msg, name, time, process.getCpuUsage(), process.getVoluntarySwitches(), process.getInvoluntarySwitches());
+        sendMAVLinkMessage(watchdog->getLcm(), &msg);
+
+        snprintf(name, sizeof(name), "mem.%u", process.getCode());
+        mavlink_msg_debug_vect_pack(sysid, compid, &msg, name, time, process.getResidentMemory() / 1048576.f, process.getReadRate() / 1024.f, process.getWriteRate() / 1024.f);
+        sendMAVLinkMessage(watchdog->getLcm(), &msg);
+    }
 }
 }
@@ -90,6 +90,7 @@ namespace MAVCONN
         void sendWatchdogCommandHeartbeat(Watchdog* watchdog);
         void sendWatchdogCommandProcessInfo(Watchdog* watchdog, const Process& process);
         void sendWatchdogCommandProcessStatus(Watchdog* watchdog, const Process& process);
+        void sendWatchdogCommandProcessResources(Watchdog* watchdog, const Process& process);
     }
 }
 
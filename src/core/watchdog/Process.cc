@@ -30,9 +30,12 @@ This file is part of the MAVCONN project
 
 #include "Process.h"
 #include <climits>
+#include <cstdio>
+#include <cstring>
 #include <ctime>
 #include <iostream>
 #include <sstream>
+#include <unistd.h>
 #include "Watchdog.h"
 
 namespace MAVCONN
@@ -51,23 +54,39 @@ namespace watchdog
         this->bRunning_ = false;
         this->bSuspended_ = false;
         this->bMuted_ = false;
-        this->bHasOutput_ = false;
 
         this->heartbeat_microseconds_max_ = INT_MAX;
-        this->heartbeat_microseconds_until_kill_ = INT_MAX;
+        this->heartbeat_deadline_ = UINT64_MAX;
         this->bTimeouted_ = false;
 
         this->bCrashed_ = false;
         this->crashs_ = 0;
-        this->restartdelay_microseconds_ = __WATCHDOG_RE_RESTART_DELAY_DEFAULTVALUE;
+        this->restart_time_ = 0;
         this->restartdelay_microseconds_max_ = __WATCHDOG_RE_RESTART_DELAY_DEFAULTVALUE;
         this->bAutoRestart_ = __WATCHDOG_AUTORESTART_PROCESSES_DEFAULTVALUE;
         this->bIgnoreReturnvalue_ = __WATCHDOG_IGNORE_RETURNVALUE_DEFAULTVALUE;
 
-        this->bScheduledHeartbeatTimerReset_ = false;
         this->bScheduledStart_ = true;
         this->bScheduledStop_ = false;
         this->bScheduledRestart_ = false;
+
+        this->sample_time_ = 0;
+        this->cputime_ = 0;
+        this->voluntary_ = 0;
+        this->involuntary_ = 0;
+        this->readbytes_ = 0;
+        this->writebytes_ = 0;
+        this->cpuUsage_ = 0;
+        this->residentMemory_ = 0;
+        this->voluntarySwitches_ = 0;
+        this->involuntarySwitches_ = 0;
+        this->readRate_ = 0;
+        this->writeRate_ = 0;
+
+        this->cpuWeight_ = 0;
+        this->cpuQuota_ = 0;
+        this->memoryLimit_ = 0;
+        CPU_ZERO(&this->cpuAffinity_);
     }
 
     Process::~Process()
@@ -86,7 +105,7 @@ namespace watchdog
     /**
      *
      */
-    void Process::started()
+    void Process::started(uint64_t now)
     {
         this->bRunning_ = true;
         this->bSuspended_ = false;
@@ -99,12 +118,15 @@ namespace watchdog
         if (this->bCrashed_)
         {
             this->bCrashed_ = false;
-            this->restartdelay_microseconds_ = this->restartdelay_microseconds_max_;
+            this->restart_time_ = now + this->restartdelay_microseconds_max_;
         }
 
-        this->resetHeartbeatTimer();
+        this->resetHeartbeatTimer(now);
         this->bTimeouted_ = false;
 
+        // The counters of the new process start at zero
+        this->sample_time_ = 0;
+
 
         time_t rawtime;
         struct tm* timeinfo;
@@ -129,8 +151,8 @@ namespace watchdog
         this->bScheduledStart_ = this->bScheduledRestart_;
         this->bScheduledRestart_ = false;
 
-        this->setHeartbeatTimer(INT_MAX);
-        this->resetOutput();
+        this->stopHeartbeatTimer();
+        this->output_.clear();
 
 
         time_t rawtime;
@@ -144,6 +166,14 @@ namespace watchdog
         this->logstream_ << std::endl;
     }
 
+    void Process::resetHeartbeatTimer(uint64_t now)
+    {
+        if (this->heartbeat_microseconds_max_ > 0 && this->heartbeat_microseconds_max_ < INT_MAX)
+            this->heartbeat_deadline_ = now + this->heartbeat_microseconds_max_;
+        else
+            this->heartbeat_deadline_ = UINT64_MAX;
+    }
+
     void Process::crashed()
     {
         this->bCrashed_ = true;
@@ -232,5 +262,90 @@ namespace watchdog
             this->logstream_ << std::endl;
         }
     }
+    /**
+        @brief Reads the resource usage of the process from /proc/<pid>/stat, status and io.
+
+        The rates are calculated from the difference to the previous sample, so they are only valid from the
+        second sample of a process on.
+
+        @param now The current time on the monotonic clock
+        @return True if the rates are valid
+    */
+    bool Process::sampleResources(uint64_t now)
+    {
+        if (!this->bRunning_ || this->pid_ <= 0)
+            return false;
+
+        char path[64];
+        char line[256];
+        unsigned long utime = 0, stime = 0;
+        unsigned long long value;
+        uint64_t voluntary = 0, involuntary = 0, readbytes = 0, writebytes = 0;
+
+        // CPU time of all threads, in clock ticks (fields 14 and 15, after the name in parentheses)
+        snprintf(path, sizeof(path), "/proc/%d/stat", (int)this->pid_);
+        FILE* file = fopen(path, "r");
+        if (!file)
+            return false;
+        bool ok = (fgets(line, sizeof(line), file) != NULL);
+        fclose(file);
+
+        const char* fields = ok ? strrchr(line, ')') : NULL;
+        if (!fields || sscanf(fields + 1, " %*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu", &utime, &stime) != 2)
+            return false;
+
+        snprintf(path, sizeof(path), "/proc/%d/status", (int)this->pid_);
+        file = fopen(path, "r");
+        if (!file)
+            return false;
+        while (fgets(line, sizeof(line), file))
+        {
+            if (sscanf(line, "VmRSS: %llu", &value) == 1)
+                this->residentMemory_ = value * 1024;
+            else if (sscanf(line, "voluntary_ctxt_switches: %llu", &value) == 1)
+                voluntary = value;
+            else if (sscanf(line, "nonvoluntary_ctxt_switches: %llu", &value) == 1)
+                involuntary = value;
+        }
+        fclose(file);
+
+        // Only available with task I/O accounting
+        snprintf(path, sizeof(path), "/proc/%d/io", (int)this->pid_);
+        file = fopen(path, "r");
+        if (file)
+        {
+            while (fgets(line, sizeof(line), file))
+            {
+                if (sscanf(line, "read_bytes: %llu", &value) == 1)
+                    readbytes = value;
+                else if (sscanf(line, "write_bytes: %llu", &value) == 1)
+                    writebytes = value;
+            }
+            fclose(file);
+        }
+
+        static const long ticks = sysconf(_SC_CLK_TCK);
+        uint64_t cputime = (uint64_t)(utime + stime) * 1000000 / ticks;
+
+        bool valid = (this->sample_time_ != 0 && now > this->sample_time_);
+        if (valid)
+        {
+            float seconds = (now - this->sample_time_) / 1000000.0f;
+            this->cpuUsage_ = (cputime - this->cputime_) / 10000.0f / seconds;
+            this->voluntarySwitches_ = (voluntary - this->voluntary_) / seconds;
+            this->involuntarySwitches_ = (involuntary - this->involuntary_) / seconds;
+            this->readRate_ = (readbytes - this->readbytes_) / seconds;
+            this->writeRate_ = (writebytes - this->writebytes_) / seconds;
+        }
+
+        this->sample_time_ = now;
+        this->cputime_ = cputime;
+        this->voluntary_ = voluntary;
+        this->involuntary_ = involuntary;
+        this->readbytes_ = readbytes;
+        this->writebytes_ = writebytes;
+
+        return valid;
+    }
 }
 }
@@ -31,6 +31,8 @@ This file is part of the MAVCONN project
 #ifndef _Process_H__
 #define _Process_H__
 
+#include <inttypes.h>
+#include <sched.h>
 #include <string>
 #include <vector>
 #include <fstream>
@@ -65,7 +67,7 @@ namespace MAVCONN
                 inline       std::vector<std::string>* getArgumentsPtr()               { return &this->arguments_; }
                 inline                    std::string* getOutputindentationPtr()       { return &this->outputindentation_; }
 
-                void started();
+                void started(uint64_t now);
                 void stoped();
                 void crashed();
 
@@ -82,24 +84,20 @@ namespace MAVCONN
                 inline bool scheduledStart() const { return this->bScheduledStart_; }
                 inline bool scheduledStop()  const { return this->bScheduledStop_; }
 
-                inline void startHeartbeatTimer(int microseconds) { this->heartbeat_microseconds_max_ = microseconds; this->resetHeartbeatTimer(); }
-                inline void tickHeartbeatTimer(int microseconds)  { this->heartbeat_microseconds_until_kill_ -= microseconds; }
-                inline void setHeartbeatTimer(int microseconds)   { this->heartbeat_microseconds_until_kill_ = microseconds; }
-                inline void resetHeartbeatTimer()                 { this->heartbeat_microseconds_until_kill_ = this->heartbeat_microseconds_max_; this->bScheduledHeartbeatTimerReset_ = false; }
-                inline int  getHeartbeatTimer() const             { return this->heartbeat_microseconds_until_kill_; }
+                // Deadlines are absolute times on the monotonic clock (see getMonotonicTimeUsecs()), UINT64_MAX if there is none
+                inline void startHeartbeatTimer(int microseconds) { this->heartbeat_microseconds_max_ = microseconds; this->stopHeartbeatTimer(); }
+                void resetHeartbeatTimer(uint64_t now);
+                inline void stopHeartbeatTimer()                  { this->heartbeat_deadline_ = UINT64_MAX; }
+                inline uint64_t getHeartbeatDeadline() const      { return this->heartbeat_deadline_; }
                 inline int  getHeartbeatTimeout() const           { return this->heartbeat_microseconds_max_; }
 
                 inline void timeout()         { this->bTimeouted_ = true; }
                 inline bool timeouted() const { return this->bTimeouted_; }
 
-                inline void scheduleHeartbeatTimerReset()  const { this->bScheduledHeartbeatTimerReset_ = true; }
-                inline bool scheduledHeartbeatTimerReset() const { return this->bScheduledHeartbeatTimerReset_; }
-
                 inline int  getCrashs() const { return this->crashs_; }
 
                 inline void setRestartDelay(int microseconds)       { this->restartdelay_microseconds_max_ = microseconds; }
-                inline void tickRestartDelayTimer(int microseconds) { if (this->restartdelay_microseconds_ > 0) { this->restartdelay_microseconds_ -= microseconds; } }
-                inline int  getRestartDelayTimer()            const { return this->restartdelay_microseconds_; }
+                inline uint64_t getRestartTime()              const { return this->restart_time_; }
 
                 inline void setAutoRestart(bool autorestart) { this->bAutoRestart_ = autorestart; }
                 inline bool getAutoRestart() const           { return this->bAutoRestart_; }
@@ -111,9 +109,31 @@ namespace MAVCONN
                 inline void unmute()            const { this->setMuted(false); }
                 inline void setMuted(bool mute) const { this->bMuted_ = mute; }
 
-                inline void scheduleOutput()    const { this->bHasOutput_ = true; }
-                inline void resetOutput()             { this->bHasOutput_ = false; }
-                inline bool hasOutput()         const { return this->bHasOutput_; }
+                inline std::string* getOutputPtr()    { return &this->output_; }
+
+                // Resource usage, sampled from /proc/<pid>/ with sampleResources()
+                bool sampleResources(uint64_t now);
+                inline float    getCpuUsage()              const { return this->cpuUsage_; }
+                inline uint64_t getResidentMemory()        const { return this->residentMemory_; }
+                inline float    getVoluntarySwitches()     const { return this->voluntarySwitches_; }
+                inline float    getInvoluntarySwitches()   const { return this->involuntarySwitches_; }
+                inline float    getReadRate()              const { return this->readRate_; }
+                inline float    getWriteRate()             const { return this->writeRate_; }
+
+                // Resource limits, applied through the cgroup of the process (see Watchdog::createCgroup())
+                inline void setCpuWeight(int weight)              { this->cpuWeight_ = weight; }
+                inline void setCpuQuota(int percent)              { this->cpuQuota_ = percent; }
+                inline void setMemoryLimit(uint64_t bytes)        { this->memoryLimit_ = bytes; }
+                inline void setCgroup(const std::string& path)    { this->cgroup_ = path; }
+                inline int  getCpuWeight()                  const { return this->cpuWeight_; }
+                inline int  getCpuQuota()                   const { return this->cpuQuota_; }
+                inline uint64_t getMemoryLimit()            const { return this->memoryLimit_; }
+                inline const std::string& getCgroup()       const { return this->cgroup_; }
+                inline bool hasLimits()                     const { return (this->cpuWeight_ > 0 || this->cpuQuota_ > 0 || this->memoryLimit_ > 0); }
+
+                inline void addCpuAffinity(int cpu)               { CPU_SET(cpu, &this->cpuAffinity_); }
+                inline const cpu_set_t& getCpuAffinity()    const { return this->cpuAffinity_; }
+                inline bool hasCpuAffinity()                const { return (CPU_COUNT(&this->cpuAffinity_) > 0); }
 
                 void startLogStream(const std::string& path);
                 inline std::ofstream& getLogStream() { return this->logstream_; }
@@ -129,25 +149,43 @@ namespace MAVCONN
 
                 bool bRunning_;                              ///< True if the process is running right now
                 mutable bool bSuspended_;                    ///< True if the process is temporarily suspended
-                mutable bool bHasOutput_;                    ///< If true, the process has passed output to the watchdog
                 mutable bool bMuted_;                        ///< True if the process is muted
 
                 int heartbeat_microseconds_max_;             ///< Number of microseconds allowed to pass between two heartbeat signals of the process
-                int heartbeat_microseconds_until_kill_;      ///< Number of microseconds until the process gets killed because of a timeout
+                uint64_t heartbeat_deadline_;                ///< Time at which the process gets killed because of a timeout
                 bool bTimeouted_;                            ///< Becomes true if the process reached the timeout
 
                 bool bCrashed_;                              ///< True if the process has stoped because of a crash
                 int crashs_;                                 ///< The number of times the process crashed
-                int restartdelay_microseconds_;              ///< Number of microseonds until the process is allowed to restart
+                uint64_t restart_time_;                      ///< Time at which the process is allowed to restart
                 int restartdelay_microseconds_max_;          ///< Delay until the process is allowed to restart
                 bool bAutoRestart_;                          ///< If true, the process will be restarted automatically after a crash
                 bool bIgnoreReturnvalue_;                    ///< If true, the returnvalue of a process will be ignored and always handled as a crash
 
-                mutable bool bScheduledHeartbeatTimerReset_; ///< If true, the timer has to be reset in the next iteration of the watchdog
                 mutable bool bScheduledStart_;               ///< If true, the process will be started in the next iteration of the watchdog
                 mutable bool bScheduledStop_;                ///< If true, the process will be stoped in the next iteration of the watchdog
                 mutable bool bScheduledRestart_;             ///< If true, the process will be restarted in the next iteration of the watchdog
 
+                std::string output_;                         ///< Output of the process after the last complete line
+
+                uint64_t sample_time_;                       ///< Time of the last resource sample, 0 if there is none yet
+                uint64_t cputime_;                           ///< CPU time (user and system) in microseconds at the last sample
+                uint64_t voluntary_;                         ///< Voluntary context switches at the last sample
+                uint64_t involuntary_;                       ///< Involuntary context switches at the last sample
+                uint64_t readbytes_;                         ///< Bytes read from storage at the last sample
+                uint64_t writebytes_;                        ///< Bytes written to storage at the last sample
+                float cpuUsage_;                             ///< CPU usage since the previous sample in percent of one core
+                uint64_t residentMemory_;                    ///< Resident set size in bytes
+                float voluntarySwitches_;                    ///< Voluntary context switches per second (waiting for I/O or events)
+                float involuntarySwitches_;                  ///< Involuntary context switches per second (preempted by the scheduler)
+                float readRate_;                             ///< Bytes per second read from storage
+                float writeRate_;                            ///< Bytes per second written to storage
+
+                int cpuWeight_;                              ///< cpu.weight of the cgroup (1 - 10000), 0 if unset
+                int cpuQuota_;                               ///< CPU time limit in percent of one core (cpu.max), 0 if unset
+                uint64_t memoryLimit_;                       ///< memory.max of the cgroup in bytes, 0 if unset
+                std::string cgroup_;                         ///< Directory of the cgroup of the process, empty if it has none
+                cpu_set_t cpuAffinity_;                      ///< CPUs the process may run on, empty for all
                 std::ofstream logstream_;
         };
     }
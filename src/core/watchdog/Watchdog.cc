@@ -30,9 +30,17 @@ This file is part of the MAVCONN project
 
 #include "Watchdog.h"
 
+#include <algorithm>
 #include <climits>
+#include <cstdlib>
+#include <cstring>
 #include <iostream>
 #include <fstream>
+#include <sstream>
+#include <sys/epoll.h>
+#include <sys/stat.h>
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
 #include <sys/wait.h>
 #include <fcntl.h>
 #include <boost/filesystem.hpp>
@@ -50,7 +58,6 @@ namespace watchdog
 {
     Watchdog* Watchdog::instance_s = 0;
     int Watchdog::HEARTBEAT_SIGNAL = __WATCHDOG_HEARTBEAT_SIGNAL;
-    int Watchdog::IO_SIGNAL = __WATCHDOG_IO_SIGNAL;
 
     /**
         @brief Constructor
@@ -65,6 +72,14 @@ namespace watchdog
 
         this->lcm_ = 0;
         this->subscription_ = 0;
+        this->nextHeartbeat_ = 0;
+        this->nextResourceSample_ = 0;
+
+        this->epollfd_ = -1;
+        this->signalfd_ = -1;
+        this->timerfd_ = -1;
+        sigemptyset(&this->signalmask_);
+        sigemptyset(&this->oldsignalmask_);
 
         this->lcmConnect();
     }
@@ -76,9 +91,13 @@ namespace watchdog
     {
         this->lcmDisconnect();
 
-        // Destroy the process structs
+        // Destroy the process structs and remove their (empty) cgroups
         for (unsigned int i = 0; i < this->processes_.size(); ++i)
+        {
+            if (!this->processes_[i]->getCgroup().empty())
+                rmdir(this->processes_[i]->getCgroup().c_str());
             delete this->processes_[i];
+        }
 
         Watchdog::instance_s = 0;
     }
@@ -103,10 +122,24 @@ namespace watchdog
             ("log,l", config::value<bool>()->default_value(__WATCHDOG_LOG_DEFAULTVALUE), "If true, the output of all processes is logged")
             ("flush,u", config::value<bool>()->default_value(__WATCHDOG_FLUSH_DEFAULTVALUE), "If true, the log files are flushed after every line of output")
             ("heartbeat,h", config::value<unsigned int>()->default_value(__WATCHDOG_HEARTBEAT_INTERVAL_DEFAULTVALUE), "Time in milliseconds between two heartbeat messages of the watchdog")
-            ("sleeptime,s", config::value<unsigned int>()->default_value(__WATCHDOG_SLEEPTIME_DEFAULTVALUE), "The time the watchdog sleeps each tick in milliseconds")
+            ("sleeptime,s", config::value<unsigned int>()->default_value(__WATCHDOG_SLEEPTIME_DEFAULTVALUE), "Unused, the watchdog sleeps until the next event")
             ("autoexit,e", config::value<bool>()->default_value(__WATCHDOG_AUTOEXIT_DEFAULTVALUE), "If true, the watchdog exits if all processes have finished properly")
+            ("resources", config::value<unsigned int>()->default_value(__WATCHDOG_RESOURCES_INTERVAL_DEFAULTVALUE), "Time in milliseconds between two resource usage messages of each process, 0 disables them")
+            ("cgroup", config::value<std::string>()->default_value(__WATCHDOG_CGROUP_DEFAULTVALUE), "cgroup v2 directory (e.g. /sys/fs/cgroup/mavconn) in which processes with CPU or memory limits get their own cgroup")
         ;
-        config::options_description desc2("Allowed process options");
+        config::options_description desc2("Allowed process options (defaults for all processes; a single process is configured with\n"
+                                          "-p \"option:option:...:path args\", e.g. -p \"t5000:a1:w200:q50:l256:p0,1:/usr/bin/process -v\")\n"
+                                          "  s0, s1               autostart off or on\n"
+                                          "  t<ms>                heartbeat timeout\n"
+                                          "  a0, a1               autorestart off or on\n"
+                                          "  i0, i1               ignore the returnvalue off or on\n"
+                                          "  r<ms>                restart delay\n"
+                                          "  w<1-10000>           CPU weight (needs --cgroup)\n"
+                                          "  q<percent>           CPU quota, 100 is one CPU (needs --cgroup)\n"
+                                          "  l<megabytes>         memory limit (needs --cgroup)\n"
+                                          "  p<cpu,cpu,...>       CPUs the process may run on\n"
+                                          "  m0, m1               mute off or on\n"
+                                          "Defaults");
         desc2.add_options()
             ("timeout,t", config::value<unsigned int>()->default_value(__WATCHDOG_TIME_TO_KILL_IN_SECONDS_DEFAULTVALUE), "Time in milliseconds after which a process gets killed if it doesn't send a heartbeat signal to the watchdog")
             ("autorestart,a", config::value<bool>()->default_value(__WATCHDOG_AUTORESTART_PROCESSES_DEFAULTVALUE), "If a process died or got killed, it will be restarted if this option is set to true")
@@ -277,148 +310,402 @@ namespace watchdog
         return path;
     }
 
+    /**
+        @brief The mainloop of the watchdog.
+
+        The watchdog sleeps in epoll_wait() until a child sends output or a signal (through a signalfd),
+        an lcm message arrives or the timerfd expires at the next deadline (a heartbeat timeout, the end
+        of a restart delay or the next heartbeat message of the watchdog). All deadlines are measured on
+        the monotonic clock.
+    */
     void Watchdog::run()
     {
-        this->timer_.reset();
-        unsigned int count = 0;
+        this->epollfd_ = epoll_create1(EPOLL_CLOEXEC);
+        this->timerfd_ = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+        if (this->epollfd_ == -1 || this->timerfd_ == -1 || this->signalfd_ == -1)
+        {
+            perror("Couldn't set up the event loop (epoll, timerfd or signalfd failed)");
+            return;
+        }
+
+        this->addToEventLoop(this->signalfd_);
+        this->addToEventLoop(this->timerfd_);
+        if (this->lcm_)
+            this->addToEventLoop(lcm_get_fileno(this->lcm_));
+
+        this->nextHeartbeat_ = getMonotonicTimeUsecs();
+        this->nextResourceSample_ = this->nextHeartbeat_;
+
+        if (!this->vm_["cgroup"].as<std::string>().empty())
+            this->setupCgroups();
 
         // Mainloop
         while (!this->bExit_)
         {
-            unsigned int ticktime = this->timer_.getMicroseconds();
-            this->timer_.reset();
-/*
-            if (count % 1000 == 0)
+            uint64_t now = getMonotonicTimeUsecs();
+            uint64_t deadline = this->updateProcesses(now);
+
+            if (this->vm_["autoexit"].as<bool>())
             {
+                // Check watchdog finish
+                bool finished = true;
                 for (unsigned int i = 0; i < this->processes_.size(); ++i)
                 {
-                    if (i > 0)
-                        std::cout << ", ";
-                    std::cout << this->processes_[i]->microseconds_until_kill_;
+                    if (!this->processes_[i]->isFinished())
+                    {
+                        finished = false;
+                        break;
+                    }
+                }
+                if (finished)
+                {
+                    if (this->vm_["verbose"].as<bool>())
+                        std::cout << "All processes have finished normally." << std::endl;
+
+                    this->bExit_ = true;
+                    break;
                 }
-                std::cout << std::endl;
             }
-*/
-            // Loop through all processes
-            for (unsigned int i = 0; i < this->processes_.size(); ++i)
+
+            if (now >= this->nextHeartbeat_)
             {
-                Process& process = *this->processes_[i];
+                this->nextHeartbeat_ = now + (uint64_t)this->vm_["heartbeat"].as<unsigned int>() * 1000;
+                sendWatchdogCommandHeartbeat(this);
+            }
+            deadline = std::min(deadline, this->nextHeartbeat_);
 
-                if (process.isRunning())
+            unsigned int resources = this->vm_["resources"].as<unsigned int>();
+            if (resources > 0)
+            {
+                if (now >= this->nextResourceSample_)
                 {
-                    // Heartbeat timer
-                    if (process.getHeartbeatTimeout() > 0)
-                    {
-                        if (process.scheduledHeartbeatTimerReset())
-                            process.resetHeartbeatTimer();
-                        else
-                            process.tickHeartbeatTimer(ticktime); // Only tick if no heartbeat signal was received to avoid false timeouts if the watchdogs iteration takes too long (ticktime > timeout)
+                    this->nextResourceSample_ = now + (uint64_t)resources * 1000;
+                    this->sampleResources(now);
+                }
+                deadline = std::min(deadline, this->nextResourceSample_);
+            }
 
-                        // Check if the process has timed out and kill it if necessary
-                        if (process.getHeartbeatTimer() < 0)
-                        {
-                            if (this->vm_["verbose"].as<bool>())
-                                std::cout << "Process \"" << process.getName() << "\" timed out, scheduling restart." << std::endl;
+            // Wake up at the next deadline at the latest
+            struct itimerspec expiry;
+            memset(&expiry, 0, sizeof(expiry));
+            expiry.it_value.tv_sec = deadline / 1000000;
+            expiry.it_value.tv_nsec = (deadline % 1000000) * 1000;
+            if (timerfd_settime(this->timerfd_, TFD_TIMER_ABSTIME, &expiry, NULL) && this->vm_["verbose"].as<bool>())
+                perror("timerfd_settime() failed");
+
+            struct epoll_event events[16];
+            int count = epoll_wait(this->epollfd_, events, 16, -1);
+            if (count == -1)
+            {
+                if (errno != EINTR && this->vm_["verbose"].as<bool>())
+                    perror("epoll_wait() failed");
+                continue;
+            }
 
-                            process.scheduleRestart();
-                            process.setHeartbeatTimer(INT_MAX); // Reset killtime to avoid sending multiple kill signals
-                            process.timeout();
-                        }
-                    }
+            now = getMonotonicTimeUsecs();
+            for (int i = 0; i < count; ++i)
+            {
+                int fd = events[i].data.fd;
 
-                    // Output
-                    if (process.hasOutput())
+                if (fd == this->signalfd_)
+                {
+                    this->handleSignals(now);
+                }
+                else if (fd == this->timerfd_)
+                {
+                    uint64_t expirations;
+                    if (read(this->timerfd_, &expirations, sizeof(expirations)) == -1 && errno != EAGAIN && this->vm_["verbose"].as<bool>())
+                        perror("read() failed (timerfd)");
+                }
+                else if (this->lcm_ && fd == lcm_get_fileno(this->lcm_))
+                {
+                    lcm_handle(this->lcm_);
+                }
+                else
+                {
+                    try
+                    {
+                        this->readOutput(this->getProcessByFiledescriptor(fd));
+                    }
+                    catch (...)
                     {
-                        process.resetOutput();
+                        // the process has exited while handling the previous events
+                        this->removeFromEventLoop(fd);
+                    }
+                }
+            }
+        }
 
-                        #define _TEXT_READ_LENGTH 1024
-                        char text[_TEXT_READ_LENGTH];
+        close(this->timerfd_);
+        close(this->epollfd_);
+        this->timerfd_ = -1;
+        this->epollfd_ = -1;
+    }
 
-                        ssize_t result = read(process.getFiledescriptor(), &text, _TEXT_READ_LENGTH - 1);
+    /**
+        @brief Handles heartbeat timeouts, scheduled starts and stops of all processes.
+        @param now The current time on the monotonic clock
+        @return The next deadline of a process, UINT64_MAX if there is none
+    */
+    uint64_t Watchdog::updateProcesses(uint64_t now)
+    {
+        uint64_t deadline = UINT64_MAX;
 
-                        if (result == -1)
-                        {
-                            if (this->vm_["verbose"].as<bool>())
-                                perror("read() failed");
-                        }
-                        else if (result > 0)
-                        {
-                            text[result] = '\0';
+        for (unsigned int i = 0; i < this->processes_.size(); ++i)
+        {
+            Process& process = *this->processes_[i];
 
-                            std::vector<char*> lines = splitLines(text);
+            // Check if the process has timed out and kill it if necessary
+            if (process.isRunning() && process.getHeartbeatDeadline() <= now)
+            {
+                if (this->vm_["verbose"].as<bool>())
+                    std::cout << "Process \"" << process.getName() << "\" timed out, scheduling restart." << std::endl;
 
-                            for (unsigned int j = 0; j < lines.size(); ++j)
-                            {
-                                if (!this->vm_["mute"].as<bool>() && !process.isMuted())
-                                    std::cout << "> " << process.getName() << process.getOutputindentation() << ": " << lines[j] << std::endl;
+                process.scheduleRestart();
+                process.stopHeartbeatTimer(); // Avoid sending multiple kill signals
+                process.timeout();
+            }
 
-                                if (this->vm_["log"].as<bool>())
-                                {
-                                    process.getLogStream() << "> " << lines[j] << std::endl;
+            if (process.scheduledStop())
+                this->stopProcess(process);
 
-                                    if (this->vm_["flush"].as<bool>())
-                                        process.getLogStream().flush();
-                                }
-                            }
-                        }
-                    }
+            if (process.scheduledStart())
+            {
+                if (process.getRestartTime() <= now)
+                {
+                    this->startProcess(process);
+
+                    // Retry later if the process couldn't be started
+                    if (process.scheduledStart())
+                        deadline = std::min(deadline, now + (uint64_t)__WATCHDOG_RE_RESTART_DELAY_DEFAULTVALUE * 1000);
+                }
+                else
+                {
+                    deadline = std::min(deadline, process.getRestartTime());
                 }
+            }
 
-                // Restartdelay timer
-                process.tickRestartDelayTimer(ticktime);
+            if (process.isRunning())
+                deadline = std::min(deadline, process.getHeartbeatDeadline());
+        }
 
-                if (process.scheduledStop())
-                    this->stopProcess(process);
+        return deadline;
+    }
 
-                if (process.scheduledStart() && process.getRestartDelayTimer() <= 0)
-                    this->startProcess(process);
-            }
+    /**
+        @brief Reads the pending signals from the signalfd.
 
-            // Call wait() with WNOHANG to find exited processes
-            while (true)
+        Heartbeat signals reset the heartbeat timer of the sending process. Exited children are reaped
+        after every wakeup, since SIGCHLD isn't queued and one signal may stand for several exits.
+    */
+    void Watchdog::handleSignals(uint64_t now)
+    {
+        struct signalfd_siginfo info;
+        while (read(this->signalfd_, &info, sizeof(info)) == sizeof(info))
+        {
+            if ((int)info.ssi_signo != HEARTBEAT_SIGNAL)
+                continue;
+
+            try
             {
-                int stat_loc;
-                pid_t exitedprocess = waitpid(-1, &stat_loc, WNOHANG);
-                if (exitedprocess > 0)
-                    this->handleChildExit(exitedprocess, stat_loc);
-                else
-                    break;
+                this->getProcessByPID(info.ssi_pid).resetHeartbeatTimer(now);
+            }
+            catch (...)
+            {
+                if (this->vm_["verbose"].as<bool>())
+                    std::cout << "heartbeat signal was raised by an unknown process (PID: " << info.ssi_pid << ")" << std::endl;
             }
+        }
 
-            if (this->vm_["autoexit"].as<bool>())
+        while (true)
+        {
+            int stat_loc;
+            pid_t exitedprocess = waitpid(-1, &stat_loc, WNOHANG);
+            if (exitedprocess > 0)
+                this->handleChildExit(exitedprocess, stat_loc);
+            else
+                break;
+        }
+    }
+
+    /**
+        @brief Reads all output the process has sent so far and prints and logs each complete line.
+    */
+    void Watchdog::readOutput(Process& process)
+    {
+        #define _TEXT_READ_LENGTH 4096
+        char text[_TEXT_READ_LENGTH];
+
+        while (true)
+        {
+            ssize_t result = read(process.getFiledescriptor(), text, _TEXT_READ_LENGTH);
+
+            if (result > 0)
             {
-                // Check watchdog finish
-                bool finished = true;
-                for (unsigned int i = 0; i < this->processes_.size(); ++i)
+                std::string& output = *process.getOutputPtr();
+                output.append(text, result);
+
+                size_t start = 0;
+                size_t end;
+                while ((end = output.find('\n', start)) != std::string::npos)
                 {
-                    if (!this->processes_[i]->isFinished())
-                    {
-                        finished = false;
-                        break;
-                    }
+                    output[end] = '\0';
+                    this->printOutput(process, output.c_str() + start);
+                    start = end + 1;
                 }
-                if (finished)
-                {
-                    if (this->vm_["verbose"].as<bool>())
-                        std::cout << "All processes have finished normally." << std::endl;
+                output.erase(0, start);
 
-                    this->bExit_ = true;
+                // Don't wait forever for the end of very long lines
+                if (output.size() >= _TEXT_READ_LENGTH)
+                {
+                    this->printOutput(process, output.c_str());
+                    output.clear();
                 }
             }
-
-            ++count;
-
-            if (this->heartbeatTimer_.getMilliseconds() > this->vm_["heartbeat"].as<unsigned int>())
+            else if (result == 0)
             {
-                this->heartbeatTimer_.reset();
-                sendWatchdogCommandHeartbeat(this);
+                // The child has closed the pipe, it gets reaped when SIGCHLD arrives
+                this->removeFromEventLoop(process.getFiledescriptor());
+                break;
             }
+            else
+            {
+                if (errno == EINTR)
+                    continue;
+                if (errno != EAGAIN && errno != EWOULDBLOCK && this->vm_["verbose"].as<bool>())
+                    perror("read() failed");
+                break;
+            }
+        }
+    }
+
+    void Watchdog::printOutput(Process& process, const char* line)
+    {
+        if (!this->vm_["mute"].as<bool>() && !process.isMuted())
+            std::cout << "> " << process.getName() << process.getOutputindentation() << ": " << line << std::endl;
+
+        if (this->vm_["log"].as<bool>())
+        {
+            process.getLogStream() << "> " << line << std::endl;
 
-            this->lcmHandle();
-            usleep(this->vm_["sleeptime"].as<unsigned int>() / 2 * 1000);
+            if (this->vm_["flush"].as<bool>())
+                process.getLogStream().flush();
         }
     }
 
+    void Watchdog::addToEventLoop(int fd)
+    {
+        struct epoll_event event;
+        memset(&event, 0, sizeof(event));
+        event.events = EPOLLIN;
+        event.data.fd = fd;
+
+        if (epoll_ctl(this->epollfd_, EPOLL_CTL_ADD, fd, &event) && this->vm_["verbose"].as<bool>())
+            perror("epoll_ctl() failed");
+    }
+
+    void Watchdog::removeFromEventLoop(int fd)
+    {
+        // the descriptor may already be gone, nothing to report then
+        epoll_ctl(this->epollfd_, EPOLL_CTL_DEL, fd, NULL);
+    }
+
+    /**
+        @brief Samples the resource usage of all running processes and sends it over lcm.
+    */
+    void Watchdog::sampleResources(uint64_t now)
+    {
+        for (unsigned int i = 0; i < this->processes_.size(); ++i)
+        {
+            Process& process = *this->processes_[i];
+
+            if (process.sampleResources(now))
+                sendWatchdogCommandProcessResources(this, process);
+        }
+    }
+
+    /**
+        @brief Creates the cgroup directory and enables the cpu and memory controllers for the cgroups of the processes.
+
+        The controllers must also be enabled in the parent directory, which is usually done by the init system already.
+    */
+    void Watchdog::setupCgroups()
+    {
+        const std::string& root = this->vm_["cgroup"].as<std::string>();
+
+        if (mkdir(root.c_str(), 0755) && errno != EEXIST && this->vm_["verbose"].as<bool>())
+        {
+            std::cout << "mkdir() failed, couldn't create the cgroup \"" << root << "\": ";
+            perror(NULL);
+        }
+
+        std::string parent = boost::filesystem::path(root).parent_path().string() + "/cgroup.subtree_control";
+        if (!Watchdog::writeCgroupFile(parent, "+cpu +memory") && this->vm_["verbose"].as<bool>())
+            std::cout << "Couldn't enable the cpu and memory controllers in " << parent << ": " << strerror(errno) << std::endl;
+        if (!Watchdog::writeCgroupFile(root + "/cgroup.subtree_control", "+cpu +memory") && this->vm_["verbose"].as<bool>())
+            std::cout << "Couldn't enable the cpu and memory controllers in " << root << "/cgroup.subtree_control: " << strerror(errno) << std::endl;
+    }
+
+    /**
+        @brief Creates the cgroup of a process and writes its CPU and memory limits.
+
+        The cgroup is named <code>-<name> and kept across restarts of the process. The child joins it before exec().
+        A limit which can't be applied is always reported, regardless of --verbose.
+    */
+    void Watchdog::createCgroup(Process& process)
+    {
+        std::ostringstream path;
+        path << this->vm_["cgroup"].as<std::string>() << "/" << process.getCode() << "-" << boost::filesystem::path(process.getName()).filename().string();
+
+        if (mkdir(path.str().c_str(), 0755) && errno != EEXIST)
+        {
+            int error = errno;
+            std::cout << "Warning: \"" << process.getName() << "\" runs without its CPU and memory limits, couldn't create the cgroup \"" << path.str() << "\": " << strerror(error) << std::endl;
+            return;
+        }
+        process.setCgroup(path.str());
+
+        if (process.getCpuWeight() > 0)
+        {
+            std::ostringstream value;
+            value << process.getCpuWeight();
+            if (!Watchdog::writeCgroupFile(path.str() + "/cpu.weight", value.str()))
+                std::cout << "Warning: couldn't set the CPU weight of \"" << process.getName() << "\" to " << value.str() << ": " << strerror(errno) << std::endl;
+        }
+        if (process.getCpuQuota() > 0)
+        {
+            // quota and period in microseconds
+            std::ostringstream value;
+            value << process.getCpuQuota() * 1000 << " 100000";
+            if (!Watchdog::writeCgroupFile(path.str() + "/cpu.max", value.str()))
+                std::cout << "Warning: couldn't set the CPU quota of \"" << process.getName() << "\" to " << process.getCpuQuota() << " percent: " << strerror(errno) << std::endl;
+        }
+        if (process.getMemoryLimit() > 0)
+        {
+            std::ostringstream value;
+            value << process.getMemoryLimit();
+            if (!Watchdog::writeCgroupFile(path.str() + "/memory.max", value.str()))
+                std::cout << "Warning: couldn't set the memory limit of \"" << process.getName() << "\" to " << value.str() << " bytes: " << strerror(errno) << std::endl;
+        }
+    }
+
+    /**
+        @brief Writes a value to a cgroup control file.
+        @return False if the file couldn't be written, errno tells why. The caller reports the error.
+    */
+    /* static */
+    bool Watchdog::writeCgroupFile(const std::string& path, const std::string& value)
+    {
+        int fd = open(path.c_str(), O_WRONLY | O_CLOEXEC);
+        bool success = (fd != -1 && write(fd, value.c_str(), value.size()) == (ssize_t)value.size());
+        int error = errno;
+        if (fd != -1)
+            close(fd);
+
+        errno = error;
+        return success;
+    }
+
     void Watchdog::lcmConnect(const char* url)
     {
         // connect to lcm and subscribe for mavlink messages
@@ -439,26 +726,6 @@ namespace watchdog
         }
     }
 
-    void Watchdog::lcmHandle()
-    {
-        int fileno = lcm_get_fileno(this->lcm_);
-
-        struct timeval tv;
-        tv.tv_sec = 0;
-        tv.tv_usec = this->vm_["sleeptime"].as<unsigned int>() / 2 * 1000;
-
-        fd_set readfds;
-        FD_ZERO(&readfds);
-        FD_SET(fileno, &readfds);
-
-        select(fileno + 1, &readfds, NULL, NULL, &tv);
-
-        if (FD_ISSET(fileno, &readfds) && errno != EINTR) // check if errno is EINTR (this happens if SIGIO interrupts select)
-            lcm_handle(this->lcm_);
-
-        errno = 0;
-    }
-
     /**
         @brief Starts a new process.
         @param process The process-struct of the process that should be started.
@@ -469,15 +736,25 @@ namespace watchdog
     */
     void Watchdog::startProcess(Process& process)
     {
-        // Open pipe
+        // The CPU and memory limits are applied through a cgroup of the process
+        if (process.hasLimits() && process.getCgroup().empty())
+        {
+            if (this->vm_["cgroup"].as<std::string>().empty())
+                std::cout << "Warning: \"" << process.getName() << "\" has CPU or memory limits, but they aren't applied without --cgroup" << std::endl;
+            else
+                this->createCgroup(process);
+        }
+
+        // Open pipe, the read end must not leak into the other children
         int pipe_file_descriptor[2];
-        if (pipe(pipe_file_descriptor))
+        if (pipe2(pipe_file_descriptor, O_CLOEXEC))
         {
             if (this->vm_["verbose"].as<bool>())
             {
                 std::cout << "pipe() failed, couldn't open pipe for \"" << process.getName() << "\": ";
                 perror(NULL);
             }
+            return;
         }
 
         // Duplicate this process
@@ -487,12 +764,30 @@ namespace watchdog
         {
             // We're the child
 
+            // The watchdog receives these signals through a signalfd; the child gets the default handling back
+            sigprocmask(SIG_SETMASK, &this->oldsignalmask_, NULL);
+
+            // Join the cgroup with the resource limits while stderr is still the console of the watchdog,
+            // a failure must be visible even if the process is muted
+            if (!process.getCgroup().empty())
+            {
+                std::ostringstream pid;
+                pid << getpid();
+                if (!Watchdog::writeCgroupFile(process.getCgroup() + "/cgroup.procs", pid.str()))
+                    fprintf(stderr, "Warning: \"%s\" runs without its CPU and memory limits, couldn't join the cgroup \"%s\": %s\n",
+                            process.getName().c_str(), process.getCgroup().c_str(), strerror(errno));
+            }
+
             // Prepare the pipe
             close(pipe_file_descriptor[0]);   // close the read end of the pipe
             dup2(pipe_file_descriptor[1], 1); // make 1 same as write-to end of pipe (1 is std::cout)
             dup2(pipe_file_descriptor[1], 2); // make 1 same as write-to end of pipe (2 is std::cerror)
             close(pipe_file_descriptor[1]);   // close excess file descriptor
 
+            // Restrict the CPUs the process may run on
+            if (process.hasCpuAffinity() && sched_setaffinity(0, sizeof(cpu_set_t), &process.getCpuAffinity()))
+                perror("sched_setaffinity() failed");
+
             // Create the program arguments
             char* argv[process.getArguments().size() + 1]; // +1 for the trailing 0
             for (unsigned int i = 0; i < process.getArguments().size(); ++i)
@@ -520,29 +815,13 @@ namespace watchdog
 
             close(pipe_file_descriptor[1]);   // close the write end of the pipe
 
-            // Prepare the pipe to get callbacks if the process sends output
-            // FIXME Violates POSIX standard, works only on Linux :(. See man fnctl for POSIX-alternatives
-            // Is a fix hard to achieve?
-#ifdef __linux
-            if (fcntl(pipe_file_descriptor[0], F_SETSIG, IO_SIGNAL) && this->vm_["verbose"].as<bool>()) // F_SETSIG defines SIGIO as the raised signal whenever the pipe gets readable
-                perror("fcntl() failed (F_SETSIG)");
-            if (fcntl(pipe_file_descriptor[0], F_SETOWN, getpid()) && this->vm_["verbose"].as<bool>()) // F_SETOWN defines our process as the destination of the SIGIO signals
-                perror("fcntl() failed (F_SETOWN)");
-            if (fcntl(pipe_file_descriptor[0], F_SETFL, O_ASYNC) && this->vm_["verbose"].as<bool>()) // F_SETFL sets the O_ASYNC flag to activate the signal sending
+            // Read the output whenever it arrives, without blocking the mainloop
+            if (fcntl(pipe_file_descriptor[0], F_SETFL, O_NONBLOCK) && this->vm_["verbose"].as<bool>())
                 perror("fcntl() failed (F_SETFL)");
-#endif
-/*
-            // Call wait with WNOHANG to kill the child if it crashes before we could set up the signal handler
-            int stat_loc;
-            pid_t exitedprocess = waitpid(pid, &stat_loc, WNOHANG);
-            if (exitedprocess)
-            {
-                this->handleChildExit(exitedprocess, stat_loc);
-                return;
-            }
-*/
+            this->addToEventLoop(pipe_file_descriptor[0]);
+
             // Set all process values
-            process.started();
+            process.started(getMonotonicTimeUsecs());
             process.setPID(pid);
             process.setFiledescriptor(pipe_file_descriptor[0]);
 
@@ -556,6 +835,9 @@ namespace watchdog
                 std::cout << "fork() failed, couldn't start \"" << process.getName() << "\": ";
                 perror(NULL);
             }
+
+            close(pipe_file_descriptor[0]);
+            close(pipe_file_descriptor[1]);
         }
     }
 
@@ -587,6 +869,14 @@ namespace watchdog
             if (this->vm_["verbose"].as<bool>())
                 std::cout << "(PID: " << process.getPID() << ", " << process.getName() << ")" << std::endl;
 
+            // Get the last output of the process, including an unterminated line
+            if (process.getFiledescriptor() != -1)
+            {
+                this->readOutput(process);
+                if (!process.getOutputPtr()->empty())
+                    this->printOutput(process, process.getOutputPtr()->c_str());
+            }
+
             if (this->vm_["log"].as<bool>())
             {
                 process.getLogStream() << std::endl;
@@ -609,7 +899,11 @@ namespace watchdog
                     process.scheduleStart();
             }
 
-            close(process.getFiledescriptor()); // Close the pipe
+            if (process.getFiledescriptor() != -1)
+            {
+                this->removeFromEventLoop(process.getFiledescriptor());
+                close(process.getFiledescriptor()); // Close the pipe
+            }
             process.setFiledescriptor(-1);
 
             sendWatchdogCommandProcessStatus(this, process);
@@ -622,244 +916,35 @@ namespace watchdog
     }
 
     /**
-        @brief Handle the SIGCHLD signal which gets raised if a child process exits.
+        @brief Blocks SIGCHLD and the heartbeat signal and receives them through a signalfd instead.
 
-        If a child process exits (either controlled by exit(int) or unwanted if an error occurrs or a signal gets raised.
-        The signal handler tries to find the reason for the exit and sets the process-struct variables accordingly to initiate a restart of the process if needed.
-    */
-    /* static */
-/*
-    void Watchdog::sigchldSignalHandler(int sig, siginfo_t* info, void* context)
-    {
-        if (Watchdog::isVerbose())
-            std::cout << "SIGCHLD was raised. ";
-
-        pid_t pid = -1;
-        bool normalexit = false;
-
-        if (info)
-        {
-            // Print error if available
-            if (info->si_errno && Watchdog::isVerbose())
-                perror("error in siginfo_t");
-
-            pid = info->si_pid;
-
-            // Wait for the child to exit
-            int stat_loc;
-            if (waitpid(pid, &stat_loc, 0) == -1)
-            {
-                if (Watchdog::isVerbose())
-                {
-                    perror("waitpid() failed");
-                    std::cout << Watchdog::getClientExitDescription(info->si_status, info->si_status, &normalexit) << ".";
-                }
-                else
-                    Watchdog::getClientExitDescription(info->si_status, info->si_status, &normalexit);
-            }
-            else
-            {
-                // Check the exit reason
-                if (Watchdog::isVerbose())
-                    std::cout << Watchdog::getClientExitDescription(WEXITSTATUS(stat_loc), WTERMSIG(stat_loc), &normalexit) << ".";
-                else
-                    Watchdog::getClientExitDescription(WEXITSTATUS(stat_loc), WTERMSIG(stat_loc), &normalexit);
-            }
-        }
-        else
-        {
-            // No siginfo object available, use wait()
-            pid = wait(NULL);
-            if (Watchdog::isVerbose())
-                std::cout << "unknown reason (no siginfo_t available).";
-        }
-
-        handleChildExit(pid, normalexit);
-    }
-*/
-    /**
-        @brief Handle the heartbeat signal which gets raised by every child process to tell the watchdog it's still alive.
-    */
-    /* static */
-    void Watchdog::heartbeatSignalHandler(int sig, siginfo_t* info, void* context)
-    {
-        if (Watchdog::isVerbose())
-            std::cout << "heartbeat signal was raised. ";
-
-        if (info)
-        {
-            // Print error if available
-            if (info->si_errno && Watchdog::isVerbose())
-                perror("error in siginfo_t");
-
-            try
-            {
-                const Process& process = Watchdog::getInstance().getProcessByPID(info->si_pid);
-
-                if (Watchdog::isVerbose())
-                    std::cout << "(PID: " << process.getPID() << ", " << process.getName() << ")" << std::endl;
-
-                // Reset the time
-                process.scheduleHeartbeatTimerReset();
-            }
-            catch (...)
-            {
-                if (Watchdog::isVerbose())
-                    std::cout << "(PID: " << info->si_pid << ", unknown process)" << std::endl;
-            }
-        }
-        else
-        {
-            if (Watchdog::isVerbose())
-                std::cout << "unknown process (no siginfo_t available)" << std::endl;
-        }
-    }
-
-    /**
-        @brief Handlers the SIGIO signal which gets raised whenever a child process sent a message to the pipe.
-    */
-    /* static */
-    void Watchdog::sigioSignalHandler(int sig, siginfo_t* info, void* context)
-    {
-        if (info)
-        {
-            // Print error if available
-            if (info->si_errno && Watchdog::isVerbose())
-                perror("sigio signal was raised. error in siginfo_t");
-
-            try
-            {
-#ifdef __linux
-                const Process& process = Watchdog::getInstance().getProcessByFiledescriptor(info->si_fd);
-#else
-                const Process& process = Watchdog::getInstance().getProcessByPID(info->si_pid);
-#endif
-                process.scheduleOutput();
-            }
-            catch (...)
-            {
-                if (Watchdog::isVerbose())
-                {
-#ifdef __linux
-                	std::cout << "sigio signal was raised, but process is unknown (FD: " << info->si_fd << ")" << std::endl;;
-#else
-                	std::cout << "sigio signal was raised, but process is unknown (PID: " << info->si_pid << ")" << std::endl;;
-#endif
-                }
-
-            }
-        }
-        else if (Watchdog::isVerbose())
-            std::cout << "sigio signal was raised, but no siginfo_t available" << std::endl;;
-
-    }
-
-    /**
-        @brief Registers all signal handlers.
+        Signals are handled in the mainloop like any other event, so no work is done in signal handlers.
+        Must be called before the first process is started.
     */
     void Watchdog::registerSignalHandlers()
     {
-//        Watchdog::registerSigchldHandler();
-        Watchdog::registerHeartbeatHandler();
-        Watchdog::registerSigioHandler();
-    }
-
-    /**
-        @brief Unregisters all signal handlers.
-    */
-    void Watchdog::unregisterSignalHandlers()
-    {
-//        Watchdog::unregisterSignalHandler(SIGCHLD);
-        Watchdog::unregisterSignalHandler(HEARTBEAT_SIGNAL);
-        Watchdog::unregisterSignalHandler(IO_SIGNAL);
-    }
-
-    /**
-        @brief Registers a handler for the SIGCHLD signal.
-
-        This signal handler is used to get a notification if a child process exits.
-    */
-    /* static */
-/*
-    void Watchdog::registerSigchldHandler()
-    {
-        struct sigaction sa;
+        sigemptyset(&this->signalmask_);
+        sigaddset(&this->signalmask_, SIGCHLD);
+        sigaddset(&this->signalmask_, HEARTBEAT_SIGNAL);
 
-        sa.sa_sigaction = &Watchdog::sigchldSignalHandler;
+        if (sigprocmask(SIG_BLOCK, &this->signalmask_, &this->oldsignalmask_) && this->vm_["verbose"].as<bool>())
+            perror("sigprocmask() failed, couldn't block SIGCHLD and the heartbeat signal");
 
-        sa.sa_flags = 0;
-        sa.sa_flags |= SA_SIGINFO; // Set this to get siginfo_t in the signal handler
-        sa.sa_flags |= SA_RESTART; // Restart interruptible functions after signal handling
-        sa.sa_flags |= SA_NODEFER; // Don't block other signals of this type
-//        sa.sa_flags |= SA_NOCLDWAIT; // Set this so we don't have to call wait() to remove the child after it exited
-
-//        sigaddset(&sa.sa_mask, SIGCHLD);
-//        sigaddset(&sa.sa_mask, SIGUSR1);
-//        sigaddset(&sa.sa_mask, SIGUSR2);
-//        sigaddset(&sa.sa_mask, SIGIO);
-
-        if (sigaction(SIGCHLD, &sa, NULL) && Watchdog::isVerbose())
-            perror("sigaction() failed, couldn'd add signal handler for SIGCHLD.");
-    }
-*/
-    /**
-        @brief Registers a handler for the heartbeat signal.
-
-        This signal handler is used to get a notification if a child raises the heartbeat signal to tell
-        the watchdog it's still alive.
-    */
-    /* static */
-    void Watchdog::registerHeartbeatHandler()
-    {
-        struct sigaction sa;
-
-        sa.sa_sigaction = &Watchdog::heartbeatSignalHandler;
-
-        sa.sa_flags = 0;
-        sa.sa_flags |= SA_SIGINFO; // Set this to get siginfo_t in the signal handler
-        sa.sa_flags |= SA_RESTART; // Restart interruptible functions after signal handling
-        sa.sa_flags |= SA_NODEFER; // Don't block other signals of this type
-
-        if (sigaction(HEARTBEAT_SIGNAL, &sa, NULL) && Watchdog::isVerbose())
-            perror("sigaction() failed, couldn'd add signal handler for heartbeat signal.");
+        this->signalfd_ = signalfd(-1, &this->signalmask_, SFD_NONBLOCK | SFD_CLOEXEC);
+        if (this->signalfd_ == -1 && this->vm_["verbose"].as<bool>())
+            perror("signalfd() failed");
     }
 
     /**
-        @brief Registers a handler for the SIGIO signal.
-
-        This signal handler is used to get a notification whenever a message was sent from
-        one of the child processes to the output pipe. The watchdog can then read the data
-        from the filedescriptor.
+        @brief Closes the signalfd and restores the signal mask.
     */
-    /* static */
-    void Watchdog::registerSigioHandler()
-    {
-        struct sigaction sa;
-
-        sa.sa_sigaction = &Watchdog::sigioSignalHandler;
-
-        sa.sa_flags = 0;
-        sa.sa_flags |= SA_SIGINFO; // Set this to get siginfo_t in the signal handler
-        sa.sa_flags |= SA_RESTART; // Restart interruptible functions after signal handling
-        sa.sa_flags |= SA_NODEFER; // Don't block other signals of this type
-
-        if (sigaction(IO_SIGNAL, &sa, NULL) && Watchdog::isVerbose())
-            perror("sigaction() failed, couldn'd add signal handler for SIGIO.");
-    }
-
-    /**
-        @brief Unregisters a signal handler for a given signal number by reapplying the standard handler.
-    */
-    /* static */
-    void Watchdog::unregisterSignalHandler(int signalnr)
+    void Watchdog::unregisterSignalHandlers()
     {
-        struct sigaction sa;
+        if (this->signalfd_ != -1)
+            close(this->signalfd_);
+        this->signalfd_ = -1;
 
-        sa.sa_handler = SIG_DFL;
-        sa.sa_flags = 0;
-
-        if (sigaction(signalnr, &sa, NULL) && Watchdog::isVerbose())
-            perror((std::string("sigaction() failed, couldn'd unregister signal handler for signal ") + Watchdog::getSignalDescription(signalnr)).c_str());
+        sigprocmask(SIG_SETMASK, &this->oldsignalmask_, NULL);
     }
 
     /**
@@ -1122,6 +1207,63 @@ namespace watchdog
                     if (Watchdog::getInstance().getConfigValuesMap()["log"].as<bool>()) process.getLogStream() << " Restart delay: " << delay << " milliseconds" << std::endl;
                 }
             }
+            else if (argument[0] == 'w')
+            {
+                // cpu weight
+                if (argument.size() >= 2)
+                {
+                    std::istringstream iss(argument.substr(1, std::string::npos));
+                    int weight = 0;
+                    iss >> weight;
+                    process.setCpuWeight(weight);
+
+                    if (Watchdog::isVerbose())                                          std::cout << "    CPU weight: " << weight << std::endl;
+                    if (Watchdog::getInstance().getConfigValuesMap()["log"].as<bool>()) process.getLogStream() << " CPU weight: " << weight << std::endl;
+                }
+            }
+            else if (argument[0] == 'q')
+            {
+                // cpu quota
+                if (argument.size() >= 2)
+                {
+                    std::istringstream iss(argument.substr(1, std::string::npos));
+                    int quota = 0;
+                    iss >> quota;
+                    process.setCpuQuota(quota);
+
+                    if (Watchdog::isVerbose())                                          std::cout << "    CPU quota: " << quota << " percent" << std::endl;
+                    if (Watchdog::getInstance().getConfigValuesMap()["log"].as<bool>()) process.getLogStream() << " CPU quota: " << quota << " percent" << std::endl;
+                }
+            }
+            else if (argument[0] == 'l')
+            {
+                // memory limit
+                if (argument.size() >= 2)
+                {
+                    std::istringstream iss(argument.substr(1, std::string::npos));
+                    float limit = 0;
+                    iss >> limit;
+                    process.setMemoryLimit(limit * 1024 * 1024);
+
+                    if (Watchdog::isVerbose())                                          std::cout << "    Memory limit: " << limit << " megabytes" << std::endl;
+                    if (Watchdog::getInstance().getConfigValuesMap()["log"].as<bool>()) process.getLogStream() << " Memory limit: " << limit << " megabytes" << std::endl;
+                }
+            }
+            else if (argument[0] == 'p')
+            {
+                // cpu affinity, a comma separated list of cpus
+                std::istringstream iss(argument.substr(1, std::string::npos));
+                std::string cpu;
+                while (std::getline(iss, cpu, ','))
+                {
+                    int number = atoi(cpu.c_str());
+                    if (number >= 0 && number < CPU_SETSIZE)
+                        process.addCpuAffinity(number);
+                }
+
+                if (Watchdog::isVerbose())                                          std::cout << "    CPU affinity: " << argument.substr(1, std::string::npos) << std::endl;
+                if (Watchdog::getInstance().getConfigValuesMap()["log"].as<bool>()) process.getLogStream() << " CPU affinity: " << argument.substr(1, std::string::npos) << std::endl;
+            }
             else if (argument[0] == 'm')
             {
                 // mute
@@ -1160,35 +1302,6 @@ namespace watchdog
             line.erase(0, 1);
     }
 
-    /**
-        @brief Returns a vector with pointers to each start of a line in a text. '\\n' characters are replaced by '\\0' to allow line-by-line output.
-
-        @param text The input text (with multiple lines).
-        @return A vector with pointers to the start character of each line
-    */
-    /* static */
-    std::vector<char*> Watchdog::splitLines(char* text)
-    {
-        std::vector<char*> output;
-        output.push_back(&text[0]);
-
-        unsigned int i = 0;
-        while (text[i] != '\0')
-        {
-            if (text[i] == '\n')
-            {
-                text[i] = '\0';
-
-                if (text[i+1] != '\0')
-                    output.push_back(&text[i+1]);
-            }
-
-            ++i;
-        }
-
-        return output;
-    }
-
     const Process& Watchdog::getProcessByCode(uint16_t code) const throw(std::invalid_argument)
     {
         if (code < this->processes_.size())
@@ -1226,6 +1339,16 @@ namespace watchdog
         }
         throw (std::invalid_argument("no process with this filedescriptor"));
     }
+
+    Process& Watchdog::getProcessByFiledescriptor(int fd) throw(std::invalid_argument)
+    {
+        for (size_t i = 0; i < this->processes_.size(); ++i)
+        {
+            if (this->processes_[i]->getFiledescriptor() == fd)
+                return (*this->processes_[i]);
+        }
+        throw (std::invalid_argument("no process with this filedescriptor"));
+    }
 }
 }
 
@@ -33,7 +33,7 @@ This file is part of the MAVCONN project
 
 #include "mavconn.h"
 #include <boost/program_options.hpp>
-#include "timer/Timer.h"
+#include <signal.h>
 #include "Process.h"
 #include "Command.h"
 
@@ -62,15 +62,18 @@ This file is part of the MAVCONN project
 // If true, the watchdog exits if all processes have finished properly
 #define __WATCHDOG_AUTOEXIT_DEFAULTVALUE true
 
-// The sleeptime of the watchdog each tick in milliseconds
+// The sleeptime of the watchdog each tick in milliseconds (unused, the watchdog waits for events)
 #define __WATCHDOG_SLEEPTIME_DEFAULTVALUE 1
 
+// Time in milliseconds between two resource usage samples of each process, 0 disables the sampling
+#define __WATCHDOG_RESOURCES_INTERVAL_DEFAULTVALUE 1000
+
+// Directory of the cgroup v2 hierarchy in which processes with resource limits get their own cgroup, empty to disable
+#define __WATCHDOG_CGROUP_DEFAULTVALUE ""
+
 // The signalnumber used for the heartbeat signal
 #define __WATCHDOG_HEARTBEAT_SIGNAL SIGRTMIN+3
 
-// The signalnumber used for output callbacks
-#define __WATCHDOG_IO_SIGNAL SIGRTMIN+5
-
 // Print status and error messages to the console
 #define __WATCHDOG_VERBOSE_DEFAULTVALUE true
 
@@ -128,45 +131,52 @@ namespace MAVCONN
                     { return this->lcm_; }
 
                 static int HEARTBEAT_SIGNAL;
-                static int IO_SIGNAL;
 
             private:
                 Process& getProcessByPID(pid_t pid) throw(std::invalid_argument);
+                Process& getProcessByFiledescriptor(int fd) throw(std::invalid_argument);
 
                 void startProcess(Process& process);
                 void stopProcess(Process& process);
                 void handleChildExit(pid_t pid, int stat_loc);
 
+                uint64_t updateProcesses(uint64_t now);
+                void handleSignals(uint64_t now);
+                void readOutput(Process& process);
+                void printOutput(Process& process, const char* line);
+                void addToEventLoop(int fd);
+                void removeFromEventLoop(int fd);
+
+                void sampleResources(uint64_t now);
+                void setupCgroups();
+                void createCgroup(Process& process);
+                static bool writeCgroupFile(const std::string& path, const std::string& value);
+
                 void lcmConnect(const char* url = NULL);
                 void lcmDisconnect();
-                void lcmHandle();
 
                 static std::string getLogPath();
 
                 static std::string getClientExitDescription(int status, int signalnr, bool* normalexit = 0);
                 static std::string getSignalDescription(int signalnr);
 
-//                static void registerSigchldHandler();
-                static void registerHeartbeatHandler();
-                static void registerSigioHandler();
-                static void unregisterSignalHandler(int signalnr);
-
                 static std::string parseNameAndArguments(const std::string& commandline, std::string* name, std::vector<std::string>* arguments);
                 static void parseAdditionalArguments(Process& process, const std::string& arguments);
                 static void trimFront(std::string* line);
-                static std::vector<char*> splitLines(char* text);
-
-//                static void sigchldSignalHandler(int sig, siginfo_t* info, void* context);
-                static void heartbeatSignalHandler(int sig, siginfo_t* info, void* context);
-                static void sigioSignalHandler(int sig, siginfo_t* info, void* context);
 
                 std::vector<Process*> processes_;                   ///< All processes that should be managed by this watchdog
                 bool bExit_;                                        ///< If true, the program leaves the mainloop
-                Timer timer_;                                       ///< A timer to measure the running time of the processes
                 boost::program_options::variables_map vm_;          ///< The program options value map
                 lcm_t* lcm_;                                        ///< Lcm connection
                 mavconn_mavlink_msg_container_t_subscription_t* subscription_;    ///< Lcm message subscription
-                Timer heartbeatTimer_;                              ///< A timer used to wait some time between two heartbeat messages
+                uint64_t nextHeartbeat_;                            ///< Time of the next heartbeat message
+                uint64_t nextResourceSample_;                       ///< Time of the next resource usage sample
+
+                int epollfd_;                                       ///< Waits for all events of the mainloop
+                int signalfd_;                                      ///< Receives SIGCHLD and the heartbeat signal
+                int timerfd_;                                       ///< Expires at the next deadline of a process
+                sigset_t signalmask_;                               ///< Signals received through signalfd_
+                sigset_t oldsignalmask_;                            ///< Signal mask before registerSignalHandlers(), restored in the children
 
 
                 static Watchdog* instance_s;
@@ -0,0 +1,792 @@
+/*=====================================================================
+
+ PIXHAWK Micro Air Vehicle Flying Robotics Toolkit
+
+ (c) 2009, 2010 PIXHAWK PROJECT  <http://pixhawk.ethz.ch>
+
+ This file is part of the PIXHAWK project
+
+ PIXHAWK is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ PIXHAWK is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with PIXHAWK. If not, see <http://www.gnu.org/licenses/>.
+
+ ======================================================================*/
+
+/**
+ * @file
+ *   @brief Implementation of the chunked image log
+ *
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include "PxImageLog.h"
+
+#include <algorithm>
+#include <dirent.h>
+#include <map>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <zlib.h>
+#include <opencv2/highgui/highgui.hpp>
+
+#define PXIMAGELOG_RECORD_MAGIC 0x31524950	// "PIR1"
+#define PXIMAGELOG_FOOTER_MAGIC 0x31584950	// "PIX1"
+#define PXIMAGELOG_MANIFEST_MAGIC 0x314d4950	// "PIM1"
+
+enum
+{
+	CODEC_RAW = 0,
+	CODEC_ZLIB = 1
+};
+
+// O_DIRECT transfers must be aligned to the logical block size of the device
+static const size_t kAlignment = 4096;
+
+namespace
+{
+
+bool
+preadAll(int fd, void* data, size_t length, uint64_t offset)
+{
+	unsigned char* p = static_cast<unsigned char*>(data);
+	while (length > 0)
+	{
+		ssize_t n = pread(fd, p, length, offset);
+		if (n < 0 && errno == EINTR)
+		{
+			continue;
+		}
+		if (n <= 0)
+		{
+			return false;
+		}
+		p += n;
+		length -= n;
+		offset += n;
+	}
+	return true;
+}
+
+bool
+isValidRecord(const PxImageLogRecord& record)
+{
+	return record.magic == PXIMAGELOG_RECORD_MAGIC &&
+		   (record.codec == CODEC_RAW || record.codec == CODEC_ZLIB) &&
+		   record.rows > 0 && record.cols > 0;
+}
+
+bool
+compareFrames(const PxImageLogReader::Frame& a, const PxImageLogReader::Frame& b)
+{
+	return a.timestamp < b.timestamp;
+}
+
+bool
+compareEntries(const PxImageManifestEntry& a, const PxImageManifestEntry& b)
+{
+	return a.timestamp < b.timestamp;
+}
+
+std::string
+chunkName(int writer, int chunk)
+{
+	char name[64];
+	snprintf(name, sizeof(name), "chunk_%d_%06d" PXIMAGELOG_EXTENSION, writer, chunk);
+	return name;
+}
+
+std::string
+bitmapName(uint64_t timestamp)
+{
+	char name[64];
+	snprintf(name, sizeof(name), "%llu.bmp", (long long unsigned)timestamp);
+	return name;
+}
+
+struct PxImageManifestHeader
+{
+	uint32_t magic;
+	uint32_t entrySize;
+};
+
+}
+
+const uint16_t PxImageManifest::kBitmap;
+const uint32_t PxImageLogReader::kBitmap;
+
+PxImageManifest::PxImageManifest()
+ : fd(-1)
+{
+
+}
+
+PxImageManifest::~PxImageManifest()
+{
+	close();
+}
+
+bool
+PxImageManifest::open(const std::string& dir)
+{
+	close();
+
+	std::string path = dir + PXIMAGELOG_MANIFEST;
+	fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0644);
+	if (fd == -1)
+	{
+		fprintf(stderr, "# ERROR: Could not open image manifest %s: %s\n",
+				path.c_str(), strerror(errno));
+		return false;
+	}
+
+	PxImageManifestHeader header;
+	header.magic = PXIMAGELOG_MANIFEST_MAGIC;
+	header.entrySize = sizeof(PxImageManifestEntry);
+	if (::write(fd, &header, sizeof(header)) != sizeof(header))
+	{
+		close();
+		return false;
+	}
+
+	return true;
+}
+
+void
+PxImageManifest::close(void)
+{
+	if (fd != -1)
+	{
+		::close(fd);
+		fd = -1;
+	}
+}
+
+bool
+PxImageManifest::append(const PxImageManifestEntry& entry)
+{
+	return fd != -1 && ::write(fd, &entry, sizeof(entry)) == sizeof(entry);
+}
+
+bool
+PxImageManifest::load(const std::string& dir, std::vector<PxImageManifestEntry>& entries)
+{
+	entries.clear();
+
+	int fd = ::open((dir + PXIMAGELOG_MANIFEST).c_str(), O_RDONLY);
+	if (fd == -1)
+	{
+		return false;
+	}
+
+	struct stat st;
+	PxImageManifestHeader header;
+	if (fstat(fd, &st) != 0 || (uint64_t)st.st_size < sizeof(header) ||
+		!preadAll(fd, &header, sizeof(header), 0) ||
+		header.magic != PXIMAGELOG_MANIFEST_MAGIC ||
+		header.entrySize != sizeof(PxImageManifestEntry))
+	{
+		::close(fd);
+		return false;
+	}
+
+	// an entry cut off by the end of the recording is ignored
+	entries.resize((st.st_size - sizeof(header)) / sizeof(PxImageManifestEntry));
+	bool result = entries.empty() ||
+				  preadAll(fd, &entries[0], entries.size() * sizeof(PxImageManifestEntry), sizeof(header));
+	::close(fd);
+
+	if (!result)
+	{
+		entries.clear();
+		return false;
+	}
+
+	// the writer threads append in the order they finish their images
+	std::sort(entries.begin(), entries.end(), compareEntries);
+
+	return true;
+}
+
+PxImageLogWriter::PxImageLogWriter()
+ : writer(0)
+ , manifest(NULL)
+ , compress(false)
+ , direct(true)
+ , chunkSize(0)
+ , fd(-1)
+ , chunkNo(0)
+ , chunkOffset(0)
+ , bytesWritten(0)
+ , buffer(NULL)
+ , kBufferSize(4 * 1024 * 1024)
+ , bufferUsed(0)
+{
+
+}
+
+PxImageLogWriter::~PxImageLogWriter()
+{
+	close();
+	free(buffer);
+}
+
+bool
+PxImageLogWriter::open(const std::string& dir, int writer, PxImageManifest* manifest,
+					   bool compress, uint64_t chunkSize, bool direct)
+{
+	close();
+
+	if (buffer == NULL)
+	{
+		void* p = NULL;
+		if (posix_memalign(&p, kAlignment, kBufferSize) != 0)
+		{
+			fprintf(stderr, "# ERROR: Could not allocate image log buffer\n");
+			return false;
+		}
+		buffer = static_cast<unsigned char*>(p);
+	}
+
+	this->dir = dir;
+	this->writer = writer;
+	this->manifest = manifest;
+	this->compress = compress;
+	this->chunkSize = chunkSize;
+	this->direct = direct;
+	chunkNo = 0;
+
+	return openChunk();
+}
+
+bool
+PxImageLogWriter::isOpen(void) const
+{
+	return fd != -1;
+}
+
+void
+PxImageLogWriter::close(void)
+{
+	if (fd != -1)
+	{
+		closeChunk();
+	}
+}
+
+bool
+PxImageLogWriter::write(uint64_t timestamp, const cv::Mat& img)
+{
+	if (fd == -1)
+	{
+		return false;
+	}
+
+	const unsigned char* data = img.data;
+	size_t rowSize = img.cols * img.elemSize();
+	size_t dataSize = rowSize * img.rows;
+	if (!img.isContinuous())
+	{
+		pixels.resize(dataSize);
+		for (int r = 0; r < img.rows; ++r)
+		{
+			memcpy(&pixels[r * rowSize], img.ptr(r), rowSize);
+		}
+		data = &pixels[0];
+	}
+
+	PxImageLogRecord record;
+	record.magic = PXIMAGELOG_RECORD_MAGIC;
+	record.codec = CODEC_RAW;
+	record.timestamp = timestamp;
+	record.rows = img.rows;
+	record.cols = img.cols;
+	record.type = img.type();
+	record.dataSize = dataSize;
+
+	if (compress)
+	{
+		uLongf zsize = compressBound(dataSize);
+		zbuffer.resize(zsize);
+		// fastest level, the writer has to keep up with the camera
+		if (compress2(&zbuffer[0], &zsize, data, dataSize, 1) == Z_OK &&
+			zsize < dataSize)
+		{
+			record.codec = CODEC_ZLIB;
+			record.dataSize = zsize;
+			data = &zbuffer[0];
+		}
+	}
+
+	uint64_t recordSize = sizeof(record) + record.dataSize;
+	if (!index.empty() && chunkOffset + recordSize > chunkSize)
+	{
+		if (!closeChunk() || !openChunk())
+		{
+			return false;
+		}
+	}
+
+	PxImageLogEntry entry;
+	entry.timestamp = timestamp;
+	entry.offset = chunkOffset;
+	entry.size = recordSize;
+	entry.reserved = 0;
+
+	if (!append(&record, sizeof(record)) || !append(data, record.dataSize))
+	{
+		return false;
+	}
+	index.push_back(entry);
+
+	if (manifest != NULL)
+	{
+		PxImageManifestEntry manifestEntry;
+		manifestEntry.timestamp = timestamp;
+		manifestEntry.offset = entry.offset;
+		manifestEntry.size = entry.size;
+		manifestEntry.writer = writer;
+		manifestEntry.chunk = chunkNo - 1;
+		manifest->append(manifestEntry);
+	}
+
+	return true;
+}
+
+uint64_t
+PxImageLogWriter::getBytesWritten(void) const
+{
+	return bytesWritten;
+}
+
+bool
+PxImageLogWriter::openChunk(void)
+{
+	std::string path = dir + chunkName(writer, chunkNo++);
+
+	int flags = O_WRONLY | O_CREAT | O_TRUNC;
+	fd = -1;
+	if (direct)
+	{
+		fd = ::open(path.c_str(), flags | O_DIRECT, 0644);
+	}
+	if (fd == -1)
+	{
+		// not every file system supports O_DIRECT (e.g. tmpfs)
+		fd = ::open(path.c_str(), flags, 0644);
+	}
+	if (fd == -1)
+	{
+		fprintf(stderr, "# ERROR: Could not open image log %s: %s\n",
+				path.c_str(), strerror(errno));
+		return false;
+	}
+
+	// reserve the chunk up front so that it does not fragment while growing
+	if (fallocate(fd, FALLOC_FL_KEEP_SIZE, 0, chunkSize) != 0 &&
+		errno != EOPNOTSUPP)
+	{
+		fprintf(stderr, "# WARNING: Could not preallocate image log %s: %s\n",
+				path.c_str(), strerror(errno));
+	}
+
+	chunkOffset = 0;
+	bufferUsed = 0;
+	index.clear();
+
+	return true;
+}
+
+bool
+PxImageLogWriter::closeChunk(void)
+{
+	PxImageLogFooter footer;
+	footer.indexOffset = chunkOffset;
+	footer.count = index.size();
+	footer.magic = PXIMAGELOG_FOOTER_MAGIC;
+
+	bool result = true;
+	if (!index.empty())
+	{
+		result = append(&index[0], index.size() * sizeof(PxImageLogEntry));
+	}
+	result = result && append(&footer, sizeof(footer));
+
+	// the last block is padded for O_DIRECT and cut back to size afterwards
+	if (result && bufferUsed > 0)
+	{
+		size_t padded = (bufferUsed + kAlignment - 1) / kAlignment * kAlignment;
+		memset(buffer + bufferUsed, 0, padded - bufferUsed);
+		result = writeBuffer(padded);
+	}
+	if (result && ftruncate(fd, chunkOffset) != 0)
+	{
+		fprintf(stderr, "# ERROR: Could not truncate image log: %s\n", strerror(errno));
+		result = false;
+	}
+
+	::close(fd);
+	fd = -1;
+	bufferUsed = 0;
+	index.clear();
+
+	return result;
+}
+
+bool
+PxImageLogWriter::append(const void* data, size_t length)
+{
+	const unsigned char* p = static_cast<const unsigned char*>(data);
+	while (length > 0)
+	{
+		size_t n = std::min(length, kBufferSize - bufferUsed);
+		memcpy(buffer + bufferUsed, p, n);
+		bufferUsed += n;
+		chunkOffset += n;
+		p += n;
+		length -= n;
+
+		if (bufferUsed == kBufferSize && !writeBuffer(kBufferSize))
+		{
+			return false;
+		}
+	}
+	return true;
+}
+
+bool
+PxImageLogWriter::writeBuffer(size_t length)
+{
+	// the buffer always starts at a multiple of its size in the file
+	uint64_t offset = chunkOffset - bufferUsed;
+	size_t done = 0;
+	while (done < length)
+	{
+		ssize_t n = pwrite(fd, buffer + done, length - done, offset + done);
+		if (n < 0 && errno == EINTR)
+		{
+			continue;
+		}
+		if (n < 0 && errno == EINVAL && (fcntl(fd, F_GETFL) & O_DIRECT))
+		{
+			// the file system accepted O_DIRECT at open, but not the write
+			fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_DIRECT);
+			continue;
+		}
+		if (n <= 0)
+		{
+			fprintf(stderr, "# ERROR: Could not write image log: %s\n", strerror(errno));
+			return false;
+		}
+		done += n;
+	}
+
+	bytesWritten += std::min(length, bufferUsed);
+	bufferUsed = 0;
+
+	return true;
+}
+
+PxImageLogReader::PxImageLogReader()
+{
+
+}
+
+PxImageLogReader::~PxImageLogReader()
+{
+	close();
+}
+
+bool
+PxImageLogReader::open(const std::string& dir)
+{
+	close();
+
+	this->dir = dir;
+	if (!this->dir.empty() && this->dir[this->dir.size() - 1] != '/')
+	{
+		this->dir += "/";
+	}
+
+	if (!loadManifest())
+	{
+		scanDirectory();
+		std::stable_sort(frames.begin(), frames.end(), compareFrames);
+	}
+
+	return !frames.empty();
+}
+
+void
+PxImageLogReader::close(void)
+{
+	for (size_t i = 0; i < fds.size(); ++i)
+	{
+		::close(fds[i]);
+	}
+	fds.clear();
+	frames.clear();
+	dir.clear();
+}
+
+const std::vector<PxImageLogReader::Frame>&
+PxImageLogReader::getFrames(void) const
+{
+	return frames;
+}
+
+bool
+PxImageLogReader::read(const Frame& frame, cv::Mat& img) const
+{
+	if (frame.chunk == kBitmap)
+	{
+		img = cv::imread(dir + bitmapName(frame.timestamp), -1);
+		return img.data != NULL;
+	}
+
+	if (frame.chunk >= fds.size() || frame.size < sizeof(PxImageLogRecord))
+	{
+		return false;
+	}
+	int fd = fds[frame.chunk];
+
+	PxImageLogRecord record;
+	if (!preadAll(fd, &record, sizeof(record), frame.offset) ||
+		!isValidRecord(record) ||
+		sizeof(record) + record.dataSize > frame.size)
+	{
+		return false;
+	}
+
+	img.create(record.rows, record.cols, record.type);
+	size_t imgSize = img.total() * img.elemSize();
+	uint64_t dataOffset = frame.offset + sizeof(record);
+
+	if (record.codec == CODEC_ZLIB)
+	{
+		std::vector<unsigned char> data(record.dataSize);
+		uLongf size = imgSize;
+		if (!preadAll(fd, &data[0], record.dataSize, dataOffset) ||
+			uncompress(img.data, &size, &data[0], record.dataSize) != Z_OK ||
+			size != imgSize)
+		{
+			return false;
+		}
+	}
+	else
+	{
+		// raw pixels go straight into the image
+		if (record.dataSize != imgSize ||
+			!preadAll(fd, img.data, imgSize, dataOffset))
+		{
+			return false;
+		}
+	}
+
+	return true;
+}
+
+bool
+PxImageLogReader::loadManifest(void)
+{
+	std::vector<PxImageManifestEntry> entries;
+	if (!PxImageManifest::load(dir, entries))
+	{
+		return false;
+	}
+
+	// chunk files are opened once, in the order they are referenced
+	std::map<uint32_t, uint32_t> chunks;
+	std::vector<uint64_t> chunkSizes;
+	frames.reserve(entries.size());
+	for (size_t i = 0; i < entries.size(); ++i)
+	{
+		const PxImageManifestEntry& entry = entries[i];
+
+		Frame frame;
+		frame.timestamp = entry.timestamp;
+		frame.size = entry.size;
+		frame.offset = entry.offset;
+
+		if (entry.writer == PxImageManifest::kBitmap)
+		{
+			frame.chunk = kBitmap;
+		}
+		else
+		{
+			uint32_t key = ((uint32_t)entry.writer << 16) | entry.chunk;
+			std::map<uint32_t, uint32_t>::iterator it = chunks.find(key);
+			if (it == chunks.end())
+			{
+				std::string path = dir + chunkName(entry.writer, entry.chunk);
+				int fd = ::open(path.c_str(), O_RDONLY);
+				struct stat st;
+				if (fd == -1 || fstat(fd, &st) != 0)
+				{
+					fprintf(stderr, "# WARNING: Could not open image log %s: %s\n",
+							path.c_str(), strerror(errno));
+					if (fd != -1)
+					{
+						::close(fd);
+						fd = -1;
+					}
+				}
+				else
+				{
+					fds.push_back(fd);
+					chunkSizes.push_back(st.st_size);
+				}
+				it = chunks.insert(std::make_pair(key, fd == -1 ? kBitmap : fds.size() - 1)).first;
+			}
+			if (it->second == kBitmap)
+			{
+				// chunk file is missing
+				continue;
+			}
+			if (entry.offset + entry.size > chunkSizes[it->second])
+			{
+				// listed, but still in the write buffer when the recording ended
+				continue;
+			}
+			frame.chunk = it->second;
+		}
+
+		frames.push_back(frame);
+	}
+
+	return true;
+}
+
+void
+PxImageLogReader::scanDirectory(void)
+{
+	DIR* d = opendir(dir.c_str());
+	if (d == NULL)
+	{
+		return;
+	}
+
+	std::vector<std::string> chunkNames;
+	size_t extLength = strlen(PXIMAGELOG_EXTENSION);
+	struct dirent* ent;
+	while ((ent = readdir(d)) != NULL)
+	{
+		std::string name = ent->d_name;
+		if (name.size() > extLength &&
+			name.compare(name.size() - extLength, extLength, PXIMAGELOG_EXTENSION) == 0)
+		{
+			chunkNames.push_back(name);
+		}
+		else if (name.size() > 4 && name.compare(name.size() - 4, 4, ".bmp") == 0)
+		{
+			Frame frame;
+			frame.timestamp = strtoull(name.c_str(), NULL, 10);
+			frame.chunk = kBitmap;
+			frame.size = 0;
+			frame.offset = 0;
+			frames.push_back(frame);
+		}
+	}
+	closedir(d);
+
+	std::sort(chunkNames.begin(), chunkNames.end());
+
+	for (size_t i = 0; i < chunkNames.size(); ++i)
+	{
+		int fd = ::open((dir + chunkNames[i]).c_str(), O_RDONLY);
+		if (fd == -1)
+		{
+			fprintf(stderr, "# WARNING: Could not open image log %s%s: %s\n",
+					dir.c_str(), chunkNames[i].c_str(), strerror(errno));
+			continue;
+		}
+		fds.push_back(fd);
+		loadChunk(fds.size() - 1);
+	}
+}
+
+bool
+PxImageLogReader::loadChunk(uint32_t chunk)
+{
+	int fd = fds[chunk];
+
+	struct stat st;
+	if (fstat(fd, &st) != 0)
+	{
+		return false;
+	}
+	uint64_t fileSize = st.st_size;
+
+	PxImageLogFooter footer;
+	if (fileSize < sizeof(footer) ||
+		!preadAll(fd, &footer, sizeof(footer), fileSize - sizeof(footer)) ||
+		footer.magic != PXIMAGELOG_FOOTER_MAGIC ||
+		footer.indexOffset + footer.count * sizeof(PxImageLogEntry) + sizeof(footer) != fileSize)
+	{
+		return scanChunk(chunk, fileSize);
+	}
+
+	std::vector<PxImageLogEntry> index(footer.count);
+	if (footer.count > 0 &&
+		!preadAll(fd, &index[0], footer.count * sizeof(PxImageLogEntry), footer.indexOffset))
+	{
+		return scanChunk(chunk, fileSize);
+	}
+
+	for (size_t i = 0; i < index.size(); ++i)
+	{
+		Frame frame;
+		frame.timestamp = index[i].timestamp;
+		frame.chunk = chunk;
+		frame.size = index[i].size;
+		frame.offset = index[i].offset;
+		frames.push_back(frame);
+	}
+
+	return true;
+}
+
+bool
+PxImageLogReader::scanChunk(uint32_t chunk, uint64_t fileSize)
+{
+	// recover the records of a chunk that was not closed properly
+	size_t count = 0;
+	uint64_t offset = 0;
+	PxImageLogRecord record;
+	while (offset + sizeof(record) <= fileSize &&
+		   preadAll(fds[chunk], &record, sizeof(record), offset) &&
+		   isValidRecord(record) &&
+		   offset + sizeof(record) + record.dataSize <= fileSize)
+	{
+		Frame frame;
+		frame.timestamp = record.timestamp;
+		frame.chunk = chunk;
+		frame.size = sizeof(record) + record.dataSize;
+		frame.offset = offset;
+		frames.push_back(frame);
+
+		offset += frame.size;
+		++count;
+	}
+
+	fprintf(stderr, "# WARNING: Image log chunk %u has no index, recovered %zu images\n",
+			chunk, count);
+
+	return count > 0;
+}
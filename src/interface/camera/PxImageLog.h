@@ -0,0 +1,212 @@
+/*=====================================================================
+
+ PIXHAWK Micro Air Vehicle Flying Robotics Toolkit
+
+ (c) 2009, 2010 PIXHAWK PROJECT  <http://pixhawk.ethz.ch>
+
+ This file is part of the PIXHAWK project
+
+ PIXHAWK is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ PIXHAWK is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with PIXHAWK. If not, see <http://www.gnu.org/licenses/>.
+
+ ======================================================================*/
+
+/**
+ * @file
+ *   @brief Definition of the chunked image log
+ *
+ *   Images are appended to large chunk files instead of being written as
+ *   one file each. A chunk file is a sequence of records (header and pixel
+ *   data, optionally zlib compressed), followed by an index of all records
+ *   and a footer pointing to the index:
+ *
+ *   | record 0 | record 1 | ... | index entries | footer |
+ *
+ *   A chunk that was not closed (e.g. after a power loss) has no index;
+ *   the reader then recovers the records by walking the record headers.
+ *
+ *   Every image folder also gets a manifest, which lists the images of all
+ *   chunk files (or the bitmap files of the old layout) in one file, so
+ *   that a reader finds them with a single read instead of walking the
+ *   folder and the chunk indexes.
+ *
+ */
+
+#ifndef PXIMAGELOG_H
+#define PXIMAGELOG_H
+
+#include <inttypes.h>
+#include <string>
+#include <vector>
+#include <opencv2/core/core.hpp>
+
+#define PXIMAGELOG_EXTENSION ".pxlog"
+#define PXIMAGELOG_MANIFEST "images.manifest"
+
+struct PxImageLogRecord
+{
+	uint32_t magic;
+	uint32_t codec;			///< 0: raw pixels, 1: zlib
+	uint64_t timestamp;
+	int32_t rows;
+	int32_t cols;
+	int32_t type;			///< OpenCV matrix type
+	uint32_t dataSize;		///< bytes following the header
+};
+
+struct PxImageLogEntry
+{
+	uint64_t timestamp;
+	uint64_t offset;		///< position of the record header in the chunk
+	uint32_t size;			///< record size including the header
+	uint32_t reserved;
+};
+
+struct PxImageLogFooter
+{
+	uint64_t indexOffset;
+	uint32_t count;
+	uint32_t magic;
+};
+
+struct PxImageManifestEntry
+{
+	uint64_t timestamp;
+	uint64_t offset;		///< of the record in the chunk file
+	uint32_t size;			///< of the record
+	uint16_t writer;		///< chunk file chunk_<writer>_<chunk>.pxlog
+	uint16_t chunk;
+};
+
+/**
+ * @brief Lists the images written to a folder
+ *
+ * Entries are appended with one write() to a file opened with O_APPEND,
+ * so several writer threads can share a manifest, and an interrupted
+ * recording loses at most the entry being written.
+ */
+class PxImageManifest
+{
+public:
+	// writer of the entries for bitmap files, named <timestamp>.bmp
+	static const uint16_t kBitmap = 0xFFFF;
+
+	PxImageManifest();
+	~PxImageManifest();
+
+	bool open(const std::string& dir);
+	void close(void);
+
+	bool append(const PxImageManifestEntry& entry);
+
+	// the entries of the manifest in dir, sorted by timestamp
+	static bool load(const std::string& dir, std::vector<PxImageManifestEntry>& entries);
+
+private:
+	int fd;
+};
+
+/**
+ * @brief Appends images to a series of chunk files
+ *
+ * Chunks are named chunk_<writer>_NNNNNN.pxlog. Data is staged in an aligned
+ * buffer and written in large blocks, with O_DIRECT where the file system
+ * supports it, into space preallocated with fallocate(). An instance is
+ * not thread-safe; use one per writer thread.
+ */
+class PxImageLogWriter
+{
+public:
+	PxImageLogWriter();
+	~PxImageLogWriter();
+
+	// every image written is added to the manifest, if there is one
+	bool open(const std::string& dir, int writer, PxImageManifest* manifest,
+			  bool compress, uint64_t chunkSize, bool direct = true);
+	bool isOpen(void) const;
+	void close(void);
+
+	bool write(uint64_t timestamp, const cv::Mat& img);
+
+	uint64_t getBytesWritten(void) const;
+
+private:
+	bool openChunk(void);
+	bool closeChunk(void);
+	bool append(const void* data, size_t length);
+	bool writeBuffer(size_t length);
+
+	std::string dir;
+	int writer;
+	PxImageManifest* manifest;
+	bool compress;
+	bool direct;
+	uint64_t chunkSize;
+
+	int fd;
+	int chunkNo;
+	uint64_t chunkOffset;		///< logical size of the current chunk
+	uint64_t bytesWritten;
+
+	unsigned char* buffer;
+	const size_t kBufferSize;
+	size_t bufferUsed;
+
+	std::vector<PxImageLogEntry> index;
+	std::vector<unsigned char> pixels;
+	std::vector<unsigned char> zbuffer;
+};
+
+/**
+ * @brief Reads the images of a folder
+ *
+ * The images are taken from the manifest of the folder. Without one, the
+ * folder is searched for chunk files and bitmap files.
+ */
+class PxImageLogReader
+{
+public:
+	struct Frame
+	{
+		uint64_t timestamp;
+		uint32_t chunk;		///< kBitmap for a bitmap file
+		uint32_t size;
+		uint64_t offset;
+	};
+
+	static const uint32_t kBitmap = 0xFFFFFFFF;
+
+	PxImageLogReader();
+	~PxImageLogReader();
+
+	// frames are sorted by timestamp
+	bool open(const std::string& dir);
+	void close(void);
+
+	const std::vector<Frame>& getFrames(void) const;
+
+	// may be called from several threads at once
+	bool read(const Frame& frame, cv::Mat& img) const;
+
+private:
+	bool loadManifest(void);
+	void scanDirectory(void);
+	bool loadChunk(uint32_t chunk);
+	bool scanChunk(uint32_t chunk, uint64_t fileSize);
+
+	std::string dir;
+	std::vector<int> fds;
+	std::vector<Frame> frames;
+};
+
+#endif
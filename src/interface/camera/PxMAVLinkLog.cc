@@ -0,0 +1,413 @@
+/*=====================================================================
+
+ PIXHAWK Micro Air Vehicle Flying Robotics Toolkit
+
+ (c) 2009, 2010 PIXHAWK PROJECT  <http://pixhawk.ethz.ch>
+
+ This file is part of the PIXHAWK project
+
+ PIXHAWK is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ PIXHAWK is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with PIXHAWK. If not, see <http://www.gnu.org/licenses/>.
+
+ ======================================================================*/
+
+/**
+ * @file
+ *   @brief Implementation of the indexed MAVLink log
+ *
+ */
+
+#include "PxMAVLinkLog.h"
+
+#include <algorithm>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define PXMAVLINKLOG_FOOTER_MAGIC 0x4c4d5850	// "PXML"
+#define PXMAVLINKLOG_VERSION 1
+
+// timestamp and message, padded to the longest message
+static const size_t kRecordSize = sizeof(uint64_t) + MAVLINK_MAX_PACKET_LEN;
+
+// position of the message id and the payload in a record
+static const size_t kMsgIdOffset = sizeof(uint64_t) + 5;
+static const size_t kPayloadOffset = sizeof(uint64_t) + 6;
+
+// read ahead after a seek
+static const size_t kReadAhead = 16 * 1024 * 1024;
+
+namespace
+{
+
+bool
+compareTimestamp(uint64_t timestamp, const PxMAVLinkLogIndexEntry& entry)
+{
+	return timestamp < entry.timestamp;
+}
+
+}
+
+PxMAVLinkLogWriter::PxMAVLinkLogWriter()
+ : offset(0)
+ , recordCount(0)
+ , kBlockSize(256)
+{
+
+}
+
+PxMAVLinkLogWriter::~PxMAVLinkLogWriter()
+{
+	close();
+}
+
+bool
+PxMAVLinkLogWriter::open(const std::string& filename)
+{
+	close();
+
+	file.open(filename.c_str(), std::ios::binary | std::ios::out);
+	if (!file)
+	{
+		fprintf(stderr, "# ERROR: Could not open MAVLink log %s\n", filename.c_str());
+		return false;
+	}
+
+	offset = 0;
+	recordCount = 0;
+	index.clear();
+
+	return true;
+}
+
+bool
+PxMAVLinkLogWriter::isOpen(void) const
+{
+	return file.is_open();
+}
+
+void
+PxMAVLinkLogWriter::close(void)
+{
+	if (!file.is_open())
+	{
+		return;
+	}
+
+	PxMAVLinkLogFooter footer;
+	footer.indexOffset = offset;
+	footer.count = index.size();
+	footer.blockSize = kBlockSize;
+	footer.version = PXMAVLINKLOG_VERSION;
+	footer.magic = PXMAVLINKLOG_FOOTER_MAGIC;
+
+	if (!index.empty())
+	{
+		file.write(reinterpret_cast<const char*>(&index[0]),
+				   index.size() * sizeof(PxMAVLinkLogIndexEntry));
+	}
+	file.write(reinterpret_cast<const char*>(&footer), sizeof(footer));
+	file.close();
+
+	index.clear();
+}
+
+bool
+PxMAVLinkLogWriter::write(uint64_t timestamp, const mavlink_message_t* msg,
+						  const int8_t* extendedPayload, uint32_t extendedPayloadLength)
+{
+	if (!file.is_open())
+	{
+		return false;
+	}
+
+	if (recordCount % kBlockSize == 0)
+	{
+		PxMAVLinkLogIndexEntry entry;
+		entry.timestamp = timestamp;
+		entry.offset = offset;
+		memset(entry.msgids, 0, sizeof(entry.msgids));
+		index.push_back(entry);
+	}
+	index.back().msgids[msg->msgid / 8] |= 1 << (msg->msgid % 8);
+
+	uint8_t buf[kRecordSize];
+	memset(buf, 0, sizeof(buf));
+	memcpy(buf, &timestamp, sizeof(uint64_t));
+	mavlink_msg_to_send_buffer(buf + sizeof(uint64_t), msg);
+	file.write(reinterpret_cast<char*>(buf), kRecordSize);
+	offset += kRecordSize;
+
+	if (extendedPayloadLength > 0)
+	{
+		file.write(reinterpret_cast<const char*>(extendedPayload), extendedPayloadLength);
+		offset += extendedPayloadLength;
+	}
+
+	++recordCount;
+
+	return file.good();
+}
+
+PxMAVLinkLogReader::PxMAVLinkLogReader()
+ : data(NULL)
+ , size(0)
+ , endOffset(0)
+ , offset(0)
+ , block(0)
+ , filtered(false)
+ , record(NULL)
+ , recordPayloadLength(0)
+{
+	memset(filter, 0, sizeof(filter));
+}
+
+PxMAVLinkLogReader::~PxMAVLinkLogReader()
+{
+	close();
+}
+
+bool
+PxMAVLinkLogReader::open(const std::string& filename)
+{
+	close();
+
+	int fd = ::open(filename.c_str(), O_RDONLY);
+	if (fd == -1)
+	{
+		return false;
+	}
+
+	struct stat st;
+	if (fstat(fd, &st) != 0)
+	{
+		::close(fd);
+		return false;
+	}
+	size = st.st_size;
+
+	if (size > 0)
+	{
+		void* p = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (p == MAP_FAILED)
+		{
+			fprintf(stderr, "# ERROR: Could not map MAVLink log %s: %s\n",
+					filename.c_str(), strerror(errno));
+			::close(fd);
+			size = 0;
+			return false;
+		}
+		data = static_cast<const uint8_t*>(p);
+		madvise(p, size, MADV_SEQUENTIAL);
+	}
+	::close(fd);
+
+	endOffset = size;
+
+	PxMAVLinkLogFooter footer;
+	if (size >= sizeof(footer))
+	{
+		memcpy(&footer, data + size - sizeof(footer), sizeof(footer));
+
+		if (footer.magic == PXMAVLINKLOG_FOOTER_MAGIC &&
+			footer.version == PXMAVLINKLOG_VERSION &&
+			footer.indexOffset + (uint64_t)footer.count * sizeof(PxMAVLinkLogIndexEntry) +
+			sizeof(footer) == size)
+		{
+			index.resize(footer.count);
+			if (footer.count > 0)
+			{
+				memcpy(&index[0], data + footer.indexOffset,
+					   footer.count * sizeof(PxMAVLinkLogIndexEntry));
+			}
+			endOffset = footer.indexOffset;
+		}
+	}
+
+	offset = 0;
+	block = 0;
+
+	return true;
+}
+
+void
+PxMAVLinkLogReader::close(void)
+{
+	if (data != NULL)
+	{
+		munmap(const_cast<uint8_t*>(data), size);
+		data = NULL;
+	}
+	size = 0;
+	index.clear();
+	endOffset = 0;
+	offset = 0;
+	block = 0;
+}
+
+bool
+PxMAVLinkLogReader::hasIndex(void) const
+{
+	return !index.empty();
+}
+
+void
+PxMAVLinkLogReader::setFilter(const std::vector<uint8_t>& msgids)
+{
+	memset(filter, 0, sizeof(filter));
+	for (size_t i = 0; i < msgids.size(); ++i)
+	{
+		filter[msgids[i] / 8] |= 1 << (msgids[i] % 8);
+	}
+	filtered = !msgids.empty();
+}
+
+bool
+PxMAVLinkLogReader::seek(uint64_t timestamp)
+{
+	offset = 0;
+	block = 0;
+
+	if (!index.empty())
+	{
+		// last block starting before the timestamp
+		std::vector<PxMAVLinkLogIndexEntry>::const_iterator it =
+			std::upper_bound(index.begin(), index.end(), timestamp, compareTimestamp);
+		if (it != index.begin())
+		{
+			--it;
+		}
+		block = it - index.begin();
+		offset = it->offset;
+	}
+
+	// find the record within the block, or in the whole log without index
+	while (readRecord())
+	{
+		uint64_t recordTimestamp;
+		memcpy(&recordTimestamp, record, sizeof(uint64_t));
+		if (recordTimestamp >= timestamp)
+		{
+			// reading continues from here, not from the start of the log
+			uint64_t page = offset & ~(uint64_t)(sysconf(_SC_PAGESIZE) - 1);
+			madvise(const_cast<uint8_t*>(data) + page,
+					std::min(size - page, (uint64_t)kReadAhead), MADV_WILLNEED);
+			return true;
+		}
+
+		offset += kRecordSize + recordPayloadLength;
+	}
+
+	return false;
+}
+
+bool
+PxMAVLinkLogReader::read(uint64_t& timestamp, mavlink_message_t& msg,
+						 const int8_t*& extendedPayload, uint32_t& extendedPayloadLength)
+{
+	while (true)
+	{
+		if (filtered && !index.empty())
+		{
+			while (block + 1 < index.size() && offset >= index[block + 1].offset)
+			{
+				++block;
+			}
+			if (!blockMatchesFilter(block))
+			{
+				if (!skipToNextBlock())
+				{
+					return false;
+				}
+				continue;
+			}
+		}
+
+		if (!readRecord())
+		{
+			return false;
+		}
+		offset += kRecordSize + recordPayloadLength;
+
+		uint8_t msgid = record[kMsgIdOffset];
+		if (filtered && !(filter[msgid / 8] & (1 << (msgid % 8))))
+		{
+			continue;
+		}
+
+		memcpy(&timestamp, record, sizeof(uint64_t));
+		memcpy(&(msg.magic), record + sizeof(uint64_t), MAVLINK_MAX_PACKET_LEN);
+
+		extendedPayload = reinterpret_cast<const int8_t*>(record + kRecordSize);
+		extendedPayloadLength = recordPayloadLength;
+
+		return true;
+	}
+}
+
+bool
+PxMAVLinkLogReader::readRecord(void)
+{
+	if (offset + kRecordSize > endOffset)
+	{
+		return false;
+	}
+
+	record = data + offset;
+
+	recordPayloadLength = 0;
+	if (record[kMsgIdOffset] == MAVLINK_MSG_ID_EXTENDED_MESSAGE)
+	{
+		// the extended header starts with 3 bytes, followed by the length
+		memcpy(&recordPayloadLength, record + kPayloadOffset + 3, sizeof(uint32_t));
+		if (offset + kRecordSize + recordPayloadLength > endOffset)
+		{
+			// truncated log
+			return false;
+		}
+	}
+
+	return true;
+}
+
+bool
+PxMAVLinkLogReader::skipToNextBlock(void)
+{
+	if (block + 1 >= index.size())
+	{
+		offset = endOffset;
+		return false;
+	}
+
+	++block;
+	offset = index[block].offset;
+
+	return true;
+}
+
+bool
+PxMAVLinkLogReader::blockMatchesFilter(size_t block) const
+{
+	for (size_t i = 0; i < sizeof(filter); ++i)
+	{
+		if (index[block].msgids[i] & filter[i])
+		{
+			return true;
+		}
+	}
+	return false;
+}
@@ -0,0 +1,146 @@
+/*=====================================================================
+
+ PIXHAWK Micro Air Vehicle Flying Robotics Toolkit
+
+ (c) 2009, 2010 PIXHAWK PROJECT  <http://pixhawk.ethz.ch>
+
+ This file is part of the PIXHAWK project
+
+ PIXHAWK is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ PIXHAWK is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with PIXHAWK. If not, see <http://www.gnu.org/licenses/>.
+
+ ======================================================================*/
+
+/**
+ * @file
+ *   @brief Definition of the indexed MAVLink log
+ *
+ *   A MAVLink log (*.mavlink) is a sequence of records. Every record is a
+ *   receive timestamp (8 bytes) and the message as sent on the wire,
+ *   padded to MAVLINK_MAX_PACKET_LEN. Extended messages are followed by
+ *   their extended payload.
+ *
+ *   When the log is closed, a sparse index is appended behind the records:
+ *   one entry per block of records with the timestamp and file offset of
+ *   its first record and the set of message ids in the block. A footer at
+ *   the very end points to the index. Logs without an index (old logs, or
+ *   logs of a process that did not shut down) are read sequentially.
+ *
+ */
+
+#ifndef PXMAVLINKLOG_H
+#define PXMAVLINKLOG_H
+
+#include <fstream>
+#include <inttypes.h>
+#include <string>
+#include <vector>
+
+#include "mavconn.h"
+
+struct PxMAVLinkLogIndexEntry
+{
+	uint64_t timestamp;		///< of the first record in the block
+	uint64_t offset;		///< of the first record in the block
+	uint8_t msgids[32];		///< bit set of the message ids in the block
+};
+
+struct PxMAVLinkLogFooter
+{
+	uint64_t indexOffset;	///< end of the records
+	uint32_t count;
+	uint32_t blockSize;		///< records per index entry
+	uint32_t version;
+	uint32_t magic;
+};
+
+/**
+ * @brief Writes a MAVLink log and its index
+ */
+class PxMAVLinkLogWriter
+{
+public:
+	PxMAVLinkLogWriter();
+	~PxMAVLinkLogWriter();
+
+	bool open(const std::string& filename);
+	bool isOpen(void) const;
+	// appends the index, so that readers can seek
+	void close(void);
+
+	bool write(uint64_t timestamp, const mavlink_message_t* msg,
+			   const int8_t* extendedPayload = NULL, uint32_t extendedPayloadLength = 0);
+
+private:
+	std::ofstream file;
+	uint64_t offset;
+	uint32_t recordCount;
+	const uint32_t kBlockSize;
+	std::vector<PxMAVLinkLogIndexEntry> index;
+};
+
+/**
+ * @brief Reads a MAVLink log, seeking with its index where there is one
+ *
+ * The log is mapped into memory, so records and extended payloads are
+ * read in place.
+ */
+class PxMAVLinkLogReader
+{
+public:
+	PxMAVLinkLogReader();
+	~PxMAVLinkLogReader();
+
+	bool open(const std::string& filename);
+	void close(void);
+
+	bool hasIndex(void) const;
+
+	/**
+	 * Only return messages with these ids. Blocks of the log without any
+	 * of them are skipped with the index, the other records are skipped
+	 * without decoding them.
+	 */
+	void setFilter(const std::vector<uint8_t>& msgids);
+
+	// continue reading with the first record at or after the timestamp
+	bool seek(uint64_t timestamp);
+
+	/**
+	 * Next record, false at the end of the log. The extended payload points
+	 * into the log and stays valid until the log is closed.
+	 */
+	bool read(uint64_t& timestamp, mavlink_message_t& msg,
+			  const int8_t*& extendedPayload, uint32_t& extendedPayloadLength);
+
+private:
+	bool readRecord(void);
+	bool skipToNextBlock(void);
+	bool blockMatchesFilter(size_t block) const;
+
+	const uint8_t* data;
+	uint64_t size;
+	uint64_t endOffset;		///< end of the records
+	uint64_t offset;		///< of the next record
+	size_t block;			///< index entry of the next record
+
+	std::vector<PxMAVLinkLogIndexEntry> index;
+
+	bool filtered;
+	uint8_t filter[32];
+
+	const uint8_t* record;	///< read by readRecord()
+	uint32_t recordPayloadLength;
+};
+
+#endif
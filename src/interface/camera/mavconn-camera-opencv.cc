@@ -151,10 +151,11 @@ mavlinkHandler(const lcm_recv_buf_t* rbuf, const char* channel,
 
 void lcmWait(lcm_t* lcm)
 {
-	// Blocking wait for new data
+	// Blocking wait for new data; paramClient uses the same LCM instance
+	// and also continues a requested parameter list on a quiet bus
 	while (!quit)
 	{
-		lcm_handle(lcm);
+		paramClient->handleLCM();
 	}
 }
 
@@ -263,6 +264,13 @@ int main(int argc, char* argv[])
 		exit(EXIT_FAILURE);
 	}
 
+	// the LCM thread passes messages to the parameter client
+	paramClient = new MAVConnParamClient(getSystemID(), compid, lcm, configFile, verbose);
+	paramClient->setParamValue("MINIMGINTERVAL", 0);
+	paramClient->setParamValue("EXPOSURE", exposure);
+	paramClient->setParamValue("GAIN", gain);
+	paramClient->readParamsFromFile(configFile);
+
 	//========= Initialize threading =========
 	Glib::Thread* lcmThread = 0;
 	Glib::Thread* imageThread = 0;
@@ -319,12 +327,6 @@ int main(int argc, char* argv[])
 		processingDoneCond = new Glib::Cond;
 	}
 
-    paramClient = new MAVConnParamClient(getSystemID(), compid, lcm, configFile, verbose);
-    paramClient->setParamValue("MINIMGINTERVAL", 0);
-    paramClient->setParamValue("EXPOSURE", exposure);
-    paramClient->setParamValue("GAIN", gain);
-    paramClient->readParamsFromFile(configFile);
-
 	//========= Initialize capture devices =========
 	fprintf(stderr, "# INFO: Creating capture...\n");
 
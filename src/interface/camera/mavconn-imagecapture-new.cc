@@ -32,7 +32,9 @@ This file is part of the PIXHAWK project
  */
 
 #include <inttypes.h>
+#include <algorithm>
 #include <cstdio>
+#include <deque>
 #include <iostream>
 #include <fstream>
 #include <glib.h>
@@ -50,6 +52,8 @@ This file is part of the PIXHAWK project
 
 #include "interface/shared_mem/SHMImageClient.h"
 #include "mavconn.h"
+#include "PxImageLog.h"
+#include "PxMAVLinkLog.h"
 
 namespace config = boost::program_options;
 namespace bfs = boost::filesystem;
@@ -79,7 +83,7 @@ ofstream plainLogFileDirection0;
 ofstream plainLogFileDirection1;
 ofstream plainLogFileMultiDirection0;
 ofstream plainLogFileMultiDirection1;
-ofstream mavlinkFile;
+PxMAVLinkLogWriter mavlinkLog;
 
 string calibStrDirection0;
 string calibStrLeftDirection0;
@@ -88,14 +92,19 @@ string calibStrDirection1;
 string calibStrLeftDirection1;
 string calibStrRightDirection1;
 
-uint64_t imgNum = 0;
-
 bool recordData = false;
 bool bPause = false;
 
 bool calib_problems = false;
 
-GAsyncQueue *image_write_queue = NULL;
+// image writing
+std::string imageFormat;		///< "chunk" or "bmp"
+bool compressImages = false;
+bool bufferedIO = false;
+int chunkSizeMB = 512;
+int writerThreadCount = 2;
+int queueSize = 32;
+std::string dropPolicy;			///< "newest" or "oldest"
 
 //image information to store
 uint64_t timestamp;
@@ -108,6 +117,8 @@ bool quit = false;
 
 typedef struct _writeData
 {
+	std::string captureDir;
+	unsigned int session;
 	int direction;
 	bool stereo;
 	cv::Mat imgLeft;
@@ -118,6 +129,24 @@ typedef struct _writeData
 	double lat, lon, alt, vdop, hdop, satcount;
 } writeData;
 
+std::deque<writeData*> writeQueue;
+GMutex writeQueueMutex;			///< guards the queue, the counters below and writesInProgress
+GCond writeQueueCond;			///< signalled when an image has been queued
+GCond writeIdleCond;			///< signalled when the writers have run out of images or closed their chunk files
+int writesInProgress = 0;
+int writersWithOpenLogs = 0;	///< writers whose chunk files are still open
+unsigned int recordingSession = 0;
+uint64_t framesQueued = 0;
+uint64_t framesDropped = 0;
+uint64_t framesWritten = 0;
+uint64_t framesFailed = 0;
+uint64_t bytesWritten = 0;
+
+GMutex logFileMutex;			///< guards the image data files
+
+// image manifests of the current recording, per direction and left/right camera
+PxImageManifest manifests[2][2];
+
 void
 signalHandler(int signal)
 {
@@ -129,55 +158,239 @@ signalHandler(int signal)
 	}
 }
 
-static void image_writer (void)
+/**
+ * @brief Queue an image for the writer threads
+ *
+ * The queue is bounded, so a writer that cannot keep up with the cameras
+ * costs images instead of memory. Which image is dropped when the queue is
+ * full is set with --drop_policy.
+ */
+static void queue_image(writeData* data)
 {
-	while(!quit)
+	writeData* dropped = NULL;
+
+	g_mutex_lock(&writeQueueMutex);
+	++framesQueued;
+	if (writeQueue.size() >= (size_t)queueSize)
+	{
+		++framesDropped;
+		if (dropPolicy == "oldest")
+		{
+			dropped = writeQueue.front();
+			writeQueue.pop_front();
+			writeQueue.push_back(data);
+		}
+		else
+		{
+			dropped = data;
+		}
+	}
+	else
+	{
+		writeQueue.push_back(data);
+	}
+	g_cond_signal(&writeQueueCond);
+	g_mutex_unlock(&writeQueueMutex);
+
+	if (dropped != NULL)
+	{
+		if (debug) printf("image queue full, dropped image %llu. \n", (long long unsigned)dropped->timestamp);
+		delete dropped;
+	}
+}
+
+/**
+ * @brief Wait until the writer threads have written every queued image
+ *
+ * If the recording has been stopped, this also waits until the writers
+ * have closed their chunk files.
+ */
+static void wait_for_writers(void)
+{
+	g_mutex_lock(&writeQueueMutex);
+	while (!writeQueue.empty() || writesInProgress > 0 || (!recordData && writersWithOpenLogs > 0))
+	{
+		// wake idle writers so that they close their chunk files
+		g_cond_broadcast(&writeQueueCond);
+		g_cond_wait(&writeIdleCond, &writeQueueMutex);
+	}
+	g_mutex_unlock(&writeQueueMutex);
+}
+
+static void write_image_data(const writeData* data)
+{
+	g_mutex_lock(&logFileMutex);
+	if (data->direction == 0)
+	{
+		imageDataFileDirection0.precision(32);
+		imageDataFileDirection0 << data->timestamp << ", " << data->roll << ", " << data->pitch << ", " << data->yaw << ", " << data->lat << ", " << data->lon << ", " << data->alt << ", " << data->ground_dist << ", " << data->gx << ", " << data->gy << ", " << data->gz << endl;
+		plainLogFileDirection0.precision(32);
+		plainLogFileDirection0 << data->timestamp << ", " << data->roll << ", " << data->pitch << ", " << data->yaw << ", " << data->lat << ", " << data->lon << ", " << data->alt << ", " << data->pres_alt << ", " << data->ground_dist << ", " << data->vdop << ", " << data->hdop << ", " << data->satcount << ", " << data->local_x_gps_raw << ", " << data->local_y_gps_raw << ", " << data->local_z_gps_raw << ", " << data->vx << ", " << data->vy << ", " << data->vz << ", " << data->gx << ", " << data->gy << ", " << data->gz << ", " << data->gvx << ", " << data->gvy << ", " << data->gvz << endl;
+		plainLogFileMultiDirection0.precision(32);
+		plainLogFileMultiDirection0 << data->timestamp << ", " << data->roll << ", " << data->pitch << ", " << data->yaw << ", " << data->lat << ", " << data->lon << ", " << data->alt << ", " << data->pres_alt << ", " << data->ground_dist << ", " << data->vdop << ", " << data->hdop << ", " << data->satcount << ", " << data->local_x_gps_raw << ", " << data->local_y_gps_raw << ", " << data->local_z_gps_raw << ", " << data->local_x << ", " << data->local_y << ", " << data->local_z << ", " << data->vx << ", " << data->vy << ", " << data->vz << ", " << data->gx << ", " << data->gy << ", " << data->gz << ", " << data->gvx << ", " << data->gvy << ", " << data->gvz << endl;
+	}
+	else
 	{
-		//TODO: use timed_pop() here so that the process can be killed nicely...
-		writeData *data = (writeData *) g_async_queue_pop(image_write_queue);
+		imageDataFileDirection1.precision(32);
+		imageDataFileDirection1 << data->timestamp << ", " << data->roll << ", " << data->pitch << ", " << data->yaw << ", " << data->lat << ", " << data->lon << ", " << data->alt << ", " << data->ground_dist << ", " << data->gx << ", " << data->gy << ", " << data->gz << endl;
+		plainLogFileDirection1.precision(32);
+		plainLogFileDirection1 << data->timestamp << ", " << data->roll << ", " << data->pitch << ", " << data->yaw << ", " << data->lat << ", " << data->lon << ", " << data->alt << ", " << data->pres_alt << ", " << data->ground_dist << ", " << data->vdop << ", " << data->hdop << ", " << data->satcount << ", " << data->local_x_gps_raw << ", " << data->local_y_gps_raw << ", " << data->local_z_gps_raw << ", " << data->vx << ", " << data->vy << ", " << data->vz << ", " << data->gx << ", " << data->gy << ", " << data->gz << ", " << data->gvx << ", " << data->gvy << ", " << data->gvz << endl;
+		plainLogFileMultiDirection1.precision(32);
+		plainLogFileMultiDirection1 << data->timestamp << ", " << data->roll << ", " << data->pitch << ", " << data->yaw << ", " << data->lat << ", " << data->lon << ", " << data->alt << ", " << data->pres_alt << ", " << data->ground_dist << ", " << data->vdop << ", " << data->hdop << ", " << data->satcount << ", " << data->local_x_gps_raw << ", " << data->local_y_gps_raw << ", " << data->local_z_gps_raw << ", " << data->local_x << ", " << data->local_y << ", " << data->local_z << ", " << data->vx << ", " << data->vy << ", " << data->vz << ", " << data->gx << ", " << data->gy << ", " << data->gz << ", " << data->gvx << ", " << data->gvy << ", " << data->gvz << endl;
+	}
+	g_mutex_unlock(&logFileMutex);
+}
+
+static gpointer image_writer (gpointer writerNo)
+{
+	// every writer appends to its own chunk files, named after the writer
+	int writer = GPOINTER_TO_INT(writerNo);
 
-		char fileName[128];
-		sprintf(fileName, "%llu.bmp", (long long unsigned)data->timestamp);
+	// chunk files of the current session, per direction and left/right camera
+	PxImageLogWriter logs[2][2];
+	bool logsOpen = false;
+	unsigned int logSession = 0;
+	uint64_t reportedBytes = 0;
+	const char* sideDir[2] = {"left/", "right/"};
 
-		std::string strDirection;
-		if (data->direction == 0)
+	g_mutex_lock(&writeQueueMutex);
+	while(!quit)
+	{
+		if (writeQueue.empty())
 		{
-			strDirection = DIRECTUION_0_DIR;
-			imageDataFileDirection0.precision(32);
-			imageDataFileDirection0 << data->timestamp << ", " << data->roll << ", " << data->pitch << ", " << data->yaw << ", " << data->lat << ", " << data->lon << ", " << data->alt << ", " << data->ground_dist << ", " << data->gx << ", " << data->gy << ", " << data->gz << endl;
-			plainLogFileDirection0.precision(32);
-			plainLogFileDirection0 << data->timestamp << ", " << data->roll << ", " << data->pitch << ", " << data->yaw << ", " << data->lat << ", " << data->lon << ", " << data->alt << ", " << data->pres_alt << ", " << data->ground_dist << ", " << data->vdop << ", " << data->hdop << ", " << data->satcount << ", " << data->local_x_gps_raw << ", " << data->local_y_gps_raw << ", " << data->local_z_gps_raw << ", " << data->vx << ", " << data->vy << ", " << data->vz << ", " << data->gx << ", " << data->gy << ", " << data->gz << ", " << data->gvx << ", " << data->gvy << ", " << data->gvz << endl;
-			plainLogFileMultiDirection0.precision(32);
-			plainLogFileMultiDirection0 << data->timestamp << ", " << data->roll << ", " << data->pitch << ", " << data->yaw << ", " << data->lat << ", " << data->lon << ", " << data->alt << ", " << data->pres_alt << ", " << data->ground_dist << ", " << data->vdop << ", " << data->hdop << ", " << data->satcount << ", " << data->local_x_gps_raw << ", " << data->local_y_gps_raw << ", " << data->local_z_gps_raw << ", " << data->local_x << ", " << data->local_y << ", " << data->local_z << ", " << data->vx << ", " << data->vy << ", " << data->vz << ", " << data->gx << ", " << data->gy << ", " << data->gz << ", " << data->gvx << ", " << data->gvy << ", " << data->gvz << endl;
+			if (!recordData && (logs[0][0].isOpen() || logs[0][1].isOpen() ||
+								logs[1][0].isOpen() || logs[1][1].isOpen()))
+			{
+				// recording stopped, finish the chunk files with their index
+				g_mutex_unlock(&writeQueueMutex);
+				for (int d = 0; d < 2; ++d)
+				{
+					logs[d][0].close();
+					logs[d][1].close();
+				}
+				g_mutex_lock(&writeQueueMutex);
+				if (logsOpen)
+				{
+					logsOpen = false;
+					--writersWithOpenLogs;
+				}
+				g_cond_broadcast(&writeIdleCond);
+				continue;
+			}
+			g_cond_wait(&writeQueueCond, &writeQueueMutex);
+			continue;
 		}
-		else
+
+		writeData *data = writeQueue.front();
+		writeQueue.pop_front();
+		if (data->session != recordingSession)
 		{
-			strDirection = DIRECTUION_1_DIR;
-			imageDataFileDirection1.precision(32);
-			imageDataFileDirection1 << data->timestamp << ", " << data->roll << ", " << data->pitch << ", " << data->yaw << ", " << data->lat << ", " << data->lon << ", " << data->alt << ", " << data->ground_dist << ", " << data->gx << ", " << data->gy << ", " << data->gz << endl;
-			plainLogFileDirection1.precision(32);
-			plainLogFileDirection1 << data->timestamp << ", " << data->roll << ", " << data->pitch << ", " << data->yaw << ", " << data->lat << ", " << data->lon << ", " << data->alt << ", " << data->pres_alt << ", " << data->ground_dist << ", " << data->vdop << ", " << data->hdop << ", " << data->satcount << ", " << data->local_x_gps_raw << ", " << data->local_y_gps_raw << ", " << data->local_z_gps_raw << ", " << data->vx << ", " << data->vy << ", " << data->vz << ", " << data->gx << ", " << data->gy << ", " << data->gz << ", " << data->gvx << ", " << data->gvy << ", " << data->gvz << endl;
-			plainLogFileMultiDirection1.precision(32);
-			plainLogFileMultiDirection1 << data->timestamp << ", " << data->roll << ", " << data->pitch << ", " << data->yaw << ", " << data->lat << ", " << data->lon << ", " << data->alt << ", " << data->pres_alt << ", " << data->ground_dist << ", " << data->vdop << ", " << data->hdop << ", " << data->satcount << ", " << data->local_x_gps_raw << ", " << data->local_y_gps_raw << ", " << data->local_z_gps_raw << ", " << data->local_x << ", " << data->local_y << ", " << data->local_z << ", " << data->vx << ", " << data->vy << ", " << data->vz << ", " << data->gx << ", " << data->gy << ", " << data->gz << ", " << data->gvx << ", " << data->gvy << ", " << data->gvz << endl;
+			// queued for a previous recording
+			++framesDropped;
+			delete data;
+			if (writeQueue.empty() && writesInProgress == 0)
+			{
+				g_cond_broadcast(&writeIdleCond);
+			}
+			continue;
 		}
+		++writesInProgress;
+		g_mutex_unlock(&writeQueueMutex);
+
+		write_image_data(data);
+
+		std::string strDirection = (data->direction == 0) ? DIRECTUION_0_DIR : DIRECTUION_1_DIR;
+		const cv::Mat* images[2] = {&data->imgLeft, &data->imgRight};
+		int imageCount = data->stereo ? 2 : 1;
+		bool success = true;
+		uint64_t bytes = 0;
 
-		if (data->stereo)
+		if (imageFormat == "bmp")
 		{
-			cv::imwrite((captureDir + strDirection + std::string("left/") + fileName).c_str(), data->imgLeft);
-			cv::imwrite((captureDir + strDirection + std::string("right/") + fileName).c_str(), data->imgRight);
+			char fileName[128];
+			sprintf(fileName, "%llu.bmp", (long long unsigned)data->timestamp);
+
+			for (int i = 0; i < imageCount; ++i)
+			{
+				if (cv::imwrite((data->captureDir + strDirection + sideDir[i] + fileName).c_str(), *images[i]))
+				{
+					PxImageManifestEntry entry;
+					entry.timestamp = data->timestamp;
+					entry.offset = 0;
+					entry.size = 0;
+					entry.writer = PxImageManifest::kBitmap;
+					entry.chunk = PxImageManifest::kBitmap;
+					manifests[data->direction][i].append(entry);
+				}
+				else
+				{
+					success = false;
+				}
+				bytes += images[i]->total() * images[i]->elemSize();
+			}
 		}
 		else
 		{
-			cv::imwrite((captureDir + strDirection + std::string("left/") + fileName).c_str(), data->imgLeft);
+			if (data->session != logSession)
+			{
+				for (int d = 0; d < 2; ++d)
+				{
+					logs[d][0].close();
+					logs[d][1].close();
+				}
+				logSession = data->session;
+			}
+
+			for (int i = 0; i < imageCount; ++i)
+			{
+				PxImageLogWriter& log = logs[data->direction][i];
+				if (!log.isOpen())
+				{
+					log.open(data->captureDir + strDirection + sideDir[i], writer,
+							 &manifests[data->direction][i], compressImages, (uint64_t)chunkSizeMB * 1024 * 1024, !bufferedIO);
+				}
+				success = log.write(data->timestamp, *images[i]) && success;
+			}
+
+			// the chunk files write in large blocks, count what reached the disk
+			uint64_t logBytes = 0;
+			for (int d = 0; d < 2; ++d)
+			{
+				logBytes += logs[d][0].getBytesWritten() + logs[d][1].getBytesWritten();
+			}
+			bytes = logBytes - reportedBytes;
+			reportedBytes = logBytes;
 		}
 
-		++imgNum;
 		if (debug) printf("image written. \n");
 
-		data->imgLeft.release();
-		data->imgRight.release();
-		free(data);
+		delete data;
+
+		g_mutex_lock(&writeQueueMutex);
+		--writesInProgress;
+		bool open = logs[0][0].isOpen() || logs[0][1].isOpen() || logs[1][0].isOpen() || logs[1][1].isOpen();
+		if (open != logsOpen)
+		{
+			logsOpen = open;
+			writersWithOpenLogs += open ? 1 : -1;
+		}
+		if (success)
+		{
+			++framesWritten;
+		}
+		else
+		{
+			++framesFailed;
+		}
+		bytesWritten += bytes;
+		if (writeQueue.empty() && writesInProgress == 0)
+		{
+			g_cond_broadcast(&writeIdleCond);
+		}
 	}
+	g_mutex_unlock(&writeQueueMutex);
+
+	return NULL;
 }
 
 void image_handler(const lcm_recv_buf_t* rbuf, const char* channel, const mavconn_mavlink_msg_container_t* container, void* user)
@@ -297,9 +510,12 @@ void image_handler(const lcm_recv_buf_t* rbuf, const char* channel, const mavcon
 			data->local_y_gps_raw = local_y_gps_raw;
 			data->local_z_gps_raw = local_z_gps_raw;			
 
+			data->captureDir = captureDir;
+			data->session = recordingSession;
+
 			gotFirstImage = true;
 
-			g_async_queue_push(image_write_queue, data);
+			queue_image(data);
 			if (debug) printf("image pushed. \n");
 		}
 	}
@@ -492,7 +708,15 @@ static void mavlink_handler (const lcm_recv_buf_t *rbuf, const char * channel, c
 						prepareCaptureFile(plainLogFileMultiDirection1, captureDir + std::string(DIRECTUION_1_DIR), MULTI_COMPONENT_CAPTURE_FILE, "timestamp, roll, pitch, yaw, lat, lon, alt, pressure_alt, ground_distance, vdop, hdop, satcount, local_x_gps_raw, local_y_gps_raw, local_z_gps_raw, local_x_system, local_y_system, local_z_system, speedx_system, speedy_system, speedz_system, ground truth X, ground truth Y, ground truth Z, ground truth speed X, ground truth speed Y, ground truth speed Z", "IMAGE", timeinfo);
 						char dateBuf[80];
 						strftime( dateBuf, 80, "%Y%m%d_%H%M%S\0", timeinfo );
-						mavlinkFile.open((captureDir + string(dateBuf) + string(".mavlink")).c_str(), ios::binary | ios::out);
+						mavlinkLog.open(captureDir + string(dateBuf) + string(".mavlink"));
+
+						// the writers add every image to the manifest of its folder
+						for (int d = 0; d < 2; ++d)
+						{
+							std::string strDirection = (d == 0) ? DIRECTUION_0_DIR : DIRECTUION_1_DIR;
+							manifests[d][0].open(captureDir + strDirection + "left/");
+							manifests[d][1].open(captureDir + strDirection + "right/");
+						}
 
 						sprintf((char*)&statustext.text, "MAVCONN: imagecapture: STARTING RECORDING");
 						mavlink_msg_statustext_encode(sysid, compid, &msg, &statustext);
@@ -500,6 +724,16 @@ static void mavlink_handler (const lcm_recv_buf_t *rbuf, const char * channel, c
 						snprintf((char*)&statustext.text, MAVLINK_MSG_STATUSTEXT_FIELD_TEXT_LEN, "%s%s%s", captureDir.c_str(), dateBuf, ".mavlink");
 						mavlink_msg_statustext_encode(sysid, compid, &msg, &statustext);
 						sendMAVLinkMessage(lcmMavlink, &msg);
+
+						g_mutex_lock(&writeQueueMutex);
+						++recordingSession;
+						framesQueued = 0;
+						framesDropped = 0;
+						framesWritten = 0;
+						framesFailed = 0;
+						bytesWritten = 0;
+						g_mutex_unlock(&writeQueueMutex);
+
 						recordData = true;
 						bPause = false;
 					}
@@ -518,6 +752,11 @@ static void mavlink_handler (const lcm_recv_buf_t *rbuf, const char * channel, c
 						// stop recording image data
 						if (verbose) printf("Stop recording.\n");
 
+						// images queued until now still belong to this recording
+						recordData = false;
+						wait_for_writers();
+
+						g_mutex_lock(&logFileMutex);
 						imageDataFileDirection0 << endl << "### EOF" << endl;
 						imageDataFileDirection0.close();
 						imageDataFileDirection1 << endl << "### EOF" << endl;
@@ -530,14 +769,39 @@ static void mavlink_handler (const lcm_recv_buf_t *rbuf, const char * channel, c
 						plainLogFileMultiDirection0.close();
 						plainLogFileMultiDirection1 << endl << "### EOF" << endl;
 						plainLogFileMultiDirection1.close();
-						mavlinkFile.close();
+						g_mutex_unlock(&logFileMutex);
+						mavlinkLog.close();
+						for (int d = 0; d < 2; ++d)
+						{
+							manifests[d][0].close();
+							manifests[d][1].close();
+						}
+
+						g_mutex_lock(&writeQueueMutex);
+						uint64_t queued = framesQueued;
+						uint64_t dropped = framesDropped;
+						uint64_t written = framesWritten;
+						uint64_t failed = framesFailed;
+						uint64_t bytes = bytesWritten;
+						g_mutex_unlock(&writeQueueMutex);
+
+						if (!silent)
+						{
+							printf("Recorded %llu of %llu images (%llu dropped, %llu failed), %.1f MB written.\n",
+								   (long long unsigned)written, (long long unsigned)queued,
+								   (long long unsigned)dropped, (long long unsigned)failed,
+								   bytes / (1024.0 * 1024.0));
+						}
 
 						mavlink_message_t msg;
 						mavlink_statustext_t statustext;
 						sprintf((char*)&statustext.text, "MAVCONN: imagecapture: STOPPED RECORDING");
 						mavlink_msg_statustext_encode(sysid, compid, &msg, &statustext);
 						sendMAVLinkMessage(lcmMavlink, &msg);
-						recordData = false;
+						snprintf((char*)&statustext.text, MAVLINK_MSG_STATUSTEXT_FIELD_TEXT_LEN, "%llu images, %llu dropped, %llu failed",
+								 (long long unsigned)written, (long long unsigned)dropped, (long long unsigned)failed);
+						mavlink_msg_statustext_encode(sysid, compid, &msg, &statustext);
+						sendMAVLinkMessage(lcmMavlink, &msg);
 						bPause = false;
 					}
 				}
@@ -592,17 +856,14 @@ static void mavlink_handler (const lcm_recv_buf_t *rbuf, const char * channel, c
 	if(recordData && !bPause)
 	{
 		//write into mavlink logfile
-		const int len = MAVLINK_MAX_PACKET_LEN+sizeof(uint64_t);
-		uint8_t buf[len];
-		uint64_t time = getSystemTimeUsecs();
-		memcpy(buf, (void*)&time, sizeof(uint64_t));
-		mavlink_msg_to_send_buffer(buf+sizeof(uint64_t), mavlink_msg);
-		mavlinkFile.write((char *)buf, len);
-
 		if (mavlink_msg->msgid == MAVLINK_MSG_ID_EXTENDED_MESSAGE)
 		{
-			mavlinkFile.write(reinterpret_cast<char*>(container->extended_payload),
-							  container->extended_payload_len);
+			mavlinkLog.write(getSystemTimeUsecs(), mavlink_msg,
+							 container->extended_payload, container->extended_payload_len);
+		}
+		else
+		{
+			mavlinkLog.write(getSystemTimeUsecs(), mavlink_msg);
 		}
 	}
 }
@@ -636,6 +897,13 @@ int main(int argc, char* argv[])
 		("silent,s", config::bool_switch(&silent)->default_value(false), "suppress outputs")
 		("verbose,v", config::bool_switch(&verbose)->default_value(false), "verbose output")
 		("debug,d", config::bool_switch(&debug)->default_value(false), "debug output")
+		("image_format", config::value<string>(&imageFormat)->default_value("chunk"), "chunk: append images to chunk files, bmp: one bitmap per image")
+		("compress", config::bool_switch(&compressImages)->default_value(false), "compress images in chunk files with zlib (lossless)")
+		("chunk_size", config::value<int>(&chunkSizeMB)->default_value(chunkSizeMB), "size of a chunk file in MB")
+		("buffered_io", config::bool_switch(&bufferedIO)->default_value(false), "write chunk files through the page cache instead of O_DIRECT")
+		("writer_threads", config::value<int>(&writerThreadCount)->default_value(writerThreadCount), "number of threads writing images")
+		("queue_size", config::value<int>(&queueSize)->default_value(queueSize), "number of images waiting to be written at most")
+		("drop_policy", config::value<string>(&dropPolicy)->default_value("newest"), "image dropped when the queue is full: newest or oldest")
 		/*("stereo_front", config::bool_switch(&stereo_front)->default_value(false), "record front stereo")*/
 		;
 	config::variables_map vm;
@@ -647,6 +915,20 @@ int main(int argc, char* argv[])
 		return 1;
 	}
 
+	if (imageFormat != "chunk" && imageFormat != "bmp")
+	{
+		fprintf(stderr, "# ERROR: Unknown image format %s, use chunk or bmp.\n", imageFormat.c_str());
+		return 1;
+	}
+	if (dropPolicy != "newest" && dropPolicy != "oldest")
+	{
+		fprintf(stderr, "# ERROR: Unknown drop policy %s, use newest or oldest.\n", dropPolicy.c_str());
+		return 1;
+	}
+	writerThreadCount = std::max(writerThreadCount, 1);
+	queueSize = std::max(queueSize, 1);
+	chunkSizeMB = std::max(chunkSizeMB, 1);
+
 	// ----- Setting up communication and data for images
 	// Creating LCM network provider
 	lcm_t* lcmImage = lcm_create ("udpm://");
@@ -667,14 +949,8 @@ int main(int argc, char* argv[])
 
 	// ----- Creating thread for image handling
 	GThread* lcm_imageThread;
-	GThread* lcm_imageWriterThread;
 	GError* err;
 
-	if (!image_write_queue)
-	{
-		image_write_queue = g_async_queue_new();
-	}
-
 	// thread for IMAGE channel
 	if( (lcm_imageThread = g_thread_try_new("LCMIMG", (GThreadFunc)lcm_image_wait, (void *)lcmImage, &err)) == NULL)
 	{
@@ -683,12 +959,15 @@ int main(int argc, char* argv[])
 		exit(EXIT_FAILURE);
 	}
 
-	// thread for image_writer
-	if( (lcm_imageWriterThread = g_thread_try_new("LCMIMGCP", (GThreadFunc)image_writer, NULL, &err)) == NULL)
+	// threads for image_writer
+	for (int i = 0; i < writerThreadCount; ++i)
 	{
-		cout << "Thread create failed: " << err->message << "!!" << endl;
-		g_error_free(err);
-		exit(EXIT_FAILURE);
+		if( g_thread_try_new("LCMIMGCP", image_writer, GINT_TO_POINTER(i), &err) == NULL)
+		{
+			cout << "Thread create failed: " << err->message << "!!" << endl;
+			g_error_free(err);
+			exit(EXIT_FAILURE);
+		}
 	}
 
 
@@ -46,6 +46,7 @@ This file is part of the PIXHAWK project
 
 #include "interface/shared_mem/SHMImageClient.h"
 #include "mavconn.h"
+#include "PxMAVLinkLog.h"
 
 namespace config = boost::program_options;
 namespace bfs = boost::filesystem;
@@ -72,7 +73,7 @@ string captureDirRight;
 ofstream imageDataFile;
 ofstream plainLogFile;
 ofstream plainLogFileMulti;
-ofstream mavlinkFile;
+PxMAVLinkLogWriter mavlinkLog;
 
 cv::Mat img_left( 480, 640, CV_8UC1 );
 cv::Mat img_right( 480, 640, CV_8UC1 );
@@ -329,7 +330,7 @@ static void mavlink_handler (const lcm_recv_buf_t *rbuf, const char * channel, c
 
 					char dateBuf[80];
 					strftime( dateBuf, 80, "%Y%m%d_%H%M%S\0", timeinfo );
-					mavlinkFile.open((string(CAPTURE_DIR) + string(dateBuf) + string(".mavlink")).c_str(), ios::binary | ios::out);
+					mavlinkLog.open(string(CAPTURE_DIR) + string(dateBuf) + string(".mavlink"));
 
 					sprintf((char*)&statustext.text, "MAVCONN: imagecapture: STARTING RECORDING");
 					mavlink_msg_statustext_encode(sysid, compid, &msg, &statustext);
@@ -361,7 +362,7 @@ static void mavlink_handler (const lcm_recv_buf_t *rbuf, const char * channel, c
 					plainLogFile.close();
 					plainLogFileMulti << endl << "### EOF" << endl;
 					plainLogFileMulti.close();
-					mavlinkFile.close();
+					mavlinkLog.close();
 
 					mavlink_message_t msg;
 					mavlink_statustext_t statustext;
@@ -440,12 +441,7 @@ static void mavlink_handler (const lcm_recv_buf_t *rbuf, const char * channel, c
 	if(recordData && !bPause)
 	{
 		//write into mavlink logfile
-		const int len = MAVLINK_MAX_PACKET_LEN+sizeof(uint64_t);
-		uint8_t buf[len];
-		uint64_t time = getSystemTimeUsecs();
-		memcpy(buf, (void*)&time, sizeof(uint64_t));
-		mavlink_msg_to_send_buffer(buf+sizeof(uint64_t), msg);
-		mavlinkFile.write((char *)buf, len);
+		mavlinkLog.write(getSystemTimeUsecs(), msg);
 	}
 }
 
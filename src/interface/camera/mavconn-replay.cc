@@ -2,6 +2,9 @@
 #include <cstdio>
 #include <iostream>
 #include <fstream>
+#include <algorithm>
+#include <deque>
+#include <errno.h>
 #include <glibmm.h>
 #include <time.h>
 // BOOST includes
@@ -12,6 +15,8 @@
 
 #include "interface/shared_mem/SHMImageServer.h"
 #include "mavconn.h"
+#include "PxImageLog.h"
+#include "PxMAVLinkLog.h"
 
 namespace config = boost::program_options;
 namespace bfs = boost::filesystem;
@@ -26,6 +31,270 @@ uint64_t camid_right = 0; ///< Right camera unique id
 bool silent, verbose;
 int sysid = getSystemID();
 int compid = PX_COMP_ID_CAMERA;
+double speed = 1.0;		///< replay speed, relative to the recording
+bool fastReplay = false;	///< replay as fast as possible
+int prefetchThreads = 2;
+int lookahead = 8;		///< images decoded ahead at most
+bool lockstep = false;		///< publish an image only after the consumers finished the last one
+int lockstepTimeout = 10000;	///< ms to wait for the consumers
+
+// images of a stream, sorted by timestamp
+typedef std::vector<PxImageLogReader::Frame> ImageList;
+
+/**
+ * @brief Open the images in a folder, written as bitmaps or chunk files
+ */
+void
+loadImageList(const std::string& path, PxImageLogReader& log, bool verbose)
+{
+	if (log.open(path))
+	{
+		if (verbose) printf("found %zu images in %s\n", log.getFrames().size(), path.c_str());
+	}
+}
+
+bool
+compareTimestamp(const PxImageLogReader::Frame& frame, uint64_t timestamp)
+{
+	return frame.timestamp < timestamp;
+}
+
+// first image at or after the timestamp
+ImageList::const_iterator
+lowerBound(const ImageList& images, uint64_t timestamp)
+{
+	return std::lower_bound(images.begin(), images.end(), timestamp, compareTimestamp);
+}
+
+// image with exactly this timestamp, or end()
+ImageList::const_iterator
+findImage(const ImageList& images, uint64_t timestamp)
+{
+	ImageList::const_iterator it = lowerBound(images, timestamp);
+	if (it != images.end() && it->timestamp != timestamp)
+	{
+		return images.end();
+	}
+	return it;
+}
+
+/**
+ * @brief Loads the upcoming images of a stream on worker threads
+ *
+ * Images are requested in timestamp order. While one is being published,
+ * the following ones are decoded ahead into a bounded window, so that a
+ * slow disk or decoder does not stall the replay.
+ */
+class ImagePrefetcher
+{
+public:
+	explicit ImagePrefetcher(const PxImageLogReader& reader)
+	 : reader(reader)
+	 , images(NULL)
+	 , lookahead(1)
+	 , running(false)
+	{
+
+	}
+
+	~ImagePrefetcher()
+	{
+		{
+			Glib::Mutex::Lock lock(mutex);
+			running = false;
+			cond.broadcast();
+		}
+		for (size_t i = 0; i < threads.size(); ++i)
+		{
+			threads[i]->join();
+		}
+		while (!window.empty())
+		{
+			delete window.front();
+			window.pop_front();
+		}
+	}
+
+	void start(const ImageList& images, ImageList::const_iterator from,
+			   int threadCount, size_t lookahead)
+	{
+		this->images = &images;
+		this->lookahead = std::max(lookahead, (size_t)1);
+		next = from;
+		running = true;
+
+		for (int i = 0; i < threadCount; ++i)
+		{
+			threads.push_back(Glib::Thread::create(sigc::mem_fun(*this, &ImagePrefetcher::worker), true));
+		}
+	}
+
+	// the image it points to, from the window if it has been prefetched
+	bool get(ImageList::const_iterator it, cv::Mat& img)
+	{
+		if (threads.empty())
+		{
+			return reader.read(*it, img);
+		}
+
+		Glib::Mutex::Lock lock(mutex);
+
+		// images before it have been skipped
+		while (!window.empty() && window.front()->image->timestamp < it->timestamp)
+		{
+			drop();
+		}
+		if (window.empty() || window.front()->image != it)
+		{
+			// not prefetched, continue prefetching from it
+			while (!window.empty())
+			{
+				drop();
+			}
+			next = it;
+		}
+		cond.broadcast();
+
+		while (window.empty() || window.front()->state != Slot::DONE)
+		{
+			cond.wait(mutex);
+		}
+
+		Slot* slot = window.front();
+		window.pop_front();
+		cond.broadcast();
+
+		img = slot->img;
+		bool ok = slot->ok;
+		delete slot;
+
+		return ok;
+	}
+
+private:
+	struct Slot
+	{
+		enum State
+		{
+			PENDING,
+			LOADING,
+			DONE
+		};
+
+		ImageList::const_iterator image;
+		State state;
+		bool abandoned;
+		bool ok;
+		cv::Mat img;
+	};
+
+	// remove the first slot of the window, mutex must be held
+	void drop(void)
+	{
+		Slot* slot = window.front();
+		window.pop_front();
+		if (slot->state == Slot::LOADING)
+		{
+			// the worker deletes it when it is done
+			slot->abandoned = true;
+		}
+		else
+		{
+			delete slot;
+		}
+	}
+
+	void worker(void)
+	{
+		Glib::Mutex::Lock lock(mutex);
+		while (running)
+		{
+			Slot* slot = NULL;
+			for (size_t i = 0; i < window.size() && slot == NULL; ++i)
+			{
+				if (window[i]->state == Slot::PENDING)
+				{
+					slot = window[i];
+				}
+			}
+			if (slot == NULL && window.size() < lookahead && next != images->end())
+			{
+				slot = new Slot;
+				slot->image = next++;
+				slot->state = Slot::PENDING;
+				slot->abandoned = false;
+				slot->ok = false;
+				window.push_back(slot);
+			}
+			if (slot == NULL)
+			{
+				cond.wait(mutex);
+				continue;
+			}
+
+			slot->state = Slot::LOADING;
+			lock.release();
+
+			cv::Mat img;
+			bool ok = reader.read(*slot->image, img);
+
+			lock.acquire();
+			if (slot->abandoned)
+			{
+				delete slot;
+				continue;
+			}
+			slot->img = img;
+			slot->ok = ok;
+			slot->state = Slot::DONE;
+			cond.broadcast();
+		}
+	}
+
+	const PxImageLogReader& reader;
+	const ImageList* images;
+	ImageList::const_iterator next;		///< next image to enter the window
+	std::deque<Slot*> window;
+	size_t lookahead;
+	bool running;
+
+	Glib::Mutex mutex;
+	Glib::Cond cond;					///< signalled when the window changes
+	std::vector<Glib::Thread*> threads;
+};
+
+/**
+ * @brief In lockstep mode, wait until the consumers have processed the image
+ */
+void
+waitForConsumers(px::SHMImageServer& cam, uint64_t timestamp)
+{
+	if (lockstep && !cam.waitForClients(lockstepTimeout))
+	{
+		fprintf(stderr, "# WARNING: Image %llu was not acknowledged within %d ms, continuing.\n",
+				(long long unsigned)timestamp, lockstepTimeout);
+	}
+}
+
+/**
+ * @brief Sleep until usecs after start on the monotonic clock
+ */
+void
+waitUntil(const struct timespec& start, uint64_t usecs)
+{
+	struct timespec due = start;
+	due.tv_sec += usecs / 1000000;
+	due.tv_nsec += (usecs % 1000000) * 1000;
+	if (due.tv_nsec >= 1000000000)
+	{
+		++due.tv_sec;
+		due.tv_nsec -= 1000000000;
+	}
+
+	// sleeping to an absolute time does not drift with the time spent
+	// publishing, and restarts after a signal without extending the sleep
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &due, NULL) == EINTR);
+}
 
 int main(int argc, char* argv[])
 {
@@ -73,6 +342,34 @@ int main(int argc, char* argv[])
 		optOrientation.set_long_name("orientation");
 		optOrientation.set_description("Orientation of the camera (forward|downward)");
 
+		Glib::OptionEntry optMsgIds;
+		optMsgIds.set_long_name("msgids");
+		optMsgIds.set_description("Comma-separated list of the message ids to replay (default: all)");
+
+		Glib::OptionEntry optSpeed;
+		optSpeed.set_long_name("speed");
+		optSpeed.set_description("Replay speed relative to the recording (default: 1.0)");
+
+		Glib::OptionEntry optFast;
+		optFast.set_long_name("fast");
+		optFast.set_description("Replay as fast as possible");
+
+		Glib::OptionEntry optLockstep;
+		optLockstep.set_long_name("lockstep");
+		optLockstep.set_description("Replay as fast as the consumers acknowledge the images, instead of in real time. Only consumers which call SHMImageClient::acknowledgeImage() (e.g. mavconn-view) are waited for; without any, this replays as fast as --fast");
+
+		Glib::OptionEntry optLockstepTimeout;
+		optLockstepTimeout.set_long_name("lockstep_timeout");
+		optLockstepTimeout.set_description("Time in ms to wait for an acknowledgement (default: 10000, -1 waits forever)");
+
+		Glib::OptionEntry optPrefetchThreads;
+		optPrefetchThreads.set_long_name("prefetch_threads");
+		optPrefetchThreads.set_description("Number of threads loading images ahead (default: 2, 0 loads them when needed)");
+
+		Glib::OptionEntry optLookahead;
+		optLookahead.set_long_name("lookahead");
+		optLookahead.set_description("Number of images loaded ahead at most (default: 8)");
+
 		Glib::OptionEntry optPublishExtended;
 		optPublishExtended.set_long_name("publish_extended");
 		optPublishExtended.set_description("Publish extended MAVLINK messages");
@@ -91,6 +388,14 @@ int main(int argc, char* argv[])
 		optGroup.add_entry(optSilent, silent);
 		optGroup.add_entry(optOrientation, orientation);
 		optGroup.add_entry(optPublishExtended, publishExtended);
+		Glib::ustring msgidString;
+		optGroup.add_entry(optMsgIds, msgidString);
+		optGroup.add_entry(optSpeed, speed);
+		optGroup.add_entry(optFast, fastReplay);
+		optGroup.add_entry(optLockstep, lockstep);
+		optGroup.add_entry(optLockstepTimeout, lockstepTimeout);
+		optGroup.add_entry(optPrefetchThreads, prefetchThreads);
+		optGroup.add_entry(optLookahead, lookahead);
 
 		Glib::OptionContext optContext("");
 		optContext.set_help_enabled(true);
@@ -121,9 +426,8 @@ int main(int argc, char* argv[])
 		camid_right = idright;
 		uint64_t startTimestamp = strtoull(fromTimestampString.c_str(), NULL, 0);
 
-	std::ifstream mavlinkLog;
-	mavlinkLog.open(logfile.c_str(), std::ios::binary | std::ios::in);
-	if (!mavlinkLog)
+	PxMAVLinkLogReader mavlinkLog;
+	if (!mavlinkLog.open(logfile))
 	{
 		printf("mavconn-replay: Error opening MAVLINK log file: %s\n", logfile.c_str());
 		return EXIT_FAILURE;
@@ -152,9 +456,8 @@ int main(int argc, char* argv[])
 	bool do_images = false;
 	bool do_stereo = false;
 	px::SHMImageServer cam;
-	std::map<uint64_t, std::string> images_left;
-	std::map<uint64_t, std::string> images_right;
-	typedef std::pair<const uint64_t, std::string> image_type;
+	PxImageLogReader log_left;
+	PxImageLogReader log_right;
 	bfs::path ipath_left(imagepath_left);
 	bfs::path ipath_right(imagepath_right);
 	if (bfs::exists(ipath_left) && bfs::is_directory(ipath_left))
@@ -174,29 +477,7 @@ int main(int argc, char* argv[])
 		if (imagepath_left.size() > 0 && imagepath_left[imagepath_left.size() - 1] != '/')
 			imagepath_left += '/';
 
-		try
-		{
-			bfs::directory_iterator file(imagepath_left);
-			bfs::directory_iterator end;
-
-			std::string extension;
-			std::string filename;
-
-			while (file != end)
-			{
-				extension = bfs::extension(*file);
-				if (extension == ".bmp")
-				{
-					filename = bfs::basename(*file);
-					uint64_t timestamp = strtoull(filename.c_str(), NULL, 10);
-					image_type val(timestamp, file->path().string());
-					images_left.insert(val);
-					if (verbose) printf("found %s\n", file->path().string().c_str());
-				}
-				++file;
-			}
-		}
-		catch (...) {}
+		loadImageList(imagepath_left, log_left, verbose);
 
 		//check for right images
 		if (bfs::exists(ipath_right) && bfs::is_directory(ipath_right))
@@ -206,33 +487,11 @@ int main(int argc, char* argv[])
 			if (imagepath_right.size() > 0 && imagepath_right[imagepath_right.size() - 1] != '/')
 				imagepath_right += '/';
 
-			try
-			{
-				bfs::directory_iterator file(imagepath_right);
-				bfs::directory_iterator end;
-
-				std::string extension;
-				std::string filename;
-
-				while (file != end)
-				{
-					extension = bfs::extension(*file);
-					if (extension == ".bmp")
-					{
-						filename = bfs::basename(*file);
-						uint64_t timestamp = strtoull(filename.c_str(), NULL, 10);
-						image_type val(timestamp, file->path().string());
-						images_right.insert(val);
-						if (verbose) printf("found %s\n", file->path().string().c_str());
-					}
-					++file;
-				}
-			}
-			catch (...) {}
+			loadImageList(imagepath_right, log_right, verbose);
 		}
 
 		//if we found any right camera images activate stereo mode
-		if (!images_right.empty())
+		if (!log_right.getFrames().empty())
 		{
 			printf("Outputting stereo stream\n");
 			do_stereo = true;
@@ -276,45 +535,102 @@ int main(int argc, char* argv[])
 		}
 	}
 
-	std::map<uint64_t, std::string>::iterator sync_image_left_it = images_left.begin();
-	std::map<uint64_t, std::string>::iterator sync_image_right_it = images_right.begin();
+	const ImageList& images_left = log_left.getFrames();
+	const ImageList& images_right = log_right.getFrames();
+	ImageList::const_iterator sync_image_left_it = images_left.begin();
+	ImageList::const_iterator sync_image_right_it = images_right.begin();
 
-	const int len = MAVLINK_MAX_PACKET_LEN+sizeof(uint64_t);
-	unsigned char buf[len];
-	uint64_t last_time = 0;
+	if (msgidString.length() > 0)
+	{
+		std::vector<uint8_t> msgids;
+		const char* p = msgidString.c_str();
+		char* end;
+		for (unsigned long id = strtoul(p, &end, 0); end != p; id = strtoul(p, &end, 0))
+		{
+			msgids.push_back(id);
+			p = (*end == ',') ? end + 1 : end;
+		}
+		if (do_images)
+		{
+			// images are replayed along with their trigger messages
+			msgids.push_back(MAVLINK_MSG_ID_IMAGE_TRIGGERED);
+		}
+		mavlinkLog.setFilter(msgids);
+	}
+
+	lookahead = std::max(lookahead, 1);
+	if (speed <= 0.0)
+	{
+		fprintf(stderr, "# ERROR: Replay speed must be positive.\n");
+		return EXIT_FAILURE;
+	}
 
 	printf("mavconn-replay: Start playing logfile %s...\n", logfile.c_str());
 
 	if(startTimestamp > 0)
+	{
 		printf("trying to skip to timestamp %lu...\n", startTimestamp);
 
-	GTimeVal gtime;
-	g_get_current_time(&gtime);
-	uint64_t current_time = ((uint64_t)gtime.tv_sec)*G_USEC_PER_SEC + ((uint64_t)gtime.tv_usec);
-	uint64_t last_current_time = 0;
+		if (!mavlinkLog.hasIndex())
+		{
+			printf("mavconn-replay: Log has no index, searching the timestamp from the start\n");
+		}
+		// trigger messages are logged after the image has been taken, so
+		// none of them is skipped by seeking to the image timestamp
+		mavlinkLog.seek(startTimestamp);
+		sync_image_left_it = lowerBound(images_left, startTimestamp);
+		sync_image_right_it = lowerBound(images_right, startTimestamp);
+	}
+
+	ImagePrefetcher prefetch_left(log_left);
+	ImagePrefetcher prefetch_right(log_right);
+	if (do_images && prefetchThreads > 0)
+	{
+		if (!Glib::thread_supported())
+		{
+			Glib::thread_init();
+		}
+
+		prefetch_left.start(images_left, lowerBound(images_left, startTimestamp), prefetchThreads, lookahead);
+		if (do_stereo)
+		{
+			prefetch_right.start(images_right, lowerBound(images_right, startTimestamp), prefetchThreads, lookahead);
+		}
+	}
+
+	// the first replayed record is published right away, the others when
+	// they are due relative to it
+	struct timespec replay_start;
+	uint64_t log_start = 0;
 
 	cv::Mat image_left;
 	cv::Mat image_right;
 
 	bool found_correct_timestamp = (startTimestamp == 0);
 
-	while(!mavlinkLog.eof())
+	uint64_t time;
+	mavlink_message_t msg;
+	const int8_t* extended_payload;
+	uint32_t extended_payload_len;
+
+	while(mavlinkLog.read(time, msg, extended_payload, extended_payload_len))
 	{
 		bool il = false;
 		bool ir = false;
 
-		mavlinkLog.read((char *)buf, len);
-
-		//first 8 bytes are the timestamp
-		uint64_t time;
-		memcpy((void*)&time, buf, sizeof(uint64_t));
-
-		mavlink_message_t msg;
-		memcpy(&(msg.magic), buf + sizeof(uint64_t), MAVLINK_MAX_PACKET_LEN);
-
-		//the checksums follow directly after the payload, so copy them to their fields in mavlink_message_t
-		//msg.ck_a = *(sizeof(uint64_t) + buf + msg.len + MAVLINK_CORE_HEADER_LEN + 1);
-		//msg.ck_b = *(sizeof(uint64_t) + buf + msg.len + MAVLINK_CORE_HEADER_LEN + 2);
+		//don't wait for IMAGE_AVAILABLE messages, they are not published
+		if (msg.msgid != MAVLINK_MSG_ID_IMAGE_AVAILABLE && found_correct_timestamp && !fastReplay && !lockstep)
+		{
+			if (log_start == 0)
+			{
+				clock_gettime(CLOCK_MONOTONIC, &replay_start);
+				log_start = time;
+			}
+			else if (time > log_start)
+			{
+				waitUntil(replay_start, (time - log_start) / speed);
+			}
+		}
 
 		//printf("%llu\n", time);
 
@@ -322,7 +638,7 @@ int main(int argc, char* argv[])
 		if (do_images && msg.msgid == MAVLINK_MSG_ID_IMAGE_TRIGGERED)
 		{
 			//printf("image triggered: %llu\n", (long long unsigned) time);
-			std::map<uint64_t,std::string>::iterator it;
+			ImageList::const_iterator it;
 			mavlink_image_triggered_t itrg;
 			mavlink_msg_image_triggered_decode(&msg, &itrg);
 
@@ -334,7 +650,7 @@ int main(int argc, char* argv[])
 					found_correct_timestamp = true;
 				}
 
-				it = images_left.find(itrg.timestamp);
+				it = findImage(images_left, itrg.timestamp);
 				if (it == images_left.end())
 				{
 					// Image not found
@@ -343,14 +659,13 @@ int main(int argc, char* argv[])
 				else
 				{
 					// Image found
-					if (verbose) printf("[%llu] loading left image %s\n", (long long unsigned) camid_left, it->second.c_str());
-					image_left = cv::imread(it->second.c_str(), -1);
-					il = true;
+					if (verbose) printf("[%llu] loading left image %llu\n", (long long unsigned) camid_left, (long long unsigned) it->timestamp);
+					il = prefetch_left.get(it, image_left);
 				}
 
 				if (do_stereo)
 				{
-					it = images_right.find(itrg.timestamp);
+					it = findImage(images_right, itrg.timestamp);
 					if (it == images_right.end())
 					{
 						// Image not found
@@ -359,9 +674,8 @@ int main(int argc, char* argv[])
 					else
 					{
 						// Image found
-						if (verbose) printf("[%llu] loading right image %s\n", (long long unsigned) camid_right, it->second.c_str());
-						image_right = cv::imread(it->second.c_str(), -1);
-						ir = true;
+						if (verbose) printf("[%llu] loading right image %llu\n", (long long unsigned) camid_right, (long long unsigned) it->timestamp);
+						ir = prefetch_right.get(it, image_right);
 					}
 				}
 
@@ -376,13 +690,14 @@ int main(int argc, char* argv[])
 					{
 						cam.writeMonoImage(image_left, camid_left, itrg.timestamp, itrg, 0);
 					}
+					waitForConsumers(cam, itrg.timestamp);
 				}
 			}
 		}
 		else if (do_images)
 		{
 			if (( (images_left.empty() || sync_image_left_it != images_left.end()) && (images_right.empty() ||  sync_image_right_it != images_right.end()) && !(images_right.empty() && images_left.empty())) &&
-				(sync_image_left_it->first >= startTimestamp || sync_image_right_it->first >= startTimestamp))
+				(sync_image_left_it->timestamp >= startTimestamp || sync_image_right_it->timestamp >= startTimestamp))
 			{
 				if (found_correct_timestamp == false)
 				{
@@ -390,24 +705,22 @@ int main(int argc, char* argv[])
 					found_correct_timestamp = true;
 				}
 
-				uint64_t timestamp = sync_image_left_it->first;
-				if (sync_image_left_it->first < time)
+				uint64_t timestamp = sync_image_left_it->timestamp;
+				if (sync_image_left_it->timestamp < time)
 				{
 					// Image found
-					if (verbose) printf("[%llu] loading left image %s\n", (long long unsigned) camid_left, sync_image_left_it->second.c_str());
-					image_left = cv::imread(sync_image_left_it->second.c_str(), -1);
-					il = true;
+					if (verbose) printf("[%llu] loading left image %llu\n", (long long unsigned) camid_left, (long long unsigned) sync_image_left_it->timestamp);
+					il = prefetch_left.get(sync_image_left_it, image_left);
 					++sync_image_left_it;
 				}
 
 				if (do_stereo)
 				{
-					if (sync_image_right_it->first < time)
+					if (sync_image_right_it->timestamp < time)
 					{
 						// Image found
-						if (verbose) printf("[%llu] loading right image %s\n", (long long unsigned) camid_right, sync_image_right_it->second.c_str());
-						image_right = cv::imread(sync_image_right_it->second.c_str(), -1);
-						ir = true;
+						if (verbose) printf("[%llu] loading right image %llu\n", (long long unsigned) camid_right, (long long unsigned) sync_image_right_it->timestamp);
+						ir = prefetch_right.get(sync_image_right_it, image_right);
 						++sync_image_right_it;
 					}
 				}
@@ -424,6 +737,7 @@ int main(int argc, char* argv[])
 					{
 						cam.writeMonoImage(image_left, camid_left, timestamp, itrg, 0);
 					}
+					waitForConsumers(cam, timestamp);
 				}
 			}
 			else
@@ -438,17 +752,6 @@ int main(int argc, char* argv[])
 		//don't publish IMAGE_AVAILABLE messages or if we did not find the right timestamped image yet
 		if (msg.msgid != MAVLINK_MSG_ID_IMAGE_AVAILABLE && found_correct_timestamp)
 		{
-			uint64_t usecs_to_wait = 0;
-			uint64_t usecs_gone = current_time - last_current_time;
-			if (last_time > 0)
-			{
-				usecs_to_wait = time-last_time;
-				if (usecs_gone < usecs_to_wait)
-				{
-					usleep(usecs_to_wait - usecs_gone);
-				}
-			}
-
 			if (msg.msgid == MAVLINK_MSG_ID_EXTENDED_MESSAGE)
 			{
 				// Pack a new container
@@ -458,32 +761,19 @@ int main(int argc, char* argv[])
 
 				memcpy(&(container.msg), &msg, sizeof(container.msg));
 
-				// read extended header
-				uint8_t* payload = reinterpret_cast<uint8_t*>(msg.payload64);
-
-				unsigned int extended_payload_len;
-				memcpy(&extended_payload_len, payload + 3, 4);
-
 				container.extended_payload_len = extended_payload_len;
-				container.extended_payload = new int8_t[extended_payload_len];
-				mavlinkLog.read(reinterpret_cast<char*>(container.extended_payload),
-								extended_payload_len);
+				container.extended_payload = const_cast<int8_t*>(extended_payload);
 
 				// Publish the message on the LCM bus
 				if (publishExtended)
 				{
 					mavconn_mavlink_msg_container_t_publish(lcmMavlink, MAVLINK_MAIN, &container);
 				}
-
-				delete [] container.extended_payload;
 			}
 			else
 			{
 				sendMAVLinkMessage(lcmMavlink, &msg);
 			}
-
-			last_time = time;
-			last_current_time = current_time;
 		}
 	}
 
@@ -79,6 +79,7 @@ imageHandler(const lcm_recv_buf_t* rbuf, const char* channel,
 			reinterpret_cast< std::vector<px::SHMImageClient>* >(user);
 
 	cv::Mat imgToSave;
+	std::vector<px::SHMImageClient*> readClients;
 
 	for (size_t i = 0; i < clientVec->size(); ++i)
 	{
@@ -88,6 +89,7 @@ imageHandler(const lcm_recv_buf_t* rbuf, const char* channel,
 			continue;
 		}
 
+		bool read = false;
 		cv::Mat imgLeft, imgRight;
 		if (client.readStereoImage(msg, imgLeft, imgRight))
 		{
@@ -109,6 +111,7 @@ imageHandler(const lcm_recv_buf_t* rbuf, const char* channel,
 #endif
 
 			imgLeft.copyTo(imgToSave);
+			read = true;
 		}
 		else
 		{
@@ -144,6 +147,7 @@ imageHandler(const lcm_recv_buf_t* rbuf, const char* channel,
 	#endif
 
 				img.copyTo(imgToSave);
+				read = true;
 			}
 		}
 
@@ -160,6 +164,12 @@ imageHandler(const lcm_recv_buf_t* rbuf, const char* channel,
 #endif
 
 			imgBayer.copyTo(imgToSave);
+			read = true;
+		}
+
+		if (read)
+		{
+			readClients.push_back(&client);
 		}
 	}
 
@@ -178,6 +188,13 @@ imageHandler(const lcm_recv_buf_t* rbuf, const char* channel,
 		break;
 	}
 #endif
+
+	// the images read above are processed, let a lockstep replay publish
+	// the next ones
+	for (size_t i = 0; i < readClients.size(); ++i)
+	{
+		readClients[i]->acknowledgeImage();
+	}
 }
 
 int main(int argc, char* argv[])
@@ -15,7 +15,9 @@
 #include <inttypes.h>
 #include <cstdlib>
 #include <cstdio>
+#include <cerrno>
 #include <iostream>
+#include <map>
 
 #include "mavconn.h"
 
@@ -24,22 +26,15 @@ class PxSharedMemClient
 public:
 	PxSharedMemClient()
 	{
-		shms = new char*[256];
-		shm_sizes = new int[256];
 
-		for (size_t i = 0; i < 256; ++i)
-		    shms[i] = NULL;
-		for (size_t i = 0; i < 256; ++i)
-		    shm_sizes[i] = 0;
 	}
 
 	~PxSharedMemClient()
 	{
-		// Detach shared memory segment
-		shmdt(shm);
-
-		delete[] shms;
-		delete[] shm_sizes;
+		for (std::map<key_t, Segment>::iterator it = shms.begin(); it != shms.end(); ++it)
+		{
+			shmdt(it->second.ptr);
+		}
 	}
 
 protected:
@@ -250,53 +245,21 @@ public:
 			// Extract the image meta information and pointer location from the image
 			mavlink_image_available_t img;
 			mavlink_msg_image_available_decode(msg, &img);
-			int cam = (int)img.cam_no;
 			//int size = img.width * img.height * img.depth/8 * img.channels;
 			int size = (img.width * img.height * img.depth * img.channels) / 8;
 			//std::cout << "cam #" << (int)img.cam_no << " key: " << img.key << " size: " << size << " width: " << (int)img.width << " height: " << (int)img.height << " depth: " << (int)img.depth << " channels: " << (int)img.channels << " " << std::endl;
 
-			// Check if shared memory for this camera is already attached
-			if (shms[cam] == NULL || shm_sizes[cam] != size)
-			{
-				//attachSharedMem((int)img.key, size, &shm);
-				shm_sizes[cam] = size;
-			}
-
-			shms[cam] = shm;
-			char* ptr;// = shm;
-			key_t m_key = img.key;
-
-			int shmid;
-			if ((shmid = shmget(m_key, size, IPC_CREAT | 0666)) < 0)
-			{
-				perror("\t# ERROR: shmget failed: Could not read shared memory");
-				return false;
-			}
-
-			// Attach shared memory segment
-			if((ptr = (char*)shmat(shmid, NULL, SHM_RDONLY)) == (char*)-1)
-				//if((r_shm = (char*)shmat(shmid, NULL, 0)) == (char*)-1)
+			// Image at position img_buf_index (multi-image buffer)
+			char* ptr = sharedMemAttach(img.key, size, img.img_buf_index);
+			if (!ptr)
 			{
-				perror("\t# ERROR: shmat failed: Could not attach shared memory");
 				return false;
 			}
 
-			//cvCreateImageHeader(cvSize(img.width,img.height),IPL_DEPTH_8U, img.channels);
-			//char* raw = (char*) malloc(size);
-			// Check if memory could be allocated
-			//if (raw == NULL || ptr == NULL) return NULL;
-
 			// Copy message into IPLImage
-			// Copy image at position img_buf_index (multi-image buffer)
 			// FIXME should check the img.valid_until field to determine if the image
 			// is still valid
-			//memcpy(ret1->imageData, ptr+size*img.img_buf_index, size);	// original before img_buf_index change for fast stereo hack
-			//memcpy(ret1->imageData, ptr+(img.cam_no*size), size);
 			memcpy(ret1->imageData, ptr, size);
-
-			//memcpy(raw, ptr, size);
-			shmdt(ptr);
-			//cvSetData(ret, raw, (int)img.width);
 			return true;
 		}
 	}
@@ -323,42 +286,18 @@ public:
 			mavlink_image_available_t img;
 			mavlink_msg_image_available_decode(msg, &img);
 
-			if (img.img_buf_index != 2)
-				return false;
-
-			int cam = (int)img.cam_no;
 			int size = img.width * img.height * img.depth/8 * img.channels;
 
-			// Check if shared memory for this camera is already attached
-			if (shms[cam] == NULL || shm_sizes[cam] != size*2)
+			// Each stereo frame holds two images
+			char* ptr = sharedMemAttach(img.key, size*2, img.img_buf_index);
+			if (!ptr)
 			{
-				//attachSharedMem((int)img.key, size, &shm);
-				shm_sizes[cam] = size*2;
-			}
-
-			shms[cam] = shm;
-			char* ptr;
-			key_t m_key = img.key;
-
-			int shmid;
-			if ((shmid = shmget(m_key, size*2, IPC_CREAT | 0666)) < 0)
-			{
-				perror("shmget");
-				return false;
-			}
-
-			// Attach shared memory segment
-			if((ptr = (char*)shmat(shmid, NULL, SHM_RDONLY)) == (char*)-1)
-			{
-				perror("shmat");
 				return false;
 			}
 
 			// Copy message into IPLImage
 			memcpy(ret1->imageData, ptr, size);
 			memcpy(ret2->imageData, ptr+size, size);
-
-			shmdt(ptr);
 			return true;
 		}
 	}
@@ -377,43 +316,22 @@ public:
 			mavlink_image_available_t img;
 			mavlink_msg_image_available_decode(msg, &img);
 
-			if (img.img_buf_index != 3)
+			// Kinect images are published as camera number 40
+			if (img.cam_no != 40)
 				return false;
 
-			int cam = (int)img.cam_no;
 			int bayersize = img.width * img.height; // IPL_DEPTH_8U, 1 channel
 			int depthsize = img.width * img.height * 2; // IPL_DEPTH_16U, 1 channel
 
-			// Check if shared memory for this camera is already attached
-			if (shms[cam] == NULL || shm_sizes[cam] != (bayersize + depthsize))
-			{
-				//attachSharedMem((int)img.key, size, &shm);
-				shm_sizes[cam] = bayersize + depthsize;
-			}
-
-			shms[cam] = shm;
-			char* ptr;
-			key_t m_key = img.key;
-
-			int shmid;
-			if ((shmid = shmget(m_key, shm_sizes[cam], IPC_CREAT | 0666)) < 0)
-			{
-				perror("shmget");
-				return false;
-			}
-
-			// Attach shared memory segment
-			if((ptr = (char*)shmat(shmid, NULL, SHM_RDONLY)) == (char*)-1)
+			char* ptr = sharedMemAttach(img.key, bayersize + depthsize, img.img_buf_index);
+			if (!ptr)
 			{
-				perror("shmat");
 				return false;
 			}
 
 			// Copy message into IPLImage
 			memcpy(bayerFrame->imageData, ptr, bayersize);
 			memcpy(depthFrame->imageData, ptr+bayersize, depthsize);
-
-			shmdt(ptr);
 			return true;
 		}
 	}
@@ -432,9 +350,78 @@ public:
 											}
 */
 private:
-	char* shm;
-	char** shms;
-	int* shm_sizes;
+	/**
+	 * Returns the frame at index in the shared memory segment of a server,
+	 * or NULL if the frame does not fit into the segment or the server has
+	 * not created the segment yet (the next image retries). Each segment is
+	 * attached once and stays attached until the client is destroyed or
+	 * the server replaces it with a new segment under the same key.
+	 */
+	char* sharedMemAttach(key_t key, int frameSize, int index)
+	{
+		// only the server creates the segment, a segment created here would
+		// be too small for the server to use
+		int shmid = shmget(key, 0, 0);
+		if (shmid < 0)
+		{
+			if (errno != ENOENT)
+			{
+				perror("\t# ERROR: shmget failed: Could not read shared memory");
+			}
+			return NULL;
+		}
+
+		std::map<key_t, Segment>::iterator it = shms.find(key);
+		if (it == shms.end() || it->second.shmid != shmid)
+		{
+			// the server has been restarted and removed the old segment
+			if (it != shms.end())
+			{
+				shmdt(it->second.ptr);
+				shms.erase(it);
+			}
+
+			struct shmid_ds info;
+			if (shmctl(shmid, IPC_STAT, &info) < 0)
+			{
+				perror("\t# ERROR: shmctl failed: Could not read shared memory size");
+				return NULL;
+			}
+
+			// Attach shared memory segment
+			char* ptr;
+			if ((ptr = (char*)shmat(shmid, NULL, SHM_RDONLY)) == (char*)-1)
+			{
+				perror("\t# ERROR: shmat failed: Could not attach shared memory");
+				return NULL;
+			}
+
+			Segment segment;
+			segment.shmid = shmid;
+			segment.ptr = ptr;
+			segment.size = info.shm_segsz;
+			it = shms.insert(std::make_pair(key, segment)).first;
+		}
+
+		if (frameSize <= 0 || index < 0 ||
+			(uint64_t)frameSize * (index + 1) > it->second.size)
+		{
+			fprintf(stderr, "\t# ERROR: Image %d of %d bytes does not fit into shared memory segment %d of %llu bytes\n",
+					index, frameSize, key, (unsigned long long)it->second.size);
+			return NULL;
+		}
+
+		return it->second.ptr + (size_t)frameSize * index;
+	}
+
+	struct Segment
+	{
+		int shmid;
+		char* ptr;
+		size_t size;
+	};
+
+	std::map<key_t, Segment> shms;	///< Attached segments by key
 };
 
 #endif /* PXSHAREDMEMCLIENT_H_ */
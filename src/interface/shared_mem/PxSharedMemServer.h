@@ -15,12 +15,13 @@
 #include <inttypes.h>
 #include <cstdlib>
 #include <cstdio>
+#include <cerrno>
 #include <iostream>
 
 #include <mavlink.h>
 #include "mavconn.h"
 
-int img_buf_size = 2;  ///< Number of images in buffer, each image stays img_buf_size/frame rate in the buffer, e.g. 5/30 = 167 ms
+int img_buf_size = 4;  ///< Number of images in buffer, each image stays img_buf_size/frame rate in the buffer, e.g. 5/30 = 167 ms. A stereo frame takes two images.
 
 class PxSharedMemServer
 {
@@ -35,6 +36,7 @@ public:
 		this->img_buf_index = 0;
 		this->shmid = -1;
 		this->shm = 0;
+		this->hugePages = false;
 
 		this->shm_size = (width * height * img_buf_size * depth * channels) / 8;//; ///< Monochrome 640x480 images
 	}
@@ -49,6 +51,7 @@ public:
 		this->img_buf_index = 0;
 		this->shmid = -1;
 		this->shm = 0;
+		this->hugePages = false;
 
 		this->shm_size = shmsize_;
 	}
@@ -64,12 +67,21 @@ public:
             if (shmctl(this->shmid, IPC_RMID, &this->shmid_ds) == -1)
             {
                 perror("shmctl: IPC_RMID");
-                exit(EXIT_FAILURE);
             }
 		}
 	}
 
-	void sharedMemWriteImage(const IplImage* frame, uint64_t cam_id, uint32_t cam_no, uint64_t timestamp, float roll, float pitch, float yaw, float z, float lon, float lat, float alt, uint32_t exposure, lcm_t* lcm)
+	/**
+	 * Back the shared memory segment with huge pages (Linux only). Has to be
+	 * called before the first image is written. The segment is then rounded
+	 * up to a multiple of the huge page size.
+	 */
+	void setHugePages(bool enable)
+	{
+		this->hugePages = enable;
+	}
+
+	bool sharedMemWriteImage(const IplImage* frame, uint64_t cam_id, uint32_t cam_no, uint64_t timestamp, float roll, float pitch, float yaw, float z, float lon, float lat, float alt, uint32_t exposure, lcm_t* lcm)
 	{
 		//printf("WRITING CAM %d\n", cam_no);
 		// FIXME Calculate properly
@@ -84,25 +96,14 @@ public:
 		CvSize img_size;
 		cvGetRawData(frame, (uchar**)(&data), &step, &img_size);
 
-		// Create shared memory segment
-		if (this->shmid == -1)
+		// Copy image raw data into the next frame of the ring
+		uint32_t size = this->shm_size / img_buf_size;
+		char* buf = nextFrame(size);
+		if (!buf)
 		{
-			if ((this->shmid = shmget(this->key, this->shm_size, IPC_CREAT | 0666)) < 0)
-			{
-				perror("shmget");
-				exit(EXIT_FAILURE);
-			}
+			return false;
 		}
-
-		// Attach shared memory segment
-		if((this->shm = (char*)shmat(this->shmid, NULL, 0)) == (char*)-1) {
-			perror("shmat");
-			exit(EXIT_FAILURE);
-		}
-
-		// Copy image raw data into shared memory
-		uint32_t size = this->shm_size / img_buf_size;
-		memcpy(this->shm+(cam_no*size), data, this->shm_size / img_buf_size);
+		memcpy(buf, data, size);
 
 		// Send out data at 1 Hz
 		//sprintf(s, "Image #%d", img_seq);
@@ -112,7 +113,7 @@ public:
 		imginfo.timestamp = timestamp;
 		imginfo.valid_until = valid_until;
 		imginfo.img_seq = this->img_seq;
-		imginfo.img_buf_index = 1;	//FIXME
+		imginfo.img_buf_index = this->img_buf_index;
 		imginfo.width = img_size.width;
 		imginfo.height = img_size.height;
 		imginfo.depth = frame->depth;
@@ -135,11 +136,10 @@ public:
 		mavlink_message_t_publish (lcm, "IMAGES", &msg);
 		this->img_seq++;
 
-		// Detach shared memory segment
-		shmdt(this->shm);
+		return true;
 	}
 
-	void sharedMemWriteStereoImage(const IplImage* frame, uint64_t cam_id, uint32_t cam_no, const IplImage* frame_right, uint64_t cam_id_right, uint32_t cam_no_right, uint64_t timestamp, float roll, float pitch, float yaw, float z, float lon, float lat, float alt, uint32_t exposure, lcm_t* lcm)
+	bool sharedMemWriteStereoImage(const IplImage* frame, uint64_t cam_id, uint32_t cam_no, const IplImage* frame_right, uint64_t cam_id_right, uint32_t cam_no_right, uint64_t timestamp, float roll, float pitch, float yaw, float z, float lon, float lat, float alt, uint32_t exposure, lcm_t* lcm)
 	{
 		// FIXME Calculate properly
 		struct timeval tv;
@@ -157,27 +157,15 @@ public:
 		CvSize img_size_right;
 		cvGetRawData(frame_right, (uchar**)(&data_right), &step_right, &img_size_right);
 
-		// Create shared memory segment
-		if (this->shmid == -1)
+		// Copy image raw data into the next frame of the ring
+		uint32_t size = this->shm_size / img_buf_size;
+		char* buf = nextFrame(size * 2);
+		if (!buf)
 		{
-			// Create shared memory segment
-			if ((this->shmid = shmget(this->key, this->shm_size, IPC_CREAT | 0666)) < 0)
-			{
-				perror("shmget");
-				exit(EXIT_FAILURE);
-			}
+			return false;
 		}
-
-		// Attach shared memory segment
-		if((this->shm = (char*)shmat(this->shmid, NULL, 0)) == (char*)-1) {
-			perror("shmat");
-			exit(EXIT_FAILURE);
-		}
-
-		// Copy image raw data into shared memory
-		uint32_t size = this->shm_size / img_buf_size;
-		memcpy(this->shm, 			 data, size);
-		memcpy(this->shm + size, data_right, size);
+		memcpy(buf, 		data, size);
+		memcpy(buf + size, data_right, size);
 
 		// Send out data at 1 Hz
 		//sprintf(s, "Image #%d", img_seq);
@@ -187,7 +175,7 @@ public:
 		imginfo.timestamp = timestamp;
 		imginfo.valid_until = valid_until;
 		imginfo.img_seq = this->img_seq;
-		imginfo.img_buf_index = 2; //FIXME
+		imginfo.img_buf_index = this->img_buf_index;
 		imginfo.width = img_size.width;
 		imginfo.height = img_size.height;
 		imginfo.depth = frame->depth;
@@ -211,11 +199,10 @@ public:
 
 		this->img_seq++;
 
-		// Detach shared memory segment
-		shmdt(this->shm);
+		return true;
 	}
 
-	void sharedMemWriteKinectImage(const IplImage* bayerframe, const IplImage* depthframe, uint64_t timestamp, float roll, float pitch, float yaw, float z, float lon, float lat, float alt, lcm_t* lcm)
+	bool sharedMemWriteKinectImage(const IplImage* bayerframe, const IplImage* depthframe, uint64_t timestamp, float roll, float pitch, float yaw, float z, float lon, float lat, float alt, lcm_t* lcm)
 	{
 		// FIXME Calculate properly
 		struct timeval tv;
@@ -233,28 +220,16 @@ public:
 		CvSize depthimg_size;
 		cvGetRawData(depthframe, (uchar**)(&depthdata), &depthstep, &depthimg_size);
 
-		// Create shared memory segment
-		if (this->shmid == -1)
-		{
-			// Create shared memory segment
-			if ((this->shmid = shmget(this->key, this->shm_size, IPC_CREAT | 0666)) < 0)
-			{
-				perror("shmget");
-				exit(EXIT_FAILURE);
-			}
-		}
-
-		// Attach shared memory segment
-		if((this->shm = (char*)shmat(this->shmid, NULL, 0)) == (char*)-1) {
-			perror("shmat");
-			exit(EXIT_FAILURE);
-		}
-
-		// Copy image raw data into shared memory
+		// Copy image raw data into the next frame of the ring
 		int bayersize = bayerimg_size.width * bayerimg_size.height;
 		int depthsize = depthimg_size.width * depthimg_size.height * 2;
-		memcpy(this->shm, bayerdata, bayersize);
-		memcpy(this->shm + bayersize, depthdata, depthsize);
+		char* buf = nextFrame(bayersize + depthsize);
+		if (!buf)
+		{
+			return false;
+		}
+		memcpy(buf, bayerdata, bayersize);
+		memcpy(buf + bayersize, depthdata, depthsize);
 
 		// Send out data at 1 Hz
 		//sprintf(s, "Image #%d", img_seq);
@@ -264,7 +239,7 @@ public:
 		imginfo.timestamp = timestamp;
 		imginfo.valid_until = valid_until;
 		imginfo.img_seq = this->img_seq;
-		imginfo.img_buf_index = 3; //FIXME
+		imginfo.img_buf_index = this->img_buf_index;
 		imginfo.width = depthimg_size.width;
 		imginfo.height = depthimg_size.height;
 		imginfo.depth = 0;
@@ -288,11 +263,97 @@ public:
 
 		this->img_seq++;
 
-		// Detach shared memory segment
-		shmdt(this->shm);
+		return true;
 	}
 
 protected:
+	/**
+	 * Returns the location of the next frame in the ring of frames. The
+	 * segment is created and attached on the first call and stays attached
+	 * until the server is destroyed.
+	 */
+	char* nextFrame(int frameSize)
+	{
+		if (!this->shm)
+		{
+			int flags = IPC_CREAT | 0666;
+			size_t segmentSize = this->shm_size;
+#ifdef SHM_HUGETLB
+			if (this->hugePages)
+			{
+				// SHM_HUGETLB segments must be a multiple of the huge page size
+				size_t hugePageSize = getHugePageSize();
+				segmentSize = (segmentSize + hugePageSize - 1) / hugePageSize * hugePageSize;
+				flags |= SHM_HUGETLB;
+			}
+#endif
+			// Create shared memory segment
+			this->shmid = shmget(this->key, segmentSize, flags);
+			if (this->shmid < 0 && errno == EINVAL)
+			{
+				// a smaller segment is left under this key (e.g. from a
+				// server with smaller images), replace it
+				int oldShmid = shmget(this->key, 0, 0);
+				if (oldShmid >= 0 && shmctl(oldShmid, IPC_RMID, NULL) == 0)
+				{
+					this->shmid = shmget(this->key, segmentSize, flags);
+				}
+			}
+			if (this->shmid < 0)
+			{
+				perror("shmget");
+				return NULL;
+			}
+
+			// Attach shared memory segment
+			char* mem;
+			if ((mem = (char*)shmat(this->shmid, NULL, 0)) == (char*)-1)
+			{
+				perror("shmat");
+				return NULL;
+			}
+
+			// Touch all pages once so that writing a frame never page faults
+			memset(mem, 0, this->shm_size);
+			this->shm = mem;
+		}
+
+		int ringLength = this->shm_size / frameSize;
+		if (ringLength < 1)
+		{
+			fprintf(stderr, "# ERROR: frame of %d bytes does not fit into shared memory of %d bytes.\n", frameSize, this->shm_size);
+			return NULL;
+		}
+
+		this->img_buf_index = this->img_seq % ringLength;
+		return this->shm + this->img_buf_index * frameSize;
+	}
+
+	/**
+	 * Size of a huge page in bytes as reported by /proc/meminfo, 2 MB if it
+	 * cannot be read.
+	 */
+	static size_t getHugePageSize(void)
+	{
+		size_t size = 2 * 1024 * 1024;
+		FILE* meminfo = fopen("/proc/meminfo", "r");
+		if (meminfo)
+		{
+			char line[128];
+			unsigned long kb;
+			while (fgets(line, sizeof(line), meminfo))
+			{
+				if (sscanf(line, "Hugepagesize: %lu kB", &kb) == 1)
+				{
+					size = kb * 1024;
+					break;
+				}
+			}
+			fclose(meminfo);
+		}
+		return size;
+	}
+
 	void attachSharedMem(int key, int shm_size, char** r_shm)
 	{
 	    this->key = key;
@@ -324,6 +385,7 @@ private:
 	int shm_size;
 	unsigned int img_seq;
 	int img_buf_index;
+	bool hugePages;
 	struct shmid_ds shmid_ds;
 };
 
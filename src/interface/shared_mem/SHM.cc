@@ -26,7 +26,7 @@ This file is part of the PIXHAWK project
 *   @brief Shared memory interface.
 *
 *   This interface has two modes: client and server. The shared memory
-*   structure consists of one static buffer, and one dynamic ringbuffer.
+*   structure consists of one static buffer, and one dynamic data area.
 *
 *   @author Lionel Heng  <hengli@inf.ethz.ch>
 *
@@ -34,9 +34,24 @@ This file is part of the PIXHAWK project
 
 #include "SHM.h"
 
+#include <algorithm>
 #include <limits.h>
 #include <string.h>
 #include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#endif
+#if defined(__ARM_FEATURE_CRC32)
+#include <arm_acle.h>
+#elif defined(__x86_64__) || defined(__i386__)
+#include <nmmintrin.h>
+#endif
 
 /*
 
@@ -52,11 +67,283 @@ SHARED MEMORY STRUCTURE:
 00     01 02 03 04    05 06 ... N-1    N
 SBYTE  LEN            DATA             CRC
 
+
+SLOT LAYOUT (LAYOUT_SLOTS):
+
+-- KEY --    --------- STATIC ---------      ----------------------------------------------------- SLOT HEADER ------------------------------------------------------
+             OFFSET       PACKET PACKET      WRITE_SEQ    SLOT_COUNT   SLOT_SIZE    LATEST_SLOT  WAITERS      INTEGRITY    ACK_SEQ      ACK_WAITERS
+00 01 02 03  00 01 02 03  ...    ...         00 01 02 03  00 01 02 03  00 01 02 03  00 01 02 03  00 01 02 03  00 01 02 03  00 01 02 03  00 01 02 03  ...
+
+                                             s_off (aligned to 64 bytes, 64 bytes)
+
+-------------------- READER (s_off + 64 + n * 64, 16 entries) --------------------
+PID          CURSOR       READ         SKIPPED      OVERRUN      ACKED        ACKING       (padding)
+00 01 02 03  00 01 02 03  00 01 02 03  00 01 02 03  00 01 02 03  00 01 02 03  00 01 02 03  ...
+
+-------------------- SLOT (s_off + 64 + 16 * 64 + n * (64 + s_size)) --------------------
+GENERATION   PACKET_SEQ   LEN          LEASES       CHECKSUM     (padding)    DATA
+00 01 02 03  00 01 02 03  00 01 02 03  00 01 02 03  00 01 02 03  ...          64 ... 64 + s_size - 1
+
+The generation counter is odd while the writer is modifying the slot and
+even otherwise (seqlock). A reader copies the payload and accepts it only if
+the generation counter was even and unchanged across the copy, so torn
+packets are never returned.
+
+WRITE_SEQ doubles as a futex word: readers blocked in waitForDataPacket()
+sleep on it and register themselves in WAITERS, so the writer only issues
+a wake-up system call if somebody is actually waiting.
+
+INTEGRITY is the checksum algorithm selected by the server (none, CRC32C or
+xxHash32). Clients read it from the header, so only the server chooses.
+
+Readers may also borrow a slot without copying it. LEASES counts the
+readers currently borrowing the slot; the writer skips borrowed slots and
+only overwrites one if every slot is borrowed.
+
+Every client claims a READER entry with its first read by swapping its pid
+into a free entry or into one whose process has exited. CURSOR is the
+sequence number of the next packet the client will read, so the server
+sees each reader's lag as WRITE_SEQ - CURSOR. A client in READ_LATEST mode
+counts the packets it jumps over as SKIPPED; a client in READ_SEQUENTIAL
+mode reads the oldest packet still in a slot and counts packets which were
+overwritten before it got to them as OVERRUN. Each entry is written only
+by its owner and lives in its own cache line.
+
+A client that acknowledges the packets it has finished processing sets
+ACKING and copies its CURSOR to ACKED. It then increments ACK_SEQ, which
+is the futex word a server blocked in waitForAcknowledgements() sleeps on
+(registered in ACK_WAITERS). The server waits until every live ACKING
+reader has acknowledged all packets written, which paces it to the
+slowest of these readers. Readers that never acknowledge are not waited
+for.
+
 */
 
 namespace px
 {
 
+const unsigned int __SHM_CACHE_LINE = 64;
+const int __SHM_SLOT_READ_ATTEMPTS = 4;
+const int __SHM_MAX_READERS = 16;
+
+static inline unsigned int
+alignToCacheLine(unsigned int n)
+{
+	return (n + __SHM_CACHE_LINE - 1) & ~(__SHM_CACHE_LINE - 1);
+}
+
+// CRC32C (Castagnoli), reflected polynomial
+const uint32_t __SHM_CRC32C_POLY = 0x82F63B78;
+
+class Crc32cTable
+{
+public:
+	Crc32cTable()
+	{
+		for (uint32_t i = 0; i < 256; ++i)
+		{
+			uint32_t c = i;
+			for (int k = 0; k < 8; ++k)
+			{
+				c = (c & 1) ? (c >> 1) ^ __SHM_CRC32C_POLY : (c >> 1);
+			}
+			table[i] = c;
+		}
+	}
+
+	uint32_t table[256];
+};
+
+static uint32_t
+crc32cSoftware(uint32_t crc, const uint8_t* data, uint32_t length)
+{
+	static const Crc32cTable t;
+
+	for (uint32_t i = 0; i < length; ++i)
+	{
+		crc = t.table[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+	}
+	return crc;
+}
+
+#if defined(__ARM_FEATURE_CRC32)
+static uint32_t
+crc32cHardware(uint32_t crc, const uint8_t* data, uint32_t length)
+{
+	for (; length >= 8; length -= 8, data += 8)
+	{
+		uint64_t v;
+		memcpy(&v, data, 8);
+		crc = __crc32cd(crc, v);
+	}
+	for (; length > 0; --length, ++data)
+	{
+		crc = __crc32cb(crc, *data);
+	}
+	return crc;
+}
+#elif defined(__x86_64__) || defined(__i386__)
+__attribute__((target("sse4.2")))
+static uint32_t
+crc32cHardware(uint32_t crc, const uint8_t* data, uint32_t length)
+{
+#ifdef __x86_64__
+	uint64_t crc64 = crc;
+	for (; length >= 8; length -= 8, data += 8)
+	{
+		uint64_t v;
+		memcpy(&v, data, 8);
+		crc64 = _mm_crc32_u64(crc64, v);
+	}
+	crc = static_cast<uint32_t>(crc64);
+#endif
+	for (; length >= 4; length -= 4, data += 4)
+	{
+		uint32_t v;
+		memcpy(&v, data, 4);
+		crc = _mm_crc32_u32(crc, v);
+	}
+	for (; length > 0; --length, ++data)
+	{
+		crc = _mm_crc32_u8(crc, *data);
+	}
+	return crc;
+}
+#endif
+
+static uint32_t
+crc32c(const uint8_t* data, uint32_t length)
+{
+	uint32_t crc = 0xFFFFFFFF;
+#if defined(__ARM_FEATURE_CRC32)
+	crc = crc32cHardware(crc, data, length);
+#elif defined(__x86_64__) || defined(__i386__)
+	static const bool sse42 = __builtin_cpu_supports("sse4.2");
+	if (sse42)
+	{
+		crc = crc32cHardware(crc, data, length);
+	}
+	else
+	{
+		crc = crc32cSoftware(crc, data, length);
+	}
+#else
+	crc = crc32cSoftware(crc, data, length);
+#endif
+	return ~crc;
+}
+
+// xxHash32 by Yann Collet; four independent lanes keep the pipeline busy
+const uint32_t __SHM_XXH_PRIME1 = 2654435761U;
+const uint32_t __SHM_XXH_PRIME2 = 2246822519U;
+const uint32_t __SHM_XXH_PRIME3 = 3266489917U;
+const uint32_t __SHM_XXH_PRIME4 = 668265263U;
+const uint32_t __SHM_XXH_PRIME5 = 374761393U;
+
+static inline uint32_t
+rotl32(uint32_t x, int r)
+{
+	return (x << r) | (x >> (32 - r));
+}
+
+static inline uint32_t
+read32(const uint8_t* p)
+{
+	uint32_t v;
+	memcpy(&v, p, 4);
+	return v;
+}
+
+static inline uint32_t
+xxhash32Round(uint32_t acc, uint32_t input)
+{
+	acc += input * __SHM_XXH_PRIME2;
+	acc = rotl32(acc, 13);
+	return acc * __SHM_XXH_PRIME1;
+}
+
+static uint32_t
+xxhash32(const uint8_t* data, uint32_t length)
+{
+	const uint8_t* p = data;
+	const uint8_t* end = data + length;
+	uint32_t h;
+
+	if (length >= 16)
+	{
+		const uint8_t* limit = end - 16;
+		uint32_t v1 = __SHM_XXH_PRIME1 + __SHM_XXH_PRIME2;
+		uint32_t v2 = __SHM_XXH_PRIME2;
+		uint32_t v3 = 0;
+		uint32_t v4 = -__SHM_XXH_PRIME1;
+
+		do
+		{
+			v1 = xxhash32Round(v1, read32(p));
+			v2 = xxhash32Round(v2, read32(p + 4));
+			v3 = xxhash32Round(v3, read32(p + 8));
+			v4 = xxhash32Round(v4, read32(p + 12));
+			p += 16;
+		}
+		while (p <= limit);
+
+		h = rotl32(v1, 1) + rotl32(v2, 7) + rotl32(v3, 12) + rotl32(v4, 18);
+	}
+	else
+	{
+		h = __SHM_XXH_PRIME5;
+	}
+
+	h += length;
+
+	for (; p + 4 <= end; p += 4)
+	{
+		h += read32(p) * __SHM_XXH_PRIME3;
+		h = rotl32(h, 17) * __SHM_XXH_PRIME4;
+	}
+	for (; p < end; ++p)
+	{
+		h += (*p) * __SHM_XXH_PRIME5;
+		h = rotl32(h, 11) * __SHM_XXH_PRIME1;
+	}
+
+	h ^= h >> 15;
+	h *= __SHM_XXH_PRIME2;
+	h ^= h >> 13;
+	h *= __SHM_XXH_PRIME3;
+	h ^= h >> 16;
+
+	return h;
+}
+
+static inline int
+elapsedMs(const struct timespec& start)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - start.tv_sec) * 1000 +
+		   (now.tv_nsec - start.tv_nsec) / 1000000;
+}
+
+#ifdef __linux__
+static inline void
+futexWait(uint32_t* addr, uint32_t val, int timeout)
+{
+	struct timespec ts;
+	ts.tv_sec = timeout / 1000;
+	ts.tv_nsec = (timeout % 1000) * 1000000;
+
+	// the segment is shared between processes, so no FUTEX_PRIVATE_FLAG
+	syscall(SYS_futex, addr, FUTEX_WAIT, val, (timeout < 0) ? NULL : &ts, NULL, 0);
+}
+
+static inline void
+futexWakeAll(uint32_t* addr)
+{
+	syscall(SYS_futex, addr, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+}
+#endif
+
 SHM::SHM()
  : m_mem(0)
  , m_key(0)
@@ -65,18 +352,33 @@ SHM::SHM()
  , m_w_off(0)
  , m_r_off(0)
  , m_i_off(0)
+ , m_layout(LAYOUT_RINGBUFFER)
+ , m_s_off(0)
+ , m_s_size(0)
+ , m_s_count(0)
+ , m_s_next(0)
+ , m_integrity(INTEGRITY_NONE)
+ , m_w_seq(0)
+ , m_r_seq(0)
+ , m_t_off(0)
+ , m_reader(-1)
+ , m_r_mode(READ_LATEST)
 {
 
 }
 
 SHM::~SHM()
 {
-
+	if (m_mem != 0 && m_layout == LAYOUT_SLOTS)
+	{
+		unregisterReader();
+	}
 }
 
 bool
 SHM::init(int key, SHM::Type type, int infoMaxPacketSize, int infoQueueLength,
-		  int dataMaxPacketSize, int dataQueueLength)
+		  int dataMaxPacketSize, int dataQueueLength, SHM::Layout layout,
+		  SHM::Integrity integrity)
 {
 	if (infoMaxPacketSize <= 0)
 	{
@@ -100,7 +402,36 @@ SHM::init(int key, SHM::Type type, int infoMaxPacketSize, int infoQueueLength,
 	}
 
 	m_i_size = infoMaxPacketSize * infoQueueLength;
-	m_d_size = dataMaxPacketSize * dataQueueLength;
+	m_layout = layout;
+	m_integrity = integrity;
+
+	unsigned int segmentSize;
+	if (layout == LAYOUT_RINGBUFFER)
+	{
+		m_d_size = dataMaxPacketSize * dataQueueLength;
+		segmentSize = m_i_size + m_d_size + 16;
+	}
+	else if (layout == LAYOUT_SLOTS)
+	{
+		m_s_off = alignToCacheLine(m_i_size + 8);
+		m_s_size = alignToCacheLine(dataMaxPacketSize);
+		m_s_count = dataQueueLength;
+		m_t_off = m_s_off + __SHM_CACHE_LINE;
+		m_d_size = __SHM_CACHE_LINE + __SHM_MAX_READERS * __SHM_CACHE_LINE +
+				   m_s_count * (__SHM_CACHE_LINE + m_s_size);
+		segmentSize = m_s_off + m_d_size;
+	}
+	else
+	{
+		fprintf(stderr, "# ERROR: Unknown layout.\n");
+		return false;
+	}
+
+	if (integrity != INTEGRITY_NONE && layout != LAYOUT_SLOTS)
+	{
+		fprintf(stderr, "# ERROR: Integrity modes require the slot layout.\n");
+		return false;
+	}
 
 	int m, f;
 	m_type = type;
@@ -112,7 +443,8 @@ SHM::init(int key, SHM::Type type, int infoMaxPacketSize, int infoQueueLength,
 	else if (type == CLIENT_TYPE)
 	{
 		m = IPC_CREAT | 0666;
-		f = SHM_RDONLY;
+		// clients borrowing slots update the lease counters
+		f = (layout == LAYOUT_SLOTS) ? 0 : SHM_RDONLY;
 	}
 	else
 	{
@@ -122,7 +454,18 @@ SHM::init(int key, SHM::Type type, int infoMaxPacketSize, int infoQueueLength,
 
 	int shmid;
 	key_t shmkey = key;
-	if ((shmid = shmget(shmkey, m_i_size + m_d_size + 16, m)) == -1)
+	if ((shmid = shmget(shmkey, segmentSize, m)) == -1 &&
+		errno == EINVAL && type == SERVER_TYPE)
+	{
+		// a smaller segment with a different layout is left over from a
+		// previous server; remove it and create a new one
+		if ((shmid = shmget(shmkey, 0, 0)) != -1)
+		{
+			shmctl(shmid, IPC_RMID, NULL);
+		}
+		shmid = shmget(shmkey, segmentSize, m);
+	}
+	if (shmid == -1)
 	{
 		fprintf(stderr, "# ERROR: Unable to get a shared memory segment (ERRNO #%d).\n", errno);
 #ifdef __APPLE__
@@ -144,18 +487,58 @@ SHM::init(int key, SHM::Type type, int infoMaxPacketSize, int infoQueueLength,
 
 	m_r_off = 0;
 	m_w_off = 0;
+	m_r_seq = 0;
+	m_w_seq = 0;
+	m_s_next = 0;
+	m_reader = -1;
 	if (type == SERVER_TYPE)
 	{
 		srand(time(0));
 		m_key = rand();
-		memcpy(m_mem, &(m_key), 4);
 
 		unsigned int num = 0;
 		memcpy(&(m_mem[4]), &num, 4);
-		memcpy(&(m_mem[m_i_size + 8]), &num, 4);
+		if (layout == LAYOUT_RINGBUFFER)
+		{
+			memcpy(&(m_mem[m_i_size + 8]), &num, 4);
+		}
+		else
+		{
+			// clients waiting on a segment that is reused stay registered
+			// and unregister once they are woken below, so keep their count
+			uint32_t* header = writeSeq();
+			uint32_t waiters = __atomic_load_n(header + 4, __ATOMIC_SEQ_CST);
+			uint32_t ackWaiters = __atomic_load_n(header + 7, __ATOMIC_SEQ_CST);
+
+			// clearing the whole data area also pre-faults its pages
+			memset(&(m_mem[m_s_off]), 0, m_d_size);
+			__atomic_store_n(header + 4, waiters, __ATOMIC_SEQ_CST);
+			__atomic_store_n(header + 7, ackWaiters, __ATOMIC_SEQ_CST);
+			header[1] = m_s_count;
+			header[2] = m_s_size;
+			header[5] = integrity;
+		}
+
+		// publish the new key last so that clients resynchronize only
+		// after the segment has been reset
+		__atomic_store_n(reinterpret_cast<uint32_t*>(m_mem), m_key,
+						 __ATOMIC_RELEASE);
+
+#ifdef __linux__
+		if (layout == LAYOUT_SLOTS)
+		{
+			// clients still waiting on the old segment have to resynchronize
+			futexWakeAll(writeSeq());
+		}
+#endif
 
 		fprintf(stderr, "# INFO: allocate %.2f MB of shared memory\n",
-				(m_i_size + m_d_size + 16) / (1024.0 * 1024.0));
+				segmentSize / (1024.0 * 1024.0));
+	}
+	else if (layout == LAYOUT_SLOTS)
+	{
+		// register right away if the server is already running
+		resync();
 	}
 
 	return true;
@@ -255,6 +638,11 @@ SHM::writeInfoPacket(const std::vector<uint8_t>& data)
 int
 SHM::readDataPacket(std::vector<uint8_t>& data, uint32_t length)
 {
+	if (m_layout == LAYOUT_SLOTS)
+	{
+		return readSlotPacket(data, length, false);
+	}
+
 	unsigned int shmkey, off;
 	memcpy(&shmkey, m_mem, 4);
 	memcpy(&off, &(m_mem[m_i_size + 8]), 4);
@@ -295,6 +683,11 @@ SHM::readDataPacket(std::vector<uint8_t>& data, uint32_t length)
 int
 SHM::readDataPacket(std::vector<uint8_t>& data)
 {
+	if (m_layout == LAYOUT_SLOTS)
+	{
+		return readSlotPacket(data, UINT_MAX, true);
+	}
+
 	unsigned int shmkey, off;
 	memcpy(&shmkey, m_mem, 4);
 	memcpy(&off, &(m_mem[m_i_size + 8]), 4);
@@ -350,6 +743,11 @@ SHM::writeDataPacket(const std::vector<uint8_t>& data)
 uint32_t
 SHM::writeDataPacket(const uint8_t* data, uint32_t length)
 {
+	if (m_layout == LAYOUT_SLOTS)
+	{
+		return writeSlotPacket(data, length);
+	}
+
 	// write packet magic ID (1 byte)
 	m_mem[pos(0,WRITE_DATA)] = __SHM_IDENTIFIER;
 	// write size of packet (4 bytes)
@@ -374,11 +772,130 @@ SHM::writeDataPacket(const uint8_t* data, uint32_t length)
 bool
 SHM::bytesWaiting(void) const
 {
+	if (m_layout == LAYOUT_SLOTS)
+	{
+		return (__atomic_load_n(writeSeq(), __ATOMIC_ACQUIRE) != m_r_seq);
+	}
+
 	unsigned int off;
 	memcpy(&off, &(m_mem[m_i_size + 8]), 4);
 	return (off != m_r_off);
 }
 
+bool
+SHM::waitForDataPacket(int timeout)
+{
+	if (bytesWaiting())
+	{
+		return true;
+	}
+
+#ifdef __linux__
+	if (m_layout == LAYOUT_SLOTS)
+	{
+		uint32_t* seq = writeSeq();
+		uint32_t* waiters = seq + 4;
+
+		// register before re-checking so that the writer cannot miss us
+		__atomic_add_fetch(waiters, 1, __ATOMIC_SEQ_CST);
+		uint32_t w_seq = __atomic_load_n(seq, __ATOMIC_SEQ_CST);
+		if (w_seq == m_r_seq)
+		{
+			futexWait(seq, w_seq, timeout);
+		}
+		__atomic_sub_fetch(waiters, 1, __ATOMIC_SEQ_CST);
+
+		return bytesWaiting();
+	}
+#endif
+
+	// no shared wait primitive available, fall back to polling
+	for (int t = 0; timeout < 0 || t < timeout; ++t)
+	{
+		usleep(1000);
+		if (bytesWaiting())
+		{
+			return true;
+		}
+	}
+
+	return false;
+}
+
+bool
+SHM::acknowledge(void)
+{
+	if (m_layout != LAYOUT_SLOTS || resync() || m_reader < 0)
+	{
+		return false;
+	}
+
+	// only this client writes its entry
+	uint32_t* r = reader(m_reader);
+	__atomic_store_n(r + 5, m_r_seq, __ATOMIC_RELAXED);
+	__atomic_store_n(r + 6, 1, __ATOMIC_RELAXED);
+
+	uint32_t* acks = writeSeq() + 6;
+	__atomic_add_fetch(acks, 1, __ATOMIC_SEQ_CST);
+
+#ifdef __linux__
+	if (__atomic_load_n(writeSeq() + 7, __ATOMIC_SEQ_CST) > 0)
+	{
+		futexWakeAll(acks);
+	}
+#endif
+
+	return true;
+}
+
+bool
+SHM::waitForAcknowledgements(int timeout)
+{
+	if (m_layout != LAYOUT_SLOTS || m_type != SERVER_TYPE)
+	{
+		return true;
+	}
+
+	struct timespec start;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	while (true)
+	{
+		bool done;
+#ifdef __linux__
+		uint32_t* acks = writeSeq() + 6;
+		uint32_t* waiters = writeSeq() + 7;
+
+		// register before checking so that no acknowledgement is missed
+		__atomic_add_fetch(waiters, 1, __ATOMIC_SEQ_CST);
+		uint32_t a = __atomic_load_n(acks, __ATOMIC_SEQ_CST);
+		done = acknowledged();
+		int left = timeout - elapsedMs(start);
+		if (!done && (timeout < 0 || left > 0))
+		{
+			// wake up now and then to notice readers which have exited
+			futexWait(acks, a, (timeout < 0) ? 100 : std::min(left, 100));
+		}
+		__atomic_sub_fetch(waiters, 1, __ATOMIC_SEQ_CST);
+#else
+		done = acknowledged();
+		if (!done)
+		{
+			usleep(1000);
+		}
+#endif
+
+		if (done)
+		{
+			return true;
+		}
+		if (timeout >= 0 && elapsedMs(start) >= timeout)
+		{
+			return acknowledged();
+		}
+	}
+}
+
 const char PROC_SHM_MAX[] = "/proc/sys/kernel/shmmax";
 
 long long
@@ -434,6 +951,516 @@ SHM::getType(void) const
 	return m_type;
 }
 
+SHM::Layout
+SHM::getLayout(void) const
+{
+	return m_layout;
+}
+
+int
+SHM::borrowDataPacket(const uint8_t*& data, SHM::Lease& lease)
+{
+	if (m_layout != LAYOUT_SLOTS)
+	{
+		fprintf(stderr, "# ERROR: Borrowing packets requires the slot layout.\n");
+		return -1;
+	}
+
+	releaseDataPacket(lease);
+
+	if (resync())
+	{
+		return 0;
+	}
+
+	uint32_t w_seq = __atomic_load_n(writeSeq(), __ATOMIC_ACQUIRE);
+	for (int i = 0; i < __SHM_SLOT_READ_ATTEMPTS && w_seq != m_r_seq; ++i)
+	{
+		uint32_t index, seq;
+		if (nextSlot(w_seq, index, seq))
+		{
+			unsigned char* s = slot(index);
+			uint32_t* generation = reinterpret_cast<uint32_t*>(s);
+			uint32_t* leases = reinterpret_cast<uint32_t*>(s + 12);
+
+			// take the lease before checking the slot; the writer sets the
+			// generation before checking the leases, so one of us backs off
+			__atomic_add_fetch(leases, 1, __ATOMIC_SEQ_CST);
+			uint32_t g = __atomic_load_n(generation, __ATOMIC_SEQ_CST);
+			uint32_t packetSeq, payloadSizeInBytes;
+			memcpy(&packetSeq, s + 4, 4);
+			memcpy(&payloadSizeInBytes, s + 8, 4);
+
+			if ((g & 1) == 0 && packetSeq == seq &&
+				payloadSizeInBytes <= m_s_size)
+			{
+				lease.slot = index;
+				lease.generation = g;
+				lease.key = m_key;
+
+				data = s + __SHM_CACHE_LINE;
+				consumeSlot(seq);
+
+				uint32_t sum;
+				memcpy(&sum, s + 16, 4);
+				if (checksum(data, payloadSizeInBytes, readIntegrity()) != sum)
+				{
+					fprintf(stderr, "# WARNING: packet checksum error.\n");
+					releaseDataPacket(lease);
+					return -1;
+				}
+				return payloadSizeInBytes;
+			}
+
+			__atomic_sub_fetch(leases, 1, __ATOMIC_SEQ_CST);
+		}
+		w_seq = __atomic_load_n(writeSeq(), __ATOMIC_ACQUIRE);
+	}
+
+	if (w_seq == m_r_seq)
+	{
+		return 0;
+	}
+
+	fprintf(stderr, "# WARNING: packet overwritten while borrowing.\n");
+	return -1;
+}
+
+bool
+SHM::releaseDataPacket(SHM::Lease& lease)
+{
+	if (lease.slot < 0)
+	{
+		return false;
+	}
+
+	unsigned char* s = slot(lease.slot);
+	uint32_t* generation = reinterpret_cast<uint32_t*>(s);
+
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	bool valid = (__atomic_load_n(generation, __ATOMIC_RELAXED) == lease.generation);
+
+	// the server has reset the segment, including all lease counters
+	if (lease.key == __atomic_load_n(reinterpret_cast<uint32_t*>(m_mem),
+									 __ATOMIC_ACQUIRE))
+	{
+		__atomic_sub_fetch(reinterpret_cast<uint32_t*>(s + 12), 1,
+						   __ATOMIC_RELEASE);
+	}
+	else
+	{
+		valid = false;
+	}
+
+	lease.slot = -1;
+
+	return valid;
+}
+
+void
+SHM::setReadMode(SHM::ReadMode mode)
+{
+	m_r_mode = mode;
+}
+
+SHM::ReadMode
+SHM::getReadMode(void) const
+{
+	return m_r_mode;
+}
+
+bool
+SHM::getReaderStats(SHM::ReaderStats& stats) const
+{
+	if (m_layout != LAYOUT_SLOTS || m_reader < 0 ||
+		m_key != __atomic_load_n(reinterpret_cast<uint32_t*>(m_mem), __ATOMIC_ACQUIRE))
+	{
+		return false;
+	}
+
+	uint32_t* r = reader(m_reader);
+	stats.pid = __atomic_load_n(r, __ATOMIC_RELAXED);
+	stats.lag = __atomic_load_n(writeSeq(), __ATOMIC_ACQUIRE) -
+				__atomic_load_n(r + 1, __ATOMIC_RELAXED);
+	stats.read = __atomic_load_n(r + 2, __ATOMIC_RELAXED);
+	stats.skipped = __atomic_load_n(r + 3, __ATOMIC_RELAXED);
+	stats.overrun = __atomic_load_n(r + 4, __ATOMIC_RELAXED);
+
+	return true;
+}
+
+int
+SHM::getReaderStats(std::vector<SHM::ReaderStats>& stats) const
+{
+	stats.clear();
+
+	if (m_layout != LAYOUT_SLOTS)
+	{
+		return 0;
+	}
+
+	uint32_t w_seq = __atomic_load_n(writeSeq(), __ATOMIC_ACQUIRE);
+	for (int i = 0; i < __SHM_MAX_READERS; ++i)
+	{
+		uint32_t* r = reader(i);
+		int pid = __atomic_load_n(r, __ATOMIC_ACQUIRE);
+		if (pid == 0 || (kill(pid, 0) == -1 && errno == ESRCH))
+		{
+			continue;
+		}
+
+		ReaderStats s;
+		s.pid = pid;
+		s.lag = w_seq - __atomic_load_n(r + 1, __ATOMIC_RELAXED);
+		s.read = __atomic_load_n(r + 2, __ATOMIC_RELAXED);
+		s.skipped = __atomic_load_n(r + 3, __ATOMIC_RELAXED);
+		s.overrun = __atomic_load_n(r + 4, __ATOMIC_RELAXED);
+		stats.push_back(s);
+	}
+
+	return stats.size();
+}
+
+int
+SHM::readSlotPacket(std::vector<uint8_t>& data, uint32_t length, bool consume)
+{
+	if (resync())
+	{
+		return 0;
+	}
+
+	uint32_t w_seq = __atomic_load_n(writeSeq(), __ATOMIC_ACQUIRE);
+	for (int i = 0; i < __SHM_SLOT_READ_ATTEMPTS && w_seq != m_r_seq; ++i)
+	{
+		uint32_t index, seq;
+		if (nextSlot(w_seq, index, seq))
+		{
+			unsigned char* s = slot(index);
+			uint32_t* generation = reinterpret_cast<uint32_t*>(s);
+
+			uint32_t g1 = __atomic_load_n(generation, __ATOMIC_ACQUIRE);
+			uint32_t packetSeq, payloadSizeInBytes;
+			memcpy(&packetSeq, s + 4, 4);
+			memcpy(&payloadSizeInBytes, s + 8, 4);
+
+			if ((g1 & 1) == 0 && packetSeq == seq &&
+				payloadSizeInBytes <= m_s_size)
+			{
+				if (length > payloadSizeInBytes)
+				{
+					length = payloadSizeInBytes;
+				}
+
+				if (data.capacity() < length)
+				{
+					data.reserve(length);
+				}
+				data.resize(length);
+				memcpy(&(data[0]), s + __SHM_CACHE_LINE, length);
+
+				uint32_t sum;
+				memcpy(&sum, s + 16, 4);
+
+				__atomic_thread_fence(__ATOMIC_ACQUIRE);
+				if (__atomic_load_n(generation, __ATOMIC_RELAXED) == g1)
+				{
+					if (consume)
+					{
+						consumeSlot(seq);
+					}
+
+					// only complete packets can be verified
+					if (length == payloadSizeInBytes &&
+						checksum(&(data[0]), length, readIntegrity()) != sum)
+					{
+						fprintf(stderr, "# WARNING: packet checksum error.\n");
+						return -1;
+					}
+					return length;
+				}
+			}
+		}
+
+		// the writer has lapped us while reading; retry with the next packet
+		w_seq = __atomic_load_n(writeSeq(), __ATOMIC_ACQUIRE);
+	}
+
+	if (w_seq == m_r_seq)
+	{
+		return 0;
+	}
+
+	fprintf(stderr, "# WARNING: packet overwritten while reading.\n");
+	return -1;
+}
+
+bool
+SHM::nextSlot(uint32_t w_seq, uint32_t& index, uint32_t& seq) const
+{
+	if (m_r_mode == READ_LATEST)
+	{
+		index = __atomic_load_n(writeSeq() + 3, __ATOMIC_ACQUIRE);
+		seq = w_seq - 1;
+		return true;
+	}
+
+	// find the oldest packet which has not been read yet; the caller
+	// validates the slot, so a racing writer only causes a retry
+	uint32_t pending = w_seq - m_r_seq;
+	uint32_t oldest = pending;
+	for (unsigned int i = 0; i < m_s_count && oldest != 0; ++i)
+	{
+		unsigned char* s = slot(i);
+
+		// skip slots which have never been written
+		if (__atomic_load_n(reinterpret_cast<uint32_t*>(s), __ATOMIC_ACQUIRE) == 0)
+		{
+			continue;
+		}
+
+		uint32_t d = __atomic_load_n(reinterpret_cast<uint32_t*>(s + 4),
+									 __ATOMIC_RELAXED) - m_r_seq;
+		if (d < oldest)
+		{
+			oldest = d;
+			index = i;
+		}
+	}
+
+	if (oldest == pending)
+	{
+		return false;
+	}
+
+	seq = m_r_seq + oldest;
+	return true;
+}
+
+void
+SHM::consumeSlot(uint32_t seq)
+{
+	uint32_t missed = seq - m_r_seq;
+	m_r_seq = seq + 1;
+
+	if (m_reader < 0)
+	{
+		return;
+	}
+
+	// only this client writes its entry
+	uint32_t* r = reader(m_reader);
+	__atomic_store_n(r + 1, m_r_seq, __ATOMIC_RELAXED);
+	__atomic_store_n(r + 2, r[2] + 1, __ATOMIC_RELAXED);
+	if (missed > 0)
+	{
+		uint32_t* counter = (m_r_mode == READ_LATEST) ? r + 3 : r + 4;
+		__atomic_store_n(counter, *counter + missed, __ATOMIC_RELAXED);
+	}
+}
+
+bool
+SHM::resync(void)
+{
+	uint32_t shmkey = __atomic_load_n(reinterpret_cast<uint32_t*>(m_mem),
+									  __ATOMIC_ACQUIRE);
+	if (m_key == shmkey)
+	{
+		return false;
+	}
+
+	// the server has reset the segment, including the reader table
+	m_key = shmkey;
+	m_r_seq = __atomic_load_n(writeSeq(), __ATOMIC_ACQUIRE);
+	m_reader = -1;
+	if (m_type == CLIENT_TYPE)
+	{
+		registerReader();
+	}
+
+	return true;
+}
+
+bool
+SHM::registerReader(void)
+{
+	int self = getpid();
+
+	for (int i = 0; i < __SHM_MAX_READERS; ++i)
+	{
+		uint32_t* r = reader(i);
+		uint32_t pid = __atomic_load_n(r, __ATOMIC_ACQUIRE);
+
+		// reclaim entries of readers which exited without unregistering
+		if (pid != 0 && !(kill(pid, 0) == -1 && errno == ESRCH))
+		{
+			continue;
+		}
+
+		if (__atomic_compare_exchange_n(r, &pid, self, false,
+										__ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+		{
+			__atomic_store_n(r + 1, m_r_seq, __ATOMIC_RELAXED);
+			__atomic_store_n(r + 2, 0, __ATOMIC_RELAXED);
+			__atomic_store_n(r + 3, 0, __ATOMIC_RELAXED);
+			__atomic_store_n(r + 4, 0, __ATOMIC_RELAXED);
+			__atomic_store_n(r + 5, m_r_seq, __ATOMIC_RELAXED);
+			__atomic_store_n(r + 6, 0, __ATOMIC_RELAXED);
+			m_reader = i;
+			return true;
+		}
+	}
+
+	fprintf(stderr, "# WARNING: all %d reader entries are in use, reading without statistics.\n",
+			__SHM_MAX_READERS);
+	return false;
+}
+
+void
+SHM::unregisterReader(void)
+{
+	if (m_reader < 0)
+	{
+		return;
+	}
+
+	// a new server has already cleared the table
+	if (m_key == __atomic_load_n(reinterpret_cast<uint32_t*>(m_mem), __ATOMIC_ACQUIRE))
+	{
+		uint32_t self = getpid();
+		__atomic_compare_exchange_n(reader(m_reader), &self, 0, false,
+									__ATOMIC_RELEASE, __ATOMIC_RELAXED);
+	}
+	m_reader = -1;
+}
+
+bool
+SHM::acknowledged(void) const
+{
+	for (int i = 0; i < __SHM_MAX_READERS; ++i)
+	{
+		uint32_t* r = reader(i);
+		int pid = __atomic_load_n(r, __ATOMIC_ACQUIRE);
+		if (pid == 0 || __atomic_load_n(r + 6, __ATOMIC_ACQUIRE) == 0)
+		{
+			continue;
+		}
+		if (__atomic_load_n(r + 5, __ATOMIC_ACQUIRE) != m_w_seq &&
+			!(kill(pid, 0) == -1 && errno == ESRCH))
+		{
+			return false;
+		}
+	}
+
+	return true;
+}
+
+uint32_t
+SHM::writeSlotPacket(const uint8_t* data, uint32_t length)
+{
+	if (length > m_s_size)
+	{
+		fprintf(stderr, "# WARNING: packet of %u bytes exceeds slot size of %u bytes.\n",
+				length, m_s_size);
+		return 0;
+	}
+
+	// checksum the source before taking the slot to keep the odd phase short
+	uint32_t sum = checksum(data, length, m_integrity);
+
+	// find the next slot which is not borrowed by a reader
+	unsigned char* s = 0;
+	uint32_t* generation = 0;
+	uint32_t g = 0;
+	for (unsigned int i = 0; i < m_s_count; ++i)
+	{
+		s = slot(m_s_next);
+		generation = reinterpret_cast<uint32_t*>(s);
+		g = *generation;
+
+		// mark slot as being written
+		__atomic_store_n(generation, g + 1, __ATOMIC_SEQ_CST);
+		if (__atomic_load_n(reinterpret_cast<uint32_t*>(s + 12), __ATOMIC_SEQ_CST) == 0)
+		{
+			break;
+		}
+		if (i + 1 == m_s_count)
+		{
+			fprintf(stderr, "# WARNING: all slots are borrowed, overwriting slot %u.\n",
+					m_s_next);
+			break;
+		}
+
+		// slot is borrowed; its contents are untouched, so restore it
+		__atomic_store_n(generation, g, __ATOMIC_RELEASE);
+		m_s_next = (m_s_next + 1) % m_s_count;
+	}
+
+	// the payload must not become visible before the slot is marked odd
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+
+	memcpy(s + 4, &m_w_seq, 4);
+	memcpy(s + 8, &length, 4);
+	memcpy(s + 16, &sum, 4);
+	memcpy(s + __SHM_CACHE_LINE, data, length);
+
+	// mark slot as stable and publish the packet
+	__atomic_store_n(generation, g + 2, __ATOMIC_RELEASE);
+	__atomic_store_n(writeSeq() + 3, m_s_next, __ATOMIC_RELAXED);
+	++m_w_seq;
+	__atomic_store_n(writeSeq(), m_w_seq, __ATOMIC_SEQ_CST);
+
+#ifdef __linux__
+	if (__atomic_load_n(writeSeq() + 4, __ATOMIC_SEQ_CST) > 0)
+	{
+		futexWakeAll(writeSeq());
+	}
+#endif
+
+	m_s_next = (m_s_next + 1) % m_s_count;
+
+	return length;
+}
+
+unsigned char*
+SHM::slot(uint32_t index) const
+{
+	return m_mem + m_t_off + __SHM_MAX_READERS * __SHM_CACHE_LINE +
+		   index * (__SHM_CACHE_LINE + m_s_size);
+}
+
+uint32_t*
+SHM::reader(int index) const
+{
+	return reinterpret_cast<uint32_t*>(m_mem + m_t_off + index * __SHM_CACHE_LINE);
+}
+
+uint32_t*
+SHM::writeSeq(void) const
+{
+	return reinterpret_cast<uint32_t*>(m_mem + m_s_off);
+}
+
+SHM::Integrity
+SHM::readIntegrity(void) const
+{
+	// the server may have been restarted with a different mode
+	return static_cast<Integrity>(__atomic_load_n(writeSeq() + 5, __ATOMIC_RELAXED));
+}
+
+uint32_t
+SHM::checksum(const uint8_t* data, uint32_t length, SHM::Integrity integrity) const
+{
+	switch (integrity)
+	{
+	case INTEGRITY_CRC32C:
+		return crc32c(data, length);
+	case INTEGRITY_XXHASH32:
+		return xxhash32(data, length);
+	default:
+		return 0;
+	}
+}
+
 uint8_t
 SHM::crc(const std::vector<uint8_t>& data) const
 {
@@ -26,7 +26,13 @@ This file is part of the PIXHAWK project
 *   @brief Shared memory interface.
 *
 *   This interface has two modes: client and server. The shared memory
-*   structure consists of one static buffer, and one dynamic ringbuffer.
+*   structure consists of one static buffer, and one dynamic data area.
+*   The data area is either a byte ringbuffer or an array of fixed-size,
+*   cache-line aligned slots, each guarded by a seqlock. With the slot
+*   layout, every client registers a cursor in the segment header, so the
+*   server can see how far each reader lags behind. Readers may also
+*   acknowledge the packets they have finished, and the server can wait
+*   for these acknowledgements to run in lockstep with its readers.
 *
 *   @author Lionel Heng  <hengli@inf.ethz.ch>
 *
@@ -73,11 +79,80 @@ public:
 		CLIENT_TYPE = 1
 	} Type;
 
+	typedef enum
+	{
+		LAYOUT_RINGBUFFER = 0,
+		LAYOUT_SLOTS = 1
+	} Layout;
+
+	typedef enum
+	{
+		INTEGRITY_NONE = 0,
+		INTEGRITY_CRC32C = 1,
+		INTEGRITY_XXHASH32 = 2
+	} Integrity;
+
+	/**
+	 * A reader's claim on a borrowed slot. While a lease is held, the
+	 * server does not overwrite the slot unless all slots are borrowed.
+	 */
+	struct Lease
+	{
+		Lease() : slot(-1), generation(0), key(0) {}
+
+		int      slot;
+		uint32_t generation;
+		uint32_t key;
+	};
+
+	typedef enum
+	{
+		READ_LATEST = 0,		/* jump to the newest packet */
+		READ_SEQUENTIAL = 1		/* read every packet still in a slot */
+	} ReadMode;
+
+	/**
+	 * Counters of one registered reader, kept in the segment header.
+	 */
+	struct ReaderStats
+	{
+		ReaderStats() : pid(0), lag(0), read(0), skipped(0), overrun(0) {}
+
+		int      pid;		/* process of the reader */
+		uint32_t lag;		/* packets written but not yet read */
+		uint32_t read;		/* packets read or borrowed */
+		uint32_t skipped;	/* packets passed over on purpose (READ_LATEST) */
+		uint32_t overrun;	/* packets overwritten before they were read */
+	};
+
 	SHM();
 	~SHM();
 
+	/**
+	 * Creates (server) or attaches to (client) a shared memory segment.
+	 *
+	 * @param key Shared memory key.
+	 * @param type Server or client.
+	 * @param infoMaxPacketSize Maximum size of an info packet.
+	 * @param infoQueueLength Number of info packets.
+	 * @param dataMaxPacketSize Maximum size of a data packet. With
+	 * 							LAYOUT_SLOTS, this is the capacity of a slot.
+	 * @param dataQueueLength Number of data packets. With LAYOUT_SLOTS, this
+	 * 						  is the number of slots.
+	 * @param layout Layout of the data area. Server and clients of the same
+	 * 				 segment have to use the same layout.
+	 * @param integrity Checksum of data packets; only supported with
+	 * 					LAYOUT_SLOTS, where the seqlock already rejects torn
+	 * 					packets. The server records it in the segment header,
+	 * 					the value passed by clients is ignored. The
+	 * 					ringbuffer layout always uses its 8-bit sum.
+	 *
+	 * @return Result of shared memory segment access.
+	 */
 	bool init(int key, Type type, int infoMaxPacketSize, int infoQueueLength,
-			  int dataMaxPacketSize, int dataQueueLength);
+			  int dataMaxPacketSize, int dataQueueLength,
+			  Layout layout = LAYOUT_RINGBUFFER,
+			  Integrity integrity = INTEGRITY_NONE);
 
 	int hashKey(const std::string& str) const;
 
@@ -105,17 +180,97 @@ public:
 	 */
 	int readDataPacket(std::vector<uint8_t>& data);
 
+	/**
+	 * Borrow the most recent data packet without copying it out of the
+	 * shared memory segment. Only supported with LAYOUT_SLOTS. A lease
+	 * which is still held is released first.
+	 *
+	 * @param data Set to the packet payload inside the shared memory
+	 * 			   segment; valid until the lease is released.
+	 * @param lease Lease on the borrowed slot.
+	 *
+	 * @return Number of bytes borrowed, 0 if no new packet is available
+	 * 		   and -1 on error.
+	 */
+	int borrowDataPacket(const uint8_t*& data, Lease& lease);
+
+	/**
+	 * Release a borrowed data packet so that the server can reuse its slot.
+	 *
+	 * @param lease Lease returned by borrowDataPacket.
+	 *
+	 * @return True if the packet was not overwritten while it was borrowed.
+	 */
+	bool releaseDataPacket(Lease& lease);
+
 	uint32_t writeDataPacket(const std::vector<uint8_t>& data);
 	uint32_t writeDataPacket(const uint8_t* data, uint32_t length);
 
 	bool bytesWaiting(void) const;
 
+	/**
+	 * Block until the server has written a new data packet. With
+	 * LAYOUT_SLOTS, the client sleeps on a futex in the segment header and
+	 * is woken up by the server; otherwise the segment is polled.
+	 *
+	 * @param timeout Timeout in milliseconds. Negative values wait forever.
+	 *
+	 * @return True if a new data packet is available.
+	 */
+	bool waitForDataPacket(int timeout);
+
 	long long getMax(void) const;
 
 	bool setMax(long long max) const;
 
 	Type getType(void) const;
 
+	Layout getLayout(void) const;
+
+	/**
+	 * Select which packet the next read returns. Only used with
+	 * LAYOUT_SLOTS; the default is READ_LATEST.
+	 */
+	void setReadMode(ReadMode mode);
+
+	ReadMode getReadMode(void) const;
+
+	/**
+	 * Tell the server that this client has finished processing all packets
+	 * read so far. From the first call on, the server waits for this client
+	 * in waitForAcknowledgements(). Only supported with LAYOUT_SLOTS.
+	 *
+	 * @return True if the client is registered with a running server.
+	 */
+	bool acknowledge(void);
+
+	/**
+	 * Block until every acknowledging reader has acknowledged all packets
+	 * written by this server. Readers which never acknowledged a packet and
+	 * readers which have exited are not waited for.
+	 *
+	 * @param timeout Timeout in milliseconds. Negative values wait forever.
+	 *
+	 * @return True if all packets have been acknowledged.
+	 */
+	bool waitForAcknowledgements(int timeout);
+
+	/**
+	 * Counters of this client. Only available with LAYOUT_SLOTS once the
+	 * client has registered itself with a running server.
+	 *
+	 * @return True if the client is registered.
+	 */
+	bool getReaderStats(ReaderStats& stats) const;
+
+	/**
+	 * Counters of all readers registered in the segment. Only available
+	 * with LAYOUT_SLOTS.
+	 *
+	 * @return Number of registered readers.
+	 */
+	int getReaderStats(std::vector<ReaderStats>& stats) const;
+
 private:
 	typedef enum {
 		READ_INFO = 0,
@@ -124,6 +279,24 @@ private:
 		WRITE_DATA = 3
 	} Mode;
 
+	int readSlotPacket(std::vector<uint8_t>& data, uint32_t length, bool consume);
+	bool nextSlot(uint32_t w_seq, uint32_t& index, uint32_t& seq) const;
+	void consumeSlot(uint32_t seq);
+	bool resync(void);
+
+	bool acknowledged(void) const;
+
+	bool registerReader(void);
+	void unregisterReader(void);
+	uint32_t* reader(int index) const;
+	uint32_t writeSlotPacket(const uint8_t* data, uint32_t length);
+
+	unsigned char* slot(uint32_t index) const;
+	uint32_t* writeSeq(void) const;
+
+	Integrity readIntegrity(void) const;
+	uint32_t checksum(const uint8_t* data, uint32_t length, Integrity integrity) const;
+
 	uint8_t crc(const std::vector<uint8_t>& data) const;
 	uint8_t crc(const uint8_t* data, uint32_t length) const;
 
@@ -142,6 +315,17 @@ private:
 	unsigned int      m_w_off;     /* write offset */
 	unsigned int      m_r_off;     /* read offset */
 	unsigned int      m_i_off;     /* info offset */
+	Layout            m_layout;    /* ringbuffer/slot layout */
+	unsigned int      m_s_off;     /* offset of the slot header */
+	unsigned int      m_s_size;    /* payload capacity of one slot */
+	unsigned int      m_s_count;   /* number of slots */
+	unsigned int      m_s_next;    /* next slot to write */
+	Integrity         m_integrity; /* checksum of data packets */
+	uint32_t          m_w_seq;     /* number of packets written */
+	uint32_t          m_r_seq;     /* sequence number of the next packet to read */
+	unsigned int      m_t_off;     /* offset of the reader table */
+	int               m_reader;    /* entry of this client in the reader table */
+	ReadMode          m_r_mode;    /* latest/sequential reads */
 };
 
 }
@@ -75,7 +75,12 @@ SHMImageClient::init(bool subscribeLatest,
 
 	mData.reserve(1024 * 1024);
 
-	if (!mSHM.init(cam1 | cam2, SHM::CLIENT_TYPE, 128, 1, 1024 * 1024, 9))
+	// slow subscribers either drop to the newest frame or work through
+	// the backlog; the segment records how many frames that costs them
+	mSHM.setReadMode(subscribeLatest ? SHM::READ_LATEST : SHM::READ_SEQUENTIAL);
+
+	if (!mSHM.init(cam1 | cam2, SHM::CLIENT_TYPE, 128, 1, 2 * 1024 * 1024, 9,
+				   SHM::LAYOUT_SLOTS))
 	{
 		return false;
 	}
@@ -273,6 +278,24 @@ SHMImageClient::getCameraConfig(void) const
 	return (mCam1 | mCam2);
 }
 
+bool
+SHMImageClient::waitForFrame(int timeout)
+{
+	return mSHM.waitForDataPacket(timeout);
+}
+
+bool
+SHMImageClient::getReaderStats(SHM::ReaderStats& stats) const
+{
+	return mSHM.getReaderStats(stats);
+}
+
+bool
+SHMImageClient::acknowledgeImage(void)
+{
+	return mSHM.acknowledge();
+}
+
 bool
 SHMImageClient::readMonoImage(const mavlink_message_t* msg, cv::Mat& img, bool verbose)
 {
@@ -281,21 +304,25 @@ SHMImageClient::readMonoImage(const mavlink_message_t* msg, cv::Mat& img, bool v
 		// Instantly return if MAVLink message did not contain an image
 		return false;
 	}
-	
+
+	return readMonoImage(img, verbose);
+}
+
+bool
+SHMImageClient::readMonoImage(cv::Mat& img, bool verbose)
+{
 	if (!mSHM.bytesWaiting())
 	{
 		if (verbose) printf("NO DATA WAITING in MONO IMAGE SHM CLIENT, RETURNING.\n");
 		return false;
 	}
 	
-	do
+	SHM::CameraType cameraType;
+	if (!readCameraType(cameraType))
 	{
-		SHM::CameraType cameraType;
-		if (!readCameraType(cameraType))
-		{
-			if (verbose) printf("\t # ERROR SHM CLIENT: CANNOT READ CAMERA TYPEn");
-			return false;
-		}
+		if (verbose) printf("\t # ERROR SHM CLIENT: CANNOT READ CAMERA TYPEn");
+		return false;
+	}
 
 //		if (cameraType != SHM::CAMERA_MONO_8 && cameraType != SHM::CAMERA_MONO_24)
 //		{
@@ -303,13 +330,11 @@ SHMImageClient::readMonoImage(const mavlink_message_t* msg, cv::Mat& img, bool v
 //			return false;
 //		}
 
-		if (!readImage(img))
-		{
-			if (verbose) printf("\t # ERROR SHM CLIENT: FAILED TO COPY FRAME FROM MEMORY\n");
-			return false;
-		}
+	if (!readImage(img))
+	{
+		if (verbose) printf("\t # ERROR SHM CLIENT: FAILED TO COPY FRAME FROM MEMORY\n");
+		return false;
 	}
-	while (mSHM.bytesWaiting() && mSubscribeLatest);
 	
 	return true;
 }
@@ -322,31 +347,33 @@ SHMImageClient::readStereoImage(const mavlink_message_t* msg, cv::Mat& imgLeft,
 		// Instantly return if MAVLink message did not contain an image
 		return false;
 	}
-	
+
+	return readStereoImage(imgLeft, imgRight);
+}
+
+bool
+SHMImageClient::readStereoImage(cv::Mat& imgLeft, cv::Mat& imgRight)
+{
 	if (!mSHM.bytesWaiting())
 	{
 		return false;
 	}
 	
-	do
+	SHM::CameraType cameraType;
+	if (!readCameraType(cameraType))
 	{
-		SHM::CameraType cameraType;
-		if (!readCameraType(cameraType))
-		{
-			return false;
-		}
+		return false;
+	}
 
-		if (cameraType != SHM::CAMERA_STEREO_8 && cameraType != SHM::CAMERA_STEREO_24)
-		{
-			return false;
-		}
+	if (cameraType != SHM::CAMERA_STEREO_8 && cameraType != SHM::CAMERA_STEREO_24)
+	{
+		return false;
+	}
 
-		if (!readImage(imgLeft, imgRight))
-		{
-			return false;
-		}
+	if (!readImage(imgLeft, imgRight))
+	{
+		return false;
 	}
-	while (mSHM.bytesWaiting() && mSubscribeLatest);
 	
 	return true;
 }
@@ -360,30 +387,32 @@ SHMImageClient::readKinectImage(const mavlink_message_t* msg, cv::Mat& imgBayer,
 		return false;
 	}
 
+	return readKinectImage(imgBayer, imgDepth);
+}
+
+bool
+SHMImageClient::readKinectImage(cv::Mat& imgBayer, cv::Mat& imgDepth)
+{
 	if (!mSHM.bytesWaiting())
 	{
 		return false;
 	}
 
-	do
+	SHM::CameraType cameraType;
+	if (!readCameraType(cameraType))
 	{
-		SHM::CameraType cameraType;
-		if (!readCameraType(cameraType))
-		{
-			return false;
-		}
+		return false;
+	}
 
-		if (cameraType != SHM::CAMERA_KINECT)
-		{
-			return false;
-		}
+	if (cameraType != SHM::CAMERA_KINECT)
+	{
+		return false;
+	}
 
-		if (!readImage(imgBayer, imgDepth))
-		{
-			return false;
-		}
+	if (!readImage(imgBayer, imgDepth))
+	{
+		return false;
 	}
-	while (mSHM.bytesWaiting() && mSubscribeLatest);
 
 	return true;
 }
@@ -401,32 +430,125 @@ SHMImageClient::readRGBDImage(cv::Mat& img, cv::Mat& imgDepth,
 		return false;
 	}
 
-	do
+	SHM::CameraType cameraType;
+	if (!readCameraType(cameraType))
 	{
-		SHM::CameraType cameraType;
-		if (!readCameraType(cameraType))
-		{
-			return false;
-		}
+		return false;
+	}
 
-		if (cameraType != SHM::CAMERA_RGBD)
-		{
-			return false;
-		}
+	if (cameraType != SHM::CAMERA_RGBD)
+	{
+		return false;
+	}
 
-		if (!readImageWithCameraInfo(timestamp, roll, pitch, yaw,
-									 lon, lat, alt,
-									 ground_x, ground_y, ground_z,
-									 cameraMatrix, roi, img, imgDepth))
-		{
-			return false;
-		}
+	if (!readImageWithCameraInfo(timestamp, roll, pitch, yaw,
+								 lon, lat, alt,
+								 ground_x, ground_y, ground_z,
+								 cameraMatrix, roi, img, imgDepth))
+	{
+		return false;
 	}
-	while (mSHM.bytesWaiting() && mSubscribeLatest);
 
 	return true;
 }
 
+bool
+SHMImageClient::borrowMonoImage(const mavlink_message_t* msg, cv::Mat& img)
+{
+	if (msg->msgid != MAVLINK_MSG_ID_IMAGE_AVAILABLE)
+	{
+		// Instantly return if MAVLink message did not contain an image
+		return false;
+	}
+
+	return borrowMonoImage(img);
+}
+
+bool
+SHMImageClient::borrowMonoImage(cv::Mat& img)
+{
+	SHM::CameraType cameraType;
+	cv::Mat img2;
+	if (!borrowImage(cameraType, img, img2))
+	{
+		return false;
+	}
+
+	if (cameraType != SHM::CAMERA_MONO_8 && cameraType != SHM::CAMERA_MONO_24)
+	{
+		releaseImage();
+		return false;
+	}
+
+	return true;
+}
+
+bool
+SHMImageClient::borrowStereoImage(const mavlink_message_t* msg, cv::Mat& imgLeft, cv::Mat& imgRight)
+{
+	if (msg->msgid != MAVLINK_MSG_ID_IMAGE_AVAILABLE)
+	{
+		// Instantly return if MAVLink message did not contain an image
+		return false;
+	}
+
+	return borrowStereoImage(imgLeft, imgRight);
+}
+
+bool
+SHMImageClient::borrowStereoImage(cv::Mat& imgLeft, cv::Mat& imgRight)
+{
+	SHM::CameraType cameraType;
+	if (!borrowImage(cameraType, imgLeft, imgRight))
+	{
+		return false;
+	}
+
+	if (cameraType != SHM::CAMERA_STEREO_8 && cameraType != SHM::CAMERA_STEREO_24)
+	{
+		releaseImage();
+		return false;
+	}
+
+	return true;
+}
+
+bool
+SHMImageClient::borrowKinectImage(const mavlink_message_t* msg, cv::Mat& imgBayer, cv::Mat& imgDepth)
+{
+	if (msg->msgid != MAVLINK_MSG_ID_IMAGE_AVAILABLE)
+	{
+		// Instantly return if MAVLink message did not contain an image
+		return false;
+	}
+
+	return borrowKinectImage(imgBayer, imgDepth);
+}
+
+bool
+SHMImageClient::borrowKinectImage(cv::Mat& imgBayer, cv::Mat& imgDepth)
+{
+	SHM::CameraType cameraType;
+	if (!borrowImage(cameraType, imgBayer, imgDepth))
+	{
+		return false;
+	}
+
+	if (cameraType != SHM::CAMERA_KINECT)
+	{
+		releaseImage();
+		return false;
+	}
+
+	return true;
+}
+
+bool
+SHMImageClient::releaseImage(void)
+{
+	return mSHM.releaseDataPacket(mLease);
+}
+
 bool
 SHMImageClient::readCameraType(SHM::CameraType& cameraType)
 {
@@ -573,4 +695,68 @@ SHMImageClient::readImageWithCameraInfo(uint64_t& timestamp,
 	return true;
 }
 
+bool
+SHMImageClient::borrowImage(SHM::CameraType& cameraType, cv::Mat& img, cv::Mat& img2)
+{
+	const uint8_t* data;
+	int result = mSHM.borrowDataPacket(data, mLease);
+	if (result <= 20)
+	{
+		releaseImage();
+		return false;
+	}
+
+	uint32_t dataLength = result;
+
+	int rows, cols, type;
+	uint32_t step;
+
+	memcpy(&cameraType, data, 4);
+	memcpy(&cols, data + 4, 4);
+	memcpy(&rows, data + 8, 4);
+	memcpy(&step, data + 12, 4);
+	memcpy(&type, data + 16, 4);
+
+	if (cameraType == SHM::CAMERA_MONO_8 || cameraType == SHM::CAMERA_MONO_24)
+	{
+		if (dataLength != 20 + rows * step)
+		{
+			// data length is not consistent with image type
+			releaseImage();
+			return false;
+		}
+
+		img = cv::Mat(rows, cols, type, const_cast<uint8_t*>(data + 20), step);
+		img2 = cv::Mat();
+
+		return true;
+	}
+
+	if (cameraType == SHM::CAMERA_RGBD)
+	{
+		// images with camera info are only available as copies
+		releaseImage();
+		return false;
+	}
+
+	int type2;
+	uint32_t step2;
+
+	memcpy(&step2, data + 20, 4);
+	memcpy(&type2, data + 24, 4);
+
+	if (dataLength <= 28 ||
+		dataLength != 28 + rows * step + rows * step2)
+	{
+		// data length is not consistent with image type
+		releaseImage();
+		return false;
+	}
+
+	img = cv::Mat(rows, cols, type, const_cast<uint8_t*>(data + 28), step);
+	img2 = cv::Mat(rows, cols, type2, const_cast<uint8_t*>(data + 28 + rows * step), step2);
+
+	return true;
+}
+
 }
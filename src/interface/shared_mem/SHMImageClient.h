@@ -75,15 +75,72 @@ public:
 	static bool getGroundTruth(const mavlink_message_t* msg, float& ground_x, float& ground_y, float& ground_z);
 	
 	int getCameraConfig(void) const;
+
+	/**
+	 * Block until the server has written a new image, without waiting for
+	 * its IMAGE_AVAILABLE message. Use the read and borrow functions
+	 * without message parameter afterwards.
+	 *
+	 * @param timeout Timeout in milliseconds. Negative values wait forever.
+	 *
+	 * @return True if a new image is available.
+	 */
+	bool waitForFrame(int timeout);
+
+	/**
+	 * Frames read, skipped and overrun by this client since it registered
+	 * with the current server.
+	 *
+	 * @return False if the client is not registered.
+	 */
+	bool getReaderStats(SHM::ReaderStats& stats) const;
+
+	/**
+	 * Tell the server that the images read so far have been processed. A
+	 * server replaying a log in lockstep (mavconn-replay --lockstep) waits
+	 * for this before it publishes the next image, so a client that calls
+	 * it should do so after every image it reads.
+	 *
+	 * @return False if the client is not registered.
+	 */
+	bool acknowledgeImage(void);
+
 	bool readMonoImage(const mavlink_message_t* msg, cv::Mat& img, bool verbose=false);
+	bool readMonoImage(cv::Mat& img, bool verbose=false);
 	bool readStereoImage(const mavlink_message_t* msg, cv::Mat& imgLeft, cv::Mat& imgRight);
+	bool readStereoImage(cv::Mat& imgLeft, cv::Mat& imgRight);
 	bool readKinectImage(const mavlink_message_t* msg, cv::Mat& imgBayer, cv::Mat& imgDepth);
+	bool readKinectImage(cv::Mat& imgBayer, cv::Mat& imgDepth);
 	bool readRGBDImage(cv::Mat& img, cv::Mat& imgDepth, uint64_t& timestamp,
 					   float& roll, float& pitch, float& yaw,
 					   float& lon, float& lat, float& alt,
 					   float& ground_x, float& ground_y, float& ground_z,
 					   cv::Mat& cameraMatrix, cv::Rect& roi);
 
+	/**
+	 * Borrow the most recent image without copying it. The returned
+	 * matrices point directly into the shared memory segment and stay
+	 * valid until releaseImage() is called or another image is borrowed.
+	 * Do not modify them.
+	 *
+	 * @return True if a new image was borrowed.
+	 */
+	bool borrowMonoImage(const mavlink_message_t* msg, cv::Mat& img);
+	bool borrowMonoImage(cv::Mat& img);
+	bool borrowStereoImage(const mavlink_message_t* msg, cv::Mat& imgLeft, cv::Mat& imgRight);
+	bool borrowStereoImage(cv::Mat& imgLeft, cv::Mat& imgRight);
+	bool borrowKinectImage(const mavlink_message_t* msg, cv::Mat& imgBayer, cv::Mat& imgDepth);
+	bool borrowKinectImage(cv::Mat& imgBayer, cv::Mat& imgDepth);
+
+	/**
+	 * Return the borrowed image to the server.
+	 *
+	 * @return True if the image was not overwritten while it was borrowed.
+	 * 		   If false, the borrowed matrices may contain parts of a newer
+	 * 		   image and should be discarded.
+	 */
+	bool releaseImage(void);
+
 private:
 	bool readCameraType(SHM::CameraType& cameraType);
 
@@ -96,6 +153,8 @@ private:
 								 cv::Mat& cameraMatrix, cv::Rect& roi,
 								 cv::Mat& img, cv::Mat& img2);
 
+	bool borrowImage(SHM::CameraType& cameraType, cv::Mat& img, cv::Mat& img2);
+
 	SHM::Camera mCam1;
 	SHM::Camera mCam2;
 
@@ -103,6 +162,7 @@ private:
 	std::vector<uint8_t> mData;
 	
 	SHM mSHM;
+	SHM::Lease mLease;
 };
 
 }
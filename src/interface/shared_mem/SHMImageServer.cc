@@ -43,7 +43,8 @@ SHMImageServer::SHMImageServer()
 	
 bool
 SHMImageServer::init(int sysid, int compid, lcm_t* lcm,
-					 SHM::Camera cam1, SHM::Camera cam2)
+					 SHM::Camera cam1, SHM::Camera cam2,
+					 SHM::Integrity integrity)
 {
 	mSysid = sysid;
 	mCompid = compid;
@@ -55,7 +56,9 @@ SHMImageServer::init(int sysid, int compid, lcm_t* lcm,
 	mImgSeq = 0;
 	
 	mData.reserve(1024 * 1024);
-	return mSHM.init(mKey, SHM::SERVER_TYPE, 128, 1, 1024 * 1024, 9);
+	// 2 MB slots hold a 640x480 RGB stereo pair
+	return mSHM.init(mKey, SHM::SERVER_TYPE, 128, 1, 2 * 1024 * 1024, 9,
+					 SHM::LAYOUT_SLOTS, integrity);
 }
 
 int
@@ -64,6 +67,18 @@ SHMImageServer::getCameraConfig(void) const
 	return mCam1 | mCam2;
 }
 
+int
+SHMImageServer::getReaderStats(std::vector<SHM::ReaderStats>& stats) const
+{
+	return mSHM.getReaderStats(stats);
+}
+
+bool
+SHMImageServer::waitForClients(int timeout)
+{
+	return mSHM.waitForAcknowledgements(timeout);
+}
+
 void
 SHMImageServer::writeMonoImage(const cv::Mat& img, uint64_t camId,
 							   uint64_t timestamp, const mavlink_image_triggered_t &image_data,
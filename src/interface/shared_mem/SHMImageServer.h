@@ -56,14 +56,34 @@ public:
 	 * @param cam1 Camera 1. If it is part of a stereo rig, it is the left camera.
 	 * @param cam2 Camera 2. If it is part of a stereo rig, it is the right camera.
 	 * 						 Otherwise, leave the parameter empty.
+	 * @param integrity Checksum written with each image. Torn images are
+	 * 					already rejected without it.
 	 *
 	 * @return Result of shared memory segment access.
 	 */
 	bool init(int sysid, int compid, lcm_t* lcm,
-			  SHM::Camera cam1, SHM::Camera cam2 = SHM::CAMERA_NONE);
+			  SHM::Camera cam1, SHM::Camera cam2 = SHM::CAMERA_NONE,
+			  SHM::Integrity integrity = SHM::INTEGRITY_NONE);
 	
 	int getCameraConfig(void) const;
 
+	/**
+	 * Lag and drop counters of all clients reading from this server.
+	 *
+	 * @return Number of registered clients.
+	 */
+	int getReaderStats(std::vector<SHM::ReaderStats>& stats) const;
+
+	/**
+	 * Block until all clients which acknowledge their images have finished
+	 * the images written so far (see SHMImageClient::acknowledgeImage()).
+	 *
+	 * @param timeout Timeout in milliseconds. Negative values wait forever.
+	 *
+	 * @return True if all images have been acknowledged.
+	 */
+	bool waitForClients(int timeout);
+
 	void writeMonoImage(const cv::Mat& img, uint64_t camId,
 						uint64_t timestamp, const mavlink_image_triggered_t &image_data,
 						uint32_t exposure);
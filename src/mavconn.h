@@ -43,7 +43,12 @@ This file is part of the MAVCONN project
 #include <fstream>
 #include <vector>
 
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
 #include <unistd.h>
+#include <pthread.h>
 
 // MAVLINK message format includes
 #include <pixhawk/mavlink.h>
@@ -94,11 +99,32 @@ enum MAVCONN_COMPONENT_IDS
 #define MAVLINK_MAIN "MAVLINK"
 #define MAVLINK_IMAGES "IMAGES"
 
+/**
+ * @brief System time in microseconds since the epoch
+ *
+ * Use it to stamp data which is compared across processes and systems.
+ * It steps when NTP or GPS correct the system time, so measure intervals,
+ * timeouts and rates with getMonotonicTimeUsecs() instead.
+ */
 static inline uint64_t getSystemTimeUsecs()
 {
-	struct timeval tv;		  //System time
-	gettimeofday(&tv, NULL);
-	return ((uint64_t)tv.tv_sec) * 1000000 + tv.tv_usec;
+	struct timespec ts;		  //System time
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return ((uint64_t)ts.tv_sec) * 1000000 + ts.tv_nsec / 1000;
+}
+
+/**
+ * @brief Monotonic time in microseconds, for intervals only
+ *
+ * Never steps and has an arbitrary start, so it must not be sent to other
+ * systems. Like the system time, it is read from the vDSO without a
+ * system call.
+ */
+static inline uint64_t getMonotonicTimeUsecs()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t)ts.tv_sec) * 1000000 + ts.tv_nsec / 1000;
 }
 
 //static inline void sendSystemMessage(int compd, std::string message)
@@ -155,6 +181,84 @@ static inline int getSystemID(void)
 	return systemId;
 }
 
+/**
+ * @brief Copy a MAVLink message into an LCM container
+ *
+ * Only the header, the used part of the payload and the checksum bytes
+ * appended to it by mavlink_finalize_message() are copied.
+ */
+static inline void
+copyMAVLinkMsg(mavconn_mavlink_message_t* dst, const mavlink_message_t* msg)
+{
+	memcpy(dst, msg, offsetof(mavlink_message_t, payload64) + msg->len + MAVLINK_NUM_CHECKSUM_BYTES);
+}
+
+static inline pthread_key_t&
+publishBufferKey(void)
+{
+	static pthread_key_t key;
+	return key;
+}
+
+static inline void
+createPublishBufferKey(void)
+{
+	// frees the encode buffer of a thread when it exits
+	pthread_key_create(&publishBufferKey(), &free);
+}
+
+/**
+ * @brief Register the encode buffer of the calling thread to be freed on exit
+ */
+static inline void
+setPublishBuffer(void* buffer)
+{
+	static pthread_once_t once = PTHREAD_ONCE_INIT;
+	pthread_once(&once, &createPublishBufferKey);
+	pthread_setspecific(publishBufferKey(), buffer);
+}
+
+/**
+ * @brief Encode and publish a container
+ *
+ * Encodes into a buffer owned by the calling thread instead of allocating
+ * one per message. The buffer grows to the largest extended message the
+ * thread has sent and is freed when the thread exits.
+ */
+static inline int
+publishMAVLinkContainer(lcm_t * lcm, const char* channel, const mavconn_mavlink_msg_container_t* container)
+{
+	static __thread uint8_t* buffer = 0;
+	static __thread int bufferSize = 0;
+
+	int size = mavconn_mavlink_msg_container_t_encoded_size(container);
+	if (size > bufferSize)
+	{
+		uint8_t* newBuffer = (uint8_t*) realloc(buffer, size);
+		if (!newBuffer)
+		{
+			return -1;
+		}
+		setPublishBuffer(newBuffer);
+		buffer = newBuffer;
+		bufferSize = size;
+	}
+
+	int dataSize = mavconn_mavlink_msg_container_t_encode(buffer, 0, bufferSize, container);
+	if (dataSize < 0)
+	{
+		return dataSize;
+	}
+
+	return lcm_publish(lcm, channel, buffer, dataSize);
+}
+
+/*
+ * The send functions below are reentrant: every thread packs into its own
+ * container, so the LCM handler thread and the main loop of a process can
+ * publish at the same time.
+ */
+
 static inline void
 sendMAVLinkMessage(lcm_t * lcm, const mavlink_message_t* msg, MAVCONN_LINK_TYPE link_type=MAVCONN_LINK_TYPE_LCM);
 
@@ -162,15 +266,15 @@ static inline void
 sendMAVLinkMessage(lcm_t * lcm, const mavlink_message_t* msg, MAVCONN_LINK_TYPE link_type)
 {
 	// Pack a new container
-	static mavconn_mavlink_msg_container_t container;
+	static __thread mavconn_mavlink_msg_container_t container;
 	container.link_component_id = 0;
 	container.link_network_source = link_type;
 	container.extended_payload_len = 0;
 	container.extended_payload = 0;
-	memcpy(&(container.msg), msg, sizeof(container.msg));
+	copyMAVLinkMsg(&(container.msg), msg);
 
 	// Publish the message on the LCM bus
-	mavconn_mavlink_msg_container_t_publish (lcm, MAVLINK_MAIN, &container);
+	publishMAVLinkContainer(lcm, MAVLINK_MAIN, &container);
 }
 
 #ifdef PROTOBUF_FOUND
@@ -181,15 +285,15 @@ static inline void
 sendMAVLinkExtendedMessage(lcm_t * lcm, const mavlink_extended_message_t* msg, MAVCONN_LINK_TYPE link_type)
 {
 	// Pack a new container
-	static mavconn_mavlink_msg_container_t container;
+	static __thread mavconn_mavlink_msg_container_t container;
 	container.link_component_id = 0;
 	container.link_network_source = link_type;
-	memcpy(&(container.msg), &(msg->base_msg), MAVLINK_MAX_PACKET_LEN);
+	copyMAVLinkMsg(&(container.msg), &(msg->base_msg));
 	container.extended_payload_len = msg->extended_payload_len;
 	container.extended_payload = (int8_t*)msg->extended_payload;
 
 	// Publish the message on the LCM bus
-	mavconn_mavlink_msg_container_t_publish (lcm, MAVLINK_MAIN, &container);
+	publishMAVLinkContainer(lcm, MAVLINK_MAIN, &container);
 }
 
 static inline void
@@ -200,18 +304,7 @@ sendMAVLinkExtendedMessage(lcm_t * lcm, const std::vector<mavlink_extended_messa
 {
 	for (size_t i = 0; i < msg.size(); ++i)
 	{
-		const mavlink_extended_message_t& fragment = msg.at(i);
-
-		// Pack a new container
-		static mavconn_mavlink_msg_container_t container;
-		container.link_component_id = 0;
-		container.link_network_source = link_type;
-		memcpy(&(container.msg), &(fragment.base_msg), MAVLINK_MAX_PACKET_LEN);
-		container.extended_payload_len = fragment.extended_payload_len;
-		container.extended_payload = (int8_t*)fragment.extended_payload;
-
-		// Publish the message on the LCM bus
-		mavconn_mavlink_msg_container_t_publish (lcm, MAVLINK_MAIN, &container);
+		sendMAVLinkExtendedMessage(lcm, &msg.at(i), link_type);
 	}
 }
 #endif
@@ -223,12 +316,15 @@ static inline void
 sendMAVLinkImageMessage(lcm_t * lcm, const mavlink_message_t* msg, MAVCONN_LINK_TYPE link_type)
 {
 	// Pack a new container
-	static mavconn_mavlink_msg_container_t container;
+	static __thread mavconn_mavlink_msg_container_t container;
+	container.link_component_id = 0;
 	container.link_network_source = link_type;
-	memcpy(&(container.msg), msg, MAVLINK_MAX_PACKET_LEN);
+	container.extended_payload_len = 0;
+	container.extended_payload = 0;
+	copyMAVLinkMsg(&(container.msg), msg);
 
 	// Publish the message on the LCM bus
-	mavconn_mavlink_msg_container_t_publish (lcm, MAVLINK_IMAGES, &container);
+	publishMAVLinkContainer(lcm, MAVLINK_IMAGES, &container);
 }
 
 
@@ -114,6 +114,12 @@ uint8_t systemid = getSystemID();          		///< indicates the ID of the system
 uint8_t compid = MAV_COMP_ID_MISSIONPLANNER;	///< indicates the component ID of the waypointplanner
 
 MAVConnParamClient* paramClient;
+// parameters read in the protocol and control loops
+PxParamHandle<float> paramProtDelay;
+PxParamHandle<float> paramProtTimeout;
+PxParamHandle<float> paramSetpointDelay;
+PxParamHandle<float> paramHandleWPDelay;
+PxParamHandle<float> paramYawTolerance;
 
 enum PX_WAYPOINTPLANNER_STATES
 {
@@ -317,7 +323,7 @@ void send_mission_ack(uint8_t target_systemid, uint8_t target_compid, uint8_t ty
     mavlink_msg_mission_ack_encode(systemid, compid, &msg, &wpa);
    sendMAVLinkMessage(lcm, &msg);
 
-    usleep(paramClient->getParamValue("PROTDELAY"));
+    usleep(paramProtDelay);
 
     if (verbose) printf("Sent waypoint ack (%u) to ID %u\n", wpa.type, wpa.target_system);
 }
@@ -340,7 +346,7 @@ void send_command_ack(uint16_t cmd_id, uint8_t result)
    sendMAVLinkMessage(lcm, &msg);
     if (verbose) printf("Sent ack to command(%u) with code %u\n", cmd_id, result);
 
-    usleep(paramClient->getParamValue("PROTDELAY"));
+    usleep(paramProtDelay);
 }
 
 void send_mission_current(uint16_t seq)
@@ -364,7 +370,7 @@ void send_mission_current(uint16_t seq)
         mavlink_msg_mission_current_encode(systemid, compid, &msg, &wpc);
        sendMAVLinkMessage(lcm, &msg);
 
-        usleep(paramClient->getParamValue("PROTDELAY"));
+        usleep(paramProtDelay);
 
         if (verbose) printf("Broadcasted new current waypoint %u\n", wpc.seq);
     }
@@ -403,16 +409,14 @@ void send_setpoint(void)
            sendMAVLinkMessage(lcm, &msg);
 
             if (verbose) printf("Send setpoint: x: %.2f | y: %.2f | z: %.2f | yaw: %.3f\n", cur_dest.x, cur_dest.y, cur_dest.z, cur_dest.yaw);
-            usleep(paramClient->getParamValue("PROTDELAY"));
+            usleep(paramProtDelay);
         }
         else
         {
             if (verbose) printf("No new set point sent to IMU because the new waypoint had no local coordinates\n");
         }
 
-        struct timeval tv;
-        gettimeofday(&tv, NULL);
-        uint64_t now = ((uint64_t)tv.tv_sec)*1000000 + tv.tv_usec;
+        uint64_t now = getMonotonicTimeUsecs();
         timestamp_last_send_setpoint = now;
 	}
 	else
@@ -435,7 +439,7 @@ void send_mission_count(uint8_t target_systemid, uint8_t target_compid, uint16_t
 
     if (verbose) printf("Sent waypoint count (%u) to ID %u\n", wpc.count, wpc.target_system);
 
-    usleep(paramClient->getParamValue("PROTDELAY"));
+    usleep(paramProtDelay);
 }
 
 void send_mission(uint8_t target_systemid, uint8_t target_compid, uint16_t seq)
@@ -450,7 +454,7 @@ void send_mission(uint8_t target_systemid, uint8_t target_compid, uint16_t seq)
 		sendMAVLinkMessage(lcm, &msg);
 		if (verbose) printf("Sent waypoint %u to ID %u\n", wp->seq, wp->target_system);
 
-		usleep(paramClient->getParamValue("PROTDELAY"));
+		usleep(paramProtDelay);
 	}
 	else
 	{
@@ -471,7 +475,7 @@ void send_mission_request(uint8_t target_systemid, uint8_t target_compid, uint16
        sendMAVLinkMessage(lcm, &msg);
         if (verbose) printf("Sent waypoint request %u to ID %u\n", wpr.seq, wpr.target_system);
 
-        usleep(paramClient->getParamValue("PROTDELAY"));
+        usleep(paramProtDelay);
     }
 
     else
@@ -499,7 +503,7 @@ void send_mission_reached(uint16_t seq)
 
     if (verbose) printf("Sent waypoint %u reached message\n", wp_reached.seq);
 
-    usleep(paramClient->getParamValue("PROTDELAY"));
+    usleep(paramProtDelay);
 }
 
 void set_destination(mavlink_mission_item_t* wp)
@@ -600,7 +604,7 @@ void check_if_reached_dest(bool* posReached, bool* yawReached, uint16_t next_wp_
 	}
 
 	// yaw reached?
-	float yaw_tolerance = paramClient->getParamValue("YAWTOLERANCE");
+	float yaw_tolerance = paramYawTolerance;
 	//compare last known yaw with current desired yaw
 	if (last_known_att.yaw - yaw_tolerance >= 0.0f && last_known_att.yaw + yaw_tolerance < 2.f*M_PI)
 	{
@@ -802,9 +806,7 @@ void* sweep_thread_func (gpointer sweep_wp)
 {
 	sweep_state = PX_WPP_SWEEP_RUNNING;
 
-	struct timeval tv;
-    gettimeofday(&tv, NULL);
-    uint64_t now = ((uint64_t)tv.tv_sec)*1000000 + tv.tv_usec;
+	uint64_t now = getMonotonicTimeUsecs();
 
 	mavlink_mission_item_t* sweep_wp_ = (mavlink_mission_item_t*) sweep_wp; // Sweep waypoint with all the necessary data.
 	sweep_parameters sw;
@@ -833,7 +835,7 @@ void* sweep_thread_func (gpointer sweep_wp)
 			if (verbose) printf("Sweep: next checkpoint: %u\n", sweep_line*2);
 	    	next_sweep_wp->x = sw.x0 + (sw.r + (sweep_line % 2)*sw.d)*sw.u1 + (1+2*sweep_line)*sw.r*sw.u2;
 	    	next_sweep_wp->y = sw.y0 + (sw.r + (sweep_line % 2)*sw.d)*sw.v1 + (1+2*sweep_line)*sw.r*sw.v2;
-	    	now = ((uint64_t)tv.tv_sec)*1000000 + tv.tv_usec;
+	    	now = getMonotonicTimeUsecs();
 	    	handle_mission(current_active_wp_id,now);
 	    	yawReached = false;						///< boolean for yaw attitude reached
 	    	posReached = false;						///< boolean for position reached
@@ -861,7 +863,7 @@ void* sweep_thread_func (gpointer sweep_wp)
 	    	if (verbose) printf("Sweep: next checkpoint: %u\n", sweep_line*2+1);
 	    	next_sweep_wp->x = sw.x0 + (sw.r + ((sweep_line+1) % 2)*sw.d)*sw.u1 + (1+2*sweep_line)*sw.r*sw.u2;
 	    	next_sweep_wp->y = sw.y0 + (sw.r + ((sweep_line+1) % 2)*sw.d)*sw.v1 + (1+2*sweep_line)*sw.r*sw.v2;
-	    	now = ((uint64_t)tv.tv_sec)*1000000 + tv.tv_usec;
+	    	now = getMonotonicTimeUsecs();
 	    	handle_mission(current_active_wp_id,now);
 	    	yawReached = false;						///< boolean for yaw attitude reached
 	    	posReached = false;						///< boolean for position reached
@@ -895,7 +897,7 @@ void* sweep_thread_func (gpointer sweep_wp)
 			if (verbose) printf("Sweep: next checkpoint: %u\n", sweep_line*2);
 	    	next_sweep_wp->x = sw.x0 + (sw.r + (sweep_line % 2)*sw.d)*sw.u1 + (sw.short_side - sw.r)*sw.u2;
 	    	next_sweep_wp->y = sw.y0 + (sw.r + (sweep_line % 2)*sw.d)*sw.v1 + (sw.short_side - sw.r)*sw.r*sw.v2;
-	    	now = ((uint64_t)tv.tv_sec)*1000000 + tv.tv_usec;
+	    	now = getMonotonicTimeUsecs();
 	    	handle_mission(current_active_wp_id,now);
 	    	yawReached = false;						///< boolean for yaw attitude reached
 	    	posReached = false;						///< boolean for position reached
@@ -923,7 +925,7 @@ void* sweep_thread_func (gpointer sweep_wp)
 	    	if (verbose) printf("Sweep: next checkpoint: %u\n", sweep_line*2+1);
 	    	next_sweep_wp->x = sw.x0 + (sw.r + ((sweep_line+1) % 2)*sw.d)*sw.u1 + (sw.short_side - sw.r)*sw.u2;
 	    	next_sweep_wp->y = sw.y0 + (sw.r + ((sweep_line+1) % 2)*sw.d)*sw.v1 + (sw.short_side - sw.r)*sw.v2;
-	    	now = ((uint64_t)tv.tv_sec)*1000000 + tv.tv_usec;
+	    	now = getMonotonicTimeUsecs();
 	    	handle_mission(current_active_wp_id,now);
 	    	yawReached = false;						///< boolean for yaw attitude reached
 	    	posReached = false;						///< boolean for position reached
@@ -1124,9 +1126,9 @@ void handle_mission (uint16_t seq, uint64_t now)
 	    	{
 	    		timestamp_delay_started = now;
 	    		if (verbose) printf("Delay initiated (%.2f sec)...\n", cur_wp->param1);
-	    		if (verbose && paramClient->getParamValue("HANDLEWPDELAY")>cur_wp->param1)
+	    		if (verbose && paramHandleWPDelay>cur_wp->param1)
 	    			{
-	    				printf("Warning: Delay shorter than HANDLEWPDELAY parameter (%.2f sec)!\n", paramClient->getParamValue("HANDLEWPDELAY"));
+	    				printf("Warning: Delay shorter than HANDLEWPDELAY parameter (%.2f sec)!\n", paramHandleWPDelay.get());
 	    			}
 	    	}
 	    	if (now - timestamp_delay_started >= cur_wp->param1*1000000)
@@ -1800,10 +1802,8 @@ static void handle_communication (const mavlink_message_t* msg, uint64_t now)
 	                if(cur_dest.frame ==  MAV_FRAME_LOCAL_NED)
 	                {
 	                    mavlink_msg_attitude_decode(msg, &last_known_att);
-	                    struct timeval tv;
-                        gettimeofday(&tv, NULL);
-                        uint64_t now = ((uint64_t)tv.tv_sec)*1000000 + tv.tv_usec;
-                        if(now-timestamp_last_handle_mission > paramClient->getParamValue("HANDLEWPDELAY")*1000000 && current_active_wp_id != (uint16_t)-1)
+	                    uint64_t now = getMonotonicTimeUsecs();
+                        if(now-timestamp_last_handle_mission > paramHandleWPDelay*1000000 && current_active_wp_id != (uint16_t)-1)
                         {
                         	handle_mission(current_active_wp_id,now);
                         }
@@ -1823,10 +1823,8 @@ static void handle_communication (const mavlink_message_t* msg, uint64_t now)
 	                    g_cond_broadcast (&cond_position_received);
 
 	                    if (debug) printf("Received new position: x: %f | y: %f | z: %f\n", last_known_pos.x, last_known_pos.y, last_known_pos.z);
-	                    struct timeval tv;
-                        gettimeofday(&tv, NULL);
-                        uint64_t now = ((uint64_t)tv.tv_sec)*1000000 + tv.tv_usec;
-                        if(now-timestamp_last_handle_mission > paramClient->getParamValue("HANDLEWPDELAY")*1000000 && current_active_wp_id != (uint16_t)-1)
+	                    uint64_t now = getMonotonicTimeUsecs();
+                        if(now-timestamp_last_handle_mission > paramHandleWPDelay*1000000 && current_active_wp_id != (uint16_t)-1)
                         {
                         	handle_mission(current_active_wp_id,now);
                         }
@@ -1987,10 +1985,8 @@ static void mavlink_handler (const lcm_recv_buf_t *rbuf, const char * channel, c
     paramClient->handleMAVLinkPacket(msg);
 
     //check for timed-out operations
-    struct timeval tv;
-    gettimeofday(&tv, NULL);
-    uint64_t now = ((uint64_t)tv.tv_sec)*1000000 + tv.tv_usec;
-    if (now-protocol_timestamp_lastaction > paramClient->getParamValue("PROTTIMEOUT")*1000000 && comm_state != PX_WPP_COMM_IDLE)
+    uint64_t now = getMonotonicTimeUsecs();
+    if (now-protocol_timestamp_lastaction > paramProtTimeout*1000000 && comm_state != PX_WPP_COMM_IDLE)
     {
         if (verbose) printf("Last operation (state=%u) timed out, changing state to PX_WPP_COMM_IDLE\n", comm_state);
         comm_state = PX_WPP_COMM_IDLE;
@@ -2013,10 +2009,11 @@ static void mavlink_handler (const lcm_recv_buf_t *rbuf, const char * channel, c
 
 void* lcm_thread_func (gpointer lcm_ptr)
 {
-	lcm_t* lcm = (lcm_t*) lcm_ptr;
+	// paramClient uses the same LCM instance and also continues a
+	// requested parameter list on a quiet bus
 	while (1)
 	{
-		lcm_handle(lcm);
+		paramClient->handleLCM();
 	}
 	return NULL;
 }
@@ -2083,6 +2080,11 @@ int main(int argc, char* argv[])
     paramClient->setParamValue("PROTTIMEOUT", 2.0);
     paramClient->setParamValue("YAWTOLERANCE", 0.1745f);
     paramClient->readParamsFromFile(configFile);
+    paramProtDelay = paramClient->getParamHandle("PROTDELAY");
+    paramProtTimeout = paramClient->getParamHandle("PROTTIMEOUT");
+    paramSetpointDelay = paramClient->getParamHandle("SETPOINTDELAY");
+    paramHandleWPDelay = paramClient->getParamHandle("HANDLEWPDELAY");
+    paramYawTolerance = paramClient->getParamHandle("YAWTOLERANCE");
 
     /**********************************
     * Read list of images
@@ -2138,9 +2140,7 @@ int main(int argc, char* argv[])
             exit(1); // terminate with error
         }
 
-        struct timeval tv;
-        gettimeofday(&tv, NULL);
-        uint64_t now = ((uint64_t)tv.tv_sec)*1000000 + tv.tv_usec;
+        uint64_t now = getMonotonicTimeUsecs();
 
         uint32_t i;
         for(i = 0; i < waypoints->size(); i++)
@@ -2176,7 +2176,7 @@ int main(int argc, char* argv[])
             send_setpoint();
             g_mutex_unlock(&main_mutex);
         }
-        usleep(paramClient->getParamValue("SETPOINTDELAY")*1000000);
+        usleep(paramSetpointDelay*1000000);
     }
 
     /**********************************
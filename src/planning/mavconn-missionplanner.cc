@@ -46,6 +46,11 @@ uint8_t systemid = getSystemID();          		///< indicates the ID of the system
 uint8_t compid = MAV_COMP_ID_MISSIONPLANNER;	///< indicates the component ID of the waypointplanner
 
 MAVConnParamClient* paramClient;
+// parameters read in the protocol and control loops
+PxParamHandle<float> paramProtocolDelay;
+PxParamHandle<float> paramProtocolTimeout;
+PxParamHandle<float> paramSetpointDelay;
+PxParamHandle<float> paramYawTolerance;
 
 enum PX_WAYPOINTPLANNER_STATES
 {
@@ -82,7 +87,7 @@ void send_waypoint_ack(uint8_t target_systemid, uint8_t target_compid, uint8_t t
     mavlink_msg_mission_ack_encode(systemid, compid, &msg, &wpa);
     sendMAVLinkMessage(lcm, &msg);
 
-    usleep(paramClient->getParamValue("PROTOCOLDELAY"));
+    usleep(paramProtocolDelay);
 
     if (verbose) printf("Sent waypoint ack (%u) to ID %u\n", wpa.type, wpa.target_system);
 }
@@ -110,7 +115,7 @@ void send_waypoint_current(uint16_t seq)
         mavlink_msg_mission_current_encode(systemid, compid, &msg, &wpc);
         sendMAVLinkMessage(lcm, &msg);
 
-        usleep(paramClient->getParamValue("PROTOCOLDELAY"));
+        usleep(paramProtocolDelay);
 
         if (verbose) printf("Broadcasted new current waypoint %u\n", wpc.seq);
     }
@@ -150,7 +155,7 @@ void send_setpoint(uint16_t seq)
             mavlink_msg_set_local_position_setpoint_encode(systemid, compid, &msg, &PControlSetPoint);
             sendMAVLinkMessage(lcm, &msg);
 
-            usleep(paramClient->getParamValue("PROTOCOLDELAY"));
+            usleep(paramProtocolDelay);
             if (verbose) printf("Sent new setpoint: X: %f, Y: %f, Z: %f\n", cur->x, cur->y, cur->z);
         }
         else
@@ -158,9 +163,7 @@ void send_setpoint(uint16_t seq)
             if (verbose) printf("No new set point sent to IMU because the new waypoint %u had no local coordinates\n", cur->seq);
         }
 
-        struct timeval tv;
-        gettimeofday(&tv, NULL);
-        uint64_t now = ((uint64_t)tv.tv_sec) * 1000000 + tv.tv_usec;
+        uint64_t now = getMonotonicTimeUsecs();
         timestamp_last_send_setpoint = now;
     }
     else
@@ -183,7 +186,7 @@ void send_waypoint_count(uint8_t target_systemid, uint8_t target_compid, uint16_
 
     if (verbose) printf("Sent waypoint count (%u) to ID %u\n", wpc.count, wpc.target_system);
 
-    usleep(paramClient->getParamValue("PROTOCOLDELAY"));
+    usleep(paramProtocolDelay);
 }
 
 void send_waypoint(uint8_t target_systemid, uint8_t target_compid, uint16_t seq)
@@ -198,7 +201,7 @@ void send_waypoint(uint8_t target_systemid, uint8_t target_compid, uint16_t seq)
         sendMAVLinkMessage(lcm, &msg);
         if (verbose) printf("Sent waypoint %u to ID %u\n", wp->seq, wp->target_system);
 
-        usleep(paramClient->getParamValue("PROTOCOLDELAY"));
+        usleep(paramProtocolDelay);
     }
     else
     {
@@ -217,7 +220,7 @@ void send_waypoint_request(uint8_t target_systemid, uint8_t target_compid, uint1
 	sendMAVLinkMessage(lcm, &msg);
 	if (verbose) printf("Sent waypoint request %u to ID %u\n", wpr.seq, wpr.target_system);
 
-	usleep(paramClient->getParamValue("PROTOCOLDELAY"));
+	usleep(paramProtocolDelay);
 }
 
 /*
@@ -239,7 +242,7 @@ void send_waypoint_reached(uint16_t seq)
 
     if (verbose) printf("Sent waypoint %u reached message\n", wp_reached.seq);
 
-    usleep(paramClient->getParamValue("PROTOCOLDELAY"));
+    usleep(paramProtocolDelay);
 }
 
 float distanceToSegment(uint16_t seq, float x, float y, float z)
@@ -309,10 +312,8 @@ static void mavlink_handler(const lcm_recv_buf_t *rbuf, const char * channel, co
     paramClient->handleMAVLinkPacket(msg);
 
     //check for timed-out operations
-    struct timeval tv;
-    gettimeofday(&tv, NULL);
-    uint64_t now = ((uint64_t)tv.tv_sec) * 1000000 + tv.tv_usec;
-    if (now-protocol_timestamp_lastaction > paramClient->getParamValue("PROTOCOLTIMEOUT") && current_state != PX_WPP_IDLE)
+    uint64_t now = getMonotonicTimeUsecs();
+    if (now-protocol_timestamp_lastaction > paramProtocolTimeout && current_state != PX_WPP_IDLE)
     {
         if (verbose) printf("Last operation (state=%u) timed out, changing state to PX_WPP_IDLE\n", current_state);
         current_state = PX_WPP_IDLE;
@@ -327,7 +328,7 @@ static void mavlink_handler(const lcm_recv_buf_t *rbuf, const char * channel, co
         }
     }
 
-    if(now-timestamp_last_send_setpoint > paramClient->getParamValue("SETPOINTDELAY") && current_active_wp_id < waypoints->size())
+    if(now-timestamp_last_send_setpoint > paramSetpointDelay && current_active_wp_id < waypoints->size())
     {
         send_setpoint(current_active_wp_id);
     }
@@ -343,7 +344,7 @@ static void mavlink_handler(const lcm_recv_buf_t *rbuf, const char * channel, co
                 {
                     mavlink_attitude_t att;
                     mavlink_msg_attitude_decode(msg, &att);
-                    float yaw_tolerance = paramClient->getParamValue("YAWTOLERANCE");
+                    float yaw_tolerance = paramYawTolerance;
                     //compare current yaw
                     if (att.yaw - yaw_tolerance >= 0.0f && att.yaw + yaw_tolerance < 2.f*M_PI)
                     {
@@ -886,6 +887,10 @@ int main(int argc, char* argv[])
     paramClient->setParamValue("PROTOCOLTIMEOUT", 2000000);
     paramClient->setParamValue("YAWTOLERANCE", 0.1745f);
     paramClient->readParamsFromFile(configFile);
+    paramProtocolDelay = paramClient->getParamHandle("PROTOCOLDELAY");
+    paramProtocolTimeout = paramClient->getParamHandle("PROTOCOLTIMEOUT");
+    paramSetpointDelay = paramClient->getParamHandle("SETPOINTDELAY");
+    paramYawTolerance = paramClient->getParamHandle("YAWTOLERANCE");
 
 
     if (waypointfile.length())
@@ -999,7 +1004,8 @@ int main(int argc, char* argv[])
 
     while (1)
     {
-        lcm_handle (lcm);
+        // also continues a requested parameter list on a quiet bus
+        paramClient->handleLCM();
     }
 
     mavconn_mavlink_msg_container_t_unsubscribe (lcm, comm_sub);